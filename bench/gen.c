@@ -0,0 +1,335 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  bench/gen.c
+ * -------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * Synthetic tapdisk/xenstore workload. Every fake VBD gets what blktap3
+ * and xapi would create for a real one: a stats page in
+ * <root>/td3-<pid>/vbd-<domid>-<vbdid>, a <root>/vbd3-<domid>-<vbdid>
+ * entry, kthread-pid and params keys and the domain's vm key in the
+ * file-backed xenstore of stub/xs_stub.c (rooted at <xsroot>). gen_io()
+ * advances the counters of every page the way a busy tapdisk would.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gen.h"
+
+// Stub xenstore directories above the vbd3 backend keys
+static const char       *gen_xsdirs[] = { "/local", "/local/domain",
+                                          "/local/domain/0",
+                                          "/local/domain/0/backend",
+                                          XSIS_XS_VBD3_PATH, NULL };
+
+// Create a directory, which may already exist
+static int
+gen_mkdir(const char *path){
+    if (mkdir(path, 0755) && errno != EEXIST){
+        perror("mkdir");
+        return(1);
+    }
+    return(0);
+}
+
+// Tell stub xenstore watchers that a path changed
+static void
+gen_xs_event(gen_t *gen, const char *key){
+    // Local variables
+    char                path[PATH_MAX]; // @events path
+    char                line[PATH_MAX]; // Event line
+    int                 fd;             // @events fd
+    int                 n;              // Line length
+
+    (void)snprintf(path, sizeof(path), "%s/@events", gen->xsroot);
+    n = snprintf(line, sizeof(line), "%s\n", key);
+    if ((fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644)) < 0){
+        perror("open");
+        return;
+    }
+    if (write(fd, line, n) != n)
+        perror("write");
+    (void)close(fd);
+}
+
+int
+gen_open(gen_t *gen, const char *root, const char *xsroot){
+    // Local variables
+    char                path[PATH_MAX]; // Temporary path
+    int                 i;              // Temporary index
+
+    memset(gen, 0, sizeof(*gen));
+    (void)snprintf(gen->root, sizeof(gen->root), "%s", root);
+    (void)snprintf(gen->xsroot, sizeof(gen->xsroot), "%s", xsroot);
+    gen->nextpid = GEN_TDPID;
+    gen->rnd = 0x9e3779b97f4a7c15ULL;
+
+    // Create the stats root and the stub xenstore tree
+    if (gen_mkdir(gen->root) || gen_mkdir(gen->xsroot))
+        return(1);
+    for (i = 0; gen_xsdirs[i]; i++){
+        (void)snprintf(path, sizeof(path), "%s%s", gen->xsroot,
+                       gen_xsdirs[i]);
+        if (gen_mkdir(path))
+            return(1);
+    }
+    gen_xs_event(gen, XSIS_XS_VBD3_PATH);
+
+    // Return
+    return(0);
+}
+
+int
+gen_add(gen_t *gen, uint32_t domid, uint32_t vbdid){
+    // Local variables
+    gen_vbd_t           *vbd;           // New fake VBD
+    gen_vbd_t           *vbds;          // Reallocated VBD array
+    char                path[PATH_MAX]; // Temporary path
+    char                target[64];     // vbd3 entry target
+    char                pid[16];        // kthread-pid value
+    char                params[128];    // params (or vm) value
+    void                *page;          // Mapped stats page
+    int                 fd;             // Temporary fd
+    int                 n;              // Temporary length
+
+    if (gen->nvbds == gen->vbdsz){
+        if (!(vbds = realloc(gen->vbds, (gen->vbdsz ? gen->vbdsz*2 : 64) *
+                                        sizeof(gen_vbd_t)))){
+            perror("realloc");
+            return(1);
+        }
+        gen->vbds = vbds;
+        gen->vbdsz = gen->vbdsz ? gen->vbdsz*2 : 64;
+    }
+    vbd = &gen->vbds[gen->nvbds];
+    vbd->domid = domid;
+    vbd->vbdid = vbdid;
+    vbd->tdpid = gen->nextpid++;
+
+    // Publish the tapdisk pid in xenstore first, as xapi would
+    (void)snprintf(path, sizeof(path), "%s" XSIS_XS_VBD3_PATH "/%u",
+                   gen->xsroot, domid);
+    if (gen_mkdir(path))
+        return(1);
+    n = strlen(path);
+    (void)snprintf(path + n, sizeof(path) - n, "/%u", vbdid);
+    if (gen_mkdir(path))
+        return(1);
+    n = strlen(path);
+    (void)snprintf(path + n, sizeof(path) - n, "/kthread-pid");
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0){
+        perror("open");
+        return(1);
+    }
+    n = snprintf(pid, sizeof(pid), "%u", vbd->tdpid);
+    if (write(fd, pid, n) != n){
+        perror("write");
+        (void)close(fd);
+        return(1);
+    }
+    (void)close(fd);
+    gen_xs_event(gen, path + strlen(gen->xsroot));
+
+    // Spread VBDs over a few SRs
+    *strrchr(path, '/') = '\0';
+    n = strlen(path);
+    (void)snprintf(path + n, sizeof(path) - n, "/params");
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0){
+        perror("open");
+        return(1);
+    }
+    n = snprintf(params, sizeof(params), GEN_PARAMSFMT, domid % GEN_NSRS,
+                 domid, vbdid);
+    if (write(fd, params, n) != n){
+        perror("write");
+        (void)close(fd);
+        return(1);
+    }
+    (void)close(fd);
+
+    // Name the domain's VM (xcp-rrdd datasource owner)
+    (void)snprintf(path, sizeof(path), "%s/local/domain/%u", gen->xsroot,
+                   domid);
+    if (gen_mkdir(path))
+        return(1);
+    n = strlen(path);
+    (void)snprintf(path + n, sizeof(path) - n, "/vm");
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0){
+        perror("open");
+        return(1);
+    }
+    n = snprintf(params, sizeof(params), GEN_VMFMT, domid);
+    if (write(fd, params, n) != n){
+        perror("write");
+        (void)close(fd);
+        return(1);
+    }
+    (void)close(fd);
+
+    // Create and map the stats page
+    (void)snprintf(path, sizeof(path), "%s/" XSIS_TD3_BASEFMT, gen->root,
+                   vbd->tdpid);
+    if (gen_mkdir(path))
+        return(1);
+    (void)snprintf(path, sizeof(path), XSIS_TD3_PATHFMT, gen->root,
+                   vbd->tdpid, domid, vbdid);
+    if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0){
+        perror("open");
+        return(1);
+    }
+    if (ftruncate(fd, GEN_PAGE_SZ)){
+        perror("ftruncate");
+        (void)close(fd);
+        return(1);
+    }
+    page = mmap(NULL, GEN_PAGE_SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    if (page == MAP_FAILED){
+        perror("mmap");
+        return(1);
+    }
+    vbd->page = page;
+
+    // The vbd3 entry appears last, announcing the VBD
+    (void)snprintf(target, sizeof(target), XSIS_TD3_BASEFMT "/"
+                   XSIS_TD3_VBDFMT, vbd->tdpid, domid, vbdid);
+    (void)snprintf(path, sizeof(path), "%s/" XSIS_VBD3_BASEFMT, gen->root,
+                   domid, vbdid);
+    if (symlink(target, path)){
+        perror("symlink");
+        (void)munmap(page, GEN_PAGE_SZ);
+        return(1);
+    }
+    gen->nvbds++;
+
+    // Return
+    return(0);
+}
+
+int
+gen_del(gen_t *gen, uint32_t i){
+    // Local variables
+    gen_vbd_t           *vbd;           // Fake VBD being removed
+    char                path[PATH_MAX]; // Temporary path
+    int                 err = 0;        // Return code
+
+    if (i >= gen->nvbds)
+        return(1);
+    vbd = &gen->vbds[i];
+
+    // Tear down in the reverse order of gen_add()
+    (void)snprintf(path, sizeof(path), "%s/" XSIS_VBD3_BASEFMT, gen->root,
+                   vbd->domid, vbd->vbdid);
+    err |= unlink(path);
+    (void)munmap((void *)vbd->page, GEN_PAGE_SZ);
+    (void)snprintf(path, sizeof(path), XSIS_TD3_PATHFMT, gen->root,
+                   vbd->tdpid, vbd->domid, vbd->vbdid);
+    err |= unlink(path);
+    (void)snprintf(path, sizeof(path), "%s/" XSIS_TD3_BASEFMT, gen->root,
+                   vbd->tdpid);
+    err |= rmdir(path);
+    (void)snprintf(path, sizeof(path), "%s" XSIS_XS_VBD3_PATH
+                   "/%u/%u/kthread-pid", gen->xsroot, vbd->domid, vbd->vbdid);
+    err |= unlink(path);
+    (void)strcpy(strrchr(path, '/'), "/params");
+    (void)unlink(path);
+    *strrchr(path, '/') = '\0';
+    err |= rmdir(path);
+    gen_xs_event(gen, path + strlen(gen->xsroot));
+    *strrchr(path, '/') = '\0';
+    if (!rmdir(path)){                  // Other VBDs may share the domain
+        (void)snprintf(path, sizeof(path), "%s/local/domain/%u/vm",
+                       gen->xsroot, vbd->domid);
+        (void)unlink(path);
+        *strrchr(path, '/') = '\0';
+        (void)rmdir(path);
+    }
+    if (err)
+        perror("gen_del");
+
+    // Keep the array dense
+    *vbd = gen->vbds[--gen->nvbds];
+
+    // Return
+    return(err ? 1 : 0);
+}
+
+// xorshift64 (quality is irrelevant, speed is not)
+static uint32_t
+gen_rnd(gen_t *gen){
+    gen->rnd ^= gen->rnd << 13;
+    gen->rnd ^= gen->rnd >> 7;
+    gen->rnd ^= gen->rnd << 17;
+    return((uint32_t)gen->rnd);
+}
+
+void
+gen_io(gen_t *gen, uint32_t ops){
+    // Local variables
+    volatile tapdisk_stats *page;       // Stats page being advanced
+    uint32_t            rops;           // Reads this step
+    uint32_t            wops;           // Writes this step
+    uint32_t            i;              // Temporary index
+
+    // Requests of the last step complete; this step's stay in flight
+    for (i = 0; i < gen->nvbds; i++){
+        page = gen->vbds[i].page;
+        rops = ops ? gen_rnd(gen) % (ops + 1) : 0;
+        wops = ops - rops;
+        page->read_reqs_completed = page->read_reqs_submitted;
+        page->write_reqs_completed = page->write_reqs_submitted;
+        page->read_reqs_submitted += rops;
+        page->write_reqs_submitted += wops;
+        page->read_sectors += rops*8;
+        page->write_sectors += wops*8;
+        page->read_total_ticks += rops*150;
+        page->write_total_ticks += wops*400;
+    }
+}
+
+void
+gen_close(gen_t *gen){
+    // Local variables
+    char                path[PATH_MAX]; // Temporary path
+    int                 i;              // Temporary index
+
+    // Remove every fake VBD, then what gen_open() created
+    while (gen->nvbds)
+        (void)gen_del(gen, gen->nvbds - 1);
+    free(gen->vbds);
+    gen->vbds = NULL;
+    gen->vbdsz = 0;
+    (void)snprintf(path, sizeof(path), "%s/@events", gen->xsroot);
+    (void)unlink(path);
+    for (i = sizeof(gen_xsdirs)/sizeof(gen_xsdirs[0]) - 2; i >= 0; i--){
+        (void)snprintf(path, sizeof(path), "%s%s", gen->xsroot,
+                       gen_xsdirs[i]);
+        (void)rmdir(path);
+    }
+    (void)rmdir(gen->xsroot);
+    (void)rmdir(gen->root);
+}
@@ -0,0 +1,70 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  bench/gen.h
+ * -------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef GEN_H
+#define GEN_H
+
+// Header files
+#include <stdint.h>
+#include <limits.h>
+#include "../xsiostat.h"
+
+#define GEN_TDPID               40000   // First fake tapdisk pid
+#define GEN_PAGE_SZ             4096    // Size of a fake stats page
+#define GEN_NSRS                4       // Fake SRs VBDs are spread over
+#define GEN_PARAMSFMT           "/dev/sm/backend/gen-sr-%u/vdi-%u-%u"
+#define GEN_VMFMT               "/vm/00000000-0000-4000-8000-%012x"
+
+// Fake VBD
+typedef struct _gen_vbd_t {
+    uint32_t            domid;          // domain id
+    uint32_t            vbdid;          // vbd id
+    uint32_t            tdpid;          // fake tapdisk pid
+    volatile tapdisk_stats *page;       // mapped stats page
+} gen_vbd_t;
+
+// Fake tapdisk/xenstore environment
+typedef struct _gen_t {
+    char                root[PATH_MAX/2]; // stats root (xsiostat --root)
+    char                xsroot[PATH_MAX/2]; // stub xenstore root
+    gen_vbd_t           *vbds;          // fake VBDs (in creation order)
+    uint32_t            nvbds;          // entries in vbds
+    uint32_t            vbdsz;          // allocated entries in vbds
+    uint32_t            nextpid;        // next fake tapdisk pid
+    uint64_t            rnd;            // PRNG state
+} gen_t;
+
+// gen interface
+int
+gen_open(gen_t *, const char *, const char *);
+
+int
+gen_add(gen_t *, uint32_t, uint32_t);
+
+int
+gen_del(gen_t *, uint32_t);
+
+void
+gen_io(gen_t *, uint32_t);
+
+void
+gen_close(gen_t *);
+
+#endif /* GEN_H */
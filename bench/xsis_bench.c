@@ -0,0 +1,401 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  bench/xsis_bench.c
+ * --------------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * Scaling benchmark ("make bench"). For each population size, fake VBDs
+ * are created in a private directory under /dev/shm and measured:
+ *
+ *   alloc   vbds_alloc() attaching every VBD from scratch (ms)
+ *   update  snap_rotate() plus vbd_update() of every VBD (us/tick)
+ *   tick    update plus snap_rates() and a CSV row per VBD, i.e. the
+ *           work main_loop() does per tick without the write() (us/tick)
+ *   idle    a tick once every VBD has been idle for a while, i.e. mostly
+ *           probes rather than page reads and no rows (us/tick)
+ *   churn   a tick while BENCH_CHURN % of the VBDs are replugged, with
+ *           vbds_refresh() picking the changes up (us/tick)
+ *
+ * A second table covers recording (-o): datafile bytes per tick with every
+ * VBD busy and with every VBD idle, each counting a share of the key frame
+ * written every XSIS_DAT_KEY_STRIDE ticks, the compression ratio against
+ * raw counters (a key frame every tick) and dat_write() throughput in MB
+ * of raw counters per second.
+ *
+ * A third table times the cold attach of BENCH_ATTACH_VBDS VBDs serially
+ * and with the attach threads, the stub xenstore sleeping for a given
+ * round trip on every read (XSIS_XS_DELAY_US).
+ *
+ * Results go to stdout as a table; nothing touches the real /dev/shm
+ * entries or xenstore.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "gen.h"
+
+#define BENCH_DIR               "/dev/shm/xsis-bench-XXXXXX"
+#define BENCH_TICKS             100     // Ticks timed per measurement
+#define BENCH_CHURN             1       // VBDs replugged per tick (%)
+#define BENCH_OPS               10      // Requests per VBD per tick
+#define BENCH_VBDS_PER_DOM      4       // VBDs given to each fake domain
+#define BENCH_ATTACH_VBDS       2000    // VBDs of the attach table
+
+// Recording figures of a population size
+typedef struct _bench_rec_t {
+    double              busy;           // Bytes per tick, busy VBDs
+    double              idle;           // Bytes per tick, idle VBDs
+    double              raw;            // Bytes per tick, raw counters
+    double              mbps;           // Encode throughput (raw MB/s)
+} bench_rec_t;
+
+static const uint32_t   bench_sizes[] = { 10, 100, 1000, 10000, 0 };
+static const char       *bench_delays[] = { "0", "20", "100", "500", NULL };
+static bench_rec_t      bench_recs[sizeof(bench_sizes)/sizeof(uint32_t)];
+
+static uint64_t
+bench_now(void){
+    // Local variables
+    struct timespec     ts;             // Current time
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec);
+}
+
+// One main_loop() tick, minus datafile and stdout
+static void
+bench_tick(xsis_vbds_t *vbds, xsis_fmt_t *fmt){
+    // Local variables
+    xsis_vbd_t          *vbd;           // Temporary vbd iterator
+    uint32_t            s;              // VBD slot
+    int                 i;              // Rate index
+
+    vbds_update(vbds);
+    if (!fmt)
+        return;
+
+    snap_rates(&vbds->snap, 1000000);
+    LIST_FOREACH(vbd, &vbds->list, vbds){
+        s = vbd->slot;
+        if (snap_idle(&vbds->snap, s))
+            continue;
+        fmt_uint(fmt, vbd->domid, 0);
+        fmt_str(fmt, ",");
+        fmt_uint(fmt, vbd->vbdid, 0);
+        for (i = 0; i < XSIS_NRATES; i++){
+            fmt_str(fmt, ",");
+            fmt_fixed(fmt, vbds->snap.rate[i][s], 0);
+        }
+        fmt_str(fmt, "\n");
+    }
+    fmt->len = 0;
+}
+
+// Record BENCH_TICKS ticks of 'ops' requests per VBD, timing dat_write()
+static int
+bench_record(gen_t *gen, xsis_vbds_t *vbds, xsis_dat_t *dat, uint32_t ops,
+             uint64_t *bytes, uint64_t *ns){
+    // Local variables
+    uint64_t            off;            // Datafile offset before the ticks
+    uint64_t            t0;             // Start of measurement
+    uint32_t            t;              // Tick counter
+
+    off = dat->off;
+    for (t = 0; t < BENCH_TICKS; t++){
+        gen_io(gen, ops);
+        bench_tick(vbds, NULL);
+        t0 = bench_now();
+        if (dat_write(dat, vbds))
+            return(1);
+        *ns += bench_now() - t0;
+    }
+    *bytes = dat->off - off;
+    return(0);
+}
+
+// Replug 'n' random VBDs (new tapdisk, same ids)
+static int
+bench_churn(gen_t *gen, uint32_t n){
+    // Local variables
+    uint32_t            domid;          // Temporary DOM ID
+    uint32_t            vbdid;          // Temporary VBD ID
+    uint32_t            i;              // Temporary index
+
+    while (n--){
+        i = rand() % gen->nvbds;
+        domid = gen->vbds[i].domid;
+        vbdid = gen->vbds[i].vbdid;
+        if (gen_del(gen, i) || gen_add(gen, domid, vbdid))
+            return(1);
+    }
+    return(0);
+}
+
+static int
+bench_size(uint32_t nvbds, bench_rec_t *rec){
+    // Local variables
+    char                base[] = BENCH_DIR; // Private directory
+    char                root[PATH_MAX]; // Stats root
+    char                xsroot[PATH_MAX]; // Stub xenstore root
+    char                datafn[PATH_MAX]; // Datafile
+    gen_t               gen;            // Fake environment
+    xsis_vbds_t         vbds;           // Attached VBDs
+    xsis_dat_t          *dat = NULL;    // Datafile writer
+    xsis_flts_t         domids;         // No DOM ID filter
+    xsis_flts_t         vbdids;         // No VBD ID filter
+    xsis_fmt_t          fmt;            // Discarded output
+    uint64_t            t0;             // Start of measurement
+    uint64_t            alloc;          // vbds_alloc() time (ns)
+    uint64_t            update = 0;     // Update time (ns)
+    uint64_t            tick = 0;       // Tick time (ns)
+    uint64_t            idleto = 0;     // Tick time, idle VBDs (ns)
+    uint64_t            churn = 0;      // Tick time with churn (ns)
+    uint64_t            enc = 0;        // dat_write() time, busy (ns)
+    uint64_t            encidle = 0;    // dat_write() time, idle (ns)
+    uint64_t            key;            // Key frame bytes
+    uint64_t            busy;           // Bytes of busy ticks
+    uint64_t            idle;           // Bytes of idle ticks
+    uint32_t            nchurn;         // VBDs replugged per tick
+    uint32_t            attached;       // VBDs attached by vbds_alloc()
+    uint32_t            t;              // Tick counter
+    uint32_t            i;              // Temporary index
+    int                 err = 0;        // Return code
+
+    if (!mkdtemp(base)){
+        perror("mkdtemp");
+        return(1);
+    }
+    (void)snprintf(root, sizeof(root), "%s/shm", base);
+    (void)snprintf(xsroot, sizeof(xsroot), "%s/xs", base);
+    (void)snprintf(datafn, sizeof(datafn), "%s/rec.dat", base);
+    setenv("XSIS_XS_ROOT", xsroot, 1);
+
+    flts_init(&domids);
+    flts_init(&vbdids);
+    vbds_init(&vbds);
+    vbds.root = root;
+    fmt_init(&fmt, XSIS_FMT_CSV);
+
+    // Populate
+    if (gen_open(&gen, root, xsroot))
+        goto err;
+    for (i = 0; i < nvbds; i++)
+        if (gen_add(&gen, 1 + i/BENCH_VBDS_PER_DOM,
+                    768 + i%BENCH_VBDS_PER_DOM))
+            goto err;
+
+    // Cold attach
+    t0 = bench_now();
+    if (vbds_alloc(&vbds, &domids, &vbdids))
+        goto err;
+    alloc = bench_now() - t0;
+    attached = vbds.nvbds;
+
+    // Steady state ticks
+    bench_tick(&vbds, &fmt);
+    for (t = 0; t < BENCH_TICKS; t++){
+        gen_io(&gen, BENCH_OPS);
+        t0 = bench_now();
+        bench_tick(&vbds, NULL);
+        update += bench_now() - t0;
+        gen_io(&gen, BENCH_OPS);
+        t0 = bench_now();
+        bench_tick(&vbds, &fmt);
+        tick += bench_now() - t0;
+    }
+
+    // Recording: a key frame, then busy and idle ticks
+    if (dat_open(&dat, datafn, 1000))
+        goto err;
+    key = dat->off;
+    if (dat_write(dat, &vbds))
+        goto err;
+    key = dat->off - key;
+    if (bench_record(&gen, &vbds, dat, BENCH_OPS, &busy, &enc) ||
+        bench_record(&gen, &vbds, dat, 0, &idle, &encidle))
+        goto err;
+    rec->raw = sizeof(xsis_dat_rec_t) + nvbds*sizeof(xsis_dat_cnt_t);
+    rec->busy = (double)busy/BENCH_TICKS + (double)key/XSIS_DAT_KEY_STRIDE;
+    rec->idle = (double)idle/BENCH_TICKS + (double)key/XSIS_DAT_KEY_STRIDE;
+    rec->mbps = rec->raw*BENCH_TICKS*1000/(enc ? enc : 1);
+
+    // Idle ticks (the recording above left every VBD idle)
+    for (t = 0; t < BENCH_TICKS; t++){
+        t0 = bench_now();
+        bench_tick(&vbds, &fmt);
+        idleto += bench_now() - t0;
+    }
+
+    // Ticks with VBDs coming and going
+    nchurn = (nvbds*BENCH_CHURN + 99)/100;
+    for (t = 0; t < BENCH_TICKS; t++){
+        gen_io(&gen, BENCH_OPS);
+        if (bench_churn(&gen, nchurn))
+            goto err;
+        t0 = bench_now();
+        if (vbds_refresh(&vbds, &domids, &vbdids, 1))
+            goto err;
+        bench_tick(&vbds, &fmt);
+        churn += bench_now() - t0;
+    }
+
+    printf("%7u %7u %10.2f %10.1f %10.1f %10.1f %10.1f %11.1f %7u\n",
+           nvbds, attached, (double)alloc/1000000,
+           (double)update/BENCH_TICKS/1000, (double)tick/BENCH_TICKS/1000,
+           (double)idleto/BENCH_TICKS/1000, (double)churn/BENCH_TICKS/1000,
+           (double)tick/BENCH_TICKS/(attached ? attached : 1), vbds.nvbds);
+    fflush(stdout);
+    if (attached != nvbds || vbds.nvbds != nvbds){
+        fprintf(stderr, "Only %u/%u VBDs attached (%u after churn).\n",
+                attached, nvbds, vbds.nvbds);
+        goto err;
+    }
+
+out:
+    // Clean up
+    dat_close(dat);
+    (void)unlink(datafn);
+    vbds_free(&vbds);
+    fmt_free(&fmt);
+    flts_free(&domids);
+    flts_free(&vbdids);
+    gen_close(&gen);
+    (void)rmdir(base);
+    return(err);
+
+err:
+    err = 1;
+    goto out;
+}
+
+// Cold attach of every VBD with 'nworkers' threads (ms, or < 0)
+static double
+bench_attach(const char *root, uint32_t nvbds, uint32_t nworkers){
+    // Local variables
+    xsis_vbds_t         vbds;           // Attached VBDs
+    xsis_flts_t         domids;         // No DOM ID filter
+    xsis_flts_t         vbdids;         // No VBD ID filter
+    uint64_t            t0;             // Start of measurement
+    double              ms = -1;        // vbds_alloc() time
+
+    flts_init(&domids);
+    flts_init(&vbdids);
+    vbds_init(&vbds);
+    vbds.root = root;
+    vbds.nworkers = nworkers;
+    t0 = bench_now();
+    if (!vbds_alloc(&vbds, &domids, &vbdids) && vbds.nvbds == nvbds)
+        ms = (double)(bench_now() - t0)/1000000;
+    else
+        fprintf(stderr, "Only %u/%u VBDs attached.\n", vbds.nvbds, nvbds);
+    vbds_free(&vbds);
+    flts_free(&domids);
+    flts_free(&vbdids);
+    return(ms);
+}
+
+static int
+bench_attach_table(void){
+    // Local variables
+    char                base[] = BENCH_DIR; // Private directory
+    char                root[PATH_MAX]; // Stats root
+    char                xsroot[PATH_MAX]; // Stub xenstore root
+    gen_t               gen;            // Fake environment
+    double              serial;         // Serial attach (ms)
+    double              par;            // Parallel attach (ms)
+    uint32_t            i;              // Temporary index
+    int                 err = 0;        // Return code
+
+    if (!mkdtemp(base)){
+        perror("mkdtemp");
+        return(1);
+    }
+    (void)snprintf(root, sizeof(root), "%s/shm", base);
+    (void)snprintf(xsroot, sizeof(xsroot), "%s/xs", base);
+    setenv("XSIS_XS_ROOT", xsroot, 1);
+    if (gen_open(&gen, root, xsroot))
+        goto err;
+    for (i = 0; i < BENCH_ATTACH_VBDS; i++)
+        if (gen_add(&gen, 1 + i/BENCH_VBDS_PER_DOM,
+                    768 + i%BENCH_VBDS_PER_DOM))
+            goto err;
+
+    printf("\n   VBDs  xs_rtt_us  serial_ms  threads  parallel_ms" \
+           "  speedup\n");
+    for (i = 0; bench_delays[i]; i++){
+        setenv("XSIS_XS_DELAY_US", bench_delays[i], 1);
+        if ((serial = bench_attach(root, BENCH_ATTACH_VBDS, 1)) < 0 ||
+            (par = bench_attach(root, BENCH_ATTACH_VBDS,
+                                XSIS_ATTACH_WORKERS)) < 0)
+            goto err;
+        printf("%7u %10s %10.1f %8u %12.1f %8.1f\n", BENCH_ATTACH_VBDS,
+               bench_delays[i], serial, XSIS_ATTACH_WORKERS, par,
+               serial/(par > 0 ? par : 1));
+        fflush(stdout);
+    }
+
+out:
+    // Clean up
+    unsetenv("XSIS_XS_DELAY_US");
+    gen_close(&gen);
+    (void)rmdir(base);
+    return(err);
+
+err:
+    err = 1;
+    goto out;
+}
+
+int
+main(int argc, char **argv){
+    // Local variables
+    struct rlimit       rl;             // Open files limit
+    int                 i;              // Temporary index
+    int                 err = 0;        // Return code
+
+    // Every attached VBD keeps its stats file open
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max){
+        rl.rlim_cur = rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    srand(1);
+
+    printf("   VBDs  attach   alloc_ms  update_us    tick_us    idle_us" \
+           "   churn_us ns/VBD/tick   after\n");
+    for (i = 0; bench_sizes[i]; i++)
+        err |= bench_size(bench_sizes[i], &bench_recs[i]);
+
+    printf("\n   VBDs  raw_B/tick  busy_B/tick  ratio  idle_B/tick   ratio" \
+           "  enc_MB/s\n");
+    for (i = 0; bench_sizes[i]; i++)
+        printf("%7u %11.0f %12.1f %6.1f %12.1f %7.1f %9.1f\n",
+               bench_sizes[i], bench_recs[i].raw, bench_recs[i].busy,
+               bench_recs[i].raw/bench_recs[i].busy, bench_recs[i].idle,
+               bench_recs[i].raw/bench_recs[i].idle, bench_recs[i].mbps);
+    err |= bench_attach_table();
+
+    // Return
+    return(err);
+}
@@ -0,0 +1,158 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  bench/xsis_gen.c
+ * ------------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * Stand-alone workload generator: creates fake VBDs and keeps them busy
+ * until interrupted, e.g.
+ *
+ *   bench/xsis_gen -n 1000 -r 500 /dev/shm/xsis /tmp/xsis-xs &
+ *   XSIS_XS_ROOT=/tmp/xsis-xs ./xsiostat --root /dev/shm/xsis -s
+ *
+ * (with xsiostat built by "make XENSTORE=stub").
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "gen.h"
+
+#define GEN_VBDS_PER_DOM        4       // VBDs given to each fake domain
+#define GEN_VBDID               768     // First VBD id of a domain (xvda)
+
+static volatile sig_atomic_t stop = 0;  // Termination requested (flag)
+
+static void
+stop_h(int signal){
+    stop = 1;
+}
+
+static void
+usage(char *argv0){
+    fprintf(stderr, "Usage: %s [ -n <vbds> ] [ -r <iops> ] [ -c <churn> ]" \
+                    " [ -i <interval> ] [ -t <secs> ]\n" \
+                    "         <root> <xs_root>\n", argv0);
+    fprintf(stderr, "  -n vbds       Fake VBDs to create (default=100).\n");
+    fprintf(stderr, "  -r iops       Requests per second per VBD" \
+                    " (default=100).\n");
+    fprintf(stderr, "  -c churn      VBDs replugged per second" \
+                    " (default=0).\n");
+    fprintf(stderr, "  -i interval   Milliseconds between counter updates" \
+                    " (default=100).\n");
+    fprintf(stderr, "  -t secs       Stop after secs (default: on" \
+                    " SIGINT/SIGTERM).\n");
+    fprintf(stderr, "  root          Stats root (xsiostat --root).\n");
+    fprintf(stderr, "  xs_root       Stub xenstore root (XSIS_XS_ROOT).\n");
+}
+
+int
+main(int argc, char **argv){
+    // Local variables
+    gen_t               gen;            // Fake environment
+    struct sigaction    sa;             // Signal handler setup
+    struct timespec     ts;             // Sleep between steps
+    uint32_t            nvbds = 100;    // VBDs to create
+    uint32_t            iops = 100;     // Requests per second per VBD
+    uint32_t            churn = 0;      // Replugs per second
+    uint32_t            inter = 100;    // Step length (ms)
+    uint32_t            secs = 0;       // Run time (0 = until signalled)
+    uint64_t            step;           // Step counter
+    uint64_t            owed = 0;       // Replugs owed (per mille)
+    uint32_t            domid;          // Temporary DOM ID
+    uint32_t            vbdid;          // Temporary VBD ID
+    uint32_t            i;              // Temporary index
+    int                 c;              // Option character
+    int                 err = 0;        // Return code
+
+    // Fetch arguments
+    while ((c = getopt(argc, argv, "hn:r:c:i:t:")) != -1){
+        switch (c){
+        case 'n':
+            nvbds = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            iops = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            churn = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            inter = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            secs = strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return(1);
+        }
+    }
+    if (argc - optind != 2 || !inter){
+        usage(argv[0]);
+        return(1);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_h;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Create the fake VBDs
+    if (gen_open(&gen, argv[optind], argv[optind+1]))
+        return(1);
+    for (i = 0; i < nvbds && !stop; i++)
+        if (gen_add(&gen, 1 + i/GEN_VBDS_PER_DOM,
+                    GEN_VBDID + i%GEN_VBDS_PER_DOM))
+            goto err;
+    fprintf(stderr, "%u VBDs created, %u IOPS each, %u replugs/s.\n",
+            gen.nvbds, iops, churn);
+
+    // Advance counters, replugging VBDs as requested
+    ts.tv_sec = inter/1000;
+    ts.tv_nsec = (inter%1000)*1000000;
+    for (step = 0; !stop && (!secs || step*inter < (uint64_t)secs*1000);
+         step++){
+        gen_io(&gen, (uint32_t)((uint64_t)iops*inter/1000));
+        for (owed += (uint64_t)churn*inter; owed >= 1000 && gen.nvbds;
+             owed -= 1000){
+            i = rand() % gen.nvbds;
+            domid = gen.vbds[i].domid;
+            vbdid = gen.vbds[i].vbdid;
+            if (gen_del(&gen, i) || gen_add(&gen, domid, vbdid))
+                goto err;
+        }
+        nanosleep(&ts, NULL);
+    }
+
+out:
+    // Remove everything that was created
+    gen_close(&gen);
+    return(err);
+
+err:
+    err = 1;
+    goto out;
+}
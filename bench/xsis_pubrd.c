@@ -0,0 +1,282 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  bench/xsis_pubrd.c
+ * --------------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * Reader of the segment written by "xsiostat --publish", e.g.
+ *
+ *   ./xsiostat -s --publish /dev/shm/xsiostat > /dev/null &
+ *   bench/xsis_pubrd /dev/shm/xsiostat          (print the last tick)
+ *   bench/xsis_pubrd -t 10 /dev/shm/xsiostat    (read it for 10 seconds)
+ *
+ * With -t, copies are taken back to back while xsiostat keeps writing,
+ * and every one the sequence lock let through is checked: all entries
+ * must carry the gen the copy was taken at, and the header must match it.
+ * It exits with 1 if any copy was not consistent.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../libxsiostat.h"
+
+// Segment reader
+typedef struct _rd_t {
+    int                 fd;             // segment fd
+    const char          *map;           // segment mapping
+    size_t              len;            // bytes mapped
+    uint32_t            maxvbds;        // entries mapped
+    xsiostat_pub_t      hdr;            // header of the last copy
+    char                *ents;          // entries of the last copy
+    uint32_t            entsz;          // entries ents holds
+    uint64_t            retries;        // copies started over
+    uint64_t            remaps;         // segment mapped again
+} rd_t;
+
+static void
+usage(char *argv0){
+    fprintf(stderr, "Usage: %s [ -t <secs> ] <path>\n", argv0);
+    fprintf(stderr, "  -t secs       Read back to back for secs, checking" \
+                    " every copy.\n");
+    fprintf(stderr, "  path          Segment (xsiostat --publish).\n");
+}
+
+// Map the segment (again, if it grew)
+static int
+rd_map(rd_t *rd){
+    // Local variables
+    struct stat         st;             // Segment size
+    const xsiostat_pub_t *hdr;          // Segment header
+    void                *map;           // New mapping
+
+    if (fstat(rd->fd, &st) < 0){
+        perror("fstat");
+        return(1);
+    }
+    if ((size_t)st.st_size < sizeof(xsiostat_pub_t)){
+        fprintf(stderr, "Segment too short.\n");
+        return(1);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, rd->fd, 0);
+    if (map == MAP_FAILED){
+        perror("mmap");
+        return(1);
+    }
+    if (rd->map)
+        (void)munmap((void *)rd->map, rd->len);
+    rd->map = map;
+    rd->len = st.st_size;
+
+    hdr = map;
+    if (hdr->magic != XSIOSTAT_PUB_MAGIC ||
+        hdr->version != XSIOSTAT_PUB_VERSION ||
+        hdr->vbdsz < sizeof(xsiostat_pub_vbd_t) || hdr->hdrsz > rd->len){
+        fprintf(stderr, "Not a version %d segment.\n",
+                XSIOSTAT_PUB_VERSION);
+        return(1);
+    }
+    rd->maxvbds = (rd->len - hdr->hdrsz)/hdr->vbdsz;
+    return(0);
+}
+
+// Take a consistent copy of the segment
+static int
+rd_copy(rd_t *rd){
+    // Local variables
+    const xsiostat_pub_t *hdr;          // Segment header
+    uint64_t            gen;            // Sequence the copy started at
+    char                *tmp;           // Temporary pointer
+
+    for (;;){
+        hdr = (const xsiostat_pub_t *)rd->map;
+        if ((gen = __atomic_load_n(&hdr->gen, __ATOMIC_ACQUIRE)) & 1){
+            rd->retries++;
+            continue;
+        }
+        memcpy(&rd->hdr, hdr, sizeof(rd->hdr));
+
+        // Follow the segment as it grows
+        if (rd->hdr.nvbds > rd->maxvbds){
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&hdr->gen, __ATOMIC_RELAXED) != gen){
+                rd->retries++;
+                continue;
+            }
+            if (rd_map(rd))
+                return(1);
+            rd->remaps++;
+            continue;
+        }
+        if (rd->hdr.nvbds > rd->entsz){
+            if (!(tmp = realloc(rd->ents, (size_t)rd->hdr.nvbds *
+                                          rd->hdr.vbdsz))){
+                perror("realloc");
+                return(1);
+            }
+            rd->ents = tmp;
+            rd->entsz = rd->hdr.nvbds;
+        }
+        memcpy(rd->ents, rd->map + rd->hdr.hdrsz,
+               (size_t)rd->hdr.nvbds*rd->hdr.vbdsz);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&hdr->gen, __ATOMIC_RELAXED) == gen)
+            return(0);
+        rd->retries++;
+    }
+}
+
+// Entries of a copy not matching its header
+static uint32_t
+rd_check(rd_t *rd){
+    // Local variables
+    const xsiostat_pub_vbd_t *ent;      // Temporary entry pointer
+    uint32_t            bad = 0;        // Mismatches found
+    uint32_t            i;              // Entry index
+
+    if (rd->hdr.ticks*2 != rd->hdr.gen)
+        bad++;
+    for (i = 0; i < rd->hdr.nvbds; i++){
+        ent = (const xsiostat_pub_vbd_t *)(rd->ents +
+                                           (size_t)i*rd->hdr.vbdsz);
+        if (ent->gen != rd->hdr.gen)
+            bad++;
+    }
+    return(bad);
+}
+
+// Print a copy
+static void
+rd_print(rd_t *rd){
+    // Local variables
+    const xsiostat_pub_vbd_t *ent;      // Temporary entry pointer
+    uint32_t            i;              // Entry index
+
+    printf("tick %llu, %u VBDs, interval %u ms, publisher %u\n",
+           (unsigned long long)rd->hdr.ticks, rd->hdr.nvbds,
+           rd->hdr.interval, rd->hdr.pid);
+    printf("  DOM   VBD  tapdisk  r_iops  w_iops  r_tput  w_tput" \
+           "  r_lat_us  w_lat_us  util\n");
+    for (i = 0; i < rd->hdr.nvbds; i++){
+        ent = (const xsiostat_pub_vbd_t *)(rd->ents +
+                                           (size_t)i*rd->hdr.vbdsz);
+        printf("%5u %5u %8u %7.1f %7.1f %7.2f %7.2f %9.1f %9.1f %5.1f\n",
+               ent->id.domid, ent->id.vbdid, ent->id.tdpid,
+               ent->rate[XSIOSTAT_RATE_RIOPS],
+               ent->rate[XSIOSTAT_RATE_WIOPS],
+               ent->rate[XSIOSTAT_RATE_RTPUT],
+               ent->rate[XSIOSTAT_RATE_WTPUT],
+               ent->drv[XSIOSTAT_DRV_RLAT], ent->drv[XSIOSTAT_DRV_WLAT],
+               ent->drv[XSIOSTAT_DRV_UTIL]);
+    }
+}
+
+static uint64_t
+now_ns(void){
+    // Local variables
+    struct timespec     ts;             // Current time
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec);
+}
+
+int
+main(int argc, char **argv){
+    // Local variables
+    rd_t                rd;             // Segment reader
+    uint32_t            secs = 0;       // Reading time (0 = one copy)
+    uint64_t            start;          // Start of reading (ns)
+    uint64_t            ncopies = 0;    // Copies taken
+    uint64_t            nbad = 0;       // Inconsistent copies
+    uint64_t            first = 0;      // First tick seen
+    int                 c;              // Option character
+    int                 err = 0;        // Return code
+
+    // Fetch arguments
+    while ((c = getopt(argc, argv, "ht:")) != -1){
+        switch (c){
+        case 't':
+            secs = strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return(1);
+        }
+    }
+    if (argc - optind != 1){
+        usage(argv[0]);
+        return(1);
+    }
+
+    memset(&rd, 0, sizeof(rd));
+    if ((rd.fd = open(argv[optind], O_RDONLY | O_CLOEXEC)) < 0){
+        perror("open");
+        return(1);
+    }
+    if (rd_map(&rd))
+        goto err;
+
+    // Take copies, back to back if asked to
+    start = now_ns();
+    do {
+        if (rd_copy(&rd))
+            goto err;
+        if (!ncopies++)
+            first = rd.hdr.ticks;
+        if (rd_check(&rd))
+            nbad++;
+        if (!rd.hdr.pid){
+            fprintf(stderr, "Publisher exited.\n");
+            break;
+        }
+    } while (secs && now_ns() - start < (uint64_t)secs*1000000000);
+
+    if (secs)
+        printf("%llu copies of %llu ticks in %.1f s, %llu retries," \
+               " %llu remaps, %llu inconsistent.\n",
+               (unsigned long long)ncopies,
+               (unsigned long long)(rd.hdr.ticks - first + 1),
+               (now_ns() - start)/1e9, (unsigned long long)rd.retries,
+               (unsigned long long)rd.remaps, (unsigned long long)nbad);
+    else
+        rd_print(&rd);
+    if (nbad)
+        err = 1;
+
+out:
+    // Release resources
+    if (rd.map)
+        (void)munmap((void *)rd.map, rd.len);
+    (void)close(rd.fd);
+    free(rd.ents);
+    return(err);
+
+err:
+    err = 1;
+    goto out;
+}
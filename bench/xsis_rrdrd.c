@@ -0,0 +1,360 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  bench/xsis_rrdrd.c
+ * --------------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * Stand-in for the xcp-rrdd side of "xsiostat --rrdd", e.g.
+ *
+ *   ./xsiostat -s --rrdd /tmp/xsis.rrd > /dev/null &
+ *   bench/xsis_rrdrd /tmp/xsis.rrd          (print the datasources)
+ *   bench/xsis_rrdrd -t 10 /tmp/xsis.rrd    (read it for 10 seconds)
+ *
+ * Every read is checked the way xcp-rrdd checks a plugin page (version 2
+ * of the protocol): header, data and metadata checksums, and one
+ * datasource in the metadata for every value. Pages failing a checksum
+ * are counted and skipped, as xcp-rrdd would; any other fault fails.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define RD_MAGIC                "DATASOURCES"
+#define RD_VALUES               31      // Offset of the first value
+#define RD_NAMESZ               128     // Longest name or owner kept
+
+// Datasource found in the metadata
+typedef struct _rd_ds_t {
+    char                name[RD_NAMESZ]; // datasource name
+    char                owner[RD_NAMESZ]; // "host", "vm <uuid>", ...
+    uint8_t             isint;          // int64 value (flag)
+} rd_ds_t;
+
+// Page reader
+typedef struct _rd_t {
+    char                *page;          // last page read
+    size_t              len;            // bytes in page
+    size_t              size;           // bytes allocated for page
+    rd_ds_t             *dss;           // datasources of the metadata
+    uint32_t            ndss;           // entries in dss
+    uint32_t            dssz;           // allocated entries in dss
+    uint32_t            metacrc;        // checksum of the metadata parsed
+    uint64_t            reads;          // pages read
+    uint64_t            badcrc;         // pages failing a checksum
+    uint64_t            metas;          // metadata parsed
+} rd_t;
+
+static void
+usage(char *argv0){
+    fprintf(stderr, "Usage: %s [ -t <secs> ] <path>\n", argv0);
+    fprintf(stderr, "  -t secs       Read every 100 ms for secs, checking" \
+                    " every page.\n");
+    fprintf(stderr, "  path          Plugin page (xsiostat --rrdd).\n");
+}
+
+static uint32_t
+rd_get32(const char *p){
+    // Local variables
+    uint32_t            v;              // Big endian value
+
+    memcpy(&v, p, sizeof(v));
+    return(be32toh(v));
+}
+
+static uint64_t
+rd_get64(const char *p){
+    // Local variables
+    uint64_t            v;              // Big endian value
+
+    memcpy(&v, p, sizeof(v));
+    return(be64toh(v));
+}
+
+// CRC32 (as zlib's crc32()), bitwise: speed does not matter here
+static uint32_t
+rd_crc(const char *buf, size_t len){
+    // Local variables
+    uint32_t            c = 0xffffffff; // Running CRC
+    size_t              i;              // Byte index
+    int                 j;              // Bit index
+
+    for (i = 0; i < len; i++){
+        c ^= (uint8_t)buf[i];
+        for (j = 0; j < 8; j++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    return(c ^ 0xffffffff);
+}
+
+// Read the whole page
+static int
+rd_read(rd_t *rd, const char *path){
+    // Local variables
+    char                *tmp;           // Reallocated page
+    ssize_t             n;              // Bytes read by read()
+    int                 fd;             // Page fd
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0){
+        perror("open");
+        return(1);
+    }
+    rd->len = 0;
+    for (;;){
+        if (rd->len == rd->size){
+            if (!(tmp = realloc(rd->page, rd->size ? rd->size*2 : 65536))){
+                perror("realloc");
+                (void)close(fd);
+                return(1);
+            }
+            rd->page = tmp;
+            rd->size = rd->size ? rd->size*2 : 65536;
+        }
+        if ((n = read(fd, rd->page + rd->len, rd->size - rd->len)) <= 0)
+            break;
+        rd->len += n;
+    }
+    (void)close(fd);
+    rd->reads++;
+    return(0);
+}
+
+// Skip blanks
+static const char *
+rd_ws(const char *p, const char *end){
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r'))
+        p++;
+    return(p);
+}
+
+// Parse a JSON string (simple escapes only)
+static const char *
+rd_str(const char *p, const char *end, char *out, size_t len){
+    // Local variables
+    size_t              n = 0;          // Characters kept
+
+    p = rd_ws(p, end);
+    if (p >= end || *p++ != '"')
+        return(NULL);
+    while (p < end && *p != '"'){
+        if (*p == '\\' && ++p >= end)
+            return(NULL);
+        if (n + 1 < len)
+            out[n++] = *p;
+        p++;
+    }
+    out[n] = '\0';
+    return((p < end) ? p + 1 : NULL);
+}
+
+// Expect a character
+static const char *
+rd_chr(const char *p, const char *end, char c){
+    p = rd_ws(p, end);
+    return((p < end && *p == c) ? p + 1 : NULL);
+}
+
+// Parse the metadata: {"datasources":{"name":{"key":"value",...},...}}
+static int
+rd_meta(rd_t *rd, const char *p, const char *end){
+    // Local variables
+    char                key[RD_NAMESZ]; // Member name
+    char                val[RD_NAMESZ]; // Member value
+    rd_ds_t             *ds;            // Datasource being parsed
+    rd_ds_t             *tmp;           // Reallocated datasources
+    const char          *q;             // Past a separator
+
+    rd->ndss = 0;
+    if (!(p = rd_chr(p, end, '{')) || !(p = rd_str(p, end, key, sizeof(key)))
+        || strcmp(key, "datasources") || !(p = rd_chr(p, end, ':')) ||
+        !(p = rd_chr(p, end, '{')))
+        return(1);
+    if ((q = rd_chr(p, end, '}')))
+        return(!rd_chr(q, end, '}'));
+    for (;;){
+        if (rd->ndss == rd->dssz){
+            if (!(tmp = realloc(rd->dss, (rd->dssz ? rd->dssz*2 : 64) *
+                                         sizeof(rd_ds_t))))
+                return(1);
+            rd->dss = tmp;
+            rd->dssz = rd->dssz ? rd->dssz*2 : 64;
+        }
+        ds = &rd->dss[rd->ndss++];
+        memset(ds, 0, sizeof(*ds));
+        if (!(p = rd_str(p, end, ds->name, sizeof(ds->name))) ||
+            !(p = rd_chr(p, end, ':')) || !(p = rd_chr(p, end, '{')))
+            return(1);
+
+        // Members of a datasource (all strings)
+        for (;;){
+            if (!(p = rd_str(p, end, key, sizeof(key))) ||
+                !(p = rd_chr(p, end, ':')) ||
+                !(p = rd_str(p, end, val, sizeof(val))))
+                return(1);
+            if (!strcmp(key, "owner"))
+                strcpy(ds->owner, val);
+            else if (!strcmp(key, "value_type"))
+                ds->isint = !strcmp(val, "int64");
+            if (!(q = rd_chr(p, end, ',')))
+                break;
+            p = q;
+        }
+        if (!(p = rd_chr(p, end, '}')))
+            return(1);
+        if (!(q = rd_chr(p, end, ',')))
+            break;
+        p = q;
+    }
+    return(!(p = rd_chr(p, end, '}')) || !rd_chr(p, end, '}'));
+}
+
+// Check the page read; returns -1 on a checksum failure
+static int
+rd_check(rd_t *rd){
+    // Local variables
+    uint32_t            count;          // Datasources in the page
+    uint32_t            mlen;           // Metadata length
+    uint32_t            mcrc;           // Metadata checksum
+    const char          *meta;          // Metadata
+
+    if (rd->len < RD_VALUES || memcmp(rd->page, RD_MAGIC, 11)){
+        fprintf(stderr, "Not a plugin page.\n");
+        return(1);
+    }
+    count = rd_get32(rd->page + 19);
+    if (rd->len < RD_VALUES + (size_t)count*8 + 4 ||
+        rd->len < RD_VALUES + (size_t)count*8 + 4 +
+                  (mlen = rd_get32(rd->page + RD_VALUES + count*8))){
+        rd->badcrc++;
+        return(-1);
+    }
+    meta = rd->page + RD_VALUES + (size_t)count*8 + 4;
+    mcrc = rd_get32(rd->page + 15);
+    if (rd_crc(rd->page + 23, 8 + (size_t)count*8) !=
+        rd_get32(rd->page + 11) || rd_crc(meta, mlen) != mcrc){
+        rd->badcrc++;
+        return(-1);
+    }
+
+    // Parse the metadata when it changed only, as xcp-rrdd does
+    if (!rd->metas || mcrc != rd->metacrc){
+        if (rd_meta(rd, meta, meta + mlen)){
+            fprintf(stderr, "Invalid metadata.\n");
+            return(1);
+        }
+        rd->metacrc = mcrc;
+        rd->metas++;
+    }
+    if (rd->ndss != count){
+        fprintf(stderr, "%u values but %u datasources.\n", count,
+                rd->ndss);
+        return(1);
+    }
+    return(0);
+}
+
+// Print the datasources of the page read
+static void
+rd_print(rd_t *rd){
+    // Local variables
+    const char          *val;           // Next value
+    uint64_t            v;              // Raw value
+    double              d;              // Value as a double
+    uint32_t            i;              // Datasource index
+
+    printf("timestamp %llu, %u datasources\n",
+           (unsigned long long)rd_get64(rd->page + 23), rd->ndss);
+    val = rd->page + RD_VALUES;
+    for (i = 0; i < rd->ndss; i++, val += 8){
+        v = rd_get64(val);
+        printf("%-48s %-42s ", rd->dss[i].name, rd->dss[i].owner);
+        if (rd->dss[i].isint)
+            printf("%lld\n", (long long)v);
+        else {
+            memcpy(&d, &v, sizeof(d));
+            printf("%.2f\n", d);
+        }
+    }
+}
+
+int
+main(int argc, char **argv){
+    // Local variables
+    rd_t                rd;             // Page reader
+    struct timespec     ts;             // Sleep between reads
+    uint32_t            secs = 0;       // Reading time (0 = one read)
+    uint64_t            n;              // Reads taken
+    int                 c;              // Option character
+    int                 ret = 0;        // Check result
+    int                 err = 0;        // Return code
+
+    // Fetch arguments
+    while ((c = getopt(argc, argv, "ht:")) != -1){
+        switch (c){
+        case 't':
+            secs = strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            return(1);
+        }
+    }
+    if (argc - optind != 1){
+        usage(argv[0]);
+        return(1);
+    }
+    memset(&rd, 0, sizeof(rd));
+
+    // Read once, or every 100 ms
+    ts.tv_sec = 0;
+    ts.tv_nsec = 100000000;
+    for (n = 0; !n || n < (uint64_t)secs*10; n++){
+        if (n)
+            nanosleep(&ts, NULL);
+        if (rd_read(&rd, argv[optind]) || (ret = rd_check(&rd)) > 0)
+            goto err;
+    }
+
+    if (secs)
+        printf("%llu reads, %llu failed a checksum, metadata parsed" \
+               " %llu times.\n", (unsigned long long)rd.reads,
+               (unsigned long long)rd.badcrc, (unsigned long long)rd.metas);
+    else if (!ret)
+        rd_print(&rd);
+    if (rd.badcrc == rd.reads)
+        err = 1;
+
+out:
+    // Release resources
+    free(rd.page);
+    free(rd.dss);
+    return(err);
+
+err:
+    err = 1;
+    goto out;
+}
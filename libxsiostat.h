@@ -0,0 +1,202 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  libxsiostat.h
+ * ---------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#ifndef LIBXSIOSTAT_H
+#define LIBXSIOSTAT_H
+
+/*
+ * libxsiostat finds the VBDs of a host, maps their tapdisk stats pages
+ * and samples them into a snapshot, as xsiostat does:
+ *
+ *     xsiostat_t *xs;
+ *     xsiostat_opts_t opts = { .scan = 1 };
+ *     const xsiostat_snap_t *snap;
+ *
+ *     xsiostat_open(&xs, &opts);
+ *     for (;;){
+ *         xsiostat_refresh(xs);
+ *         snap = xsiostat_snapshot(xs);
+ *         for (i = 0; i < snap->nvbds; i++)
+ *             ... snap->ids[i].domid, snap->rate[XSIOSTAT_RATE_RIOPS][i] ...
+ *         sleep(1);
+ *     }
+ *     xsiostat_close(xs);
+ *
+ * The snapshot points straight into the library's arrays (one array per
+ * field, indexed by slot): nothing is copied, and it is only valid until
+ * the next xsiostat_refresh() or xsiostat_close(). Slots are dense and a
+ * VBD may change slot when another one goes away, so consumers keying
+ * state on VBDs should use ids[] rather than slot numbers.
+ *
+ * The library is not thread safe; one sampler can serve any number of
+ * consumers of the same thread. Enum values and structure layouts below
+ * are part of the ABI: they are only ever appended to.
+ */
+
+// Required headers
+#include <stdint.h>
+
+#define XSIOSTAT_API_VERSION    1
+
+// Counters sampled from each tapdisk stats page
+enum {
+    XSIOSTAT_CTR_ROP = 0,               // read requests submitted
+    XSIOSTAT_CTR_RSC,                   // read sectors
+    XSIOSTAT_CTR_WOP,                   // write requests submitted
+    XSIOSTAT_CTR_WSC,                   // write sectors
+    XSIOSTAT_CTR_RTU,                   // read ticks in usec
+    XSIOSTAT_CTR_WTU,                   // write ticks in usec
+    XSIOSTAT_CTR_RCP,                   // read requests completed
+    XSIOSTAT_CTR_WCP,                   // write requests completed
+    XSIOSTAT_NCTRS
+};
+
+// Rates between the last two samples of a VBD
+enum {
+    XSIOSTAT_RATE_RIOPS = 0,            // read requests per second
+    XSIOSTAT_RATE_WIOPS,                // write requests per second
+    XSIOSTAT_RATE_RTPUT,                // read throughput (per unit)
+    XSIOSTAT_RATE_WTPUT,                // write throughput (per unit)
+    XSIOSTAT_RATE_RAVGQ,                // average read queue size
+    XSIOSTAT_RATE_WAVGQ,                // average write queue size
+    XSIOSTAT_NRATES
+};
+
+// Figures derived from the counter deltas of a VBD (double precision)
+enum {
+    XSIOSTAT_DRV_IOPS = 0,              // requests per second (r+w)
+    XSIOSTAT_DRV_RLAT,                  // average read service time (us)
+    XSIOSTAT_DRV_WLAT,                  // average write service time (us)
+    XSIOSTAT_DRV_RRQSZ,                 // average read request size (KiB)
+    XSIOSTAT_DRV_WRQSZ,                 // average write request size (KiB)
+    XSIOSTAT_DRV_UTIL,                  // time with requests in service (%)
+    XSIOSTAT_NDRVS
+};
+
+// VBD identity
+typedef struct _xsiostat_id_t {
+    uint32_t            domid;          // domain id owning this vbd
+    uint32_t            vbdid;          // vbd id
+    uint32_t            tdpid;          // tapdisk pid
+    uint32_t            reserved;       // padding
+} xsiostat_id_t;
+
+// Read-only view of the last snapshot (arrays indexed by slot)
+typedef struct _xsiostat_snap_t {
+    uint32_t            nvbds;          // slots in use
+    const xsiostat_id_t *ids;           // VBD in each slot
+    const uint64_t      *cur[XSIOSTAT_NCTRS];  // counters sampled last
+    const uint64_t      *prev[XSIOSTAT_NCTRS]; // counters sampled before
+    const uint64_t      *ts;            // time cur was sampled (ns,
+                                        // CLOCK_MONOTONIC)
+    const uint64_t      *flags;         // tapdisk flags (BT3_*)
+    const float         *rate[XSIOSTAT_NRATES]; // rates between prev and cur
+    const double        *drv[XSIOSTAT_NDRVS];   // derived figures
+} xsiostat_snap_t;
+
+// Options of xsiostat_open() (zero for defaults)
+typedef struct _xsiostat_opts_t {
+    const char          *root;          // stats root (NULL = /dev/shm)
+    const char          *domids;        // domain ids, e.g. "1,10-200"
+                                        // (NULL = all)
+    const char          *vbdids;        // vbd ids (NULL = all)
+    uint32_t            unit;           // throughput unit, bytes
+                                        // (0 = 1000000, i.e. MB/s)
+    uint32_t            idle_every;     // full reads of idle VBDs, ticks
+                                        // (0 = default)
+    uint8_t             scan;           // attach VBDs plugged later (flag)
+} xsiostat_opts_t;
+
+/*
+ * "xsiostat --publish <path>" republishes every tick into one shared
+ * memory segment (a header followed by maxvbds entries of vbdsz bytes at
+ * offset hdrsz), so any number of local readers get the whole host with a
+ * single mmap and no syscall per read. The header's gen is a sequence
+ * lock: it is odd while a tick is being written and moves by two per
+ * tick. A reader copies what it needs between two reads of gen and keeps
+ * the copy only if both were the same even value:
+ *
+ *     do {
+ *         while ((gen = __atomic_load_n(&pub->gen, __ATOMIC_ACQUIRE)) & 1)
+ *             ;
+ *         ... copy pub->nvbds entries ...
+ *         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *     } while (__atomic_load_n(&pub->gen, __ATOMIC_RELAXED) != gen);
+ *
+ * Every entry written by a tick carries that tick's gen, which readers can
+ * use to check a copy. The segment only grows: when maxvbds changes,
+ * readers have to map it again. pid is cleared when xsiostat exits, after
+ * the segment has been unlinked; a new instance publishes a new segment
+ * under the same path.
+ */
+#define XSIOSTAT_PUB_MAGIC      0x42505358  // "XSPB"
+#define XSIOSTAT_PUB_VERSION    1
+
+// Published segment header
+typedef struct _xsiostat_pub_t {
+    uint32_t            magic;          // XSIOSTAT_PUB_MAGIC
+    uint32_t            version;        // XSIOSTAT_PUB_VERSION
+    uint32_t            hdrsz;          // offset of the first entry
+    uint32_t            vbdsz;          // bytes per entry
+    uint64_t            gen;            // sequence (odd while writing)
+    uint32_t            maxvbds;        // entries the segment holds
+    uint32_t            nvbds;          // entries in use
+    uint64_t            ts;             // tick time (ns since epoch)
+    uint64_t            ticks;          // ticks published
+    uint32_t            interval;       // tick interval (ms)
+    uint32_t            unit;           // throughput unit (bytes)
+    uint32_t            pid;            // publisher (0 once it exited)
+    uint32_t            reserved;       // padding
+} xsiostat_pub_t;
+
+// Published VBD entry
+typedef struct _xsiostat_pub_vbd_t {
+    xsiostat_id_t       id;             // VBD
+    uint64_t            gen;            // gen of the tick that wrote it
+    uint64_t            ts;             // time sampled (ns, CLOCK_MONOTONIC)
+    uint64_t            flags;          // tapdisk flags (BT3_*)
+    uint64_t            cur[XSIOSTAT_NCTRS];   // counters
+    double              drv[XSIOSTAT_NDRVS];   // derived figures
+    float               rate[XSIOSTAT_NRATES]; // rates since the last tick
+} xsiostat_pub_vbd_t;
+
+// Library context (opaque)
+typedef struct _xsiostat_t xsiostat_t;
+
+// Attach the VBDs of the host; returns 0 on success
+int
+xsiostat_open(xsiostat_t **, const xsiostat_opts_t *);
+
+// Follow VBDs plugged and unplugged, then sample every VBD and compute
+// rates and derived figures; returns 0 on success. The library watches
+// xenstore for tapdisk changes and drains the watch here, so call it
+// regularly (no descriptor needs polling)
+int
+xsiostat_refresh(xsiostat_t *);
+
+// Last snapshot taken (valid until the next refresh or close)
+const xsiostat_snap_t *
+xsiostat_snapshot(xsiostat_t *);
+
+// Detach all VBDs and release the context
+void
+xsiostat_close(xsiostat_t *);
+
+#endif /* LIBXSIOSTAT_H */
@@ -0,0 +1,259 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  stub/xs_stub.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+/*
+ * File-backed stand-in for the subset of libxenstore used by xsiostat
+ * (build with "make XENSTORE=stub").
+ *
+ * The store lives under $XSIS_XS_ROOT (default XS_STUB_ROOT): the value
+ * of key /a/b/c is the content of file $XSIS_XS_ROOT/a/b/c. Whoever
+ * changes the store appends the changed path, followed by a newline, to
+ * $XSIS_XS_ROOT/@events; watches fire for every appended path at or
+ * below the watched one. xs_fileno() returns an inotify fd that becomes
+ * readable when @events is appended to. $XSIS_XS_DELAY_US, if set, is
+ * slept by every read, standing in for a round trip to xenstored.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <xenstore.h>
+
+#define XS_STUB_ROOT            "/tmp/xsiostat-xs"
+#define XS_STUB_EVENTS          "@events"
+#define XS_STUB_WATCHES         8
+
+struct xs_handle {
+    char                root[PATH_MAX/2]; // store root directory
+    int                 ifd;            // inotify fd on @events
+    int                 evfd;           // @events fd (read position)
+    char                *wpath[XS_STUB_WATCHES];  // watched paths
+    char                *wtoken[XS_STUB_WATCHES]; // watch tokens
+    char                ***pending;     // initial events not yet returned
+    unsigned int        npending;       // entries in pending
+    char                buf[4096];      // partial @events line
+    size_t              buflen;         // bytes in buf
+    useconds_t          delay;          // round trip of each read (us)
+};
+
+static char **
+xs_stub_event(const char *path, const char *token){
+    // Local variables
+    char                **ev;           // Event (one allocation)
+    size_t              plen, tlen;     // String lengths
+
+    // Same layout as libxenstore: free(ev) releases everything
+    plen = strlen(path) + 1;
+    tlen = strlen(token) + 1;
+    if (!(ev = malloc(2*sizeof(char *) + plen + tlen)))
+        return(NULL);
+    ev[XS_WATCH_PATH] = (char *)(ev + 2);
+    ev[XS_WATCH_TOKEN] = ev[XS_WATCH_PATH] + plen;
+    memcpy(ev[XS_WATCH_PATH], path, plen);
+    memcpy(ev[XS_WATCH_TOKEN], token, tlen);
+    return(ev);
+}
+
+struct xs_handle *
+xs_open(unsigned long flags){
+    // Local variables
+    struct xs_handle    *h;             // Stub handle
+    char                path[PATH_MAX]; // @events path
+    const char          *root;          // Store root
+
+    if (!(h = calloc(1, sizeof(*h))))
+        return(NULL);
+    if (!(root = getenv("XSIS_XS_ROOT")))
+        root = XS_STUB_ROOT;
+    (void)snprintf(h->root, sizeof(h->root), "%s", root);
+    if (getenv("XSIS_XS_DELAY_US"))
+        h->delay = strtoul(getenv("XSIS_XS_DELAY_US"), NULL, 10);
+
+    // Follow @events from its current end
+    (void)snprintf(path, sizeof(path), "%s/" XS_STUB_EVENTS, h->root);
+    h->evfd = open(path, O_RDONLY|O_CREAT|O_CLOEXEC, 0644);
+    h->ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (h->evfd < 0 || h->ifd < 0 ||
+        inotify_add_watch(h->ifd, path, IN_MODIFY) < 0 ||
+        lseek(h->evfd, 0, SEEK_END) < 0){
+        xs_close(h);
+        return(NULL);
+    }
+    return(h);
+}
+
+void
+xs_close(struct xs_handle *h){
+    // Local variables
+    unsigned int        i;              // Temporary index
+
+    if (!h)
+        return;
+    for (i = 0; i < XS_STUB_WATCHES; i++){
+        free(h->wpath[i]);
+        free(h->wtoken[i]);
+    }
+    for (i = 0; i < h->npending; i++)
+        free(h->pending[i]);
+    free(h->pending);
+    if (h->ifd >= 0)
+        close(h->ifd);
+    if (h->evfd >= 0)
+        close(h->evfd);
+    free(h);
+}
+
+void *
+xs_read(struct xs_handle *h, xs_transaction_t t, const char *path,
+        unsigned int *len){
+    // Local variables
+    char                fn[PATH_MAX];   // Backing file
+    char                *val;           // Value read
+    struct stat         st;             // Backing file stat
+    ssize_t             ret;            // read() return
+    int                 fd;             // Backing file fd
+
+    if (h->delay)
+        (void)usleep(h->delay);
+    (void)snprintf(fn, sizeof(fn), "%s%s", h->root, path);
+    if ((fd = open(fn, O_RDONLY|O_CLOEXEC)) < 0)
+        return(NULL);
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+        !(val = malloc(st.st_size + 1))){
+        close(fd);
+        errno = ENOENT;
+        return(NULL);
+    }
+    ret = read(fd, val, st.st_size);
+    close(fd);
+    if (ret < 0){
+        free(val);
+        return(NULL);
+    }
+    val[ret] = '\0';
+    if (len)
+        *len = ret;
+    return(val);
+}
+
+bool
+xs_watch(struct xs_handle *h, const char *path, const char *token){
+    // Local variables
+    char                ***pending;     // Reallocated pending events
+    unsigned int        i;              // Temporary index
+
+    for (i = 0; i < XS_STUB_WATCHES && h->wpath[i]; i++);
+    if (i == XS_STUB_WATCHES){
+        errno = ENOSPC;
+        return(false);
+    }
+    if (!(pending = realloc(h->pending, (h->npending+1)*sizeof(char **))))
+        return(false);
+    h->pending = pending;
+    if (!(h->pending[h->npending] = xs_stub_event(path, token)))
+        return(false);
+    h->npending++;
+    h->wpath[i] = strdup(path);
+    h->wtoken[i] = strdup(token);
+    return(h->wpath[i] && h->wtoken[i]);
+}
+
+bool
+xs_unwatch(struct xs_handle *h, const char *path, const char *token){
+    // Local variables
+    unsigned int        i;              // Temporary index
+
+    for (i = 0; i < XS_STUB_WATCHES; i++)
+        if (h->wpath[i] && !strcmp(h->wpath[i], path) &&
+            !strcmp(h->wtoken[i], token)){
+            free(h->wpath[i]);
+            free(h->wtoken[i]);
+            h->wpath[i] = h->wtoken[i] = NULL;
+            return(true);
+        }
+    errno = ENOENT;
+    return(false);
+}
+
+int
+xs_fileno(struct xs_handle *h){
+    return(h->ifd);
+}
+
+char **
+xs_check_watch(struct xs_handle *h){
+    // Local variables
+    char                ibuf[4096];     // Drained inotify events
+    char                *nl;            // End of current line
+    size_t              len, plen;      // Line and watch path lengths
+    ssize_t             ret;            // read() return
+    unsigned int        i;              // Temporary index
+    char                **ev = NULL;    // Event returned
+
+    // Initial events fired by xs_watch() come first
+    if (h->npending){
+        ev = h->pending[0];
+        memmove(h->pending, h->pending+1, --h->npending*sizeof(char **));
+        return(ev);
+    }
+
+    // Clear readiness; the data itself comes from @events
+    while (read(h->ifd, ibuf, sizeof(ibuf)) > 0);
+
+    for (;;){
+        // Return the first complete line matching a watch
+        while ((nl = memchr(h->buf, '\n', h->buflen))){
+            *nl = '\0';
+            len = nl - h->buf + 1;
+            for (i = 0; !ev && i < XS_STUB_WATCHES; i++){
+                if (!h->wpath[i])
+                    continue;
+                plen = strlen(h->wpath[i]);
+                if (!strncmp(h->buf, h->wpath[i], plen) &&
+                    (h->buf[plen] == '\0' || h->buf[plen] == '/'))
+                    ev = xs_stub_event(h->buf, h->wtoken[i]);
+            }
+            memmove(h->buf, h->buf + len, h->buflen - len);
+            h->buflen -= len;
+            if (ev)
+                return(ev);
+        }
+
+        // Fetch more lines
+        if (h->buflen == sizeof(h->buf))
+            h->buflen = 0;
+        ret = read(h->evfd, h->buf + h->buflen, sizeof(h->buf) - h->buflen);
+        if (ret <= 0)
+            break;
+        h->buflen += ret;
+    }
+
+    errno = EAGAIN;
+    return(NULL);
+}
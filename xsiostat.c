@@ -26,8 +26,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
+#include <getopt.h>
 #include <sys/queue.h>
-#include <sys/time.h>
 #include "xsiostat.h"
 
 // Helper functions
@@ -41,103 +42,1198 @@ usage(char *argv0){
     fprintf(stderr, "\n %s\n", XSIS_PROGNAME);
     for (i=0; i<XSIS_PROGNAME_LEN+2; i++) fprintf(stderr, "-");
     fprintf(stderr, "\n");
-    fprintf(stderr, "Usage: %s [ -hs ] [ -i <interval> ] [ -o <out_file> ]" \
-                    " [ -d <domain_id> [ ... ] ] [ -v <vbd_id> [ ... ] ]\n",
+    fprintf(stderr, "Usage: %s [ -hsax ] [ -i <interval> ] [ -o <out_file> ]" \
+                    " [ -w <secs>[,...] ]\n" \
+                    "         [ -f <format> | --serve <socket> ]" \
+                    " [ -d <domain_id> [ ... ] ]\n" \
+                    "         [ -v <vbd_id> [ ... ] ] [ -t <n> [ -k <key> ] |" \
+                    " --group-by <g> ]\n" \
+                    "         [ --root <dir> ] [ --self ]" \
+                    " [ --idle-every <n> ] [ --publish <path> ]\n" \
+                    "         [ --rrdd <uid> ] [ --cpu ]\n" \
+                    "         [ --flight <prefix>" \
+                    " [ --trigger <cond>[,...] ] ] [ --qd[=<hz>] ]\n",
                     argv0);
+    fprintf(stderr, "       %s -r <in_file> [ -b <time> ] [ -e <time> ]" \
+                    " [ -i <interval> ] [ -w <secs>[,...] ]\n" \
+                    "         [ -ax ] [ -f <format> ]" \
+                    " [ -d <domain_id> [ ... ] ] [ -v <vbd_id> [ ... ] ]\n" \
+                    "         [ -t <n> [ -k <key> ] | --group-by <g> ]\n",
+                    argv0);
+    fprintf(stderr, "       %s --analyze <in_file>[,...] [ --diff" \
+                    " <in_file>[,...] | --bucket <secs> ]\n" \
+                    "         [ -b <time> ] [ -e <time> ] [ --threads <n> ]" \
+                    " [ -f <format> ]\n" \
+                    "         [ -d <domain_id> [ ... ] ] [ -v <vbd_id>" \
+                    " [ ... ] ] [ -t <n> [ -k <key> ] ]\n", argv0);
     fprintf(stderr, "  -h            Print this help message and quit.\n");
-    fprintf(stderr, "  -s            Scan for new VBDs at each iteration.\n");
+    fprintf(stderr, "  -s            Attach new VBDs as they are plugged.\n");
+    fprintf(stderr, "  -a            Also print idle VBDs (no requests and" \
+                    " none in flight).\n");
+    fprintf(stderr, "  -x            Also print IOPS (r+w), average latency" \
+                    " (us) and request size\n" \
+                    "                (KiB) for reads and writes, and" \
+                    " utilisation (%%).\n");
     fprintf(stderr, "  -d            Filter for DOM ID (run list_domains for" \
                     " a list).\n");
     fprintf(stderr, "  -v            Filter for VBD ID (run xenstore-ls" \
                     " /local/domain/<dom_id>/device/vbd for a list).\n");
+    fprintf(stderr, "                IDs may be given as lists and ranges" \
+                    " (e.g. -d 1,10-200).\n");
     fprintf(stderr, "  -i interval   Interval between outputs in" \
-                    " milliseconds (1000 = 1s, default=%d).\n", XSIS_INTERVAL);
-    fprintf(stderr, "  -o out_file   File to write the output to (in" \
+                    " milliseconds (1000 = 1s, default=%d).\n" \
+                    "                Timer jitter is reported on exit.\n",
+                    XSIS_INTERVAL);
+    fprintf(stderr, "  -o out_file   File to record raw counters to (in" \
                     " binary format).\n");
+    fprintf(stderr, "  -w secs,...   Report rolling averages and min/max" \
+                    " rates over windows\n" \
+                    "                of the given lengths (e.g. -w" \
+                    " 1,10,60,300).\n");
+    fprintf(stderr, "  -f format     Output format: table (default), csv" \
+                    " or jsonl (also --format=).\n");
+    fprintf(stderr, "  --serve path  Serve OpenMetrics on a Unix socket" \
+                    " instead of printing.\n");
+    fprintf(stderr, "  -t n          Only show the n busiest VBDs of each" \
+                    " tick.\n");
+    fprintf(stderr, "  -k key        Rank VBDs by riops, wiops, rMB, wMB," \
+                    " rqs, wqs or lat (average\n" \
+                    "                service time; default=riops).\n");
+    fprintf(stderr, "  --hysteresis pct  Keep VBDs shown unless beaten by" \
+                    " pct percent (with -t).\n");
+    fprintf(stderr, "  --group-by g  Report totals per dom, tapdisk or sr" \
+                    " instead of per VBD.\n");
+    fprintf(stderr, "  --self        Append xsiostat's own tick cost and" \
+                    " counters to each tick\n" \
+                    "                (figures of the previous tick).\n");
+    fprintf(stderr, "  --root dir    Look for VBD stats files in dir" \
+                    " (default=%s).\n", XSIS_SHM_ROOT);
+    fprintf(stderr, "  --idle-every n  Fully read idle VBDs every n ticks" \
+                    " only, probing them in\n" \
+                    "                between (default=%d, 1 = every" \
+                    " tick).\n", XSIS_IDLE_EVERY);
+    fprintf(stderr, "  --flight prefix  Sample every --flight-rate ms" \
+                    " (default=%d) into memory\n" \
+                    "                and write the last and next seconds" \
+                    " (--flight-keep pre,post,\n" \
+                    "                default=%d,%d) to prefix.N when a" \
+                    " trigger fires or on SIGUSR1.\n",
+                    XSIS_FLR_RATE, XSIS_FLR_PRE, XSIS_FLR_POST);
+    fprintf(stderr, "  --trigger c,...  Fire on queue=n (more than n" \
+                    " requests in flight), lowmem\n" \
+                    "                (low memory mode) or stall=ms (none" \
+                    " completed with some in flight).\n");
+    fprintf(stderr, "  --qd[=hz]     Sample requests in flight hz times a" \
+                    " second (default=%d) and\n" \
+                    "                report their mean, p50, p99, max and" \
+                    " busy fraction per tick.\n", XSIS_QD_RATE);
+    fprintf(stderr, "  --publish path  Also write every tick into shared" \
+                    " memory segment path\n" \
+                    "                (e.g. /dev/shm/xsiostat) for local" \
+                    " readers (see libxsiostat.h).\n");
+    fprintf(stderr, "  --rrdd uid    Act as xcp-rrdd plugin uid, writing" \
+                    " per-VBD datasources to\n" \
+                    "                %s/uid every tick (a pathname" \
+                    " is written to as is).\n", XSIS_RRD_DIR);
+    fprintf(stderr, "  --cpu         Also report the CPU use, CPU time per" \
+                    " request (us), context\n" \
+                    "                switches and read/write syscalls per" \
+                    " second of each tapdisk.\n");
+    fprintf(stderr, "  -r in_file    Replay a file recorded with -o (-i" \
+                    " merges samples; an -i shorter\n" \
+                    "                than the recording reports every" \
+                    " recorded sample).\n");
+    fprintf(stderr, "  -b time       Start replay at time (seconds since" \
+                    " epoch, or +secs from start).\n");
+    fprintf(stderr, "  -e time       Stop replay at time (seconds since" \
+                    " epoch, or +secs from start).\n");
+    fprintf(stderr, "  --analyze in_file,...  Report percentiles of IOPS," \
+                    " throughput, latency and\n" \
+                    "                queue size and time in low memory mode" \
+                    " per VBD, then the top\n" \
+                    "                offenders (-t n, default=%d, by p99" \
+                    " of -k iops, mbps, lat,\n" \
+                    "                queue, or by lowmem; default=lat).\n",
+                    XSIS_ANA_TOP);
+    fprintf(stderr, "  --bucket secs  Report per time bucket of secs" \
+                    " instead of per recording.\n");
+    fprintf(stderr, "  --diff in_file,...  Compare with another recording," \
+                    " VBD by VBD.\n");
+    fprintf(stderr, "  --threads n   Analyse with n threads (default=one" \
+                    " per CPU).\n");
 }
 
 // Global variables
 static uint32_t       unit = 1000000;   // MB/s
-int                   PAGE_SIZE;
+static xsis_fmt_t     fmt;              // Per-tick output buffer
+static xsis_self_t    self;             // Self-instrumentation
+static uint8_t        selfrep = 0;      // Print self trailer (flag)
+static uint8_t        allvbds = 0;      // Print idle VBDs too (flag)
+static xsis_top_t     top;              // Top-N selection (-t)
+static xsis_grps_t    grps;             // Rollups (--group-by)
+static xsis_qd_t      *qd = NULL;       // Queue depth sampler (--qd)
+static uint8_t        ext = 0;          // Print derived figures (flag, -x)
+static xsis_pub_t     *pub = NULL;      // Shared memory republisher
+static xsis_rrd_t     *rrd = NULL;      // xcp-rrdd plugin
+static xsis_cpu_t     *cpu = NULL;      // Tapdisk CPU sampler (--cpu)
+static volatile sig_atomic_t stop = 0;  // Termination requested (flag)
+static volatile sig_atomic_t dump = 0;  // Flight dump requested (flag)
 
-// Alarm handler
+// Termination handler
 void
-sigalarm_h(){
-    return;
+sigstop_h(){
+    stop = 1;
+}
+
+// Flight recorder dump handler
+void
+sigdump_h(){
+    dump = 1;
+}
+
+// Field names of CSV and JSON lines records (optional fields are
+// appended to report_keys and report_grp_keys by report_keys_add())
+static const char *report_keys[12 + XSIS_NQDS + XSIS_NDRVS + XSIS_NCPUS +
+                               1] = {
+    "ts", "domid", "vbdid", "r_iops", "w_iops", "r_mbps", "w_mbps",
+    "r_avgq", "w_avgq", "r_inflight", "w_inflight", "low_mem", NULL
+};
+static const char *report_qd_keys[] = {
+    "qd_mean", "qd_p50", "qd_p99", "qd_max", "qd_busy", NULL
+};
+static const char *report_drv_keys[] = {
+    "iops", "r_lat_us", "w_lat_us", "r_rqsz_kb", "w_rqsz_kb", "util_pct",
+    NULL
+};
+static const char *report_cpu_keys[] = {
+    "td_cpu_pct", "td_us_per_io", "td_cswch", "td_syscalls", NULL
+};
+static const char *report_win_keys[] = {
+    "ts", "domid", "vbdid", "window", "r_iops", "w_iops", "r_mbps", "w_mbps",
+    "r_avgq", "w_avgq", "min_iops", "max_iops", "min_mbps", "max_mbps", NULL
+};
+static const char *report_grp_keys[11 + XSIS_NDRVS + 1] = {
+    "ts", "group", "vbds", "r_iops", "w_iops", "r_mbps", "w_mbps",
+    "r_avgq", "w_avgq", "r_inflight", "w_inflight", NULL
+};
+static const char *report_self_keys[] = {
+    "tick_us", "scan_us", "snap_us", "rates_us", "out_us", "rec_us",
+    "max_tick_us", "overruns", "missed", "attached", "detached", "filtered",
+    "attach_failed", "torn_reads", "idle_probes", NULL
+};
+
+// Append optional fields to a list of field names
+static void
+report_keys_add(const char **keys, const char **more){
+    for (; *keys; keys++);
+    while ((*keys++ = *more++));
+}
+
+// Table columns of derived figures (-x)
+static void
+report_drv_hdr(void){
+    fmt_str(&fmt, "       IO/s    rLat_us    wLat_us  rRqKB  wRqKB  Util%");
 }
 
-// Main loop
 static void
-main_loop(xsis_vbds_t *vbds){
+report_drv(const double *drv){
+    fmt_fixed(&fmt, drv[XSIS_DRV_IOPS], 11);
+    fmt_fixed(&fmt, drv[XSIS_DRV_RLAT], 11);
+    fmt_fixed(&fmt, drv[XSIS_DRV_WLAT], 11);
+    fmt_fixed(&fmt, drv[XSIS_DRV_RRQSZ], 7);
+    fmt_fixed(&fmt, drv[XSIS_DRV_WRQSZ], 7);
+    fmt_fixed(&fmt, drv[XSIS_DRV_UTIL], 7);
+}
+
+// Table columns of tapdisk figures (--cpu)
+static void
+report_cpu_hdr(void){
+    fmt_str(&fmt, " TdCPU%  TdUs/IO  TdCsw/s  TdSys/s");
+}
+
+static void
+report_cpu(const float *tdc){
+    fmt_fixed(&fmt, tdc[XSIS_CPU_PCT], 7);
+    fmt_fixed(&fmt, tdc[XSIS_CPU_USPIO], 9);
+    fmt_fixed(&fmt, tdc[XSIS_CPU_CSW], 9);
+    fmt_fixed(&fmt, tdc[XSIS_CPU_SYSC], 9);
+}
+
+// Print the CSV header (once per run)
+static void
+report_header(const char **keys){
+    // Local variables
+    int                 i;              // Field index
+
+    if (fmt.type != XSIS_FMT_CSV || fmt.header)
+        return;
+    for (i = 0; keys[i]; i++){
+        if (i)
+            fmt_str(&fmt, ",");
+        fmt_str(&fmt, keys[i]);
+    }
+    fmt_str(&fmt, "\n");
+    fmt.header = 1;
+}
+
+// Start field 'i' of a CSV or JSON lines record
+static void
+report_field(const char **keys, int i){
+    if (fmt.type == XSIS_FMT_CSV){
+        if (i)
+            fmt_str(&fmt, ",");
+        return;
+    }
+    fmt_str(&fmt, i ? ",\"" : "{\"");
+    fmt_str(&fmt, keys[i]);
+    fmt_str(&fmt, "\":");
+}
+
+// Print xsiostat's own cost and counters (figures of the previous tick)
+static void
+report_self(xsis_vbds_t *vbds, uint64_t ts){
+    // Local variables
+    uint64_t            v[15];          // Values of report_self_keys
+    int                 i;              // Value index
+
+    v[0] = self.tick/1000;
+    for (i = 0; i < XSIS_NPHASES; i++)
+        v[1+i] = self.last[i]/1000;
+    v[6] = self.maxtick/1000;
+    v[7] = self.overruns;
+    v[8] = self.missed;
+    v[9] = vbds->nattached;
+    v[10] = vbds->ndetached;
+    v[11] = vbds->nfiltered;
+    v[12] = vbds->nattfail;
+    v[13] = vbds->snap.torn;
+    v[14] = vbds->snap.probed;
+
+    // A JSON record of its own, or a comment line (table and CSV)
+    if (fmt.type == XSIS_FMT_JSONL){
+        fmt_str(&fmt, "{\"ts\":");
+        fmt_ts(&fmt, ts);
+        fmt_str(&fmt, ",\"self\":{");
+    } else
+        fmt_str(&fmt, "# self");
+    for (i = 0; report_self_keys[i]; i++){
+        if (fmt.type == XSIS_FMT_JSONL){
+            fmt_str(&fmt, i ? ",\"" : "\"");
+            fmt_str(&fmt, report_self_keys[i]);
+            fmt_str(&fmt, "\":");
+        } else {
+            fmt_str(&fmt, " ");
+            fmt_str(&fmt, report_self_keys[i]);
+            fmt_str(&fmt, "=");
+        }
+        fmt_uint(&fmt, v[i], 0);
+    }
+    fmt_str(&fmt, (fmt.type == XSIS_FMT_JSONL) ? "}}\n" : "\n");
+}
+
+// Iterate over the VBDs to report: all of them, or the top N
+static xsis_vbd_t *
+report_first(xsis_vbds_t *vbds, uint32_t *r){
+    *r = 0;
+    if (!top.n)
+        return(LIST_FIRST(&vbds->list));
+    top_select(&top, vbds);
+    return(top.nrows ? top.rows[0] : NULL);
+}
+
+static xsis_vbd_t *
+report_next(xsis_vbd_t *vbd, uint32_t *r){
+    if (!top.n)
+        return(LIST_NEXT(vbd, vbds));
+    return((++*r < top.nrows) ? top.rows[*r] : NULL);
+}
+
+// Report rates summed over groups of VBDs
+static int
+report_grp(xsis_vbds_t *vbds, uint64_t ts){
+    // Local variables
+    static const char   *titles[] = { "", "DOM", "TAPDISK", "SR" };
+    char                label[XSIS_SR_LEN+16]; // Group column
+    const char          *name;          // Group name (or NULL)
+    xsis_grp_t          *grp;           // Temporary group pointer
+    uint32_t            g;              // Group index
+    int                 width;          // Group column width
+    int                 f;              // Field index
+    int                 i;              // Rate index
+
+    if (grp_update(&grps, vbds))
+        return(1);
+    report_header(report_grp_keys);
+
+    // Print header (table)
+    width = (grps.by == XSIS_GRP_SR) ? -36 : 10;
+    if (fmt.type == XSIS_FMT_TABLE && grps.ngrps){
+        fmt_str(&fmt, "-------------------------------------------------" \
+                      "-------------------------------------------------" \
+                      "--\n");
+        (void)snprintf(label, sizeof(label), "  %*s", width,
+                       titles[grps.by]);
+        fmt_str(&fmt, label);
+        fmt_str(&fmt, "  VBDs         r/s        w/s    rMB/s    wMB/s" \
+                      " rAvgQs wAvgQs  rInfl  wInfl");
+        if (ext)
+            report_drv_hdr();
+        fmt_str(&fmt, "\n");
+    }
+
+    for (g = 0; g < grps.ngrps; g++){
+        grp = &grps.grps[g];
+        name = grp_name(&grps, vbds, grp);
+
+        // Print machine readable record
+        if (fmt.type != XSIS_FMT_TABLE){
+            report_field(report_grp_keys, 0);
+            fmt_ts(&fmt, ts);
+            report_field(report_grp_keys, 1);
+            if (name && fmt.type == XSIS_FMT_JSONL){
+                fmt_str(&fmt, "\"");
+                fmt_str(&fmt, name);
+                fmt_str(&fmt, "\"");
+            } else if (name)
+                fmt_str(&fmt, name);
+            else
+                fmt_uint(&fmt, grp->key, 0);
+            report_field(report_grp_keys, 2);
+            fmt_uint(&fmt, grp->nvbds, 0);
+            for (i = 0; i < XSIS_NRATES; i++){
+                report_field(report_grp_keys, 3+i);
+                fmt_fixed(&fmt, grp->rate[i], 0);
+            }
+            report_field(report_grp_keys, 3+XSIS_NRATES);
+            fmt_uint(&fmt, grp->infrd, 0);
+            report_field(report_grp_keys, 4+XSIS_NRATES);
+            fmt_uint(&fmt, grp->infwr, 0);
+            f = 5+XSIS_NRATES;
+            for (i = 0; ext && i < XSIS_NDRVS; i++){
+                report_field(report_grp_keys, f++);
+                fmt_fixed(&fmt, grp->drv[i], 0);
+            }
+            fmt_str(&fmt, (fmt.type == XSIS_FMT_JSONL) ? "}\n" : "\n");
+            continue;
+        }
+
+        // Print group, then its totals
+        if (name)
+            (void)snprintf(label, sizeof(label), "  %*s", width, name);
+        else
+            (void)snprintf(label, sizeof(label), "  %*u", width, grp->key);
+        fmt_str(&fmt, label);
+        fmt_uint(&fmt, grp->nvbds, 6);
+        fmt_str(&fmt, ": ");
+        fmt_fixed(&fmt, grp->rate[XSIS_RATE_RIOPS], 10);
+        fmt_fixed(&fmt, grp->rate[XSIS_RATE_WIOPS], 11);
+        fmt_fixed(&fmt, grp->rate[XSIS_RATE_RTPUT], 9);
+        fmt_fixed(&fmt, grp->rate[XSIS_RATE_WTPUT], 9);
+        fmt_fixed(&fmt, grp->rate[XSIS_RATE_RAVGQ], 7);
+        fmt_fixed(&fmt, grp->rate[XSIS_RATE_WAVGQ], 7);
+        fmt_uint(&fmt, grp->infrd, 7);
+        fmt_uint(&fmt, grp->infwr, 7);
+        if (ext)
+            report_drv(grp->drv);
+        fmt_str(&fmt, "\n");
+    }
+    if (selfrep)
+        report_self(vbds, ts);
+    if (fmt.type == XSIS_FMT_TABLE && grps.ngrps)
+        fmt_str(&fmt, "\n");
+
+    // Write the whole tick at once
+    return(fmt_flush(&fmt));
+}
+
+// Report rates for a list of updated VBDs
+static int
+report(xsis_vbds_t *vbds, uint64_t ts){
     // Local variables
-    static struct timeval now_0;        // Current time
-    static struct timeval now_1;        // Time at last iteration
-    float               now_diff;       // now_0 and now_1 time diff (secs)
     uint8_t             header = 0;     // Has the header been printed? (flag)
     xsis_vbd_t          *vbd;           // Temporary vbd iterator
+    xsis_snap_t         *snap;          // VBD counters and rates
+    const float         *out;           // Queue depth figures of vbd
+    const float         *tdc;           // Figures of vbd's tapdisk
+    double              drv[XSIS_NDRVS]; // Derived figures of vbd
+    uint32_t            s;              // VBD slot
+    uint32_t            r;              // Row index
+    int                 f;              // Field index
+    int                 i;              // Rate index
+    static const float  none[XSIS_NQDS]; // Figures of VBDs not sampled yet
 
-    // Update time structures
-    memcpy(&now_1, &now_0, sizeof(now_1));
-    gettimeofday(&now_0, NULL);
-    now_diff  = (float)(now_0.tv_sec-now_1.tv_sec);
-    now_diff += ((float)now_0.tv_usec)/1000000;
-    now_diff -= ((float)now_1.tv_usec)/1000000;
+    // Rollups replace the per VBD rows
+    if (grps.by != XSIS_GRP_NONE)
+        return(report_grp(vbds, ts));
 
     // Loop through VBDs
-    LIST_FOREACH(vbd, vbds, vbds){
-        // Update VBD statistics
-        if (vbd_update(vbd)){
-            vbd_delete(vbd, vbds);
+    snap = &vbds->snap;
+    report_header(report_keys);
+    for (vbd = report_first(vbds, &r); vbd; vbd = report_next(vbd, &r)){
+        s = vbd->slot;
+        if (!allvbds && snap_idle(snap, s))
+            continue;
+
+        out = (qd && vbd->qd) ? vbd->qd->out : none;
+        tdc = cpu ? cpu_slot(cpu, s) : NULL;
+        for (i = 0; ext && i < XSIS_NDRVS; i++)
+            drv[i] = snap->drv[i][s];
+
+        // Print machine readable record
+        if (fmt.type != XSIS_FMT_TABLE){
+            report_field(report_keys, 0);
+            fmt_ts(&fmt, ts);
+            report_field(report_keys, 1);
+            fmt_uint(&fmt, vbd->domid, 0);
+            report_field(report_keys, 2);
+            fmt_uint(&fmt, vbd->vbdid, 0);
+            for (i = 0; i < XSIS_NRATES; i++){
+                report_field(report_keys, 3+i);
+                fmt_fixed(&fmt, snap->rate[i][s], 0);
+            }
+            report_field(report_keys, 3+XSIS_NRATES);
+            fmt_uint(&fmt, snap->cur[XSIS_CTR_ROP][s] -
+                           snap->cur[XSIS_CTR_RCP][s], 0);
+            report_field(report_keys, 4+XSIS_NRATES);
+            fmt_uint(&fmt, snap->cur[XSIS_CTR_WOP][s] -
+                           snap->cur[XSIS_CTR_WCP][s], 0);
+            report_field(report_keys, 5+XSIS_NRATES);
+            fmt_uint(&fmt, !!(snap->flags[s] & BT3_LOW_MEMORY_MODE), 0);
+            f = 6+XSIS_NRATES;
+            for (i = 0; qd && i < XSIS_NQDS; i++){
+                report_field(report_keys, f++);
+                fmt_fixed(&fmt, out[i], 0);
+            }
+            for (i = 0; ext && i < XSIS_NDRVS; i++){
+                report_field(report_keys, f++);
+                fmt_fixed(&fmt, drv[i], 0);
+            }
+            for (i = 0; cpu && i < XSIS_NCPUS; i++){
+                report_field(report_keys, f++);
+                fmt_fixed(&fmt, tdc[i], 0);
+            }
+            fmt_str(&fmt, (fmt.type == XSIS_FMT_JSONL) ? "}\n" : "\n");
             continue;
         }
 
         // Print header
         if (!header){
-            printf("----------------------------------------------------" \
-                   "----------------------------------\n");
-            printf("  DOM   VBD         r/s        w/s    rMB/s    wMB/s" \
-                   " rAvgQs wAvgQs   Low_Mem_Mode\n");
+            fmt_str(&fmt, "-------------------------------------------------" \
+                          "-------------------------------------------------" \
+                          "--\n");
+            fmt_str(&fmt, "  DOM   VBD         r/s        w/s    rMB/s" \
+                          "    wMB/s rAvgQs wAvgQs  rInfl  wInfl");
+            fmt_str(&fmt, (qd || ext || cpu) ? " LowMem" :
+                                               "   Low_Mem_Mode");
+            if (qd)
+                fmt_str(&fmt, "  qMean   qP50   qP99   qMax  Busy");
+            if (ext)
+                report_drv_hdr();
+            if (cpu)
+                report_cpu_hdr();
+            fmt_str(&fmt, "\n");
             header = 1;
         }
 
         // Print general VBD info
-        printf("%5d,%5d: ", vbd->domid, vbd->vbdid);
+        fmt_uint(&fmt, vbd->domid, 5);
+        fmt_str(&fmt, ",");
+        fmt_uint(&fmt, vbd->vbdid, 5);
+        fmt_str(&fmt, ": ");
 
         // Print rw iops
-        printf("%10.2f ",
-               ((float)(vbd->tdstat.rop_0-vbd->tdstat.rop_1))/now_diff);
-        printf("%10.2f ",
-               ((float)(vbd->tdstat.wop_0-vbd->tdstat.wop_1))/now_diff);
+        fmt_fixed(&fmt, snap->rate[XSIS_RATE_RIOPS][s], 10);
+        fmt_fixed(&fmt, snap->rate[XSIS_RATE_WIOPS][s], 11);
 
         // Print rw throughput
-        printf("%8.2f ",
-               (((float)(vbd->tdstat.rsc_0-vbd->tdstat.rsc_1)*XSIS_SECTOR_SZ)/
-                (float)unit)/now_diff);
-        printf("%8.2f ",
-               (((float)(vbd->tdstat.wsc_0-vbd->tdstat.wsc_1)*XSIS_SECTOR_SZ)/
-                (float)unit)/now_diff);
+        fmt_fixed(&fmt, snap->rate[XSIS_RATE_RTPUT][s], 9);
+        fmt_fixed(&fmt, snap->rate[XSIS_RATE_WTPUT][s], 9);
 
         // Print average queue size
-        printf("%6.2f ",
-               ((float)(vbd->tdstat.rtu_0-vbd->tdstat.rtu_1))/
-               (now_diff*1000000));
-        printf("%6.2f",
-               ((float)(vbd->tdstat.wtu_0-vbd->tdstat.wtu_1))/
-               (now_diff*1000000));
-        printf("%6d",vbd->tdstat.low_mem_mode);
+        fmt_fixed(&fmt, snap->rate[XSIS_RATE_RAVGQ][s], 7);
+        fmt_fixed(&fmt, snap->rate[XSIS_RATE_WAVGQ][s], 7);
+
+        // Print requests in flight
+        fmt_uint(&fmt, snap->cur[XSIS_CTR_ROP][s] -
+                       snap->cur[XSIS_CTR_RCP][s], 7);
+        fmt_uint(&fmt, snap->cur[XSIS_CTR_WOP][s] -
+                       snap->cur[XSIS_CTR_WCP][s], 7);
+        fmt_uint(&fmt, !!(snap->flags[s] & BT3_LOW_MEMORY_MODE),
+                 (qd || ext || cpu) ? 7 : 6);
+
+        // Print the queue depth distribution over the interval
+        if (qd){
+            fmt_fixed(&fmt, out[XSIS_QD_MEAN], 7);
+            fmt_fixed(&fmt, out[XSIS_QD_P50], 7);
+            fmt_fixed(&fmt, out[XSIS_QD_P99], 7);
+            fmt_fixed(&fmt, out[XSIS_QD_MAX], 7);
+            fmt_fixed(&fmt, out[XSIS_QD_BUSY], 6);
+        }
+
+        // Print derived figures
+        if (ext)
+            report_drv(drv);
+
+        // Print the cost of the tapdisk serving the VBD
+        if (cpu)
+            report_cpu(tdc);
 
         // Break line
-        printf("\n");
+        fmt_str(&fmt, "\n");
+    }
+    if (selfrep)
+        report_self(vbds, ts);
+    if (header)
+        fmt_str(&fmt, "\n");
+
+    // Write the whole tick at once
+    return(fmt_flush(&fmt));
+}
+
+// Report rolling window rates for a list of VBDs
+static int
+report_win(xsis_vbds_t *vbds, xsis_win_t *win, uint64_t ts){
+    // Local variables
+    uint8_t             header = 0;     // Has the header been printed? (flag)
+    xsis_vbd_t          *vbd;           // Temporary vbd iterator
+    float               out[XSIS_NWOUTS]; // Window figures
+    uint32_t            r;              // Row index
+    uint32_t            w;              // Window index
+    int                 i;              // Figure index
+
+    // Loop through VBDs and windows
+    report_header(report_win_keys);
+    for (vbd = report_first(vbds, &r); vbd; vbd = report_next(vbd, &r)){
+        for (w = 0; w < win->nwins; w++){
+            win_rates(win, &vbds->snap, vbd, w, unit, out);
+
+            // Print machine readable record
+            if (fmt.type != XSIS_FMT_TABLE){
+                report_field(report_win_keys, 0);
+                fmt_ts(&fmt, ts);
+                report_field(report_win_keys, 1);
+                fmt_uint(&fmt, vbd->domid, 0);
+                report_field(report_win_keys, 2);
+                fmt_uint(&fmt, vbd->vbdid, 0);
+                report_field(report_win_keys, 3);
+                fmt_uint(&fmt, win->secs[w], 0);
+                for (i = 0; i < XSIS_NWOUTS; i++){
+                    report_field(report_win_keys, 4+i);
+                    fmt_fixed(&fmt, out[i], 0);
+                }
+                fmt_str(&fmt, (fmt.type == XSIS_FMT_JSONL) ? "}\n" : "\n");
+                continue;
+            }
+
+            // Print header
+            if (!header){
+                fmt_str(&fmt, "-----------------------------------------" \
+                              "-----------------------------------------" \
+                              "-------------------------------\n");
+                fmt_str(&fmt, "  DOM   VBD    win        r/s        w/s" \
+                              "    rMB/s    wMB/s rAvgQs wAvgQs  minIO/s" \
+                              "  maxIO/s  minMB/s  maxMB/s\n");
+                header = 1;
+            }
+
+            // Print general VBD and window info
+            fmt_uint(&fmt, vbd->domid, 5);
+            fmt_str(&fmt, ",");
+            fmt_uint(&fmt, vbd->vbdid, 5);
+            fmt_str(&fmt, ": ");
+            fmt_uint(&fmt, win->secs[w], 5);
+            fmt_str(&fmt, "s");
+
+            // Print averages over the window
+            fmt_fixed(&fmt, out[XSIS_RATE_RIOPS], 11);
+            fmt_fixed(&fmt, out[XSIS_RATE_WIOPS], 11);
+            fmt_fixed(&fmt, out[XSIS_RATE_RTPUT], 9);
+            fmt_fixed(&fmt, out[XSIS_RATE_WTPUT], 9);
+            fmt_fixed(&fmt, out[XSIS_RATE_RAVGQ], 7);
+            fmt_fixed(&fmt, out[XSIS_RATE_WAVGQ], 7);
+
+            // Print extremes within the window
+            fmt_fixed(&fmt, out[XSIS_WOUT_MINIOPS], 9);
+            fmt_fixed(&fmt, out[XSIS_WOUT_MAXIOPS], 9);
+            fmt_fixed(&fmt, out[XSIS_WOUT_MINTPUT], 9);
+            fmt_fixed(&fmt, out[XSIS_WOUT_MAXTPUT], 9);
+
+            // Break line
+            fmt_str(&fmt, "\n");
+        }
+    }
+    if (selfrep)
+        report_self(vbds, ts);
+    if (header)
+        fmt_str(&fmt, "\n");
+
+    // Write the whole tick at once
+    return(fmt_flush(&fmt));
+}
+
+// Main loop
+static int
+main_loop(xsis_vbds_t *vbds, xsis_dat_t *dat, xsis_win_t *win,
+          xsis_srv_t *srv){
+    // Local variables
+    struct timespec     now;            // Current time
+    uint64_t            ts;             // Wall clock time (ns)
+    uint64_t            mono;           // Monotonic time (ns)
+
+    // Wall clock time is only used to label output
+    clock_gettime(CLOCK_REALTIME, &now);
+    ts = (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    mono = (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+
+    // Snapshot VBD statistics (each read is timestamped)
+    vbds_update(vbds);
+    self_mark(&self, XSIS_PH_SNAP);
+
+    // Compute rates (and queue depths sampled since the last tick)
+    snap_rates(&vbds->snap, unit);
+    if (ext || pub)
+        snap_derive(&vbds->snap);
+    if (qd)
+        qd_tick(qd);
+    if (win && win_update(win, vbds, mono))
+        return(1);
+    if (cpu && cpu_tick(cpu, vbds))
+        return(1);
+    self_mark(&self, XSIS_PH_RATES);
+
+    // Print (or publish) them
+    if (pub && pub_tick(pub, &vbds->snap))
+        return(1);
+    if (rrd && rrd_tick(rrd, vbds))
+        return(1);
+    if (srv)
+        srv_tick(srv, vbds, &self);
+    else if (win ? report_win(vbds, win, ts) : report(vbds, ts))
+        return(1);
+    self_mark(&self, XSIS_PH_OUT);
+
+    // Record raw counters
+    if (dat && dat_write(dat, vbds))
+        return(1);
+    self_mark(&self, XSIS_PH_REC);
+
+    // Return
+    return(0);
+}
+
+// Parse a replay time (seconds since epoch, or +seconds from start)
+static uint64_t
+replay_time(char *arg, uint64_t start){
+    // Local variables
+    double              secs;           // Parsed time
+
+    if (!arg)
+        return(0);
+    secs = strtod(arg + (*arg == '+'), NULL);
+    if (secs < 0)
+        secs = 0;
+    if (*arg == '+')
+        return(start + (uint64_t)(secs*1000000000));
+    return((uint64_t)(secs*1000000000));
+}
+
+// Load recorded counters into a VBD slot
+static void
+replay_load(xsis_snap_t *snap, uint32_t slot, const xsis_dat_cnt_t *cnt,
+            uint64_t ts){
+    snap->cur[XSIS_CTR_ROP][slot] = cnt->rop;
+    snap->cur[XSIS_CTR_RSC][slot] = cnt->rsc;
+    snap->cur[XSIS_CTR_WOP][slot] = cnt->wop;
+    snap->cur[XSIS_CTR_WSC][slot] = cnt->wsc;
+    snap->cur[XSIS_CTR_RTU][slot] = cnt->rtu;
+    snap->cur[XSIS_CTR_WTU][slot] = cnt->wtu;
+    snap->cur[XSIS_CTR_RCP][slot] = cnt->rop - cnt->infrd;
+    snap->cur[XSIS_CTR_WCP][slot] = cnt->wop - cnt->infwr;
+    snap->flags[slot] = cnt->flags;
+    snap->tcur[slot] = ts;
+}
+
+// Replay loop
+static int
+replay_loop(char *datafn, xsis_flts_t *domids, xsis_flts_t *vbdids,
+            int32_t inter, char *from, char *to, char *winarg){
+    // Local variables
+    xsis_datrd_t        *rd = NULL;     // Datafile reader
+    const xsis_dat_rec_t *rec;          // Current sample record
+    const xsis_dat_vbd_t *set;          // VBD set of current sample
+    const xsis_dat_cnt_t *cnt;          // Counters of current sample
+    xsis_vbds_t         vbds;           // Replayed VBDs
+    xsis_win_t          win;            // Rolling windows
+    xsis_win_t          *winp = NULL;   // Rolling windows (if requested)
+    xsis_vbd_t          *vbd;           // Temporary VBD pointer
+    xsis_vbd_t          *next;          // Next VBD (vbd may be deleted)
+    uint32_t            nent;           // Entries in current set
+    uint32_t            i;              // Temporary index
+    uint64_t            setoff = 0;     // Offset of current set
+    uint64_t            tsto;           // Stop time (ns)
+    uint64_t            last = 0;       // Time of last sample used (ns)
+    uint64_t            step;           // Minimum time between reports (ns)
+    char                tstr[32];       // Formatted time
+    time_t              secs;           // Sample time (secs)
+    int                 err = 0;        // Return code
+
+    // Open datafile and seek to the first sample of interest
+    vbds_init(&vbds);
+    if (dat_read_open(&rd, datafn))
+        goto err;
+    dat_read_seek(rd, replay_time(from, rd->hdr->start));
+    tsto = replay_time(to, rd->hdr->start);
+    // Samples within half a recorded interval of -i count as due; an -i
+    // no longer than that reports every sample
+    step = 0;
+    if (inter > 0 && (uint64_t)inter*1000000 >
+                     (uint64_t)rd->hdr->interval*500000)
+        step = (uint64_t)inter*1000000 - (uint64_t)rd->hdr->interval*500000;
+    if (winarg){
+        if (win_init(&win, winarg, (inter > 0) ? (uint32_t)inter :
+                                                 rd->hdr->interval))
+            goto err;
+        winp = &win;
     }
 
-    // Flush if anything was printed
-    if (header){
-        printf("\n");
-        fflush(stdout);
+    // Replay samples
+    while (!stop && (rec = dat_read_next(rd))){
+        if (tsto && rec->ts > tsto)
+            break;
+        if (last && rec->ts - last < step)
+            continue;
+        cnt = (const xsis_dat_cnt_t *)(rec+1);
+
+        // Follow changes to the recorded VBD set
+        if (rec->setoff != setoff){
+            if (!(set = dat_read_set(rd, rec, &nent))){
+                fprintf(stderr, "Datafile '%s' is corrupt.\n", datafn);
+                goto err;
+            }
+            LIST_FOREACH(vbd, &vbds.list, vbds)
+                vbd->setidx = UINT32_MAX;
+            for (i = nent; i-- > 0; ){
+                // Filter domids and vbdids
+                if (domids->nflts && !flt_isset(domids, set[i].domid))
+                    continue;
+                if (vbdids->nflts && !flt_isset(vbdids, set[i].vbdid))
+                    continue;
+
+                // Keep VBDs already being replayed
+                if ((vbd = vbd_find(&vbds, set[i].domid, set[i].vbdid))){
+                    if (vbd->tdpid == set[i].tdpid){
+                        vbd->setidx = i;
+                        continue;
+                    }
+                    vbd_delete(vbd, &vbds);
+                }
+
+                // Add new VBDs, primed with their current counters
+                if (!(vbd = calloc(1, sizeof(xsis_vbd_t)))){
+                    perror("calloc");
+                    goto err;
+                }
+                vbd->domid = set[i].domid;
+                vbd->vbdid = set[i].vbdid;
+                vbd->tdpid = set[i].tdpid;
+                vbd->shmfd = -1;
+                vbd->tdwd = -1;
+                vbd->setidx = i;
+                if (vbd_insert(vbd, &vbds)){
+                    free(vbd);
+                    goto err;
+                }
+                replay_load(&vbds.snap, vbd->slot, &cnt[i], rec->ts);
+            }
+
+            // Drop VBDs no longer recorded
+            for (vbd = LIST_FIRST(&vbds.list); vbd; vbd = next){
+                next = LIST_NEXT(vbd, vbds);
+                if (vbd->setidx == UINT32_MAX)
+                    vbd_delete(vbd, &vbds);
+            }
+            setoff = rec->setoff;
+        }
+
+        // Update VBD statistics from the recorded counters
+        snap_rotate(&vbds.snap);
+        LIST_FOREACH(vbd, &vbds.list, vbds)
+            replay_load(&vbds.snap, vbd->slot, &cnt[vbd->setidx],
+                        rec->ts);
+
+        // Report (the first sample only primes the counters)
+        if (last && !LIST_EMPTY(&vbds.list)){
+            if (fmt.type == XSIS_FMT_TABLE){
+                secs = rec->ts/1000000000;
+                i = strftime(tstr, sizeof(tstr), "%F %T", localtime(&secs));
+                (void)snprintf(tstr + i, sizeof(tstr) - i, ".%03u\n",
+                               (uint32_t)((rec->ts/1000000)%1000));
+                fmt_str(&fmt, tstr);
+            }
+            snap_rates(&vbds.snap, unit);
+            if (ext)
+                snap_derive(&vbds.snap);
+        }
+        if (winp && win_update(winp, &vbds, rec->ts))
+            goto err;
+        if (last && !LIST_EMPTY(&vbds.list)){
+            if (winp ? report_win(&vbds, winp, rec->ts) :
+                       report(&vbds, rec->ts))
+                goto err;
+        }
+        last = rec->ts;
     }
 
+out:
+    // Release resources
+    vbds_free(&vbds);
+    if (winp)
+        win_free(winp);
+    dat_read_close(rd);
+
     // Return
-    return;
+    return(err);
+
+err:
+    err = 1;
+    goto out;
+}
+
+// Field names of --analyze records, and keys ranking offenders (-k)
+static const char *report_ana_keys[] = {
+    "ts", "domid", "vbdid", "rank", "intervals",
+    "iops_mean", "iops_p50", "iops_p99", "iops_max",
+    "mbps_mean", "mbps_p50", "mbps_p99", "mbps_max",
+    "lat_us_mean", "lat_us_p50", "lat_us_p99", "lat_us_max",
+    "queue_mean", "queue_p50", "queue_p99", "queue_max",
+    "low_mem_pct", NULL
+};
+static const char *report_diff_keys[] = {
+    "domid", "vbdid", "figure", "before", "after", "change_pct", NULL
+};
+static const char *ana_keys[] = {
+    "iops", "mbps", "lat", "queue", "lowmem", NULL
+};
+
+// Print a time as a table title
+static void
+report_ana_time(uint64_t ns){
+    // Local variables
+    char                tstr[32];       // Formatted time
+    time_t              secs;           // Time (secs)
+
+    secs = ns/1000000000;
+    (void)strftime(tstr, sizeof(tstr), "%F %T", localtime(&secs));
+    fmt_str(&fmt, tstr);
+}
+
+// Table header of --analyze rows
+static void
+report_ana_hdr(void){
+    // Local variables
+    static const char   *names[] = { "IO/s", "MB/s", "Lat", "Queue" };
+    static const char   *stats[] = { "p50", "p99", "max" };
+    char                col[32];        // Column title
+    int                 f;              // Figure index
+    int                 i;              // Statistic index
+
+    fmt_str(&fmt, "  DOM    VBD");
+    for (f = 0; f < XSIS_NANAS; f++)
+        for (i = 0; i < 3; i++){
+            (void)snprintf(col, sizeof(col), "%s_%s", names[f], stats[i]);
+            fmt_str(&fmt, "          " + strlen(col));
+            fmt_str(&fmt, col);
+        }
+    fmt_str(&fmt, "  LowMem%\n");
+}
+
+// Print the statistics of a VBD over a bucket or a whole recording
+static void
+report_ana_row(uint64_t ts, xsis_anavbd_t *vbd, uint32_t rank,
+               xsis_anab_t *bkt){
+    // Local variables
+    xsis_anafig_t       fig;            // Statistics
+    int                 f;              // Figure index
+    int                 i;              // Statistic index
+
+    ana_figs(bkt, &fig);
+    if (fmt.type == XSIS_FMT_TABLE){
+        fmt_uint(&fmt, vbd->domid, 5);
+        fmt_uint(&fmt, vbd->vbdid, 7);
+        for (f = 0; f < XSIS_NANAS; f++)
+            for (i = XSIS_ANAF_P50; i <= XSIS_ANAF_MAX; i++)
+                fmt_fixed(&fmt, fig.fig[f][i], 10);
+        fmt_fixed(&fmt, fig.lowmem, 9);
+        fmt_str(&fmt, "\n");
+        return;
+    }
+    report_header(report_ana_keys);
+    report_field(report_ana_keys, 0);
+    fmt_ts(&fmt, ts);
+    report_field(report_ana_keys, 1);
+    fmt_uint(&fmt, vbd->domid, 0);
+    report_field(report_ana_keys, 2);
+    fmt_uint(&fmt, vbd->vbdid, 0);
+    report_field(report_ana_keys, 3);
+    fmt_uint(&fmt, rank, 0);
+    report_field(report_ana_keys, 4);
+    fmt_uint(&fmt, fig.n, 0);
+    for (f = 0; f < XSIS_NANAS; f++)
+        for (i = 0; i < XSIS_NANAFS; i++){
+            report_field(report_ana_keys, 5 + f*XSIS_NANAFS + i);
+            fmt_fixed(&fmt, fig.fig[f][i], 0);
+        }
+    report_field(report_ana_keys, 5 + XSIS_NANAS*XSIS_NANAFS);
+    fmt_fixed(&fmt, fig.lowmem, 0);
+    fmt_str(&fmt, (fmt.type == XSIS_FMT_JSONL) ? "}\n" : "\n");
+}
+
+// Ranking score of a VBD (-k)
+static float
+report_ana_score(xsis_anab_t *tot, int key){
+    // Local variables
+    xsis_anafig_t       fig;            // Statistics
+
+    ana_figs(tot, &fig);
+    return((key < XSIS_NANAS) ? fig.fig[key][XSIS_ANAF_P99] : fig.lowmem);
+}
+
+// Report an analysis: every VBD per bucket, then the top offenders
+static int
+report_ana(xsis_ana_t *ana, uint32_t topn, int key){
+    // Local variables
+    xsis_anab_t         *tots = NULL;   // Whole range of each VBD
+    uint32_t            *rank = NULL;   // VBDs, top offender first
+    float               *score = NULL;  // Ranking score of each VBD
+    xsis_anavbd_t       *vbd;           // Temporary VBD pointer
+    uint64_t            ts;             // Bucket start
+    uint64_t            end;            // Bucket end
+    uint32_t            nvbds;          // VBDs with any interval
+    uint32_t            b;              // Bucket index
+    uint32_t            i, j;           // VBD indices
+    int                 err = 0;        // Return code
+
+    for (b = 0; b < ana->nbkts; b++){
+        ts = ana->from + b*ana->bucket;
+        end = ana->bucket ? ts + ana->bucket : ana->last;
+        if (fmt.type == XSIS_FMT_TABLE){
+            fmt_str(&fmt, "-----------------------------------------------" \
+                          "-----------------------------------------------" \
+                          "-----------------------------------------------" \
+                          "\n");
+            report_ana_time(ts);
+            fmt_str(&fmt, " to ");
+            report_ana_time((end < ana->last) ? end : ana->last);
+            fmt_str(&fmt, "\n");
+            report_ana_hdr();
+        }
+        for (i = 0; i < ana->tbl.nvbds; i++){
+            vbd = ana->tbl.vbds[i];
+            if (b < vbd->nbkts && vbd->bkts[b])
+                report_ana_row(ts, vbd, 0, vbd->bkts[b]);
+        }
+        if (fmt_flush(&fmt))
+            goto err;
+    }
+
+    // Rank VBDs over the whole range (insertion, keeping the top N)
+    if (!(tots = calloc(ana->tbl.nvbds + 1, sizeof(xsis_anab_t))) ||
+        !(rank = calloc(topn + 1, sizeof(uint32_t))) ||
+        !(score = calloc(ana->tbl.nvbds + 1, sizeof(float)))){
+        perror("calloc");
+        goto err;
+    }
+    for (i = nvbds = 0; i < ana->tbl.nvbds; i++){
+        if (!ana_total(ana->tbl.vbds[i], &tots[i]))
+            continue;
+        score[i] = report_ana_score(&tots[i], key);
+        for (j = (nvbds < topn) ? nvbds++ : topn;
+             j > 0 && score[rank[j-1]] < score[i]; j--)
+            rank[j] = rank[j-1];
+        if (j < topn)
+            rank[j] = i;
+    }
+    if (fmt.type == XSIS_FMT_TABLE && nvbds){
+        fmt_str(&fmt, "-----------------------------------------------" \
+                      "-----------------------------------------------" \
+                      "-----------------------------------------------\n");
+        fmt_str(&fmt, "Top offenders by ");
+        fmt_str(&fmt, (key < XSIS_NANAS) ? "p99 " : "");
+        fmt_str(&fmt, ana_keys[key]);
+        fmt_str(&fmt, ", ");
+        report_ana_time(ana->from);
+        fmt_str(&fmt, " to ");
+        report_ana_time(ana->last);
+        fmt_str(&fmt, "\n");
+        report_ana_hdr();
+    }
+    for (j = 0; j < nvbds; j++)
+        report_ana_row(ana->from, ana->tbl.vbds[rank[j]], j + 1,
+                       &tots[rank[j]]);
+    if (fmt_flush(&fmt))
+        goto err;
+
+out:
+    // Release resources
+    free(tots);
+    free(rank);
+    free(score);
+    return(err);
+
+err:
+    err = 1;
+    goto out;
+}
+
+// Print one figure of a VBD in both recordings
+static void
+report_diff_row(xsis_anavbd_t *vbd, const char *name, float before,
+                float after){
+    // Local variables
+    char                pct[16];        // Relative change
+    char                col[32];        // Table column
+
+    pct[0] = '\0';
+    if (before > 0)
+        (void)snprintf(pct, sizeof(pct), (fmt.type == XSIS_FMT_TABLE) ?
+                       "%+.1f" : "%.1f", (after - before)*100/before);
+    if (fmt.type == XSIS_FMT_TABLE){
+        fmt_uint(&fmt, vbd->domid, 5);
+        fmt_uint(&fmt, vbd->vbdid, 7);
+        (void)snprintf(col, sizeof(col), "  %-12s", name);
+        fmt_str(&fmt, col);
+        fmt_fixed(&fmt, before, 12);
+        fmt_fixed(&fmt, after, 12);
+        (void)snprintf(col, sizeof(col), "%9s%s\n", pct[0] ? pct : "-",
+                       pct[0] ? "%" : " ");
+        fmt_str(&fmt, col);
+        return;
+    }
+    report_header(report_diff_keys);
+    report_field(report_diff_keys, 0);
+    fmt_uint(&fmt, vbd->domid, 0);
+    report_field(report_diff_keys, 1);
+    fmt_uint(&fmt, vbd->vbdid, 0);
+    report_field(report_diff_keys, 2);
+    fmt_str(&fmt, (fmt.type == XSIS_FMT_JSONL) ? "\"" : "");
+    fmt_str(&fmt, name);
+    fmt_str(&fmt, (fmt.type == XSIS_FMT_JSONL) ? "\"" : "");
+    report_field(report_diff_keys, 3);
+    fmt_fixed(&fmt, before, 0);
+    report_field(report_diff_keys, 4);
+    fmt_fixed(&fmt, after, 0);
+    report_field(report_diff_keys, 5);
+    fmt_str(&fmt, pct[0] ? pct : (fmt.type == XSIS_FMT_JSONL) ? "null" : "");
+    fmt_str(&fmt, (fmt.type == XSIS_FMT_JSONL) ? "}\n" : "\n");
+}
+
+// Compare two analyses VBD by VBD (VBDs of both only)
+static int
+report_diff(xsis_ana_t *ana, xsis_ana_t *ana2){
+    // Local variables
+    xsis_anab_t         tot;            // Whole range, before
+    xsis_anab_t         tot2;           // Whole range, after
+    xsis_anafig_t       fig;            // Statistics, before
+    xsis_anafig_t       fig2;           // Statistics, after
+    xsis_anavbd_t       *vbd;           // VBD, before
+    xsis_anavbd_t       *vbd2;          // VBD, after
+    uint32_t            only = 0;       // VBDs of the first only
+    uint32_t            only2 = 0;      // VBDs of the second only
+    uint32_t            i, j;           // VBD indices
+    int                 f;              // Figure index
+    int                 k;              // Statistic index
+
+    if (fmt.type == XSIS_FMT_TABLE)
+        fmt_str(&fmt, "  DOM    VBD  FIGURE            BEFORE" \
+                      "       AFTER    CHANGE\n");
+
+    // Both tables are sorted by (domid, vbdid)
+    for (i = j = 0; i < ana->tbl.nvbds || j < ana2->tbl.nvbds; ){
+        vbd = (i < ana->tbl.nvbds) ? ana->tbl.vbds[i] : NULL;
+        vbd2 = (j < ana2->tbl.nvbds) ? ana2->tbl.vbds[j] : NULL;
+        if (!vbd2 || (vbd && (vbd->domid < vbd2->domid ||
+                              (vbd->domid == vbd2->domid &&
+                               vbd->vbdid < vbd2->vbdid)))){
+            only++;
+            i++;
+            continue;
+        }
+        if (!vbd || vbd->domid != vbd2->domid ||
+            vbd->vbdid != vbd2->vbdid){
+            only2++;
+            j++;
+            continue;
+        }
+        i++;
+        j++;
+        if (!ana_total(vbd, &tot) || !ana_total(vbd2, &tot2))
+            continue;
+        ana_figs(&tot, &fig);
+        ana_figs(&tot2, &fig2);
+        for (f = 0; f < XSIS_NANAS; f++)
+            for (k = XSIS_ANAF_MEAN; k <= XSIS_ANAF_P99; k++)
+                report_diff_row(vbd, report_ana_keys[5 + f*XSIS_NANAFS + k],
+                                fig.fig[f][k], fig2.fig[f][k]);
+        report_diff_row(vbd, "low_mem_pct", fig.lowmem, fig2.lowmem);
+        if (fmt_flush(&fmt))
+            return(1);
+    }
+    if (only || only2)
+        fprintf(stderr, "%u VBDs only in the first recording, %u only in" \
+                        " the second.\n", only, only2);
+    return(fmt_flush(&fmt));
+}
+
+// Analyse one or two sets of datafiles
+static int
+analyze(char *files, char *files2, xsis_flts_t *domids, xsis_flts_t *vbdids,
+        char *from, char *to, uint32_t bucket, uint32_t nthreads,
+        uint32_t topn, char *topkey){
+    // Local variables
+    xsis_ana_t          *ana[2] = { NULL, NULL }; // Analyses
+    char                *list[2];       // Datafiles of each
+    int                 key = XSIS_ANA_LAT; // Ranking key
+    int                 n;              // Analyses run
+    int                 err = 0;        // Return code
+
+    if (topkey != NULL){
+        for (key = 0; ana_keys[key] && strcmp(topkey, ana_keys[key]); key++);
+        if (!ana_keys[key]){
+            fprintf(stderr, "Invalid ranking key \"%s\" (iops, mbps, lat," \
+                            " queue or lowmem).\n", topkey);
+            goto err;
+        }
+    }
+    if (!nthreads && (long)(nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        nthreads = 1;
+
+    // Times are relative to the start of each set of datafiles
+    list[0] = files;
+    list[1] = files2;
+    for (n = 0; n < 2 && list[n]; n++){
+        if (ana_open(&ana[n], list[n], unit) ||
+            ana_run(ana[n], replay_time(from, ana[n]->start),
+                    replay_time(to, ana[n]->start),
+                    (uint64_t)bucket*1000000000, nthreads, domids, vbdids))
+            goto err;
+        fprintf(stderr, "Analysed %llu intervals of %u VBDs in %u" \
+                        " datafiles in %.1f ms (%u threads).\n",
+                (unsigned long long)ana[n]->nints, ana[n]->tbl.nvbds,
+                ana[n]->nfiles, ana[n]->elapsed/1e6, ana[n]->nthreads);
+    }
+    err = ana[1] ? report_diff(ana[0], ana[1]) :
+                   report_ana(ana[0], topn ? topn : XSIS_ANA_TOP, key);
+
+out:
+    // Release resources
+    ana_close(ana[0]);
+    ana_close(ana[1]);
+    return(err);
+
+err:
+    err = 1;
+    goto out;
 }
 
 // Main
@@ -150,21 +1246,70 @@ main(int argc, char **argv) {
     int32_t             inter = -1;     // Report interval (ms)
     uint8_t             scan = 0;       // Scan for new VBDs (flag)
     uint8_t             reporting = 1;  // Currently reporting (flag)
-    struct itimerval    itv;            // itimer setup
+    xsis_evt_t          *evt = NULL;    // Event loop
+    struct timespec     t0, t1;         // Start/end of the initial attach
     char                *datafn = NULL; // Datafile pathname
-    FILE                *datafp = NULL; // Datafile file pointer
-    uint32_t            filter;         // Temporary filter
+    char                *replayfn = NULL; // Datafile to replay
+    char                *from = NULL;   // Replay start time
+    char                *to = NULL;     // Replay stop time
+    char                *winarg = NULL; // Rolling window lengths
+    char                *srvpath = NULL; // OpenMetrics socket pathname
+    char                *pubpath = NULL; // Shared memory segment pathname
+    char                *rrdarg = NULL; // xcp-rrdd plugin uid (or pathname)
+    char                *topkey = NULL; // Top-N ranking key
+    char                *anafiles = NULL; // Datafiles to analyse
+    char                *difffiles = NULL; // Datafiles to compare with
+    uint32_t            bucket = 0;     // Analysis bucket (secs, 0 = one)
+    uint32_t            nthreads = 0;   // Analysis threads (0 = CPUs)
+    uint32_t            topn = 0;       // VBDs shown per tick (0 = all)
+    float               hyst = 0;       // Top-N hysteresis (%)
+    xsis_srv_t          *srv = NULL;    // OpenMetrics server
+    xsis_flr_t          *flr = NULL;    // Flight recorder
+    char                *flrpath = NULL; // Flight recorder dump prefix
+    char                *flrkeep = NULL; // Seconds dumped around triggers
+    char                *flrtrig = NULL; // Flight recorder triggers
+    int32_t             flrrate = -1;   // Flight recorder interval (ms)
+    int32_t             qdhz = -1;      // Queue depth sampling rate (Hz)
+    uint8_t             tdcpu = 0;      // Sample tapdisk CPU use (flag)
+    sigset_t            sigs;           // Signals only taken while waiting
+    sigset_t            omask;          // Signal mask while waiting
+    xsis_win_t          win;            // Rolling windows
+    xsis_win_t          *winp = NULL;   // Rolling windows (if requested)
+    xsis_dat_t          *dat = NULL;    // Datafile writer
     int                 i;              // Temporary integer
     int                 err = 0;        // Return value
+    static const struct option longopts[] = {
+        { "format", required_argument, NULL, 'f' },
+        { "serve", required_argument, NULL, 'S' },
+        { "root", required_argument, NULL, 'R' },
+        { "self", no_argument, NULL, 'I' },
+        { "hysteresis", required_argument, NULL, 'H' },
+        { "group-by", required_argument, NULL, 'G' },
+        { "flight", required_argument, NULL, 'F' },
+        { "flight-rate", required_argument, NULL, 'P' },
+        { "flight-keep", required_argument, NULL, 'K' },
+        { "trigger", required_argument, NULL, 'T' },
+        { "idle-every", required_argument, NULL, 'E' },
+        { "qd", optional_argument, NULL, 'Q' },
+        { "publish", required_argument, NULL, 'U' },
+        { "rrdd", required_argument, NULL, 'D' },
+        { "analyze", required_argument, NULL, 'A' },
+        { "diff", required_argument, NULL, 'X' },
+        { "bucket", required_argument, NULL, 'B' },
+        { "threads", required_argument, NULL, 'N' },
+        { "cpu", no_argument, NULL, 'C' },
+        { NULL, 0, NULL, 0 }
+    };
 
     // Initialise
-    PAGE_SIZE = sysconf(_SC_PAGESIZE);
-    LIST_INIT(&domids);
-    LIST_INIT(&vbdids);
-    LIST_INIT(&vbds);
+    fmt_init(&fmt, XSIS_FMT_TABLE);
+    flts_init(&domids);
+    flts_init(&vbdids);
+    vbds_init(&vbds);
 
     // Fetch arguments
-    while ((i = getopt(argc, argv, "hsd:v:i:o:")) != -1){
+    while ((i = getopt_long(argc, argv, "hsaxd:v:i:o:r:b:e:w:f:t:k:", longopts,
+                            NULL)) != -1){
         switch (i){
         case 's': // Set scan flag, if unset
             if (scan){
@@ -175,15 +1320,30 @@ main(int argc, char **argv) {
             scan++;
             break;
 
-        case 'd': // Add DOM ID to filter
-            filter = (uint32_t)strtoul(optarg, NULL, 10);
-            if (flt_add(&domids, filter))
+        case 'a': // Print idle VBDs too
+            allvbds = 1;
+            break;
+
+        case 'x': // Print derived figures
+            ext = 1;
+            grps.drv = 1;
+            break;
+
+        case 'E': // Set how often idle VBDs are fully read
+            if (!(vbds.snap.every = strtoul(optarg, NULL, 10))){
+                fprintf(stderr, "%s: Invalid argument \"--idle-every\"," \
+                                " must be at least 1.\n", argv[0]);
                 goto err;
+            }
             break;
 
-        case 'v': // Add VBD ID to filter
-            filter = (uint32_t)strtoul(optarg, NULL, 10);
-            if (flt_add(&vbdids, filter))
+        case 'd': // Add DOM IDs to filter
+            if (flt_parse(&domids, optarg))
+                goto err;
+            break;
+
+        case 'v': // Add VBD IDs to filter
+            if (flt_parse(&vbdids, optarg))
                 goto err;
             break;
 
@@ -210,6 +1370,141 @@ main(int argc, char **argv) {
             }
             break;
 
+        case 'r': // Set datafile to replay
+            if (replayfn != NULL){
+                fprintf(stderr, "%s: Invalid argument \"-r\", input"\
+                                " datafile already set.\n", argv[0]);
+                goto err;
+            }
+            replayfn = optarg;
+            break;
+
+        case 'b': // Set replay start time
+            from = optarg;
+            break;
+
+        case 'e': // Set replay stop time
+            to = optarg;
+            break;
+
+        case 'f': // Set output format
+            if ((i = fmt_type(optarg)) < 0){
+                fprintf(stderr, "%s: Invalid output format \"%s\".\n",
+                        argv[0], optarg);
+                goto err;
+            }
+            fmt.type = i;
+            break;
+
+        case 'S': // Set OpenMetrics socket
+            srvpath = optarg;
+            break;
+
+        case 'I': // Append self-instrumentation to each tick
+            selfrep = 1;
+            break;
+
+        case 'R': // Set stats root (e.g. a synthetic one)
+            vbds.root = optarg;
+            break;
+
+        case 'w': // Set rolling window lengths
+            winarg = optarg;
+            break;
+
+        case 't': // Show only the top N VBDs
+            if (!(topn = strtoul(optarg, NULL, 10))){
+                fprintf(stderr, "%s: Invalid argument \"-t\", at least" \
+                                " one VBD must be shown.\n", argv[0]);
+                goto err;
+            }
+            break;
+
+        case 'k': // Set top N ranking key
+            topkey = optarg;
+            break;
+
+        case 'H': // Set top N hysteresis
+            hyst = strtof(optarg, NULL);
+            break;
+
+        case 'G': // Roll VBDs up by domain, tapdisk or SR
+            if ((i = grp_type(optarg)) < 0){
+                fprintf(stderr, "%s: Invalid group \"%s\".\n",
+                        argv[0], optarg);
+                goto err;
+            }
+            grps.by = i;
+            report_grp_keys[1] = (i == XSIS_GRP_DOM) ? "domid" :
+                                 (i == XSIS_GRP_TAPDISK) ? "tdpid" : "sr";
+            vbds.wantsr = (i == XSIS_GRP_SR);
+            break;
+
+        case 'F': // Keep a flight recorder
+            flrpath = optarg;
+            break;
+
+        case 'P': // Set flight recorder interval
+            flrrate = (int32_t)strtoul(optarg, NULL, 10);
+            break;
+
+        case 'K': // Set seconds dumped around flight recorder triggers
+            flrkeep = optarg;
+            break;
+
+        case 'T': // Set flight recorder triggers
+            flrtrig = optarg;
+            break;
+
+        case 'Q': // Sample queue depths between ticks
+            qdhz = optarg ? (int32_t)strtoul(optarg, NULL, 10) :
+                            XSIS_QD_RATE;
+            if (qdhz <= 0 || qdhz > 1000000){
+                fprintf(stderr, "%s: Invalid argument \"--qd\", must be" \
+                                " 1 to 1000000 samples a second.\n",
+                        argv[0]);
+                goto err;
+            }
+            break;
+
+        case 'C': // Sample tapdisk CPU use
+            tdcpu = 1;
+            break;
+
+        case 'U': // Republish ticks in shared memory
+            pubpath = optarg;
+            break;
+
+        case 'D': // Act as an xcp-rrdd plugin
+            rrdarg = optarg;
+            break;
+
+        case 'A': // Analyse datafiles
+            anafiles = optarg;
+            break;
+
+        case 'X': // Compare them with other datafiles
+            difffiles = optarg;
+            break;
+
+        case 'B': // Set analysis bucket length
+            if (!(bucket = strtoul(optarg, NULL, 10))){
+                fprintf(stderr, "%s: Invalid argument \"--bucket\", must" \
+                                " be at least 1 second.\n", argv[0]);
+                goto err;
+            }
+            break;
+
+        case 'N': // Set analysis threads
+            if (!(nthreads = strtoul(optarg, NULL, 10)) ||
+                nthreads > XSIS_ANA_MAXTHREADS){
+                fprintf(stderr, "%s: Invalid argument \"--threads\", must" \
+                                " be 1 to %d.\n", argv[0],
+                        XSIS_ANA_MAXTHREADS);
+                goto err;
+            }
+            break;
+
         case 'h': // Print help
         default:
             usage(argv[0]);
@@ -217,63 +1512,296 @@ main(int argc, char **argv) {
         }
     }
 
+    // Analyse datafiles instead of sampling (-t and -k pick offenders)
+    if (anafiles != NULL){
+        if (scan || allvbds || ext || inter != -1 || datafn != NULL ||
+            replayfn != NULL || winarg != NULL || srvpath != NULL ||
+            selfrep || hyst || grps.by != XSIS_GRP_NONE || flrpath != NULL ||
+            qdhz != -1 || pubpath != NULL || rrdarg != NULL || tdcpu){
+            fprintf(stderr, "%s: Only \"-b\", \"-e\", \"-d\", \"-v\"," \
+                            " \"-f\", \"-t\", \"-k\", \"--diff\"," \
+                            " \"--bucket\" and \"--threads\" can be used" \
+                            " with \"--analyze\".\n", argv[0]);
+            goto err;
+        }
+        if (difffiles != NULL && (bucket || topn || topkey != NULL)){
+            fprintf(stderr, "%s: Arguments \"--bucket\", \"-t\" and" \
+                            " \"-k\" cannot be used with \"--diff\".\n",
+                    argv[0]);
+            goto err;
+        }
+        err = analyze(anafiles, difffiles, &domids, &vbdids, from, to,
+                      bucket, nthreads, topn, topkey);
+        goto out;
+    }
+    if (difffiles != NULL || bucket || nthreads){
+        fprintf(stderr, "%s: Arguments \"--diff\", \"--bucket\" and" \
+                        " \"--threads\" require \"--analyze\".\n",
+                argv[0]);
+        goto err;
+    }
+
+    // Rank VBDs if only the top N are to be shown
+    if ((topkey != NULL || hyst) && !topn){
+        fprintf(stderr, "%s: Arguments \"-k\" and \"--hysteresis\"" \
+                        " require \"-t\".\n", argv[0]);
+        goto err;
+    }
+    if (topn && srvpath != NULL){
+        fprintf(stderr, "%s: Argument \"-t\" cannot be used with" \
+                        " \"--serve\".\n", argv[0]);
+        goto err;
+    }
+    if (topn && top_init(&top, topn, topkey ? topkey : "riops", hyst))
+        goto err;
+
+    // Rollups only replace the per tick VBD rows
+    if (grps.by != XSIS_GRP_NONE && (winarg != NULL || topn ||
+                                     srvpath != NULL)){
+        fprintf(stderr, "%s: Argument \"--group-by\" cannot be used with" \
+                        " \"-w\", \"-t\" or \"--serve\".\n", argv[0]);
+        goto err;
+    }
+    if (grps.by == XSIS_GRP_SR && replayfn != NULL){
+        fprintf(stderr, "%s: Datafiles do not record SRs, \"--group-by" \
+                        " sr\" cannot be used with \"-r\".\n", argv[0]);
+        goto err;
+    }
+
+    // The flight recorder options only tune --flight
+    if (flrpath == NULL && (flrrate != -1 || flrkeep != NULL ||
+                            flrtrig != NULL)){
+        fprintf(stderr, "%s: Arguments \"--flight-rate\", \"--flight-keep\"" \
+                        " and \"--trigger\" require \"--flight\".\n",
+                argv[0]);
+        goto err;
+    }
+    if (flrrate == 0){
+        fprintf(stderr, "%s: Flight recorder interval must be at least" \
+                        " 1 ms.\n", argv[0]);
+        goto err;
+    }
+
+    // Derived figures are not kept over rolling windows
+    if (ext && winarg != NULL){
+        fprintf(stderr, "%s: Argument \"-x\" cannot be used with" \
+                        " \"-w\".\n", argv[0]);
+        goto err;
+    }
+    if (qdhz != -1)
+        report_keys_add(report_keys, report_qd_keys);
+    if (ext){
+        report_keys_add(report_keys, report_drv_keys);
+        report_keys_add(report_grp_keys, report_drv_keys);
+    }
+    if (tdcpu)
+        report_keys_add(report_keys, report_cpu_keys);
+
+    // Queue depths are only reported per VBD and per tick
+    if (qdhz != -1 && (winarg != NULL || grps.by != XSIS_GRP_NONE)){
+        fprintf(stderr, "%s: Argument \"--qd\" cannot be used with" \
+                        " \"-w\" or \"--group-by\".\n", argv[0]);
+        goto err;
+    }
+
+    // So are tapdisk figures
+    if (tdcpu && (winarg != NULL || grps.by != XSIS_GRP_NONE)){
+        fprintf(stderr, "%s: Argument \"--cpu\" cannot be used with" \
+                        " \"-w\" or \"--group-by\".\n", argv[0]);
+        goto err;
+    }
+
+    // Replay a datafile instead of sampling
+    if (replayfn != NULL){
+        if (scan || datafn != NULL || srvpath != NULL || selfrep ||
+            flrpath != NULL || qdhz != -1 || pubpath != NULL ||
+            rrdarg != NULL || tdcpu){
+            fprintf(stderr, "%s: Arguments \"-s\", \"-o\", \"--serve\"," \
+                            " \"--self\", \"--flight\", \"--qd\"," \
+                            " \"--publish\", \"--rrdd\" and \"--cpu\"" \
+                            " cannot be used with \"-r\".\n", argv[0]);
+            goto err;
+        }
+        signal(SIGINT, sigstop_h);
+        signal(SIGTERM, sigstop_h);
+        err = replay_loop(replayfn, &domids, &vbdids, inter, from, to,
+                          winarg);
+        goto out;
+    }
+    if (from != NULL || to != NULL){
+        fprintf(stderr, "%s: Arguments \"-b\" and \"-e\" require" \
+                        " \"-r\" or \"--analyze\".\n", argv[0]);
+        goto err;
+    }
+
+    if (srvpath != NULL && (winarg != NULL || fmt.type != XSIS_FMT_TABLE)){
+        fprintf(stderr, "%s: Arguments \"-w\" and \"-f\" cannot be used" \
+                        " with \"--serve\".\n", argv[0]);
+        goto err;
+    }
+
     // Validate parameters and set defaults
     if (inter < 0)
         inter = XSIS_INTERVAL;
+    if (inter == 0){
+        fprintf(stderr, "%s: Output interval must be at least 1 ms.\n",
+                argv[0]);
+        goto err;
+    }
+
+    // Drive the loop with a monotonic interval timer
+    if (evt_open(&evt, inter))
+        goto err;
+    self_init(&self, inter);
+
+    if ((srvpath != NULL) && srv_open(&srv, srvpath, evt)){
+        fprintf(stderr, "%s: Error serving on socket '%s'.\n", argv[0],
+                srvpath);
+        goto err;
+    }
+
+    if ((pubpath != NULL) && pub_open(&pub, pubpath, inter, unit)){
+        fprintf(stderr, "%s: Error publishing to '%s'.\n", argv[0],
+                pubpath);
+        goto err;
+    }
 
-    if ((datafn != NULL) && (!(datafp = fopen(datafn, "w")))){
-        perror("fopen");
+    if ((rrdarg != NULL) && rrd_open(&rrd, rrdarg, inter, unit)){
+        fprintf(stderr, "%s: Error writing xcp-rrdd plugin page for" \
+                        " '%s'.\n", argv[0], rrdarg);
+        goto err;
+    }
+
+    if ((winarg != NULL) && win_init(&win, winarg, inter))
+        goto err;
+    if (winarg != NULL)
+        winp = &win;
+
+    if ((datafn != NULL) && dat_open(&dat, datafn, inter)){
         fprintf(stderr, "%s: Error opening datafile '%s' for writing.\n",
                 argv[0], datafn);
         goto err;
     }
 
-    // Allocate initial set of VBDs
-    if (vbds_alloc(&vbds, &domids, &vbdids))
+    if ((flrpath != NULL) && flr_open(&flr, flrpath, (flrrate > 0) ?
+                                      (uint32_t)flrrate : XSIS_FLR_RATE,
+                                      flrkeep, flrtrig, evt, &vbds))
+        goto err;
+
+    if ((qdhz != -1) && qd_open(&qd, qdhz, evt, &vbds))
+        goto err;
+    if (tdcpu && cpu_open(&cpu))
+        goto err;
+    if (srv){
+        srv->qd = (qd != NULL);
+        srv->drv = ext;
+        srv->cpu = cpu;
+    }
+
+    // Allocate initial set of VBDs (and report how long it took)
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (vbds_alloc(&vbds, &domids, &vbdids) || xsc_listen(vbds.xsc, evt))
         goto err;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fprintf(stderr, "Attached %u VBDs in %.1f ms.\n", vbds.nvbds,
+            (t1.tv_sec - t0.tv_sec)*1000.0 + (t1.tv_nsec - t0.tv_nsec)/1e6);
 
-    // Set alarm
-    signal(SIGALRM, sigalarm_h);
-    itv.it_interval.tv_sec = inter/1000;
-    itv.it_interval.tv_usec = (inter%1000)*1000;
-    itv.it_value.tv_sec = 0;
-    itv.it_value.tv_usec = 100000;
-    setitimer(ITIMER_REAL, &itv, NULL);
+    // Stop cleanly so the datafile trailer is written; the signals are
+    // only taken while waiting, so a stop request is never missed
+    signal(SIGINT, sigstop_h);
+    signal(SIGTERM, sigstop_h);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    if (flr){
+        signal(SIGUSR1, sigdump_h);
+        sigaddset(&sigs, SIGUSR1);
+    }
+    sigprocmask(SIG_BLOCK, &sigs, &omask);
 
     // Loop
-    while(!err){
-        // Wait for alarm
-        pause();
+    while(!err && !stop){
+        // Wait for the next tick (serving other sources meanwhile)
+        if ((i = evt_wait(evt, &omask)) < 0)
+            err = 1;
+        if (err || stop)
+            break;
+        if (dump){
+            flr_trigger(flr, "signal");
+            dump = 0;
+        }
+        if (!i)
+            continue;
 
         // Update attached VBDs
-        if (scan)
-            err = vbds_alloc(&vbds, &domids, &vbdids);
-        else
-        if (LIST_EMPTY(&vbds)){
+        self_start(&self);
+        err = vbds_refresh(&vbds, &domids, &vbdids, scan);
+        self_mark(&self, XSIS_PH_SCAN);
+        if (!scan && LIST_EMPTY(&vbds.list)){
             // There are no VBDs to report and we are not scanning
             fprintf(stderr, "No VBDs to report and 'scan' flag not set.\n");
             break;
         }
 
         // Report
-        if (!LIST_EMPTY(&vbds)){
+        if (!LIST_EMPTY(&vbds.list)){
             reporting = 1;
-            main_loop(&vbds);
-        } else if (reporting){
-            printf("Waiting for VBDs to be plugged.\n");
-            reporting = 0;
+            err = main_loop(&vbds, dat, winp, srv);
+        } else {
+            // Readers of the segment see the last VBD go too
+            if (pub)
+                err = pub_tick(pub, &vbds.snap);
+            if (rrd && rrd_tick(rrd, &vbds))
+                err = 1;
+            if (srv){
+                srv_tick(srv, &vbds, &self);
+            } else if (reporting){
+                if (fmt.type == XSIS_FMT_TABLE)
+                    printf("Waiting for VBDs to be plugged.\n");
+                reporting = 0;
+            }
         }
+        self_end(&self, evt->missed);
     }
 
 out:
     // Release resources
+    srv_close(srv);
+    flr_close(flr);
+    qd_close(qd);
+    cpu_close(cpu);
+    pub_close(pub);
+    rrd_close(rrd);
+    if (evt && evt->ticks)
+        fprintf(stderr, "%llu ticks, %llu missed, timer jitter avg %.1f us," \
+                        " max %.1f us.\n", (unsigned long long)evt->ticks,
+                (unsigned long long)evt->missed,
+                (double)evt->jitsum / evt->ticks / 1000,
+                (double)evt->jitmax / 1000);
+    if (self.ticks)
+        fprintf(stderr, "Tick cost avg %.1f us, max %.1f us (scan %.1f," \
+                        " snapshot %.1f, rates %.1f, output %.1f, record" \
+                        " %.1f), %llu overruns.\n",
+                (double)self.busy / self.ticks / 1000,
+                (double)self.maxtick / 1000,
+                (double)self.total[XSIS_PH_SCAN] / self.ticks / 1000,
+                (double)self.total[XSIS_PH_SNAP] / self.ticks / 1000,
+                (double)self.total[XSIS_PH_RATES] / self.ticks / 1000,
+                (double)self.total[XSIS_PH_OUT] / self.ticks / 1000,
+                (double)self.total[XSIS_PH_REC] / self.ticks / 1000,
+                (unsigned long long)self.overruns);
+    evt_close(evt);
     vbds_free(&vbds);
+    fmt_free(&fmt);
+    top_free(&top);
+    grp_free(&grps);
+    if (winp)
+        win_free(winp);
     flts_free(&domids);
     flts_free(&vbdids);
     if (datafn)
         free(datafn);
-    if (datafp)
-        fclose(datafp);
+    dat_close(dat);
 
     // Return
     return(err);
@@ -21,44 +21,153 @@
 // Required headers
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/queue.h>
 
 #include <blktap/tapdisk-metrics-stats.h>
 typedef struct stats tapdisk_stats;
 
+#include "libxsiostat.h"
+
 // Global definitions
 #define XSIS_PROGNAME           "Storage I/O Stats"
 #define XSIS_PROGNAME_LEN       strlen(XSIS_PROGNAME)
 
-#define XSIS_VBD3_DIR           "/dev/shm/"
+#define XSIS_SHM_ROOT           "/dev/shm" // Default stats root (--root)
 #define XSIS_VBD3_BASEFMT       "vbd3-%u-%u" // domid, vbdid
 
-#define XSIS_TD3_DIR            "/dev/shm/"
 #define XSIS_TD3_BASEFMT        "td3-%u" // tapdisk pid
-#define XSIS_TD3_PATHFMT        XSIS_TD3_DIR XSIS_TD3_BASEFMT "/vbd-%u-%u" // domid, vbdid
+#define XSIS_TD3_VBDFMT         "vbd-%u-%u" // domid, vbdid
+#define XSIS_TD3_PATHFMT        "%s/" XSIS_TD3_BASEFMT "/" XSIS_TD3_VBDFMT
+
+#define XSIS_XS_VBD3_PATH       "/local/domain/0/backend/vbd3"
+#define XSIS_XS_TOKEN           "xsiostat"
 
 #define	XSIS_INTERVAL           1000    // Default report interval (ms)
 #define	XSIS_SECTOR_SZ          512     // Bytes per sector
 
-// Tapdisk stats (from shm page)
-typedef struct _xsis_tdstat_t {
-    uint64_t            rop_0;          // read requests completed now
-    uint64_t            rop_1;          // read requests completed last time
-    uint64_t            rsc_0;          // read sectors completed now
-    uint64_t            rsc_1;          // read sectors completed last time
-    uint64_t            wop_0;          // write requests completed now
-    uint64_t            wop_1;          // write requests completed last time
-    uint64_t            wsc_0;          // write sectors completed now
-    uint64_t            wsc_1;          // write sectors completed last time
-    uint64_t            rtu_0;          // read ticks in usec now
-    uint64_t            rtu_1;          // read ticks in usec last time
-    uint64_t            wtu_0;          // write ticks in usec now
-    uint64_t            wtu_1;          // write ticks in usec last time
-    uint32_t            infrd;          // read requests inflight
-    uint32_t            infwr;          // write requests inflight
-    bool                low_mem_mode;   // tapdisk low memory mode
-} xsis_tdstat_t;
+#define XSIS_SR_LEN             64      // Longest SR name kept (--group-by)
+
+#define XSIS_SNAP_RETRIES       4       // Re-reads of an inconsistent page
+#define XSIS_IDLE_TICKS         2       // Idle ticks before backing off
+#define XSIS_IDLE_EVERY         10      // Full reads of idle VBDs (ticks)
+
+#define XSIS_ATTACH_WORKERS     4       // Threads attaching VBDs at startup
+#define XSIS_ATTACH_MIN         64      // VBDs found to attach in parallel
+
+// Counters sampled from each tapdisk stats page
+enum {
+    XSIS_CTR_ROP = 0,                   // read requests submitted
+    XSIS_CTR_RSC,                       // read sectors
+    XSIS_CTR_WOP,                       // write requests submitted
+    XSIS_CTR_WSC,                       // write sectors
+    XSIS_CTR_RTU,                       // read ticks in usec
+    XSIS_CTR_WTU,                       // write ticks in usec
+    XSIS_CTR_RCP,                       // read requests completed
+    XSIS_CTR_WCP,                       // write requests completed
+    XSIS_NCTRS
+};
+
+// Rates derived from two snapshots
+enum {
+    XSIS_RATE_RIOPS = 0,                // read requests per second
+    XSIS_RATE_WIOPS,                    // write requests per second
+    XSIS_RATE_RTPUT,                    // read throughput (per unit)
+    XSIS_RATE_WTPUT,                    // write throughput (per unit)
+    XSIS_RATE_RAVGQ,                    // average read queue size
+    XSIS_RATE_WAVGQ,                    // average write queue size
+    XSIS_NRATES
+};
+
+// Figures derived from counter deltas (double precision)
+enum {
+    XSIS_DRV_IOPS = 0,                  // requests per second (r+w)
+    XSIS_DRV_RLAT,                      // average read service time (us)
+    XSIS_DRV_WLAT,                      // average write service time (us)
+    XSIS_DRV_RRQSZ,                     // average read request size (KiB)
+    XSIS_DRV_WRQSZ,                     // average write request size (KiB)
+    XSIS_DRV_UTIL,                      // time with requests in service (%)
+    XSIS_NDRVS
+};
+
+// Snapshot of all VBDs (structure of arrays, indexed by VBD slot)
+typedef struct _xsis_snap_t {
+    uint64_t            *cur[XSIS_NCTRS];  // counters sampled this tick
+    uint64_t            *prev[XSIS_NCTRS]; // counters sampled last tick
+    uint64_t            *tcur;          // time cur was sampled (ns)
+    uint64_t            *tprev;         // time prev was sampled (ns)
+    float               *idt;           // 1/(tcur-tprev) (per sec)
+    uint64_t            *flags;         // tapdisk flags (BT3_*) this tick
+    float               *rate[XSIS_NRATES]; // rates between prev and cur
+    double              *drv[XSIS_NDRVS]; // derived figures (snap_derive)
+    struct _xsis_vbd_t  **vbds;         // VBD owning each slot
+    xsiostat_id_t       *ids;           // identity of each slot's VBD
+    uint32_t            nslots;         // slots in use
+    uint32_t            slotsz;         // slots allocated
+    uint64_t            torn;           // page reads that had to be retried
+    uint64_t            now;            // time of the last rotation (ns)
+    uint32_t            every;          // full reads of idle VBDs (ticks)
+    uint64_t            probed;         // idle slots carried over (probed)
+} xsis_snap_t;
+
+#define XSIS_WIN_MAX            8       // Rolling windows (-w)
+#define XSIS_WIN_NCTRS          XSIS_CTR_RCP // Counters kept in window rings
+#define XSIS_WIN_STEP           1000    // Minimum ring step (ms)
+
+// Rolling window figures (XSIS_RATE_* first)
+enum {
+    XSIS_WOUT_MINIOPS = XSIS_NRATES,    // minimum step IOPS (r+w)
+    XSIS_WOUT_MAXIOPS,                  // maximum step IOPS (r+w)
+    XSIS_WOUT_MINTPUT,                  // minimum step throughput (r+w)
+    XSIS_WOUT_MAXTPUT,                  // maximum step throughput (r+w)
+    XSIS_NWOUTS
+};
+
+// Min/max queues kept per window
+enum {
+    XSIS_WINQ_MINIOPS = 0,
+    XSIS_WINQ_MAXIOPS,
+    XSIS_WINQ_MINTPUT,
+    XSIS_WINQ_MAXTPUT,
+    XSIS_NWINQS
+};
+
+// Monotonic queue entry (per-step rate)
+typedef struct _xsis_winqe_t {
+    uint32_t            seq;            // ring step sequence number
+    float               val;            // rate over that step
+} xsis_winqe_t;
+
+// Monotonic queue (view into xsis_vbdwin_t.qe)
+typedef struct _xsis_winq_t {
+    uint32_t            first;          // index of oldest entry
+    uint32_t            len;            // entries in queue
+} xsis_winq_t;
+
+// Per-VBD rolling window state
+typedef struct _xsis_vbdwin_t {
+    uint32_t            nent;           // ring entries pushed for this VBD
+    uint64_t            *ring;          // ringsz entries of XSIS_WIN_NCTRS
+    xsis_winq_t         q[XSIS_WIN_MAX][XSIS_NWINQS]; // min/max queues
+    xsis_winqe_t        *qe;            // queue storage
+} xsis_vbdwin_t;
+
+// Rolling windows shared state
+typedef struct _xsis_win_t {
+    uint32_t            nwins;          // windows in use
+    uint32_t            secs[XSIS_WIN_MAX];  // window lengths (secs)
+    uint32_t            steps[XSIS_WIN_MAX]; // window lengths (ring steps)
+    uint32_t            qoff[XSIS_WIN_MAX];  // queue storage offsets
+    uint32_t            nqe;            // queue storage entries per VBD
+    uint64_t            step;           // ring step (ns)
+    uint32_t            ringsz;         // ring entries (longest window + 1)
+    uint32_t            head;           // newest ring entry
+    uint32_t            seq;            // ring steps taken so far
+    uint64_t            *ts;            // ring timestamps (ns)
+    uint64_t            now;            // time of the last update (ns)
+} xsis_win_t;
 
 // VBD general entry
 typedef struct _xsis_vbd_t {
@@ -67,39 +176,948 @@ typedef struct _xsis_vbd_t {
     uint32_t            tdpid;          // tapdisk pid
     int32_t             shmfd;          // shared memory stats fd
     void                *shmmap;        // shared memory stats mapping
-    xsis_tdstat_t       tdstat;         // tapdisk stat information
+    int32_t             tdwd;           // inotify watch on td3 dir (or -1)
+    uint32_t            slot;           // index in snapshot arrays
+    uint32_t            setidx;         // index in recorded VBD set (replay)
+    xsis_vbdwin_t       *win;           // rolling window state (or NULL)
+    uint8_t             top;            // shown by the last top-N (flag)
+    uint32_t            srid;           // index in vbds srs (0 = unknown)
+    uint64_t            frcp;           // completions (flight recorder)
+    uint64_t            frts;           // time frcp last moved (ns)
+    uint8_t             frstate;        // conditions holding (XSIS_FLR_*)
+    uint32_t            idle;           // ticks idle in a row
+    struct _xsis_vbdqd_t *qd;           // queue depth histogram (or NULL)
     LIST_ENTRY(_xsis_vbd_t) vbds;       // list
 } xsis_vbd_t;
 
-// Filter general entry
+// Keys VBDs can be ranked by (-k), XSIS_RATE_* first
+enum {
+    XSIS_TOP_LAT = XSIS_NRATES,         // average service time (r+w)
+    XSIS_NTOPKEYS
+};
+
+// Top-N selection (-t)
+typedef struct _xsis_top_t {
+    uint32_t            n;              // VBDs shown (0 = all)
+    int                 key;            // ranking key (XSIS_RATE_*/TOP_*)
+    float               hyst;           // score bonus of VBDs shown (1+x)
+    xsis_vbd_t          **rows;         // selected VBDs, best first
+    float               *score;         // scores of rows
+    uint32_t            nrows;          // entries in rows
+} xsis_top_t;
+
+// Datafile format (all records are 8-byte aligned, host endianness)
+#define XSIS_DAT_MAGIC          0x53495358  // "XSIS"
+#define XSIS_DAT_VERSION        2           // (1 = no DTICK records)
+#define XSIS_DAT_REC_SET        1           // VBD set record
+#define XSIS_DAT_REC_TICK       2           // Sample record (key frame)
+#define XSIS_DAT_REC_IDX        3           // Time index record
+#define XSIS_DAT_REC_END        4           // Trailer (points at index)
+#define XSIS_DAT_REC_DTICK      5           // Delta-encoded sample record
+#define XSIS_DAT_KEY_STRIDE     1024        // Sample records per key frame
+#define XSIS_DAT_NVALS          9           // Values per sample entry
+#define XSIS_DAT_NDODS          6           // ... stored as delta-of-delta
+
+// Datafile header (once, at offset 0)
+typedef struct _xsis_dat_hdr_t {
+    uint32_t            magic;          // XSIS_DAT_MAGIC
+    uint32_t            version;        // XSIS_DAT_VERSION
+    uint32_t            sector_sz;      // bytes per sector
+    uint32_t            interval;       // sampling interval (ms)
+    uint64_t            start;          // recording start (ns since epoch)
+} xsis_dat_hdr_t;
+
+// Datafile record header (followed by nent fixed-size entries, or by
+// 'size' bytes of encoded entries for DTICK records)
+typedef struct _xsis_dat_rec_t {
+    uint32_t            magic;          // XSIS_DAT_MAGIC
+    uint32_t            type;           // XSIS_DAT_REC_*
+    uint32_t            nent;           // number of entries that follow
+    uint32_t            size;           // payload bytes (DTICK only)
+    uint64_t            ts;             // sample time (ns since epoch)
+    uint64_t            setoff;         // offset of the VBD set in effect
+                                        // (or of the index, for END)
+} xsis_dat_rec_t;
+
+// Datafile VBD set entry
+typedef struct _xsis_dat_vbd_t {
+    uint32_t            domid;          // domain id owning this vbd
+    uint32_t            vbdid;          // vbd id
+    uint32_t            tdpid;          // tapdisk pid
+    uint32_t            reserved;       // padding
+} xsis_dat_vbd_t;
+
+// Datafile sample entry (raw counters, in VBD set order)
+typedef struct _xsis_dat_cnt_t {
+    uint64_t            rop;            // read requests
+    uint64_t            rsc;            // read sectors
+    uint64_t            wop;            // write requests
+    uint64_t            wsc;            // write sectors
+    uint64_t            rtu;            // read ticks in usec
+    uint64_t            wtu;            // write ticks in usec
+    uint32_t            infrd;          // read requests inflight
+    uint32_t            infwr;          // write requests inflight
+    uint32_t            flags;          // tapdisk flags (BT3_*)
+    uint32_t            reserved;       // padding
+} xsis_dat_cnt_t;
+
+// Datafile index entry
+typedef struct _xsis_dat_idx_t {
+    uint64_t            ts;             // sample time (ns since epoch)
+    uint64_t            off;            // offset of the sample record
+} xsis_dat_idx_t;
+
+// Datafile writer context
+typedef struct _xsis_dat_t {
+    int32_t             fd;             // datafile fd
+    uint64_t            off;            // current datafile offset
+    uint64_t            setoff;         // offset of the last VBD set record
+    xsis_dat_vbd_t      *set;           // last VBD set written
+    uint32_t            nset;           // entries in last VBD set
+    char                *buf;           // per-tick record buffer
+    size_t              bufsz;          // allocated size of buf
+    xsis_dat_idx_t      *idx;           // sparse time index
+    uint32_t            nidx;           // entries in idx
+    uint32_t            idxsz;          // allocated entries in idx
+    uint64_t            nticks;         // sample records written
+    uint64_t            *prev;          // values of the last sample
+    uint64_t            *delta;         // deltas of the last sample
+    uint32_t            nkey;           // samples since the last key frame
+    xsis_dat_vbd_t      *tset;          // set of the tick being written
+    xsis_dat_cnt_t      *tcnt;          // samples of the tick being written
+    uint32_t            tsz;            // allocated entries in tset/tcnt
+} xsis_dat_t;
+
+// Datafile reader context
+typedef struct _xsis_datrd_t {
+    int32_t             fd;             // datafile fd
+    const char          *map;           // datafile mapping
+    size_t              len;            // datafile length
+    size_t              end;            // end of sample data
+    size_t              off;            // next record to decode
+    const xsis_dat_hdr_t *hdr;          // datafile header
+    const xsis_dat_idx_t *idx;          // time index (NULL if absent)
+    uint32_t            nidx;           // entries in idx
+    char                *buf;           // last decoded sample record
+    uint64_t            *delta;         // deltas of the last sample
+    uint32_t            nbuf;           // entries buf and delta hold
+    uint8_t             valid;          // buf follows a key frame (flag)
+    const xsis_dat_rec_t *pend;         // sample found by dat_read_seek()
+} xsis_datrd_t;
+
+// Filter range
 typedef struct _xsis_flt_t {
-    uint32_t            filter;         // filter id
-    LIST_ENTRY(_xsis_flt_t) flts;       // list
+    uint32_t            lo;             // first id in range
+    uint32_t            hi;             // last id in range
 } xsis_flt_t;
 
-// Lists
-typedef LIST_HEAD(xsis_vbds, _xsis_vbd_t) xsis_vbds_t;
-typedef LIST_HEAD(xsis_flts, _xsis_flt_t) xsis_flts_t;
+// Filter (sorted, disjoint ranges)
+typedef struct _xsis_flts_t {
+    xsis_flt_t          *flts;          // ranges
+    uint32_t            nflts;          // ranges in use (0 = no filter)
+    uint32_t            fltsz;          // ranges allocated
+} xsis_flts_t;
+
+// Event source (registered with the epoll loop)
+typedef struct _xsis_evtsrc_t {
+    int                 fd;             // file descriptor polled
+    int                 (*cb)(struct _xsis_evtsrc_t *, uint32_t); // handler
+    void                *arg;           // handler context
+} xsis_evtsrc_t;
+
+// Tapdisk pid cache entry
+typedef struct _xsis_xspid_t {
+    uint64_t            key;            // domid << 32 | vbdid
+    uint32_t            tdpid;          // tapdisk pid
+} xsis_xspid_t;
+
+// Xenstore connection and tapdisk pid cache
+typedef struct _xsis_xs_t {
+    struct xs_handle    *xsh;           // persistent read-only connection
+    bool                watching;       // XSIS_XS_VBD3_PATH watch active
+    xsis_xspid_t        *pids;          // cached pids, sorted by key
+    uint32_t            npids;          // entries in pids
+    uint32_t            pidsz;          // allocated entries in pids
+    xsis_evtsrc_t       src;            // watch events (on the event loop)
+} xsis_xs_t;
+
+// Output formats (--format)
+enum {
+    XSIS_FMT_TABLE = 0,                 // human readable table
+    XSIS_FMT_CSV,                       // comma separated values
+    XSIS_FMT_JSONL,                     // one JSON object per line
+};
+
+// Per-tick output buffer
+typedef struct _xsis_fmt_t {
+    int                 type;           // XSIS_FMT_*
+    char                *buf;           // formatted output
+    size_t              len;            // bytes in buf
+    size_t              size;           // bytes allocated for buf
+    uint8_t             header;         // header printed (flag, CSV only)
+    uint8_t             err;            // allocation failed (flag)
+} xsis_fmt_t;
+
+// Event loop driven by a CLOCK_MONOTONIC timerfd
+typedef struct _xsis_evt_t {
+    int                 epfd;           // epoll instance
+    xsis_evtsrc_t       timer;          // interval timerfd
+    uint64_t            interval;       // tick interval (ns)
+    uint64_t            next;           // next expected expiry (ns)
+    uint64_t            ticks;          // ticks taken
+    uint64_t            missed;         // expiries missed (overruns)
+    uint64_t            jitsum;         // sum of wakeup delays (ns)
+    uint64_t            jitmax;         // longest wakeup delay (ns)
+} xsis_evt_t;
+
+// Phases of a tick timed by self-instrumentation
+enum {
+    XSIS_PH_SCAN = 0,                   // VBD discovery (vbds_refresh)
+    XSIS_PH_SNAP,                       // page snapshots (vbd_update)
+    XSIS_PH_RATES,                      // rates and rolling windows
+    XSIS_PH_OUT,                        // formatting and writing output
+    XSIS_PH_REC,                        // datafile recording
+    XSIS_NPHASES
+};
+
+// xsiostat's own cost and events
+typedef struct _xsis_self_t {
+    uint64_t            interval;       // tick interval (ns)
+    uint64_t            mark;           // end of the last phase timed (ns)
+    uint64_t            cur[XSIS_NPHASES];   // this tick, per phase (ns)
+    uint64_t            last[XSIS_NPHASES];  // last complete tick (ns)
+    uint64_t            total[XSIS_NPHASES]; // all ticks, per phase (ns)
+    uint64_t            tick;           // last complete tick (ns)
+    uint64_t            maxtick;        // longest tick (ns)
+    uint64_t            busy;           // all ticks (ns)
+    uint64_t            ticks;          // ticks completed
+    uint64_t            overruns;       // ticks longer than the interval
+    uint64_t            missed;         // timer expiries missed
+} xsis_self_t;
+
+#define XSIS_SRV_MAXCLI         64      // Concurrent scrapers (--serve)
+#define XSIS_SRV_REQSZ          1024    // Longest request head read
+#define XSIS_SRV_HDRSZ          256     // Room reserved for response header
+
+// Rendered scrape response (shared by all scrapers of a tick)
+typedef struct _xsis_srvbuf_t {
+    uint32_t            refs;           // srv and clients holding it
+    char                *mem;           // allocated buffer
+    size_t              off;            // start of response in mem
+    size_t              len;            // response length
+} xsis_srvbuf_t;
+
+// Scraper connection
+typedef struct _xsis_srvcli_t {
+    xsis_evtsrc_t       src;            // connected socket (fd -1 if free)
+    struct _xsis_srv_t  *srv;           // owning server
+    uint64_t            deadline;       // dropped if idle until (ns)
+    uint32_t            reqlen;         // bytes of request read
+    char                req[XSIS_SRV_REQSZ]; // request head
+    xsis_srvbuf_t       *buf;           // response being sent (or NULL)
+    size_t              off;            // response bytes sent
+} xsis_srvcli_t;
+
+// OpenMetrics server
+typedef struct _xsis_srv_t {
+    xsis_evtsrc_t       src;            // listening socket
+    xsis_evt_t          *evt;           // event loop serving scrapers
+    char                *path;          // socket pathname
+    xsis_srvcli_t       cli[XSIS_SRV_MAXCLI]; // scrapers
+    uint32_t            ncli;           // scrapers connected
+    struct _xsis_vbds_t *vbds;          // VBDs sampled at last tick
+    xsis_self_t         *self;          // self-instrumentation (or NULL)
+    xsis_srvbuf_t       *cur;           // response for last tick (or NULL)
+    xsis_fmt_t          fmt;            // response being rendered
+    uint8_t             qd;             // publish queue depths (flag)
+    uint8_t             drv;            // publish derived figures (flag)
+    struct _xsis_cpu_t  *cpu;           // tapdisk CPU sampler (or NULL)
+} xsis_srv_t;
+
+// Flight recorder defaults
+#define XSIS_FLR_RATE           50      // Sampling interval (ms)
+#define XSIS_FLR_PRE            10      // Seconds kept before a trigger
+#define XSIS_FLR_POST           5       // Seconds recorded after a trigger
+
+// Flight recorder conditions (bits of xsis_vbd_t.frstate)
+enum {
+    XSIS_FLR_QUEUE = 0,                 // requests in flight over threshold
+    XSIS_FLR_LOWMEM,                    // tapdisk in low memory mode
+    XSIS_FLR_STALL,                     // none completed while in flight
+    XSIS_FLR_SEEN,                      // VBD sampled before (not a cond.)
+};
+
+// Flight recorder sample (ring entry)
+typedef struct _xsis_flrs_t {
+    uint64_t            ts;             // sample time (ns since epoch)
+    xsis_dat_vbd_t      *set;           // VBDs sampled
+    xsis_dat_cnt_t      *cnt;           // their counters
+    uint32_t            nent;           // entries in set and cnt
+    uint32_t            sz;             // allocated entries in set and cnt
+} xsis_flrs_t;
+
+// Flight recorder (--flight)
+typedef struct _xsis_flr_t {
+    xsis_evtsrc_t       src;            // sampling timerfd
+    struct _xsis_vbds_t *vbds;          // VBDs sampled
+    char                *path;          // dump pathname prefix
+    uint32_t            rate;           // sampling interval (ms)
+    xsis_flrs_t         *ring;          // samples (oldest overwritten)
+    uint32_t            ringsz;         // entries in ring
+    uint32_t            head;           // next entry to fill
+    uint32_t            nring;          // entries filled
+    uint32_t            post;           // samples dumped after a trigger
+    uint32_t            left;           // samples left to dump
+    xsis_dat_t          *dat;           // dump being written (or NULL)
+    char                dumpfn[PATH_MAX]; // its pathname
+    uint32_t            ndumps;         // dumps started
+    uint64_t            queue;          // in-flight threshold (0 = off)
+    uint8_t             lowmem;         // trigger on low memory (flag)
+    uint64_t            stall;          // stall threshold (ns, 0 = off)
+    const char          *why;           // pending trigger (or NULL)
+    uint32_t            domid;          // VBD that fired it
+    uint32_t            vbdid;          // (if why is a VBD condition)
+} xsis_flr_t;
+
+#define XSIS_QD_RATE            1000    // Default depth sampling rate (Hz)
+#define XSIS_QD_EXACT           16      // Depths with a bin of their own
+#define XSIS_QD_NBINS           64      // Depth histogram bins
+
+// Queue depth figures (--qd)
+enum {
+    XSIS_QD_MEAN = 0,                   // mean requests in flight (r+w)
+    XSIS_QD_P50,                        // median requests in flight
+    XSIS_QD_P99,                        // 99th percentile
+    XSIS_QD_MAX,                        // most requests in flight
+    XSIS_QD_BUSY,                       // fraction of samples with any
+    XSIS_NQDS
+};
+
+// Per-VBD queue depth histogram (samples of the current interval)
+typedef struct _xsis_vbdqd_t {
+    uint32_t            bins[XSIS_QD_NBINS]; // samples per depth bin
+    uint32_t            n;              // samples taken
+    uint32_t            busy;           // samples with requests in flight
+    uint64_t            sum;            // sum of depths sampled
+    uint64_t            max;            // deepest sample
+    float               out[XSIS_NQDS]; // figures of the last interval
+} xsis_vbdqd_t;
+
+// Queue depth sampler (--qd)
+typedef struct _xsis_qd_t {
+    xsis_evtsrc_t       src;            // sampling timerfd
+    struct _xsis_vbds_t *vbds;          // VBDs sampled
+    uint32_t            hz;             // samples per second
+} xsis_qd_t;
+
+#define XSIS_PUB_MINVBDS        64      // Entries of a new segment
+
+// Shared memory republisher (--publish)
+typedef struct _xsis_pub_t {
+    int32_t             fd;             // segment fd
+    char                *path;          // segment pathname
+    xsiostat_pub_t      *hdr;           // segment mapping
+    size_t              len;            // bytes mapped
+    uint32_t            maxvbds;        // entries mapped
+    uint32_t            interval;       // tick interval (ms)
+    uint32_t            unit;           // throughput unit (bytes)
+} xsis_pub_t;
+
+#define XSIS_RRD_DIR            "/dev/shm/metrics" // Plugin pages (--rrdd)
+#define XSIS_RRD_SOCK           "/var/lib/xcp/xcp-rrdd" // xcp-rrdd API
+#define XSIS_RRD_REREG          60      // Seconds between registrations
+#define XSIS_RRD_TIMEOUT        2       // Seconds an API call may take
+#define XSIS_UUID_LEN           37      // VM uuid, with its terminator
+
+// VM owning the VBDs of a domain (--rrdd)
+typedef struct _xsis_rrdvm_t {
+    uint32_t            domid;          // domain id
+    uint8_t             used;           // owns VBDs still (flag)
+    char                uuid[XSIS_UUID_LEN]; // VM uuid ("" if unknown)
+} xsis_rrdvm_t;
+
+// xcp-rrdd plugin (--rrdd)
+typedef struct _xsis_rrd_t {
+    int32_t             fd;             // plugin page fd
+    char                *path;          // plugin page pathname
+    char                *uid;           // plugin uid (NULL = not registered)
+    uint8_t             registered;     // last registration worked (flag)
+    uint32_t            regticks;       // ticks between registrations
+    uint32_t            ticks;          // ticks since the last one
+    uint32_t            unit;           // throughput unit (bytes)
+    uint64_t            setver;         // VBD set the metadata describes
+    uint8_t             built;          // metadata built (flag)
+    char                *page;          // page being written
+    size_t              len;            // bytes in page
+    size_t              size;           // bytes allocated for page
+    uint32_t            nds;            // datasources in page
+    xsis_fmt_t          meta;           // metadata being built
+    xsis_rrdvm_t        *vms;           // VMs by domid, sorted
+    uint32_t            nvms;           // entries in vms
+    uint32_t            vmsz;           // allocated entries in vms
+} xsis_rrd_t;
+
+#define XSIS_CPU_PROC           "/proc" // Tapdisk processes (--cpu)
+#define XSIS_CPU_BUFSZ          4096    // Room for /proc/<pid>/status
+
+// Tapdisk figures (--cpu)
+enum {
+    XSIS_CPU_PCT = 0,                   // CPU time over the interval (%)
+    XSIS_CPU_USPIO,                     // CPU time per request (us)
+    XSIS_CPU_CSW,                       // context switches per second
+    XSIS_CPU_SYSC,                      // read/write syscalls per second
+    XSIS_NCPUS
+};
+
+// Tapdisk process sampled from /proc (--cpu)
+typedef struct _xsis_tdcpu_t {
+    uint32_t            tdpid;          // tapdisk pid
+    int32_t             statfd;         // /proc/<tdpid>/stat (or -1)
+    int32_t             statusfd;       // /proc/<tdpid>/status (or -1)
+    int32_t             iofd;           // /proc/<tdpid>/io (or -1)
+    uint8_t             used;           // serves VBDs still (flag)
+    uint64_t            ts;             // last sample (ns, 0 = none)
+    uint64_t            ticks;          // utime + stime (clock ticks)
+    uint64_t            csw;            // context switches
+    uint64_t            sysc;           // read and write syscalls
+    uint64_t            ops;            // requests of its VBDs this tick
+    float               out[XSIS_NCPUS]; // figures of the last interval
+} xsis_tdcpu_t;
+
+// Tapdisk CPU sampler (--cpu)
+typedef struct _xsis_cpu_t {
+    xsis_tdcpu_t        **tds;          // tapdisks, sorted by pid
+    uint32_t            ntds;           // entries in tds
+    uint32_t            tdsz;           // allocated entries in tds
+    xsis_tdcpu_t        **slots;        // tapdisk of each VBD slot
+    uint32_t            slotsz;         // allocated entries in slots
+    uint64_t            setver;         // VBD set slots follows
+    uint8_t             built;          // slots built (flag)
+    long                hz;             // clock ticks per second
+    char                *buf;           // /proc file being parsed
+} xsis_cpu_t;
+
+#define XSIS_ANA_NBINS          160     // Figure histogram bins (to 2^40)
+#define XSIS_ANA_SCALE          100     // Histogram steps per figure unit
+#define XSIS_ANA_CHUNKS         4       // Work chunks per thread and file
+#define XSIS_ANA_MAXTHREADS     64      // Most analysis threads
+#define XSIS_ANA_TOP            10      // Default offenders listed
+
+// Per-interval figures of the offline analysis (--analyze)
+enum {
+    XSIS_ANA_IOPS = 0,                  // requests per second (r+w)
+    XSIS_ANA_TPUT,                      // throughput (r+w, per unit)
+    XSIS_ANA_LAT,                       // average service time (us)
+    XSIS_ANA_QUEUE,                     // average queue size (r+w)
+    XSIS_NANAS
+};
+
+// Statistics of each figure (--analyze)
+enum {
+    XSIS_ANAF_MEAN = 0,                 // mean over the intervals
+    XSIS_ANAF_P50,                      // median
+    XSIS_ANAF_P99,                      // 99th percentile
+    XSIS_ANAF_MAX,                      // largest
+    XSIS_NANAFS
+};
+
+// Distributions of the figures of a VBD over a time bucket
+typedef struct _xsis_anab_t {
+    uint32_t            bins[XSIS_NANAS][XSIS_ANA_NBINS]; // intervals/bin
+    uint32_t            n[XSIS_NANAS];  // intervals counted
+    uint64_t            max[XSIS_NANAS]; // largest value (scaled)
+    double              sum[XSIS_NANAS]; // sum of the values
+    uint64_t            ns;             // time covered (ns)
+    uint64_t            lowmem;         // ... in low memory mode (ns)
+} xsis_anab_t;
+
+// Statistics of a VBD over a time bucket (or a whole recording)
+typedef struct _xsis_anafig_t {
+    float               fig[XSIS_NANAS][XSIS_NANAFS]; // XSIS_ANAF_*
+    float               lowmem;         // time in low memory mode (%)
+    uint32_t            n;              // intervals
+} xsis_anafig_t;
+
+// VBD of an analysis
+typedef struct _xsis_anavbd_t {
+    uint32_t            domid;          // domain id owning this vbd
+    uint32_t            vbdid;          // vbd id
+    xsis_anab_t         **bkts;         // time buckets (NULL if no samples)
+    uint32_t            nbkts;          // entries in bkts
+    uint32_t            tdpid;          // tapdisk pid of last (worker)
+    xsis_dat_cnt_t      last;           // counters of the last sample
+    uint64_t            ts;             // ... their time (ns since epoch)
+    uint64_t            seq;            // ... their worker sequence
+} xsis_anavbd_t;
+
+// VBDs of an analysis, sorted by (domid, vbdid)
+typedef struct _xsis_anatbl_t {
+    xsis_anavbd_t       **vbds;         // VBDs
+    uint32_t            nvbds;          // entries in vbds
+    uint32_t            vbdsz;          // allocated entries in vbds
+} xsis_anatbl_t;
+
+// Time range of one datafile analysed by one worker at a time
+typedef struct _xsis_anachk_t {
+    uint32_t            file;           // datafile index
+    uint64_t            t0;             // first sample (0 = file start)
+    uint64_t            t1;             // last interval ends at or after
+                                        // (0 = file end)
+} xsis_anachk_t;
+
+// Analysis worker
+typedef struct _xsis_anawk_t {
+    struct _xsis_ana_t  *ana;           // analysis
+    xsis_anatbl_t       tbl;            // VBDs seen
+    xsis_datrd_t        *rd;            // datafile reader (or NULL)
+    uint32_t            file;           // datafile rd reads
+    uint64_t            setoff;         // VBD set mapped
+    const xsis_dat_vbd_t *set;          // ... its entries (in rd's map)
+    xsis_anavbd_t       **map;          // VBD of each entry (NULL if
+                                        // filtered out)
+    uint32_t            mapsz;          // allocated entries in map
+    uint64_t            seq;            // samples decoded (plus chunks)
+    uint64_t            nints;          // intervals analysed
+    uint64_t            last;           // end of the last one (ns)
+} xsis_anawk_t;
+
+// Offline analysis of datafiles (--analyze)
+typedef struct _xsis_ana_t {
+    char                **files;        // datafile pathnames
+    xsis_datrd_t        **rds;          // ... readers (for planning)
+    uint32_t            nfiles;         // entries in files and rds
+    uint64_t            start;          // earliest recording start (ns
+                                        // since epoch)
+    uint32_t            unit;           // throughput unit (bytes)
+    uint64_t            from;           // range start (ns, 0 = open)
+    uint64_t            to;             // range end (ns, 0 = open)
+    uint64_t            bucket;         // bucket length (ns, 0 = one)
+    xsis_flts_t         *domids;        // domain ids (-d)
+    xsis_flts_t         *vbdids;        // vbd ids (-v)
+    xsis_anachk_t       *chks;          // work chunks
+    uint32_t            nchks;          // entries in chks
+    uint32_t            next;           // next chunk to take (atomic)
+    uint8_t             failed;         // a worker failed (flag, atomic)
+    xsis_anatbl_t       tbl;            // results, per VBD
+    uint32_t            nbkts;          // buckets of the longest VBD
+    uint32_t            nthreads;       // workers run
+    uint64_t            nints;          // intervals analysed
+    uint64_t            last;           // end of the last one (ns)
+    uint64_t            elapsed;        // analysis time (ns)
+} xsis_ana_t;
+
+// VBD being attached by a startup worker
+typedef struct _xsis_vbdatt_t {
+    uint32_t            domid;          // domain id owning this vbd
+    uint32_t            vbdid;          // vbd id
+    uint32_t            tdpid;          // tapdisk pid (0 if not found)
+    int32_t             shmfd;          // stats fd (or -1)
+    void                *shmmap;        // mapped stats page (or NULL)
+    char                sr[XSIS_SR_LEN]; // SR name (if wanted, or "")
+} xsis_vbdatt_t;
+
+// Startup attach work queue
+typedef struct _xsis_attq_t {
+    xsis_vbdatt_t       *atts;          // VBDs to attach, sorted
+    uint32_t            natts;          // entries in atts
+    uint32_t            attsz;          // allocated entries in atts
+    uint32_t            next;           // next entry to take (atomic)
+    const char          *root;          // stats root
+    uint8_t             wantsr;         // look SR names up (flag)
+} xsis_attq_t;
+
+// VBD set
+typedef struct _xsis_vbds_t {
+    LIST_HEAD(, _xsis_vbd_t) list;      // attached VBDs
+    xsis_vbd_t          **tbl;          // VBDs hashed by (domid, vbdid)
+    uint32_t            tblsz;          // slots in tbl (power of two)
+    uint32_t            nvbds;          // attached VBDs
+    xsis_snap_t         snap;           // counters of attached VBDs
+    int32_t             inofd;          // inotify fd (or -1 if unavailable)
+    int32_t             vbd3wd;         // inotify watch on root
+    const char          *root;          // stats root (XSIS_SHM_ROOT)
+    uint8_t             rescan;         // full scan required (flag)
+    uint32_t            nworkers;       // attach threads (1 = serial)
+    xsis_xs_t           *xsc;           // xenstore pid cache (or NULL)
+    uint64_t            nattached;      // VBDs attached (ever)
+    uint64_t            ndetached;      // VBDs detached (ever)
+    uint64_t            nfiltered;      // VBDs skipped by -d/-v (sightings)
+    uint64_t            nattfail;       // failed attaches (retried later)
+    uint8_t             wantsr;         // look SR names up (flag)
+    char                **srs;          // SR names seen (srs[0] unknown)
+    uint32_t            nsrs;           // entries in srs
+    uint32_t            srsz;           // allocated entries in srs
+} xsis_vbds_t;
+
+// Group-by keys (--group-by)
+enum {
+    XSIS_GRP_NONE = 0,                  // per VBD output
+    XSIS_GRP_DOM,                       // per domain
+    XSIS_GRP_TAPDISK,                   // per tapdisk process
+    XSIS_GRP_SR,                        // per storage repository
+};
+
+// Rollup of a group of VBDs
+typedef struct _xsis_grp_t {
+    uint32_t            key;            // domid, tdpid or srid
+    uint32_t            nvbds;          // VBDs in the group
+    float               rate[XSIS_NRATES]; // summed rates
+    uint64_t            infrd;          // read requests in flight
+    uint64_t            infwr;          // write requests in flight
+    uint64_t            delta[XSIS_NCTRS]; // summed counter deltas
+    double              drv[XSIS_NDRVS]; // derived figures (utilisation
+                                        // averaged over the VBDs)
+} xsis_grp_t;
+
+// Rollups of a tick
+typedef struct _xsis_grps_t {
+    int                 by;             // XSIS_GRP_*
+    uint8_t             drv;            // derive figures (flag, -x)
+    xsis_grp_t          *grps;          // groups, sorted by key
+    uint32_t            ngrps;          // entries in grps
+    uint32_t            grpsz;          // allocated entries in grps
+    uint32_t            *tbl;           // group index+1 hashed by key
+    uint32_t            tblsz;          // slots in tbl (power of two)
+} xsis_grps_t;
+
+// Library context (libxsiostat.h)
+struct _xsiostat_t {
+    xsis_vbds_t         vbds;           // attached VBDs
+    xsis_flts_t         domids;         // domain filter
+    xsis_flts_t         vbdids;         // vbd filter
+    uint8_t             scan;           // attach VBDs plugged later (flag)
+    uint32_t            unit;           // throughput unit (bytes)
+    xsiostat_snap_t     view;           // last snapshot, as published
+};
 
 // xsiostat_vbd interface
 int
-vbd_update(xsis_vbd_t *);
+vbd_update(xsis_vbd_t *, xsis_snap_t *);
+
+void
+vbds_update(xsis_vbds_t *);
+
+xsis_vbd_t *
+vbd_find(xsis_vbds_t *, uint32_t, uint32_t);
+
+int
+vbd_insert(xsis_vbd_t *, xsis_vbds_t *);
+
+void
+vbd_remove(xsis_vbd_t *, xsis_vbds_t *);
+
+void
+vbds_init(xsis_vbds_t *);
 
 int
 vbds_alloc(xsis_vbds_t *, xsis_flts_t *, xsis_flts_t *);
 
+int
+vbds_refresh(xsis_vbds_t *, xsis_flts_t *, xsis_flts_t *, uint8_t);
+
 void
 vbd_delete(xsis_vbd_t *, xsis_vbds_t *);
 
 void
 vbds_free(xsis_vbds_t *);
 
+// xsiostat_dat interface
+int
+dat_open(xsis_dat_t **, char *, uint32_t);
+
+int
+dat_write(xsis_dat_t *, xsis_vbds_t *);
+
+int
+dat_write_raw(xsis_dat_t *, uint64_t, const xsis_dat_vbd_t *,
+              const xsis_dat_cnt_t *, uint32_t);
+
+void
+dat_close(xsis_dat_t *);
+
+int
+dat_read_open(xsis_datrd_t **, char *);
+
+void
+dat_read_seek(xsis_datrd_t *, uint64_t);
+
+const xsis_dat_rec_t *
+dat_read_next(xsis_datrd_t *);
+
+const xsis_dat_vbd_t *
+dat_read_set(xsis_datrd_t *, const xsis_dat_rec_t *, uint32_t *);
+
+void
+dat_read_close(xsis_datrd_t *);
+
+// xsiostat_snap interface
+int
+snap_add(xsis_snap_t *, xsis_vbd_t *);
+
+void
+snap_del(xsis_snap_t *, xsis_vbd_t *);
+
+void
+snap_rotate(xsis_snap_t *);
+
+int
+snap_copy(const volatile tapdisk_stats *, const uint64_t *, uint64_t *,
+          uint64_t *, uint64_t *);
+
+void
+snap_read(xsis_snap_t *, uint32_t, const volatile tapdisk_stats *);
+
+int
+snap_probe(xsis_snap_t *, uint32_t, const volatile tapdisk_stats *);
+
+int
+snap_idle(xsis_snap_t *, uint32_t);
+
+void
+snap_rates(xsis_snap_t *, uint32_t);
+
+void
+snap_derive(xsis_snap_t *);
+
+void
+snap_free(xsis_snap_t *);
+
+// xsiostat_win interface
+int
+win_init(xsis_win_t *, char *, uint32_t);
+
+int
+win_update(xsis_win_t *, xsis_vbds_t *, uint64_t);
+
+void
+win_rates(xsis_win_t *, xsis_snap_t *, xsis_vbd_t *, uint32_t, uint32_t,
+          float *);
+
+void
+win_vbd_free(xsis_vbd_t *);
+
+void
+win_free(xsis_win_t *);
+
+// xsiostat_evt interface
+int
+evt_open(xsis_evt_t **, uint32_t);
+
+int
+evt_add(xsis_evt_t *, xsis_evtsrc_t *, uint32_t);
+
+int
+evt_mod(xsis_evt_t *, xsis_evtsrc_t *, uint32_t);
+
+void
+evt_del(xsis_evt_t *, xsis_evtsrc_t *);
+
+int
+evt_wait(xsis_evt_t *, const sigset_t *);
+
+void
+evt_close(xsis_evt_t *);
+
+// xsiostat_fmt interface
+int
+fmt_type(const char *);
+
+void
+fmt_init(xsis_fmt_t *, int);
+
+void
+fmt_str(xsis_fmt_t *, const char *);
+
+void
+fmt_uint(xsis_fmt_t *, uint64_t, int);
+
+void
+fmt_fixed(xsis_fmt_t *, double, int);
+
+void
+fmt_ts(xsis_fmt_t *, uint64_t);
+
+int
+fmt_flush(xsis_fmt_t *);
+
+void
+fmt_free(xsis_fmt_t *);
+
+// xsiostat_srv interface
+int
+srv_open(xsis_srv_t **, char *, xsis_evt_t *);
+
+void
+srv_tick(xsis_srv_t *, xsis_vbds_t *, xsis_self_t *);
+
+void
+srv_close(xsis_srv_t *);
+
+// xsiostat_top interface
+int
+top_init(xsis_top_t *, uint32_t, const char *, float);
+
+void
+top_select(xsis_top_t *, xsis_vbds_t *);
+
+void
+top_free(xsis_top_t *);
+
+// xsiostat_grp interface
+int
+grp_type(const char *);
+
+int
+grp_update(xsis_grps_t *, xsis_vbds_t *);
+
+const char *
+grp_name(xsis_grps_t *, xsis_vbds_t *, xsis_grp_t *);
+
+void
+grp_free(xsis_grps_t *);
+
+// xsiostat_flr interface
+int
+flr_open(xsis_flr_t **, char *, uint32_t, char *, char *, xsis_evt_t *,
+         xsis_vbds_t *);
+
+void
+flr_trigger(xsis_flr_t *, const char *);
+
+void
+flr_close(xsis_flr_t *);
+
+// xsiostat_qd interface
+int
+qd_open(xsis_qd_t **, uint32_t, xsis_evt_t *, xsis_vbds_t *);
+
+void
+qd_tick(xsis_qd_t *);
+
+uint32_t
+qd_bin(uint64_t, uint32_t);
+
+uint64_t
+qd_top(uint32_t, uint32_t);
+
+void
+qd_close(xsis_qd_t *);
+
+// xsiostat_pub interface
+int
+pub_open(xsis_pub_t **, char *, uint32_t, uint32_t);
+
+int
+pub_tick(xsis_pub_t *, xsis_snap_t *);
+
+void
+pub_close(xsis_pub_t *);
+
+// xsiostat_rrd interface
+int
+rrd_open(xsis_rrd_t **, char *, uint32_t, uint32_t);
+
+int
+rrd_tick(xsis_rrd_t *, xsis_vbds_t *);
+
+void
+rrd_close(xsis_rrd_t *);
+
+// xsiostat_cpu interface
+int
+cpu_open(xsis_cpu_t **);
+
+int
+cpu_tick(xsis_cpu_t *, xsis_vbds_t *);
+
+const float *
+cpu_slot(xsis_cpu_t *, uint32_t);
+
+void
+cpu_close(xsis_cpu_t *);
+
+// xsiostat_ana interface
+int
+ana_open(xsis_ana_t **, char *, uint32_t);
+
+int
+ana_run(xsis_ana_t *, uint64_t, uint64_t, uint64_t, uint32_t,
+        xsis_flts_t *, xsis_flts_t *);
+
+int
+ana_total(const xsis_anavbd_t *, xsis_anab_t *);
+
+void
+ana_figs(const xsis_anab_t *, xsis_anafig_t *);
+
+void
+ana_close(xsis_ana_t *);
+
+// xsiostat_self interface
+void
+self_init(xsis_self_t *, uint32_t);
+
+void
+self_start(xsis_self_t *);
+
+void
+self_mark(xsis_self_t *, int);
+
+void
+self_end(xsis_self_t *, uint64_t);
+
+// xsiostat_xs interface
+int
+xsc_open(xsis_xs_t **);
+
+int
+xsc_fd(xsis_xs_t *);
+
+int
+xsc_listen(xsis_xs_t *, struct _xsis_evt_t *);
+
+void
+xsc_update(xsis_xs_t *);
+
+uint32_t
+xsc_tdpid(xsis_xs_t *, uint32_t, uint32_t);
+
+uint32_t
+xsc_cached(xsis_xs_t *, uint32_t, uint32_t);
+
+void
+xsc_put(xsis_xs_t *, uint32_t, uint32_t, uint32_t);
+
+struct xs_handle *
+xsc_conn(void);
+
+uint32_t
+xsc_conn_tdpid(struct xs_handle *, uint32_t, uint32_t);
+
+int
+xsc_sr(struct xs_handle *, uint32_t, uint32_t, char *, size_t);
+
+int
+xsc_vm(struct xs_handle *, uint32_t, char *, size_t);
+
+void
+xsc_conn_close(struct xs_handle *);
+
+void
+xsc_close(xsis_xs_t *);
+
 // xsiostat_flt interface
+void
+flts_init(xsis_flts_t *);
+
 int
 flt_isset(xsis_flts_t *, uint32_t);
 
 int
-flt_add(xsis_flts_t *, uint32_t);
+flt_add(xsis_flts_t *, uint32_t, uint32_t);
+
+int
+flt_parse(xsis_flts_t *, char *);
 
 void
 flts_free(xsis_flts_t *);
@@ -0,0 +1,599 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_ana.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "xsiostat.h"
+
+/*
+ * Every datafile is cut into time ranges at key frames of its index, so a
+ * range decodes on its own, and worker threads take ranges off a shared
+ * queue. Each worker has its own reader (and mapping) of the datafile and
+ * its own per-VBD results, which are only merged once all are done. A
+ * range primes the counters with its first sample and analyses the
+ * intervals up to the first sample at or past its end, where the next
+ * range starts priming: every interval is counted once. Files without an
+ * index (recordings cut short) are a single range.
+ *
+ * The figures of each interval go into per-VBD, per-bucket histograms
+ * with the bins of the queue depth sampler (values in hundredths), so
+ * histograms of different workers and buckets add up and percentiles are
+ * within 25% of the truth.
+ */
+
+// Find a VBD, adding it if new (NULL if out of memory)
+static xsis_anavbd_t *
+ana_vbd(xsis_anatbl_t *tbl, uint32_t domid, uint32_t vbdid){
+    // Local variables
+    xsis_anavbd_t       *vbd;           // Temporary VBD pointer
+    xsis_anavbd_t       **tmp;          // Reallocated VBDs
+    uint32_t            lo, hi, mid;    // Search bounds
+
+    // Binary search for (domid, vbdid)
+    lo = 0;
+    hi = tbl->nvbds;
+    while (lo < hi){
+        mid = lo + (hi-lo)/2;
+        vbd = tbl->vbds[mid];
+        if (vbd->domid == domid && vbd->vbdid == vbdid)
+            return(vbd);
+        if (vbd->domid < domid || (vbd->domid == domid &&
+                                   vbd->vbdid < vbdid))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // Insert it at lo
+    if (tbl->nvbds == tbl->vbdsz){
+        if (!(tmp = realloc(tbl->vbds, (tbl->vbdsz ? tbl->vbdsz*2 : 64) *
+                                       sizeof(xsis_anavbd_t *)))){
+            perror("realloc");
+            return(NULL);
+        }
+        tbl->vbds = tmp;
+        tbl->vbdsz = tbl->vbdsz ? tbl->vbdsz*2 : 64;
+    }
+    if (!(vbd = calloc(1, sizeof(xsis_anavbd_t)))){
+        perror("calloc");
+        return(NULL);
+    }
+    vbd->domid = domid;
+    vbd->vbdid = vbdid;
+    memmove(&tbl->vbds[lo+1], &tbl->vbds[lo],
+            (tbl->nvbds - lo)*sizeof(xsis_anavbd_t *));
+    tbl->vbds[lo] = vbd;
+    tbl->nvbds++;
+    return(vbd);
+}
+
+// Make room for bucket 'b' of a VBD
+static int
+ana_grow(xsis_anavbd_t *vbd, uint32_t b){
+    // Local variables
+    xsis_anab_t         **tmp;          // Reallocated buckets
+    uint32_t            n;              // New bucket entries
+
+    for (n = vbd->nbkts ? vbd->nbkts : 4; n <= b; n *= 2);
+    if (!(tmp = realloc(vbd->bkts, n*sizeof(xsis_anab_t *)))){
+        perror("realloc");
+        return(1);
+    }
+    memset(&tmp[vbd->nbkts], 0, (n - vbd->nbkts)*sizeof(xsis_anab_t *));
+    vbd->bkts = tmp;
+    vbd->nbkts = n;
+    return(0);
+}
+
+static void
+ana_vbd_free(xsis_anavbd_t *vbd){
+    // Local variables
+    uint32_t            b;              // Bucket index
+
+    for (b = 0; b < vbd->nbkts; b++)
+        free(vbd->bkts[b]);
+    free(vbd->bkts);
+    free(vbd);
+}
+
+static void
+ana_tbl_free(xsis_anatbl_t *tbl){
+    // Local variables
+    uint32_t            i;              // VBD index
+
+    for (i = 0; i < tbl->nvbds; i++)
+        ana_vbd_free(tbl->vbds[i]);
+    free(tbl->vbds);
+    memset(tbl, 0, sizeof(*tbl));
+}
+
+// Count a value of figure 'f'
+static inline void
+ana_hist(xsis_anab_t *bkt, int f, double val){
+    // Local variables
+    uint64_t            v;              // Value in hundredths
+
+    v = (uint64_t)(val*XSIS_ANA_SCALE + 0.5);
+    bkt->bins[f][qd_bin(v, XSIS_ANA_NBINS)]++;
+    bkt->n[f]++;
+    bkt->sum[f] += val;
+    if (v > bkt->max[f])
+        bkt->max[f] = v;
+}
+
+// Analyse the interval of a VBD between its last sample and 'cnt'
+static int
+ana_interval(xsis_anawk_t *wk, xsis_anavbd_t *vbd, const xsis_dat_cnt_t *cnt,
+             uint64_t ts){
+    // Local variables
+    xsis_ana_t          *ana = wk->ana; // Analysis
+    const xsis_dat_cnt_t *last = &vbd->last; // Counters at the start
+    xsis_anab_t         *bkt;           // Bucket of the interval
+    double              dt;             // Interval (ns)
+    uint64_t            ops;            // Requests submitted
+    uint64_t            tu;             // Ticks in service (usecs)
+    int64_t             cp;             // Requests completed
+    uint32_t            b;              // Bucket index
+
+    // Counters going back belong to a new tapdisk: nothing to measure
+    if (ts <= vbd->ts || cnt->rop < last->rop || cnt->wop < last->wop ||
+        cnt->rsc < last->rsc || cnt->wsc < last->wsc ||
+        cnt->rtu < last->rtu || cnt->wtu < last->wtu)
+        return(0);
+
+    // Intervals go to the bucket they end in
+    b = 0;
+    if (ana->bucket && ts > ana->from)
+        b = (ts - 1 - ana->from)/ana->bucket;
+    if (b >= vbd->nbkts && ana_grow(vbd, b))
+        return(1);
+    if (!(bkt = vbd->bkts[b]) &&
+        !(bkt = vbd->bkts[b] = calloc(1, sizeof(xsis_anab_t)))){
+        perror("calloc");
+        return(1);
+    }
+
+    dt = ts - vbd->ts;
+    ops = (cnt->rop - last->rop) + (cnt->wop - last->wop);
+    tu = (cnt->rtu - last->rtu) + (cnt->wtu - last->wtu);
+    cp = (int64_t)ops - ((int64_t)cnt->infrd - last->infrd) -
+         ((int64_t)cnt->infwr - last->infwr);
+
+    ana_hist(bkt, XSIS_ANA_IOPS, ops*1e9/dt);
+    ana_hist(bkt, XSIS_ANA_TPUT, ((cnt->rsc - last->rsc) +
+                                  (cnt->wsc - last->wsc)) *
+                                 (double)wk->rd->hdr->sector_sz *
+                                 1e9/dt/ana->unit);
+    if (cp > 0)
+        ana_hist(bkt, XSIS_ANA_LAT, (double)tu/cp);
+    ana_hist(bkt, XSIS_ANA_QUEUE, tu*1e3/dt);
+    bkt->ns += dt;
+    if (cnt->flags & BT3_LOW_MEMORY_MODE)
+        bkt->lowmem += dt;
+    wk->nints++;
+    if (ts > wk->last)
+        wk->last = ts;
+    return(0);
+}
+
+// Map the VBD set of a sample to the worker's VBDs
+static int
+ana_map(xsis_anawk_t *wk, const xsis_dat_rec_t *rec){
+    // Local variables
+    xsis_ana_t          *ana = wk->ana; // Analysis
+    const xsis_dat_vbd_t *set;          // VBD set of the sample
+    xsis_anavbd_t       **tmp;          // Reallocated map
+    uint32_t            nent;           // Entries in set
+    uint32_t            i;              // Set index
+
+    if (!(set = dat_read_set(wk->rd, rec, &nent))){
+        fprintf(stderr, "Datafile '%s' is corrupt.\n", ana->files[wk->file]);
+        return(1);
+    }
+    if (nent > wk->mapsz){
+        if (!(tmp = realloc(wk->map, nent*sizeof(xsis_anavbd_t *)))){
+            perror("realloc");
+            return(1);
+        }
+        wk->map = tmp;
+        wk->mapsz = nent;
+    }
+    for (i = 0; i < nent; i++){
+        wk->map[i] = NULL;
+        if (ana->domids->nflts && !flt_isset(ana->domids, set[i].domid))
+            continue;
+        if (ana->vbdids->nflts && !flt_isset(ana->vbdids, set[i].vbdid))
+            continue;
+        if (!(wk->map[i] = ana_vbd(&wk->tbl, set[i].domid, set[i].vbdid)))
+            return(1);
+    }
+    wk->set = set;
+    wk->setoff = rec->setoff;
+    return(0);
+}
+
+// Analyse one time range of a datafile
+static int
+ana_chunk(xsis_anawk_t *wk, const xsis_anachk_t *chk){
+    // Local variables
+    xsis_ana_t          *ana = wk->ana; // Analysis
+    const xsis_dat_rec_t *rec;          // Current sample record
+    const xsis_dat_cnt_t *cnt;          // Counters of current sample
+    xsis_anavbd_t       *vbd;           // VBD of a set entry
+    uint32_t            i;              // Set index
+
+    if (!wk->rd || wk->file != chk->file){
+        dat_read_close(wk->rd);
+        wk->rd = NULL;
+        if (dat_read_open(&wk->rd, ana->files[chk->file]))
+            return(1);
+        wk->file = chk->file;
+    }
+    dat_read_seek(wk->rd, chk->t0);
+    wk->setoff = 0;
+
+    // Samples of the previous range do not start intervals
+    wk->seq++;
+    while ((rec = dat_read_next(wk->rd))){
+        if (ana->to && rec->ts > ana->to)
+            break;
+        if (rec->setoff != wk->setoff && ana_map(wk, rec))
+            return(1);
+        wk->seq++;
+        cnt = (const xsis_dat_cnt_t *)(rec+1);
+        for (i = 0; i < rec->nent; i++){
+            if (!(vbd = wk->map[i]))
+                continue;
+            if (vbd->seq == wk->seq - 1 && vbd->tdpid == wk->set[i].tdpid &&
+                ana_interval(wk, vbd, &cnt[i], rec->ts))
+                return(1);
+            vbd->last = cnt[i];
+            vbd->tdpid = wk->set[i].tdpid;
+            vbd->ts = rec->ts;
+            vbd->seq = wk->seq;
+        }
+        if (chk->t1 && rec->ts >= chk->t1)
+            break;
+    }
+    return(0);
+}
+
+static void *
+ana_worker(void *arg){
+    // Local variables
+    xsis_anawk_t        *wk = arg;      // Worker
+    xsis_ana_t          *ana = wk->ana; // Analysis
+    uint32_t            i;              // Chunk index
+
+    // The other workers stop at their next chunk once one failed
+    while (!__atomic_load_n(&ana->failed, __ATOMIC_RELAXED) &&
+           (i = __sync_fetch_and_add(&ana->next, 1)) < ana->nchks)
+        if (ana_chunk(wk, &ana->chks[i]))
+            __atomic_store_n(&ana->failed, 1, __ATOMIC_RELAXED);
+    dat_read_close(wk->rd);
+    wk->rd = NULL;
+    return(NULL);
+}
+
+// Add the histograms of 'src' to 'dst'
+static void
+ana_merge(xsis_anab_t *dst, const xsis_anab_t *src){
+    // Local variables
+    uint32_t            b;              // Bin index
+    int                 f;              // Figure index
+
+    for (f = 0; f < XSIS_NANAS; f++){
+        for (b = 0; b < XSIS_ANA_NBINS; b++)
+            dst->bins[f][b] += src->bins[f][b];
+        dst->n[f] += src->n[f];
+        dst->sum[f] += src->sum[f];
+        if (src->max[f] > dst->max[f])
+            dst->max[f] = src->max[f];
+    }
+    dst->ns += src->ns;
+    dst->lowmem += src->lowmem;
+}
+
+// Move the results of a worker into the analysis
+static int
+ana_gather(xsis_ana_t *ana, xsis_anatbl_t *tbl){
+    // Local variables
+    xsis_anavbd_t       *src;           // VBD of the worker
+    xsis_anavbd_t       *dst;           // Same VBD in the results
+    uint32_t            i;              // VBD index
+    uint32_t            b;              // Bucket index
+
+    for (i = 0; i < tbl->nvbds; i++){
+        src = tbl->vbds[i];
+        if (!(dst = ana_vbd(&ana->tbl, src->domid, src->vbdid)))
+            return(1);
+        for (b = 0; b < src->nbkts; b++){
+            if (!src->bkts[b])
+                continue;
+            if (b >= dst->nbkts && ana_grow(dst, b))
+                return(1);
+            if (dst->bkts[b]){
+                ana_merge(dst->bkts[b], src->bkts[b]);
+                continue;
+            }
+            dst->bkts[b] = src->bkts[b];
+            src->bkts[b] = NULL;
+            if (b >= ana->nbkts)
+                ana->nbkts = b + 1;
+        }
+    }
+    return(0);
+}
+
+// Cut the datafiles into work chunks
+static int
+ana_plan(xsis_ana_t *ana, uint32_t nthreads){
+    // Local variables
+    const xsis_datrd_t  *rd;            // Reader of a datafile
+    xsis_anachk_t       *chk;           // Chunk being set up
+    uint32_t            lo, hi;         // Key frames within the range
+    uint32_t            n;              // Chunks of the datafile
+    uint32_t            f;              // Datafile index
+    uint32_t            c;              // Chunk index
+
+    if (!(ana->chks = calloc((size_t)ana->nfiles *
+                             nthreads*XSIS_ANA_CHUNKS,
+                             sizeof(xsis_anachk_t)))){
+        perror("calloc");
+        return(1);
+    }
+    for (f = 0; f < ana->nfiles; f++){
+        rd = ana->rds[f];
+        lo = hi = 0;
+        if (rd->idx){
+            for (lo = 0; lo < rd->nidx && rd->idx[lo].ts <= ana->from;
+                 lo++);
+            for (hi = lo; hi < rd->nidx &&
+                          (!ana->to || rd->idx[hi].ts < ana->to); hi++);
+        }
+
+        // Ranges of about the same number of key frames
+        n = hi - lo + 1;
+        if (n > nthreads*XSIS_ANA_CHUNKS)
+            n = nthreads*XSIS_ANA_CHUNKS;
+        for (c = 0; c < n; c++){
+            chk = &ana->chks[ana->nchks++];
+            chk->file = f;
+            chk->t0 = c ? rd->idx[lo + c*(hi-lo)/n].ts : ana->from;
+            chk->t1 = (c+1 < n) ? rd->idx[lo + (c+1)*(hi-lo)/n].ts : 0;
+        }
+    }
+    return(0);
+}
+
+int
+ana_open(xsis_ana_t **ana, char *files, uint32_t unit){
+    // Local variables
+    char                *list = NULL;   // Copy of files
+    char                *name;          // Datafile pathname
+    char                *save;          // strtok_r() state
+    void                *tmp;           // Reallocated arrays
+    int                 err = 0;        // Return code
+
+    // Allocate analysis context
+    if (!(*ana = calloc(1, sizeof(xsis_ana_t)))){
+        perror("calloc");
+        goto err;
+    }
+    (*ana)->unit = unit;
+
+    // Open every datafile of the list
+    if (!(list = strdup(files))){
+        perror("strdup");
+        goto err;
+    }
+    for (name = strtok_r(list, ",", &save); name;
+         name = strtok_r(NULL, ",", &save)){
+        if (!(tmp = realloc((*ana)->files, ((*ana)->nfiles+1) *
+                                           sizeof(char *)))){
+            perror("realloc");
+            goto err;
+        }
+        (*ana)->files = tmp;
+        if (!(tmp = realloc((*ana)->rds, ((*ana)->nfiles+1) *
+                                         sizeof(xsis_datrd_t *)))){
+            perror("realloc");
+            goto err;
+        }
+        (*ana)->rds = tmp;
+        if (!((*ana)->files[(*ana)->nfiles] = strdup(name))){
+            perror("strdup");
+            goto err;
+        }
+        if (dat_read_open(&(*ana)->rds[(*ana)->nfiles], name)){
+            fprintf(stderr, "Error opening datafile '%s'.\n", name);
+            free((*ana)->files[(*ana)->nfiles]);
+            goto err;
+        }
+        if (!(*ana)->nfiles ||
+            (*ana)->rds[(*ana)->nfiles]->hdr->start < (*ana)->start)
+            (*ana)->start = (*ana)->rds[(*ana)->nfiles]->hdr->start;
+        (*ana)->nfiles++;
+    }
+    if (!(*ana)->nfiles){
+        fprintf(stderr, "No datafile to analyse.\n");
+        goto err;
+    }
+
+out:
+    // Return
+    free(list);
+    return(err);
+
+err:
+    ana_close(*ana);
+    *ana = NULL;
+    err = 1;
+    goto out;
+}
+
+int
+ana_run(xsis_ana_t *ana, uint64_t from, uint64_t to, uint64_t bucket,
+        uint32_t nthreads, xsis_flts_t *domids, xsis_flts_t *vbdids){
+    // Local variables
+    pthread_t           tids[XSIS_ANA_MAXTHREADS]; // Worker threads
+    xsis_anawk_t        *wks = NULL;    // Workers
+    struct timespec     t0, t1;         // Start/end of the analysis
+    uint32_t            nt;             // Worker threads started
+    uint32_t            i;              // Worker index
+    int                 err = 0;        // Return code
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ana->from = from ? from : ana->start;
+    ana->to = to;
+    ana->bucket = bucket;
+    ana->domids = domids;
+    ana->vbdids = vbdids;
+    if (nthreads > XSIS_ANA_MAXTHREADS)
+        nthreads = XSIS_ANA_MAXTHREADS;
+    if (!nthreads)
+        nthreads = 1;
+    if (ana_plan(ana, nthreads))
+        goto err;
+    if (nthreads > ana->nchks)
+        nthreads = ana->nchks;
+
+    // Run the workers, the main thread being the first of them
+    if (!(wks = calloc(nthreads, sizeof(xsis_anawk_t)))){
+        perror("calloc");
+        goto err;
+    }
+    for (i = 0; i < nthreads; i++)
+        wks[i].ana = ana;
+    ana->next = 0;
+    for (nt = 1; nt < nthreads; nt++)
+        if (pthread_create(&tids[nt], NULL, ana_worker, &wks[nt]))
+            break;
+    (void)ana_worker(&wks[0]);
+    for (i = 1; i < nt; i++)
+        (void)pthread_join(tids[i], NULL);
+    ana->nthreads = nt;
+    if (__atomic_load_n(&ana->failed, __ATOMIC_RELAXED))
+        goto err;
+
+    // Merge their results
+    for (i = 0; i < nt; i++){
+        if (ana_gather(ana, &wks[i].tbl))
+            goto err;
+        ana->nints += wks[i].nints;
+        if (wks[i].last > ana->last)
+            ana->last = wks[i].last;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ana->elapsed = (t1.tv_sec - t0.tv_sec)*1000000000ULL +
+                   t1.tv_nsec - t0.tv_nsec;
+
+out:
+    // Release worker resources
+    if (wks){
+        for (i = 0; i < nthreads; i++){
+            ana_tbl_free(&wks[i].tbl);
+            free(wks[i].map);
+        }
+        free(wks);
+    }
+    return(err);
+
+err:
+    err = 1;
+    goto out;
+}
+
+int
+ana_total(const xsis_anavbd_t *vbd, xsis_anab_t *tot){
+    // Local variables
+    uint32_t            b;              // Bucket index
+
+    // Add all buckets of a VBD up; returns 0 if it has none
+    memset(tot, 0, sizeof(*tot));
+    for (b = 0; b < vbd->nbkts; b++)
+        if (vbd->bkts[b])
+            ana_merge(tot, vbd->bkts[b]);
+    return(tot->n[XSIS_ANA_IOPS] != 0);
+}
+
+// Smallest value at least 'rank' intervals are at or under
+static float
+ana_rank(const xsis_anab_t *bkt, int f, uint32_t rank){
+    // Local variables
+    uint64_t            top;            // Largest value of the bin
+    uint32_t            sum = 0;        // Intervals in bins so far
+    uint32_t            b;              // Bin
+
+    for (b = 0; b < XSIS_ANA_NBINS-1; b++)
+        if ((sum += bkt->bins[f][b]) >= rank)
+            break;
+    top = qd_top(b, XSIS_ANA_NBINS);
+    if (top > bkt->max[f])
+        top = bkt->max[f];
+    return((float)top/XSIS_ANA_SCALE);
+}
+
+void
+ana_figs(const xsis_anab_t *bkt, xsis_anafig_t *out){
+    // Local variables
+    uint32_t            n;              // Intervals of a figure
+    int                 f;              // Figure index
+
+    memset(out, 0, sizeof(*out));
+    out->n = bkt->n[XSIS_ANA_IOPS];
+    if (bkt->ns)
+        out->lowmem = (float)bkt->lowmem*100/bkt->ns;
+    for (f = 0; f < XSIS_NANAS; f++){
+        if (!(n = bkt->n[f]))
+            continue;
+        out->fig[f][XSIS_ANAF_MEAN] = bkt->sum[f]/n;
+        out->fig[f][XSIS_ANAF_P50] = ana_rank(bkt, f, (n + 1)/2);
+        out->fig[f][XSIS_ANAF_P99] = ana_rank(bkt, f, n - n/100);
+        out->fig[f][XSIS_ANAF_MAX] = (float)bkt->max[f]/XSIS_ANA_SCALE;
+    }
+}
+
+void
+ana_close(xsis_ana_t *ana){
+    // Local variables
+    uint32_t            f;              // Datafile index
+
+    // Release analysis resources
+    if (ana){
+        for (f = 0; f < ana->nfiles; f++){
+            dat_read_close(ana->rds[f]);
+            free(ana->files[f]);
+        }
+        free(ana->files);
+        free(ana->rds);
+        free(ana->chks);
+        ana_tbl_free(&ana->tbl);
+        free(ana);
+    }
+}
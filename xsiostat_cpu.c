@@ -0,0 +1,352 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_cpu.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/queue.h>
+#include "xsiostat.h"
+
+/*
+ * Many VBDs are usually served by one tapdisk, so its /proc files are read
+ * once per tick whatever the number of its VBDs, and the requests of all
+ * of them are summed to get its CPU time per request. Files are opened
+ * when a tapdisk is first seen and read with pread() from then on; the
+ * tapdisks and the slot to tapdisk map are only rebuilt when the VBD set
+ * changes (slots only move then).
+ *
+ * CPU time (utime + stime) comes from stat, context switches from status
+ * and read/write syscalls from io. Tapdisk is single threaded, so the
+ * context switches of its main thread (status) are those of the process.
+ * A tapdisk whose files cannot be opened or read (it went, or io is not
+ * readable without privileges) reports 0 for the figures concerned.
+ */
+
+// Sampling time (ns)
+static uint64_t
+cpu_now(void){
+    // Local variables
+    struct timespec     ts;             // Current time
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec);
+}
+
+// Open /proc/<pid>/<name> (or return -1)
+static int32_t
+cpu_openf(uint32_t pid, const char *name){
+    // Local variables
+    char                path[64];       // File pathname
+
+    (void)snprintf(path, sizeof(path), "%s/%u/%s", XSIS_CPU_PROC, pid, name);
+    return(open(path, O_RDONLY | O_CLOEXEC));
+}
+
+static void
+cpu_closef(int32_t *fd){
+    if (*fd >= 0)
+        (void)close(*fd);
+    *fd = -1;
+}
+
+// Read a /proc file from the start into buf (NUL terminated)
+static int
+cpu_read(xsis_cpu_t *cpu, int32_t fd){
+    // Local variables
+    ssize_t             n;              // Bytes read
+
+    if (fd < 0 || (n = pread(fd, cpu->buf, XSIS_CPU_BUFSZ-1, 0)) <= 0)
+        return(1);
+    cpu->buf[n] = '\0';
+    return(0);
+}
+
+// Value following a field name (e.g. "syscr:") in buf
+static uint64_t
+cpu_field(const char *buf, const char *name){
+    // Local variables
+    const char          *p;             // Field found
+
+    if (!(p = strstr(buf, name)))
+        return(0);
+    return(strtoull(p + strlen(name), NULL, 10));
+}
+
+// CPU time of the process (utime + stime, fields 14 and 15 of stat)
+static int
+cpu_ticks(const char *buf, uint64_t *ticks){
+    // Local variables
+    const char          *p;             // Parse position
+    char                *end;           // Past utime
+    int                 i;              // Field index
+
+    // The command may hold spaces and brackets; fields follow the last ')'
+    if (!(p = strrchr(buf, ')')))
+        return(1);
+    for (i = 3; i < 14; i++)
+        if (!(p = strchr(p + 1, ' ')))
+            return(1);
+    *ticks = strtoull(p, &end, 10);
+    *ticks += strtoull(end, NULL, 10);
+    return(0);
+}
+
+static void
+cpu_release(xsis_tdcpu_t *td){
+    cpu_closef(&td->statfd);
+    cpu_closef(&td->statusfd);
+    cpu_closef(&td->iofd);
+    free(td);
+}
+
+// Find a tapdisk (or where it goes in the sorted array)
+static uint32_t
+cpu_find(xsis_cpu_t *cpu, uint32_t tdpid){
+    // Local variables
+    uint32_t            lo = 0;         // First candidate
+    uint32_t            hi;             // Past the last candidate
+    uint32_t            mid;            // Candidate
+
+    hi = cpu->ntds;
+    while (lo < hi){
+        mid = lo + (hi - lo)/2;
+        if (cpu->tds[mid]->tdpid < tdpid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return(lo);
+}
+
+// Tapdisk of a VBD, opening its files if it is new
+static xsis_tdcpu_t *
+cpu_get(xsis_cpu_t *cpu, uint32_t tdpid){
+    // Local variables
+    xsis_tdcpu_t        *td;            // Tapdisk
+    xsis_tdcpu_t        **tmp;          // Reallocated tapdisks
+    uint32_t            i;              // Tapdisk index
+
+    i = cpu_find(cpu, tdpid);
+    if (i < cpu->ntds && cpu->tds[i]->tdpid == tdpid)
+        return(cpu->tds[i]);
+
+    if (cpu->ntds == cpu->tdsz){
+        if (!(tmp = realloc(cpu->tds, (cpu->tdsz ? cpu->tdsz*2 : 16) *
+                                      sizeof(xsis_tdcpu_t *)))){
+            perror("realloc");
+            return(NULL);
+        }
+        cpu->tds = tmp;
+        cpu->tdsz = cpu->tdsz ? cpu->tdsz*2 : 16;
+    }
+    if (!(td = calloc(1, sizeof(xsis_tdcpu_t)))){
+        perror("calloc");
+        return(NULL);
+    }
+    td->tdpid = tdpid;
+    td->statfd = cpu_openf(tdpid, "stat");
+    td->statusfd = cpu_openf(tdpid, "status");
+    td->iofd = cpu_openf(tdpid, "io");
+    memmove(&cpu->tds[i+1], &cpu->tds[i],
+            (cpu->ntds - i)*sizeof(xsis_tdcpu_t *));
+    cpu->tds[i] = td;
+    cpu->ntds++;
+    return(td);
+}
+
+// Map every slot to its tapdisk, dropping tapdisks left without VBDs
+static int
+cpu_build(xsis_cpu_t *cpu, xsis_snap_t *snap){
+    // Local variables
+    xsis_tdcpu_t        **tmp;          // Reallocated slot map
+    uint32_t            s;              // Slot index
+    uint32_t            i, j;           // Tapdisk indices
+
+    if (snap->nslots > cpu->slotsz){
+        if (!(tmp = realloc(cpu->slots, snap->slotsz *
+                                        sizeof(xsis_tdcpu_t *)))){
+            perror("realloc");
+            return(1);
+        }
+        cpu->slots = tmp;
+        cpu->slotsz = snap->slotsz;
+    }
+    for (i = 0; i < cpu->ntds; i++)
+        cpu->tds[i]->used = 0;
+    for (s = 0; s < snap->nslots; s++){
+        cpu->slots[s] = NULL;
+        if (!snap->vbds[s]->tdpid)
+            continue;
+        if (!(cpu->slots[s] = cpu_get(cpu, snap->vbds[s]->tdpid)))
+            return(1);
+        cpu->slots[s]->used = 1;
+    }
+    for (i = j = 0; i < cpu->ntds; i++){
+        if (cpu->tds[i]->used)
+            cpu->tds[j++] = cpu->tds[i];
+        else
+            cpu_release(cpu->tds[i]);
+    }
+    cpu->ntds = j;
+    return(0);
+}
+
+// Sample a tapdisk and work its figures out over the interval
+static void
+cpu_sample(xsis_cpu_t *cpu, xsis_tdcpu_t *td, uint64_t now){
+    // Local variables
+    uint64_t            ticks;          // utime + stime
+    uint64_t            csw = 0;        // Context switches
+    uint64_t            sysc = 0;       // read and write syscalls
+    double              dt;             // Seconds since the last sample
+    double              us;             // CPU time over the interval (us)
+
+    // Without stat there is nothing to report (e.g. the process went)
+    errno = 0;
+    if (cpu_read(cpu, td->statfd) || cpu_ticks(cpu->buf, &ticks)){
+        if (td->statfd >= 0 && errno == ESRCH){
+            cpu_closef(&td->statfd);
+            cpu_closef(&td->statusfd);
+            cpu_closef(&td->iofd);
+        }
+        memset(td->out, 0, sizeof(td->out));
+        td->ts = 0;
+        return;
+    }
+    if (!cpu_read(cpu, td->statusfd))
+        csw = cpu_field(cpu->buf, "voluntary_ctxt_switches:") +
+              cpu_field(cpu->buf, "nonvoluntary_ctxt_switches:");
+    if (!cpu_read(cpu, td->iofd))
+        sysc = cpu_field(cpu->buf, "syscr:") +
+               cpu_field(cpu->buf, "syscw:");
+
+    // Figures need two samples
+    if (td->ts && now > td->ts){
+        dt = (now - td->ts)/1e9;
+        us = (double)(ticks - td->ticks)*1e6/cpu->hz;
+        td->out[XSIS_CPU_PCT] = us/1e4/dt;
+        td->out[XSIS_CPU_USPIO] = td->ops ? us/td->ops : 0;
+        td->out[XSIS_CPU_CSW] = (csw - td->csw)/dt;
+        td->out[XSIS_CPU_SYSC] = (sysc - td->sysc)/dt;
+    }
+    td->ts = now;
+    td->ticks = ticks;
+    td->csw = csw;
+    td->sysc = sysc;
+}
+
+int
+cpu_open(xsis_cpu_t **cpu){
+    // Local variables
+    int                 err = 0;        // Return code
+
+    // Allocate sampler context
+    if (!(*cpu = calloc(1, sizeof(xsis_cpu_t)))){
+        perror("calloc");
+        goto err;
+    }
+    if (((*cpu)->hz = sysconf(_SC_CLK_TCK)) <= 0){
+        perror("sysconf");
+        goto err;
+    }
+    if (!((*cpu)->buf = malloc(XSIS_CPU_BUFSZ))){
+        perror("malloc");
+        goto err;
+    }
+
+out:
+    // Return
+    return(err);
+
+err:
+    cpu_close(*cpu);
+    *cpu = NULL;
+    err = 1;
+    goto out;
+}
+
+int
+cpu_tick(xsis_cpu_t *cpu, xsis_vbds_t *vbds){
+    // Local variables
+    xsis_snap_t         *snap;          // Snapshot of all VBDs
+    uint64_t            setver;         // Current VBD set
+    uint64_t            now;            // Sampling time (ns)
+    uint32_t            s;              // Slot index
+    uint32_t            i;              // Tapdisk index
+
+    // Only a change of VBD set moves slots (or brings new tapdisks)
+    snap = &vbds->snap;
+    setver = vbds->nattached + vbds->ndetached;
+    if (!cpu->built || setver != cpu->setver){
+        if (cpu_build(cpu, snap))
+            return(1);
+        cpu->setver = setver;
+        cpu->built = 1;
+    }
+
+    // Requests of all the VBDs of each tapdisk (slots with two samples)
+    for (i = 0; i < cpu->ntds; i++)
+        cpu->tds[i]->ops = 0;
+    for (s = 0; s < snap->nslots; s++)
+        if (cpu->slots[s] && snap->idt[s] > 0)
+            cpu->slots[s]->ops += snap->cur[XSIS_CTR_ROP][s] -
+                                  snap->prev[XSIS_CTR_ROP][s] +
+                                  snap->cur[XSIS_CTR_WOP][s] -
+                                  snap->prev[XSIS_CTR_WOP][s];
+
+    // Read each tapdisk once
+    now = cpu_now();
+    for (i = 0; i < cpu->ntds; i++)
+        cpu_sample(cpu, cpu->tds[i], now);
+    return(0);
+}
+
+const float *
+cpu_slot(xsis_cpu_t *cpu, uint32_t slot){
+    // Local variables
+    static const float  none[XSIS_NCPUS]; // Figures of VBDs without one
+
+    if (!cpu->built || slot >= cpu->slotsz || !cpu->slots[slot])
+        return(none);
+    return(cpu->slots[slot]->out);
+}
+
+void
+cpu_close(xsis_cpu_t *cpu){
+    // Local variables
+    uint32_t            i;              // Tapdisk index
+
+    // Release sampler resources
+    if (cpu){
+        for (i = 0; i < cpu->ntds; i++)
+            cpu_release(cpu->tds[i]);
+        free(cpu->tds);
+        free(cpu->slots);
+        free(cpu->buf);
+        free(cpu);
+    }
+}
@@ -0,0 +1,787 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_dat.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#include "xsiostat.h"
+
+/*
+ * Datafile layout:
+ *
+ *   xsis_dat_hdr_t
+ *   { xsis_dat_rec_t (SET)   + nent * xsis_dat_vbd_t }  when the set changes
+ *   { xsis_dat_rec_t (TICK)  + nent * xsis_dat_cnt_t }  key frame
+ *   { xsis_dat_rec_t (DTICK) + size bytes }             other ticks
+ *   ...
+ *
+ *   xsis_dat_rec_t (IDX) + nent * xsis_dat_idx_t       on clean close
+ *   xsis_dat_rec_t (END)                                on clean close
+ *
+ * Every sample record carries the offset of the SET record describing its
+ * entries. A TICK record (key frame) holds raw counters and is written
+ * whenever the set changes and at least every XSIS_DAT_KEY_STRIDE ticks;
+ * the DTICK records after it only hold changes, so decoding starts at a
+ * key frame. A DTICK payload is a bitmap with a bit per entry, followed
+ * by XSIS_DAT_NVALS zig-zag varints for each entry whose bit is set: the
+ * delta-of-delta of the six monotonic counters, then the delta of the
+ * in-flight counts and flags. An entry whose values are all zero (idle,
+ * or moving exactly as fast as last tick) costs a single bit.
+ *
+ * The index holds one entry per key frame and is located through the END
+ * record. Files without a trailer (e.g. after a crash) are searched by
+ * bisection, resynchronising on record headers.
+ */
+
+#define XSIS_DAT_MAXVAR         10      // Longest varint (bytes)
+
+static uint64_t
+dat_now(void){
+    // Local variables
+    struct timespec     ts;             // Current time
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return((uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec);
+}
+
+static int
+dat_flush(xsis_dat_t *dat, size_t len){
+    // Local variables
+    size_t              done = 0;       // Bytes written so far
+    ssize_t             ret;            // write() return
+
+    // Write the whole buffer, retrying on short writes
+    while (done < len){
+        ret = write(dat->fd, dat->buf + done, len - done);
+        if (ret < 0){
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            return(1);
+        }
+        done += ret;
+    }
+    dat->off += len;
+
+    // Return
+    return(0);
+}
+
+static int
+dat_reserve(xsis_dat_t *dat, size_t len){
+    // Local variables
+    char                *buf;           // Reallocated buffer
+
+    // Grow record buffer if required
+    if (len <= dat->bufsz)
+        return(0);
+    if (!(buf = realloc(dat->buf, len))){
+        perror("realloc");
+        return(1);
+    }
+    dat->buf = buf;
+    dat->bufsz = len;
+
+    // Return
+    return(0);
+}
+
+int
+dat_open(xsis_dat_t **dat, char *datafn, uint32_t interval){
+    // Local variables
+    xsis_dat_hdr_t      *hdr;           // Datafile header
+    int                 err = 0;        // Return code
+
+    // Allocate writer context
+    if (!(*dat = calloc(1, sizeof(xsis_dat_t)))){
+        perror("calloc");
+        goto err;
+    }
+    (*dat)->fd = -1;
+
+    // Open datafile
+    if (((*dat)->fd = open(datafn, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0){
+        perror("open");
+        goto err;
+    }
+
+    // Write header
+    if (dat_reserve(*dat, sizeof(xsis_dat_hdr_t)))
+        goto err;
+    hdr = (xsis_dat_hdr_t *)(*dat)->buf;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = XSIS_DAT_MAGIC;
+    hdr->version = XSIS_DAT_VERSION;
+    hdr->sector_sz = XSIS_SECTOR_SZ;
+    hdr->interval = interval;
+    hdr->start = dat_now();
+    if (dat_flush(*dat, sizeof(xsis_dat_hdr_t)))
+        goto err;
+
+out:
+    // Return
+    return(err);
+
+err:
+    dat_close(*dat);
+    *dat = NULL;
+    err = 1;
+    goto out;
+}
+
+// Raw counters of a VBD
+static void
+dat_cnt(xsis_snap_t *snap, uint32_t s, xsis_dat_cnt_t *cnt){
+    cnt->rop = snap->cur[XSIS_CTR_ROP][s];
+    cnt->rsc = snap->cur[XSIS_CTR_RSC][s];
+    cnt->wop = snap->cur[XSIS_CTR_WOP][s];
+    cnt->wsc = snap->cur[XSIS_CTR_WSC][s];
+    cnt->rtu = snap->cur[XSIS_CTR_RTU][s];
+    cnt->wtu = snap->cur[XSIS_CTR_WTU][s];
+    cnt->infrd = snap->cur[XSIS_CTR_ROP][s] - snap->cur[XSIS_CTR_RCP][s];
+    cnt->infwr = snap->cur[XSIS_CTR_WOP][s] - snap->cur[XSIS_CTR_WCP][s];
+    cnt->flags = (uint32_t)snap->flags[s];
+    cnt->reserved = 0;
+}
+
+// Sample entry to and from XSIS_DAT_NVALS values (monotonic ones first)
+static void
+dat_vals(const xsis_dat_cnt_t *cnt, uint64_t *v){
+    v[0] = cnt->rop;
+    v[1] = cnt->rsc;
+    v[2] = cnt->wop;
+    v[3] = cnt->wsc;
+    v[4] = cnt->rtu;
+    v[5] = cnt->wtu;
+    v[6] = cnt->infrd;
+    v[7] = cnt->infwr;
+    v[8] = cnt->flags;
+}
+
+static void
+dat_unvals(const uint64_t *v, xsis_dat_cnt_t *cnt){
+    cnt->rop = v[0];
+    cnt->rsc = v[1];
+    cnt->wop = v[2];
+    cnt->wsc = v[3];
+    cnt->rtu = v[4];
+    cnt->wtu = v[5];
+    cnt->infrd = (uint32_t)v[6];
+    cnt->infwr = (uint32_t)v[7];
+    cnt->flags = (uint32_t)v[8];
+    cnt->reserved = 0;
+}
+
+// Append a varint
+static uint8_t *
+dat_put(uint8_t *p, uint64_t u){
+    while (u >= 0x80){
+        *p++ = (uint8_t)u | 0x80;
+        u >>= 7;
+    }
+    *p++ = (uint8_t)u;
+    return(p);
+}
+
+// Fetch a varint, or return NULL if it is truncated or too long
+static const uint8_t *
+dat_get(const uint8_t *p, const uint8_t *end, uint64_t *u){
+    // Local variables
+    uint32_t            shift;          // Position of the next 7 bits
+
+    *u = 0;
+    for (shift = 0; p < end && shift < 7*XSIS_DAT_MAXVAR; shift += 7){
+        *u |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            return(p);
+    }
+    return(NULL);
+}
+
+// Encode samples against the last ones; return the encoded size
+static uint32_t
+dat_encode(xsis_dat_t *dat, const xsis_dat_cnt_t *cnt, uint32_t nent,
+           uint8_t *out){
+    // Local variables
+    uint64_t            v[XSIS_DAT_NVALS]; // Values of an entry
+    uint64_t            *prev;          // Last values of the entry
+    uint64_t            *delta;         // Last deltas of the entry
+    uint64_t            d;              // Delta of a value
+    uint64_t            z;              // Value as stored (zig-zag)
+    uint64_t            moved;          // OR of all stored values
+    uint8_t             *p;             // End of the encoded entries
+    uint8_t             *q;             // End of the entry being encoded
+    uint32_t            i;              // Entry index
+    int                 j;              // Value index
+
+    memset(out, 0, (nent+7)/8);
+    p = out + (nent+7)/8;
+    for (i = 0; i < nent; i++){
+        dat_vals(&cnt[i], v);
+        prev = dat->prev + (size_t)i*XSIS_DAT_NVALS;
+        delta = dat->delta + (size_t)i*XSIS_DAT_NDODS;
+        moved = 0;
+        q = p;
+        for (j = 0; j < XSIS_DAT_NVALS; j++){
+            d = v[j] - prev[j];
+            prev[j] = v[j];
+            if (j < XSIS_DAT_NDODS){
+                z = d - delta[j];
+                delta[j] = d;
+            } else
+                z = d;
+            z = (z << 1) ^ (uint64_t)((int64_t)z >> 63);
+            moved |= z;
+            q = dat_put(q, z);
+        }
+
+        // Only keep entries that did not carry on as predicted
+        if (moved){
+            out[i/8] |= 1 << (i%8);
+            p = q;
+        }
+    }
+
+    // Pad to the record alignment
+    while ((p - out) & 7)
+        *p++ = 0;
+    return(p - out);
+}
+
+int
+dat_write_raw(xsis_dat_t *dat, uint64_t ts, const xsis_dat_vbd_t *set,
+              const xsis_dat_cnt_t *cnt, uint32_t nent){
+    // Local variables
+    xsis_dat_rec_t      *rec;           // Temporary record header
+    xsis_dat_vbd_t      *nset;          // Reallocated set
+    xsis_dat_idx_t      *idx;           // Reallocated index
+    uint64_t            *vals;          // Reallocated values
+    uint32_t            i;              // Temporary index
+    uint8_t             newset;         // VBD set changed (flag)
+    uint8_t             key;            // Write a key frame (flag)
+    size_t              len = 0;        // Bytes used in buffer
+
+    // Check whether the VBD set changed since the last tick
+    newset = (nent != dat->nset) || !dat->set ||
+             memcmp(set, dat->set, nent*sizeof(*set));
+
+    // Make room for both records
+    if (dat_reserve(dat, 2*sizeof(xsis_dat_rec_t) + nent/8 + 8 +
+                         nent*(sizeof(xsis_dat_vbd_t) +
+                               XSIS_DAT_NVALS*XSIS_DAT_MAXVAR)))
+        return(1);
+
+    // Emit VBD set record
+    if (newset){
+        if (nent > dat->nset || !dat->set){
+            if (!(nset = realloc(dat->set, (nent?nent:1)*sizeof(*nset)))){
+                perror("realloc");
+                return(1);
+            }
+            dat->set = nset;
+            if (!(vals = realloc(dat->prev, (nent?nent:1) *
+                                 XSIS_DAT_NVALS*sizeof(uint64_t)))){
+                perror("realloc");
+                return(1);
+            }
+            dat->prev = vals;
+            if (!(vals = realloc(dat->delta, (nent?nent:1) *
+                                 XSIS_DAT_NDODS*sizeof(uint64_t)))){
+                perror("realloc");
+                return(1);
+            }
+            dat->delta = vals;
+        }
+        rec = (xsis_dat_rec_t *)dat->buf;
+        memset(rec, 0, sizeof(*rec));
+        rec->magic = XSIS_DAT_MAGIC;
+        rec->type = XSIS_DAT_REC_SET;
+        rec->nent = nent;
+        rec->ts = ts;
+        rec->setoff = dat->off;
+        memcpy(rec+1, set, nent*sizeof(*set));
+        memcpy(dat->set, set, nent*sizeof(*set));
+        dat->nset = nent;
+        dat->setoff = dat->off;
+        dat->nkey = 0;
+        len = sizeof(*rec) + nent*sizeof(*set);
+    }
+    key = !dat->nkey;
+    dat->nkey = (dat->nkey + 1) % XSIS_DAT_KEY_STRIDE;
+    dat->nticks++;
+
+    // Index every key frame
+    if (key){
+        if (dat->nidx == dat->idxsz){
+            if (!(idx = realloc(dat->idx, (dat->idxsz ? dat->idxsz*2 : 64) *
+                                          sizeof(*idx)))){
+                perror("realloc");
+                return(1);
+            }
+            dat->idx = idx;
+            dat->idxsz = dat->idxsz ? dat->idxsz*2 : 64;
+        }
+        dat->idx[dat->nidx].ts = ts;
+        dat->idx[dat->nidx].off = dat->off + len;
+        dat->nidx++;
+    }
+
+    // Emit sample record
+    rec = (xsis_dat_rec_t *)(dat->buf + len);
+    memset(rec, 0, sizeof(*rec));
+    rec->magic = XSIS_DAT_MAGIC;
+    rec->type = key ? XSIS_DAT_REC_TICK : XSIS_DAT_REC_DTICK;
+    rec->nent = nent;
+    rec->ts = ts;
+    rec->setoff = dat->setoff;
+    if (key){
+        // Raw counters, which the following ticks are encoded against
+        memcpy(rec+1, cnt, nent*sizeof(*cnt));
+        for (i = 0; i < nent; i++)
+            dat_vals(&cnt[i], dat->prev + (size_t)i*XSIS_DAT_NVALS);
+        memset(dat->delta, 0, (size_t)nent*XSIS_DAT_NDODS*sizeof(uint64_t));
+        len += sizeof(*rec) + nent*sizeof(*cnt);
+    } else {
+        rec->size = dat_encode(dat, cnt, nent, (uint8_t *)(rec+1));
+        len += sizeof(*rec) + rec->size;
+    }
+
+    // Write both records at once
+    return(dat_flush(dat, len));
+}
+
+int
+dat_write(xsis_dat_t *dat, xsis_vbds_t *vbds){
+    // Local variables
+    xsis_vbd_t          *vbd;           // Temporary VBD iterator
+    xsis_dat_vbd_t      *set;           // Reallocated set of this tick
+    xsis_dat_cnt_t      *cnt;           // Reallocated samples of this tick
+    uint32_t            i = 0;          // Temporary index
+
+    // Gather the set and counters of this tick
+    if (vbds->nvbds > dat->tsz){
+        if (!(set = realloc(dat->tset, vbds->nvbds*sizeof(*set)))){
+            perror("realloc");
+            return(1);
+        }
+        dat->tset = set;
+        if (!(cnt = realloc(dat->tcnt, vbds->nvbds*sizeof(*cnt)))){
+            perror("realloc");
+            return(1);
+        }
+        dat->tcnt = cnt;
+        dat->tsz = vbds->nvbds;
+    }
+    LIST_FOREACH(vbd, &vbds->list, vbds){
+        dat->tset[i].domid = vbd->domid;
+        dat->tset[i].vbdid = vbd->vbdid;
+        dat->tset[i].tdpid = vbd->tdpid;
+        dat->tset[i].reserved = 0;
+        dat_cnt(&vbds->snap, vbd->slot, &dat->tcnt[i]);
+        i++;
+    }
+    return(dat_write_raw(dat, dat_now(), dat->tset, dat->tcnt, i));
+}
+
+static void
+dat_trailer(xsis_dat_t *dat){
+    // Local variables
+    xsis_dat_rec_t      *rec;           // Temporary record header
+    uint64_t            idxoff;         // Offset of the index record
+    size_t              len;            // Bytes used in buffer
+
+    // Emit index and END records
+    len = 2*sizeof(*rec) + dat->nidx*sizeof(xsis_dat_idx_t);
+    if (dat_reserve(dat, len))
+        return;
+    idxoff = dat->off;
+    rec = (xsis_dat_rec_t *)dat->buf;
+    memset(rec, 0, sizeof(*rec));
+    rec->magic = XSIS_DAT_MAGIC;
+    rec->type = XSIS_DAT_REC_IDX;
+    rec->nent = dat->nidx;
+    rec->ts = dat_now();
+    rec->setoff = dat->setoff;
+    if (dat->nidx)
+        memcpy(rec+1, dat->idx, dat->nidx*sizeof(xsis_dat_idx_t));
+    rec = (xsis_dat_rec_t *)((char *)(rec+1) +
+                             dat->nidx*sizeof(xsis_dat_idx_t));
+    memset(rec, 0, sizeof(*rec));
+    rec->magic = XSIS_DAT_MAGIC;
+    rec->type = XSIS_DAT_REC_END;
+    rec->ts = dat_now();
+    rec->setoff = idxoff;
+    (void)dat_flush(dat, len);
+}
+
+void
+dat_close(xsis_dat_t *dat){
+    // Release writer resources
+    if (dat){
+        if (dat->fd >= 0){
+            if (dat->off >= sizeof(xsis_dat_hdr_t))
+                dat_trailer(dat);
+            (void)close(dat->fd);
+        }
+        free(dat->set);
+        free(dat->buf);
+        free(dat->idx);
+        free(dat->prev);
+        free(dat->delta);
+        free(dat->tset);
+        free(dat->tcnt);
+        free(dat);
+    }
+}
+
+// Size of the entries following a record header, or 0 if unknown
+static size_t
+dat_entsz(uint32_t type){
+    switch (type){
+    case XSIS_DAT_REC_SET:
+        return(sizeof(xsis_dat_vbd_t));
+    case XSIS_DAT_REC_TICK:
+        return(sizeof(xsis_dat_cnt_t));
+    case XSIS_DAT_REC_IDX:
+        return(sizeof(xsis_dat_idx_t));
+    case XSIS_DAT_REC_END:
+        return(sizeof(xsis_dat_rec_t)); // nent is always 0
+    case XSIS_DAT_REC_DTICK:
+        return(1);                      // sized by 'size' instead
+    }
+    return(0);
+}
+
+// Return the record at 'off' if it is complete and well formed
+static const xsis_dat_rec_t *
+dat_read_rec(xsis_datrd_t *rd, size_t off, size_t end){
+    // Local variables
+    const xsis_dat_rec_t *rec;          // Record header
+    size_t              entsz;          // Entry size
+
+    if ((off & 7) || off + sizeof(*rec) > end)
+        return(NULL);
+    rec = (const xsis_dat_rec_t *)(rd->map + off);
+    if (rec->magic != XSIS_DAT_MAGIC || !(entsz = dat_entsz(rec->type)))
+        return(NULL);
+    if (rec->type == XSIS_DAT_REC_DTICK){
+        // Padded payload, holding at least the bitmap
+        if ((rec->size & 7) || rec->size < ((uint64_t)rec->nent+7)/8 ||
+            end - off - sizeof(*rec) < rec->size)
+            return(NULL);
+    } else
+    if ((end - off - sizeof(*rec))/entsz < rec->nent)
+        return(NULL);
+    return(rec);
+}
+
+static size_t
+dat_rec_len(const xsis_dat_rec_t *rec){
+    if (rec->type == XSIS_DAT_REC_DTICK)
+        return(sizeof(*rec) + rec->size);
+    return(sizeof(*rec) + rec->nent*dat_entsz(rec->type));
+}
+
+// Find the first key frame at or after record boundary 'off'
+static size_t
+dat_key(xsis_datrd_t *rd, size_t off){
+    // Local variables
+    const xsis_dat_rec_t *rec;          // Temporary record
+
+    while ((rec = dat_read_rec(rd, off, rd->end)) &&
+           rec->type != XSIS_DAT_REC_TICK)
+        off += dat_rec_len(rec);
+    return(rec ? off : rd->end);
+}
+
+// Start decoding from a key frame
+static int
+dat_read_key(xsis_datrd_t *rd, const xsis_dat_rec_t *rec){
+    // Local variables
+    char                *buf;           // Reallocated record buffer
+    uint64_t            *delta;         // Reallocated deltas
+
+    rd->valid = 0;
+    if (rec->nent > rd->nbuf || !rd->buf){
+        if (!(buf = realloc(rd->buf, sizeof(*rec) +
+                            rec->nent*sizeof(xsis_dat_cnt_t)))){
+            perror("realloc");
+            return(1);
+        }
+        rd->buf = buf;
+        if (!(delta = realloc(rd->delta, (rec->nent?rec->nent:1) *
+                              XSIS_DAT_NDODS*sizeof(uint64_t)))){
+            perror("realloc");
+            return(1);
+        }
+        rd->delta = delta;
+        rd->nbuf = rec->nent;
+    }
+    memcpy(rd->buf, rec, sizeof(*rec) + rec->nent*sizeof(xsis_dat_cnt_t));
+    memset(rd->delta, 0, (size_t)rec->nent*XSIS_DAT_NDODS*sizeof(uint64_t));
+    rd->valid = 1;
+    return(0);
+}
+
+// Apply a DTICK record to the last sample; NULL if it cannot be decoded
+static const xsis_dat_rec_t *
+dat_read_delta(xsis_datrd_t *rd, const xsis_dat_rec_t *rec){
+    // Local variables
+    xsis_dat_rec_t      *last;          // Last sample record
+    xsis_dat_cnt_t      *cnt;           // Its entries
+    uint64_t            v[XSIS_DAT_NVALS]; // Values of an entry
+    uint64_t            *delta;         // Deltas of an entry
+    uint64_t            z;              // Stored value (zig-zag)
+    const uint8_t       *map;           // Bitmap of stored entries
+    const uint8_t       *p;             // Next stored value
+    const uint8_t       *end;           // End of payload
+    uint32_t            i;              // Entry index
+    int                 j;              // Value index
+
+    // Only decodable following the key frame of the same set
+    last = (xsis_dat_rec_t *)rd->buf;
+    if (!rd->valid || rec->nent != last->nent || rec->setoff != last->setoff)
+        return(NULL);
+
+    map = (const uint8_t *)(rec+1);
+    p = map + (rec->nent+7)/8;
+    end = map + rec->size;
+    cnt = (xsis_dat_cnt_t *)(last+1);
+    for (i = 0; i < rec->nent; i++){
+        dat_vals(&cnt[i], v);
+        delta = rd->delta + (size_t)i*XSIS_DAT_NDODS;
+        for (j = 0; j < XSIS_DAT_NVALS; j++){
+            z = 0;
+            if ((map[i/8] & (1 << (i%8))) && !(p = dat_get(p, end, &z))){
+                rd->valid = 0;
+                return(NULL);
+            }
+            z = (z >> 1) ^ -(z & 1);
+            if (j < XSIS_DAT_NDODS){
+                delta[j] += z;
+                v[j] += delta[j];
+            } else
+                v[j] += z;
+        }
+        dat_unvals(v, &cnt[i]);
+    }
+    last->ts = rec->ts;
+    return(last);
+}
+
+// Find the first record boundary at or after 'off'
+static size_t
+dat_resync(xsis_datrd_t *rd, size_t off){
+    // Local variables
+    const xsis_dat_rec_t *rec;          // Candidate record
+    size_t              next;           // Offset of the following record
+
+    for (off = (off + 7) & ~(size_t)7; off < rd->end; off += 8){
+        if (!(rec = dat_read_rec(rd, off, rd->end)))
+            continue;
+        // Require the following record to chain correctly as well
+        next = off + dat_rec_len(rec);
+        if (next == rd->end || dat_read_rec(rd, next, rd->end))
+            return(off);
+    }
+    return(rd->end);
+}
+
+int
+dat_read_open(xsis_datrd_t **rd, char *datafn){
+    // Local variables
+    struct stat         st;             // Datafile stat
+    const xsis_dat_rec_t *rec;          // Trailer / index record
+    int                 err = 0;        // Return code
+
+    // Allocate reader context
+    if (!(*rd = calloc(1, sizeof(xsis_datrd_t)))){
+        perror("calloc");
+        goto err;
+    }
+    (*rd)->fd = -1;
+
+    // Open and map datafile
+    if (((*rd)->fd = open(datafn, O_RDONLY)) < 0){
+        perror("open");
+        goto err;
+    }
+    if (fstat((*rd)->fd, &st)){
+        perror("fstat");
+        goto err;
+    }
+    if (st.st_size < sizeof(xsis_dat_hdr_t)){
+        fprintf(stderr, "Datafile '%s' is too short.\n", datafn);
+        goto err;
+    }
+    (*rd)->len = st.st_size;
+    if (((*rd)->map = mmap(NULL, (*rd)->len, PROT_READ, MAP_SHARED,
+                           (*rd)->fd, 0)) == MAP_FAILED){
+        (*rd)->map = NULL;
+        perror("mmap");
+        goto err;
+    }
+    (void)madvise((void *)(*rd)->map, (*rd)->len, MADV_SEQUENTIAL);
+
+    // Validate header
+    (*rd)->hdr = (const xsis_dat_hdr_t *)(*rd)->map;
+    if ((*rd)->hdr->magic != XSIS_DAT_MAGIC ||
+        !(*rd)->hdr->version || (*rd)->hdr->version > XSIS_DAT_VERSION){
+        fprintf(stderr, "Datafile '%s' has an unknown format.\n", datafn);
+        goto err;
+    }
+    (*rd)->off = sizeof(xsis_dat_hdr_t);
+    (*rd)->end = (*rd)->len;
+
+    // Locate the time index through the trailer, if any
+    if ((*rd)->len >= sizeof(xsis_dat_hdr_t) + sizeof(xsis_dat_rec_t)){
+        rec = dat_read_rec(*rd, (*rd)->len - sizeof(*rec), (*rd)->len);
+        if (rec && rec->type == XSIS_DAT_REC_END &&
+            rec->setoff >= sizeof(xsis_dat_hdr_t) &&
+            (rec = dat_read_rec(*rd, rec->setoff, (*rd)->len)) &&
+            rec->type == XSIS_DAT_REC_IDX){
+            (*rd)->end = (const char *)rec - (*rd)->map;
+            (*rd)->idx = (const xsis_dat_idx_t *)(rec+1);
+            (*rd)->nidx = rec->nent;
+        }
+    }
+
+out:
+    // Return
+    return(err);
+
+err:
+    dat_read_close(*rd);
+    *rd = NULL;
+    err = 1;
+    goto out;
+}
+
+void
+dat_read_seek(xsis_datrd_t *rd, uint64_t ts){
+    // Local variables
+    const xsis_dat_rec_t *rec;          // Temporary record
+    size_t              lo, hi, mid;    // Search bounds
+    uint32_t            ilo, ihi, imid; // Index search bounds
+
+    // Start from the beginning
+    rd->off = sizeof(xsis_dat_hdr_t);
+    rd->valid = 0;
+    rd->pend = NULL;
+    if (!ts)
+        return;
+
+    if (rd->idx){
+        // Binary search the index for the last entry before ts
+        ilo = 0;
+        ihi = rd->nidx;
+        while (ilo < ihi){
+            imid = ilo + (ihi-ilo)/2;
+            if (rd->idx[imid].ts < ts)
+                ilo = imid + 1;
+            else
+                ihi = imid;
+        }
+        if (ilo && rd->idx[ilo-1].off < rd->end)
+            rd->off = rd->idx[ilo-1].off;
+    } else {
+        // No index: bisect the file, resynchronising on record headers
+        lo = rd->off;
+        hi = rd->end;
+        while (hi - lo > XSIS_DAT_KEY_STRIDE*sizeof(xsis_dat_rec_t)){
+            mid = dat_key(rd, dat_resync(rd, lo + (hi-lo)/2));
+            if (mid >= hi || !(rec = dat_read_rec(rd, mid, rd->end)))
+                break;
+            if (rec->ts < ts)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        rd->off = lo;
+    }
+
+    // Decode forward (from a key frame) to the first sample at or after ts
+    while ((rec = dat_read_next(rd)) && rec->ts < ts);
+    rd->pend = rec;
+}
+
+const xsis_dat_rec_t *
+dat_read_next(xsis_datrd_t *rd){
+    // Local variables
+    const xsis_dat_rec_t *rec;          // Temporary record
+
+    // A sample already decoded by dat_read_seek() goes first
+    if ((rec = rd->pend)){
+        rd->pend = NULL;
+        return(rec);
+    }
+
+    // Return the next sample record, skipping other record types
+    while ((rec = dat_read_rec(rd, rd->off, rd->end))){
+        rd->off += dat_rec_len(rec);
+        if (rec->type == XSIS_DAT_REC_TICK){
+            // Version 1 files only hold key frames
+            if (rd->hdr->version > 1 && dat_read_key(rd, rec))
+                return(NULL);
+            return(rec);
+        }
+        if (rec->type == XSIS_DAT_REC_DTICK &&
+            (rec = dat_read_delta(rd, rec)))
+            return(rec);
+    }
+    return(NULL);
+}
+
+const xsis_dat_vbd_t *
+dat_read_set(xsis_datrd_t *rd, const xsis_dat_rec_t *tick, uint32_t *nent){
+    // Local variables
+    const xsis_dat_rec_t *rec;          // VBD set record
+
+    // Fetch and validate the VBD set describing a sample record
+    if (!(rec = dat_read_rec(rd, tick->setoff, rd->end)) ||
+        rec->type != XSIS_DAT_REC_SET || rec->nent != tick->nent)
+        return(NULL);
+    *nent = rec->nent;
+    return((const xsis_dat_vbd_t *)(rec+1));
+}
+
+void
+dat_read_close(xsis_datrd_t *rd){
+    // Release reader resources
+    if (rd){
+        if (rd->map)
+            (void)munmap((void *)rd->map, rd->len);
+        if (rd->fd >= 0)
+            (void)close(rd->fd);
+        free(rd->buf);
+        free(rd->delta);
+        free(rd);
+    }
+}
@@ -0,0 +1,197 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_evt.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "xsiostat.h"
+
+/*
+ * Ticks come from a periodic timerfd on CLOCK_MONOTONIC, so they neither
+ * drift nor follow wall clock steps. The timerfd and any other source
+ * (e.g. scraper sockets) share one epoll instance; sources are embedded
+ * in their owners and handed to epoll by pointer. The delay between each
+ * expected expiry and the wakeup is accumulated as scheduling jitter.
+ */
+
+#define EVT_FIRST               100000000 // First tick, at most (ns)
+#define EVT_MAXEVS              16      // Events taken per epoll_wait
+
+static uint64_t
+evt_now(void){
+    // Local variables
+    struct timespec     ts;             // Current time
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec);
+}
+
+int
+evt_open(xsis_evt_t **evt, uint32_t interval){
+    // Local variables
+    struct itimerspec   its;            // Timer setup
+    uint64_t            first;          // First expiry (ns)
+    int                 err = 0;        // Return code
+
+    // Allocate event loop context
+    if (!(*evt = calloc(1, sizeof(xsis_evt_t)))){
+        perror("calloc");
+        goto err;
+    }
+    (*evt)->timer.fd = -1;
+    if (((*evt)->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+        perror("epoll_create1");
+        goto err;
+    }
+
+    // Arm a periodic timer with absolute expiries
+    if (((*evt)->timer.fd = timerfd_create(CLOCK_MONOTONIC,
+                                           TFD_NONBLOCK | TFD_CLOEXEC)) < 0){
+        perror("timerfd_create");
+        goto err;
+    }
+    (*evt)->interval = (uint64_t)interval*1000000;
+    first = evt_now() + (((*evt)->interval < EVT_FIRST) ? (*evt)->interval :
+                                                          EVT_FIRST);
+    its.it_value.tv_sec = first/1000000000;
+    its.it_value.tv_nsec = first%1000000000;
+    its.it_interval.tv_sec = interval/1000;
+    its.it_interval.tv_nsec = (interval%1000)*1000000;
+    if (timerfd_settime((*evt)->timer.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0){
+        perror("timerfd_settime");
+        goto err;
+    }
+    (*evt)->next = first;
+    if (evt_add(*evt, &(*evt)->timer, EPOLLIN))
+        goto err;
+
+out:
+    // Return
+    return(err);
+
+err:
+    evt_close(*evt);
+    *evt = NULL;
+    err = 1;
+    goto out;
+}
+
+int
+evt_add(xsis_evt_t *evt, xsis_evtsrc_t *src, uint32_t events){
+    // Local variables
+    struct epoll_event  ev;             // Registration
+
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(evt->epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0){
+        perror("epoll_ctl");
+        return(1);
+    }
+    return(0);
+}
+
+int
+evt_mod(xsis_evt_t *evt, xsis_evtsrc_t *src, uint32_t events){
+    // Local variables
+    struct epoll_event  ev;             // Registration
+
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(evt->epfd, EPOLL_CTL_MOD, src->fd, &ev) < 0){
+        perror("epoll_ctl");
+        return(1);
+    }
+    return(0);
+}
+
+void
+evt_del(xsis_evt_t *evt, xsis_evtsrc_t *src){
+    // Sources are also dropped by epoll when their fd is closed
+    (void)epoll_ctl(evt->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+}
+
+int
+evt_wait(xsis_evt_t *evt, const sigset_t *mask){
+    // Local variables
+    struct epoll_event  evs[EVT_MAXEVS]; // Ready sources
+    xsis_evtsrc_t       *src;           // Ready source
+    uint64_t            exp = 0;        // Timer expiries
+    uint64_t            now;            // Wakeup time (ns)
+    int                 n;              // Ready sources
+    int                 i;              // Temporary index
+
+    // Dispatch sources until the timer expires (or a signal arrives)
+    while (!exp){
+        if ((n = epoll_pwait(evt->epfd, evs, EVT_MAXEVS, -1, mask)) < 0){
+            if (errno == EINTR)
+                return(0);
+            perror("epoll_pwait");
+            return(-1);
+        }
+        for (i = 0; i < n; i++){
+            src = evs[i].data.ptr;
+            if (src != &evt->timer){
+                if (src->cb(src, evs[i].events))
+                    return(-1);
+                continue;
+            }
+            if (read(evt->timer.fd, &exp, sizeof(exp)) != sizeof(exp)){
+                exp = 0;
+                continue;
+            }
+
+            // Account for the delay since the (last) expected expiry
+            now = evt_now();
+            evt->next += (exp-1)*evt->interval;
+            if (now > evt->next){
+                evt->jitsum += now - evt->next;
+                if (now - evt->next > evt->jitmax)
+                    evt->jitmax = now - evt->next;
+            }
+            evt->next += evt->interval;
+            evt->missed += exp-1;
+            evt->ticks++;
+        }
+    }
+
+    // Return
+    return((int)exp);
+}
+
+void
+evt_close(xsis_evt_t *evt){
+    // Release event loop resources
+    if (evt){
+        if (evt->timer.fd >= 0)
+            (void)close(evt->timer.fd);
+        if (evt->epfd >= 0)
+            (void)close(evt->epfd);
+        free(evt);
+    }
+}
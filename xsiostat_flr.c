@@ -0,0 +1,338 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_flr.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/queue.h>
+#include "xsiostat.h"
+
+/*
+ * The flight recorder has its own timerfd on the event loop and copies
+ * the raw counters of every VBD into a ring of samples at a high rate,
+ * independently of the output interval. Conditions are checked on every
+ * sample and fire on their rising edge only, per VBD. When one fires (or
+ * on SIGUSR1), the ring is written to a new datafile, followed by the
+ * samples of the next 'post' seconds; firing again meanwhile extends the
+ * dump. Dumps are ordinary datafiles, replayed with -r.
+ */
+
+static uint64_t
+flr_now(void){
+    // Local variables
+    struct timespec     ts;             // Current time
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return((uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec);
+}
+
+// Parse a --trigger list (e.g. "queue=64,lowmem,stall=300")
+static int
+flr_parse(xsis_flr_t *flr, char *arg){
+    // Local variables
+    char                *cond;          // Condition being parsed
+    char                *val;           // Its value (after '=')
+    char                *save;          // strtok_r() state
+    char                *end;           // End of a number
+
+    for (cond = strtok_r(arg, ",", &save); cond;
+         cond = strtok_r(NULL, ",", &save)){
+        if ((val = strchr(cond, '=')))
+            *val++ = '\0';
+        if (!strcmp(cond, "lowmem") && !val){
+            flr->lowmem = 1;
+            continue;
+        }
+        if ((strcmp(cond, "queue") && strcmp(cond, "stall")) || !val ||
+            !*val || !strtoul(val, &end, 10) || *end)
+            goto err;
+        if (!strcmp(cond, "queue"))
+            flr->queue = strtoul(val, NULL, 10);
+        else
+            flr->stall = strtoull(val, NULL, 10)*1000000;
+    }
+    return(0);
+
+err:
+    fprintf(stderr, "Invalid trigger \"%s%s%s\".\n", cond, val ? "=" : "",
+            val ? val : "");
+    return(1);
+}
+
+void
+flr_trigger(xsis_flr_t *flr, const char *why){
+    // Picked up by the next sample
+    if (!flr->why)
+        flr->why = why;
+}
+
+// Check the conditions of a VBD against one of its samples
+static void
+flr_check(xsis_flr_t *flr, xsis_vbd_t *vbd, const uint64_t *v,
+          uint64_t flags, uint64_t now){
+    // Local variables
+    uint64_t            inflight;       // Requests in flight
+    uint64_t            done;           // Requests completed
+    uint8_t             state = 0;      // Conditions holding now
+    uint8_t             rise;           // Conditions that just started
+
+    inflight = (v[XSIS_CTR_ROP] - v[XSIS_CTR_RCP]) +
+               (v[XSIS_CTR_WOP] - v[XSIS_CTR_WCP]);
+    done = v[XSIS_CTR_RCP] + v[XSIS_CTR_WCP];
+    if (flr->queue && inflight > flr->queue)
+        state |= 1 << XSIS_FLR_QUEUE;
+    if (flr->lowmem && (flags & BT3_LOW_MEMORY_MODE))
+        state |= 1 << XSIS_FLR_LOWMEM;
+
+    // Stalled: nothing completed for 'stall' ns with requests in flight
+    if (!(vbd->frstate & (1 << XSIS_FLR_SEEN)) || done != vbd->frcp ||
+        !inflight){
+        vbd->frcp = done;
+        vbd->frts = now;
+    } else if (flr->stall && now - vbd->frts >= flr->stall)
+        state |= 1 << XSIS_FLR_STALL;
+
+    // Conditions already holding when a VBD shows up do not fire
+    rise = state & ~vbd->frstate;
+    if (!(vbd->frstate & (1 << XSIS_FLR_SEEN)))
+        rise = 0;
+    vbd->frstate = state | (1 << XSIS_FLR_SEEN);
+    if (rise && !flr->why){
+        flr->why = (rise & (1 << XSIS_FLR_STALL)) ? "stall" :
+                   (rise & (1 << XSIS_FLR_QUEUE)) ? "queue" : "lowmem";
+        flr->domid = vbd->domid;
+        flr->vbdid = vbd->vbdid;
+    }
+}
+
+// Append a sample to the dump being written
+static void
+flr_write(xsis_flr_t *flr, xsis_flrs_t *smp){
+    if (dat_write_raw(flr->dat, smp->ts, smp->set, smp->cnt, smp->nent) ||
+        !--flr->left){
+        dat_close(flr->dat);
+        flr->dat = NULL;
+        flr->left = 0;
+        fprintf(stderr, "Flight recorder: finished '%s'.\n", flr->dumpfn);
+    }
+}
+
+// Start a dump with the samples in the ring, oldest first
+static void
+flr_dump(xsis_flr_t *flr){
+    // Local variables
+    uint32_t            i;              // Ring index
+    uint32_t            n;              // Samples left to write
+
+    (void)snprintf(flr->dumpfn, sizeof(flr->dumpfn), "%s.%u", flr->path,
+                   ++flr->ndumps);
+    if (strcmp(flr->why, "signal"))
+        fprintf(stderr, "Flight recorder: %s on VBD %u/%u, writing '%s'.\n",
+                flr->why, flr->domid, flr->vbdid, flr->dumpfn);
+    else
+        fprintf(stderr, "Flight recorder: %s, writing '%s'.\n", flr->why,
+                flr->dumpfn);
+    if (dat_open(&flr->dat, flr->dumpfn, flr->rate))
+        return;
+    flr->left = flr->nring + flr->post;
+    i = (flr->head + flr->ringsz - flr->nring) % flr->ringsz;
+    for (n = flr->nring; n && flr->dat; n--, i = (i+1) % flr->ringsz)
+        flr_write(flr, &flr->ring[i]);
+}
+
+// Take a sample of every VBD
+static void
+flr_sample(xsis_flr_t *flr){
+    // Local variables
+    xsis_flrs_t         *smp;           // Ring entry being filled
+    xsis_vbd_t          *vbd;           // Temporary VBD iterator
+    void                *ptr;           // Reallocated array
+    uint64_t            v[XSIS_NCTRS];  // Counters of vbd
+    uint64_t            flags;          // Flags of vbd
+    uint64_t            now;            // Time vbd was read (monotonic)
+    uint32_t            n;              // VBDs sampled
+    uint32_t            i = 0;          // Temporary index
+
+    // Make room for every VBD (ring entries only ever grow)
+    smp = &flr->ring[flr->head];
+    n = flr->vbds->nvbds;
+    if (n > smp->sz){
+        if (!(ptr = realloc(smp->set, n*sizeof(*smp->set)))){
+            perror("realloc");
+            return;
+        }
+        smp->set = ptr;
+        if (!(ptr = realloc(smp->cnt, n*sizeof(*smp->cnt)))){
+            perror("realloc");
+            return;
+        }
+        smp->cnt = ptr;
+        smp->sz = n;
+    }
+
+    smp->ts = flr_now();
+    LIST_FOREACH(vbd, &flr->vbds->list, vbds){
+        (void)snap_copy((const volatile tapdisk_stats *)vbd->shmmap, NULL,
+                        v, &flags, &now);
+        if (v[XSIS_CTR_RCP] > v[XSIS_CTR_ROP])
+            v[XSIS_CTR_RCP] = v[XSIS_CTR_ROP];
+        if (v[XSIS_CTR_WCP] > v[XSIS_CTR_WOP])
+            v[XSIS_CTR_WCP] = v[XSIS_CTR_WOP];
+        smp->set[i].domid = vbd->domid;
+        smp->set[i].vbdid = vbd->vbdid;
+        smp->set[i].tdpid = vbd->tdpid;
+        smp->set[i].reserved = 0;
+        smp->cnt[i].rop = v[XSIS_CTR_ROP];
+        smp->cnt[i].rsc = v[XSIS_CTR_RSC];
+        smp->cnt[i].wop = v[XSIS_CTR_WOP];
+        smp->cnt[i].wsc = v[XSIS_CTR_WSC];
+        smp->cnt[i].rtu = v[XSIS_CTR_RTU];
+        smp->cnt[i].wtu = v[XSIS_CTR_WTU];
+        smp->cnt[i].infrd = v[XSIS_CTR_ROP] - v[XSIS_CTR_RCP];
+        smp->cnt[i].infwr = v[XSIS_CTR_WOP] - v[XSIS_CTR_WCP];
+        smp->cnt[i].flags = (uint32_t)flags;
+        smp->cnt[i].reserved = 0;
+        flr_check(flr, vbd, v, flags, now);
+        i++;
+    }
+    smp->nent = i;
+    flr->head = (flr->head + 1) % flr->ringsz;
+    if (flr->nring < flr->ringsz)
+        flr->nring++;
+
+    // Dump (or keep dumping) around triggers
+    if (flr->dat){
+        if (flr->why)
+            flr->left = flr->post + 1;
+        flr_write(flr, smp);
+    } else if (flr->why)
+        flr_dump(flr);
+    flr->why = NULL;
+}
+
+// Sampling timer expired
+static int
+flr_cb(xsis_evtsrc_t *src, uint32_t events){
+    // Local variables
+    xsis_flr_t          *flr = src->arg; // Flight recorder
+    uint64_t            exp;            // Timer expiries
+
+    if (read(src->fd, &exp, sizeof(exp)) == sizeof(exp))
+        flr_sample(flr);
+    return(0);
+}
+
+int
+flr_open(xsis_flr_t **flr, char *path, uint32_t rate, char *keep,
+         char *trig, xsis_evt_t *evt, xsis_vbds_t *vbds){
+    // Local variables
+    struct itimerspec   its;            // Timer setup
+    double              pre = XSIS_FLR_PRE; // Seconds kept before triggers
+    double              post = XSIS_FLR_POST; // Seconds dumped after them
+    char                *end;           // End of a number
+    int                 err = 0;        // Return code
+
+    // Allocate flight recorder context
+    if (!(*flr = calloc(1, sizeof(xsis_flr_t)))){
+        perror("calloc");
+        goto err;
+    }
+    (*flr)->src.fd = -1;
+    (*flr)->path = path;
+    (*flr)->rate = rate;
+    (*flr)->vbds = vbds;
+    if (trig && flr_parse(*flr, trig))
+        goto err;
+
+    // Size the ring for 'pre' seconds (plus the sample that triggers)
+    if (keep){
+        pre = strtod(keep, &end);
+        if (*end == ',')
+            post = strtod(end + 1, &end);
+        if (*end || pre < 0 || post < 0){
+            fprintf(stderr, "Invalid flight recorder window \"%s\".\n",
+                    keep);
+            goto err;
+        }
+    }
+    (*flr)->ringsz = (uint32_t)(pre*1000/rate) + 1;
+    (*flr)->post = (uint32_t)(post*1000/rate);
+    if (!((*flr)->ring = calloc((*flr)->ringsz, sizeof(xsis_flrs_t)))){
+        perror("calloc");
+        goto err;
+    }
+
+    // Sample from a periodic timer on the event loop
+    if (((*flr)->src.fd = timerfd_create(CLOCK_MONOTONIC,
+                                         TFD_NONBLOCK | TFD_CLOEXEC)) < 0){
+        perror("timerfd_create");
+        goto err;
+    }
+    its.it_value.tv_sec = its.it_interval.tv_sec = rate/1000;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = (rate%1000)*1000000;
+    if (timerfd_settime((*flr)->src.fd, 0, &its, NULL) < 0){
+        perror("timerfd_settime");
+        goto err;
+    }
+    (*flr)->src.cb = flr_cb;
+    (*flr)->src.arg = *flr;
+    if (evt_add(evt, &(*flr)->src, EPOLLIN))
+        goto err;
+
+out:
+    // Return
+    return(err);
+
+err:
+    flr_close(*flr);
+    *flr = NULL;
+    err = 1;
+    goto out;
+}
+
+void
+flr_close(xsis_flr_t *flr){
+    // Local variables
+    uint32_t            i;              // Ring index
+
+    // Release flight recorder resources (finishing any dump early)
+    if (flr){
+        if (flr->dat){
+            dat_close(flr->dat);
+            fprintf(stderr, "Flight recorder: finished '%s' early.\n",
+                    flr->dumpfn);
+        }
+        if (flr->src.fd >= 0)
+            (void)close(flr->src.fd);
+        for (i = 0; flr->ring && i < flr->ringsz; i++){
+            free(flr->ring[i].set);
+            free(flr->ring[i].cnt);
+        }
+        free(flr->ring);
+        free(flr);
+    }
+}
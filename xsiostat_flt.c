@@ -22,63 +22,129 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/queue.h>
+#include <string.h>
+#include <errno.h>
 #include "xsiostat.h"
 
+/*
+ * Filters are kept as a sorted array of disjoint, non-adjacent [lo, hi]
+ * ranges, so a lookup is a binary search regardless of how the IDs were
+ * given on the command line.
+ */
+
+void
+flts_init(xsis_flts_t *flts){
+    // Initialise empty filter
+    flts->flts = NULL;
+    flts->nflts = 0;
+    flts->fltsz = 0;
+}
+
 int
 flt_isset(xsis_flts_t *flts, uint32_t filter){
     // Local variables
-    xsis_flt_t          *flt;           // Temporary FLT pointer
-    int                 isset = 0;      // Return code
+    uint32_t            lo = 0;         // Search lower bound
+    uint32_t            hi;             // Search upper bound
+    uint32_t            mid;            // Search midpoint
 
-    // Check if filter is already in list
-    LIST_FOREACH(flt, flts, flts)
-        if (flt->filter == filter){
-            isset = 1;
-            break;
-        }
+    // Binary search for a range containing filter
+    hi = flts->nflts;
+    while (lo < hi){
+        mid = lo + (hi-lo)/2;
+        if (filter < flts->flts[mid].lo)
+            hi = mid;
+        else
+        if (filter > flts->flts[mid].hi)
+            lo = mid + 1;
+        else
+            return(1);
+    }
 
     // Return
-    return(isset);
+    return(0);
 }
 
 int
-flt_add(xsis_flts_t *flts, uint32_t filter){
+flt_add(xsis_flts_t *flts, uint32_t lo, uint32_t hi){
     // Local variables
-    xsis_flt_t          *flt;           // Temporary FLT pointer
-    int                 err = 0;        // Return code
+    xsis_flt_t          *flt;           // Reallocated ranges
+    uint32_t            i, j;           // First/last range merged
 
-    // Check if filter is already in list
-    if (flt_isset(flts, filter))
-            goto err;
+    // Find the first range ending at or after lo-1
+    for (i = 0; i < flts->nflts; i++)
+        if (lo == 0 || flts->flts[i].hi >= lo - 1)
+            break;
+
+    // Find the ranges overlapping or adjacent to [lo, hi]
+    for (j = i; j < flts->nflts; j++)
+        if (hi != UINT32_MAX && flts->flts[j].lo > hi + 1)
+            break;
 
-    // Allocate new filter and insert into list
-    if (!(flt = (xsis_flt_t *)calloc(1, sizeof(xsis_flt_t)))){
-        perror("calloc");
-        goto err;
+    if (j > i){
+        // Merge ranges i..j-1 into one
+        if (flts->flts[i].lo < lo)
+            lo = flts->flts[i].lo;
+        if (flts->flts[j-1].hi > hi)
+            hi = flts->flts[j-1].hi;
+        memmove(&flts->flts[i+1], &flts->flts[j],
+                (flts->nflts-j)*sizeof(xsis_flt_t));
+        flts->nflts -= j-i-1;
+    } else {
+        // Insert a new range at i
+        if (flts->nflts == flts->fltsz){
+            if (!(flt = realloc(flts->flts, (flts->fltsz ? flts->fltsz*2 : 8)*
+                                            sizeof(xsis_flt_t)))){
+                perror("realloc");
+                return(1);
+            }
+            flts->flts = flt;
+            flts->fltsz = flts->fltsz ? flts->fltsz*2 : 8;
+        }
+        memmove(&flts->flts[i+1], &flts->flts[i],
+                (flts->nflts-i)*sizeof(xsis_flt_t));
+        flts->nflts++;
     }
-    flt->filter = filter;
-    LIST_INSERT_HEAD(flts, flt, flts);
+    flts->flts[i].lo = lo;
+    flts->flts[i].hi = hi;
 
-out:
     // Return
-    return(err);
+    return(0);
+}
+
+int
+flt_parse(xsis_flts_t *flts, char *arg){
+    // Local variables
+    unsigned long       lo, hi;         // Parsed range
+    char                *ptr = arg;     // Parse position
+    char                *start;         // Start of current ID
+
+    // Parse a comma separated list of IDs or ID ranges (e.g. "1,10-200")
+    do {
+        errno = 0;
+        start = ptr;
+        lo = hi = strtoul(start, &ptr, 10);
+        if (ptr != start && *ptr == '-'){
+            start = ptr+1;
+            hi = strtoul(start, &ptr, 10);
+        }
+        if (errno || ptr == start || lo > UINT32_MAX || hi > UINT32_MAX || lo > hi ||
+            (*ptr && *ptr != ',')){
+            fprintf(stderr, "Invalid filter \"%s\".\n", arg);
+            return(1);
+        }
+        if (flt_add(flts, lo, hi))
+            return(1);
+    } while (*ptr++ == ',');
 
-err:
-    err = 1;
-    goto out;
+    // Return
+    return(0);
 }
 
 void
 flts_free(xsis_flts_t *flts){
-    // Local variables
-    xsis_flt_t          *flt;           // Temporary FLT pointer
-
-    // Loop through FLTs, freeing resources
-    LIST_FOREACH(flt, flts, flts){
-        LIST_REMOVE(flt, flts);
-        free(flt);
-    }
+    // Release ranges
+    free(flts->flts);
+    flts_init(flts);
 
     // Return
     return;
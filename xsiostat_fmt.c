@@ -0,0 +1,197 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_fmt.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "xsiostat.h"
+
+/*
+ * A whole tick of output is formatted into one buffer and handed to the
+ * kernel with a single write(). Numbers are converted by hand (integers,
+ * and floats as fixed point with two decimals), which is much cheaper
+ * than printf's float formatting with thousands of VBDs per tick.
+ */
+
+#define FMT_NUMSZ               32      // Room for one formatted number
+
+int
+fmt_type(const char *arg){
+    // Map a --format argument to XSIS_FMT_*
+    if (!strcmp(arg, "table"))
+        return(XSIS_FMT_TABLE);
+    if (!strcmp(arg, "csv"))
+        return(XSIS_FMT_CSV);
+    if (!strcmp(arg, "jsonl"))
+        return(XSIS_FMT_JSONL);
+    return(-1);
+}
+
+void
+fmt_init(xsis_fmt_t *fmt, int type){
+    memset(fmt, 0, sizeof(*fmt));
+    fmt->type = type;
+}
+
+// Make room for 'n' more bytes (on failure, output is dropped)
+static int
+fmt_reserve(xsis_fmt_t *fmt, size_t n){
+    // Local variables
+    size_t              size;           // New buffer size
+    char                *buf;           // Reallocated buffer
+
+    if (fmt->err)
+        return(1);
+    if (fmt->len + n <= fmt->size)
+        return(0);
+    for (size = fmt->size ? fmt->size : 4096; size < fmt->len + n; size *= 2);
+    if (!(buf = realloc(fmt->buf, size))){
+        perror("realloc");
+        fmt->err = 1;
+        return(1);
+    }
+    fmt->buf = buf;
+    fmt->size = size;
+    return(0);
+}
+
+void
+fmt_str(xsis_fmt_t *fmt, const char *str){
+    // Local variables
+    size_t              n;              // String length
+
+    n = strlen(str);
+    if (fmt_reserve(fmt, n))
+        return;
+    memcpy(fmt->buf + fmt->len, str, n);
+    fmt->len += n;
+}
+
+// Append 'digits' right aligned in 'width' columns
+static void
+fmt_pad(xsis_fmt_t *fmt, const char *digits, int n, int width){
+    // Local variables
+    int                 pad;            // Leading spaces
+
+    pad = (width > n) ? width - n : 0;
+    if (fmt_reserve(fmt, pad + n))
+        return;
+    memset(fmt->buf + fmt->len, ' ', pad);
+    memcpy(fmt->buf + fmt->len + pad, digits, n);
+    fmt->len += pad + n;
+}
+
+void
+fmt_uint(xsis_fmt_t *fmt, uint64_t val, int width){
+    // Local variables
+    char                tmp[FMT_NUMSZ]; // Digits, filled from the end
+    char                *ptr;           // First digit
+
+    ptr = tmp + sizeof(tmp);
+    do {
+        *--ptr = '0' + val % 10;
+        val /= 10;
+    } while (val);
+    fmt_pad(fmt, ptr, tmp + sizeof(tmp) - ptr, width);
+}
+
+void
+fmt_fixed(xsis_fmt_t *fmt, double val, int width){
+    // Local variables
+    char                tmp[FMT_NUMSZ]; // Digits, filled from the end
+    char                *ptr;           // First digit
+    uint64_t            cents;          // Value in hundredths
+
+    // Rates are never negative; clamp anything out of range
+    if (!(val > 0))
+        val = 0;
+    if (val > 1e15)
+        val = 1e15;
+    cents = (uint64_t)(val*100 + 0.5);
+
+    ptr = tmp + sizeof(tmp);
+    *--ptr = '0' + cents % 10;
+    *--ptr = '0' + (cents / 10) % 10;
+    *--ptr = '.';
+    cents /= 100;
+    do {
+        *--ptr = '0' + cents % 10;
+        cents /= 10;
+    } while (cents);
+    fmt_pad(fmt, ptr, tmp + sizeof(tmp) - ptr, width);
+}
+
+void
+fmt_ts(xsis_fmt_t *fmt, uint64_t ns){
+    // Local variables
+    char                tmp[4];         // Milliseconds
+    uint32_t            ms;             // Milliseconds part
+
+    // Seconds since epoch with millisecond precision
+    fmt_uint(fmt, ns/1000000000, 0);
+    ms = (ns/1000000) % 1000;
+    tmp[0] = '.';
+    tmp[1] = '0' + ms / 100;
+    tmp[2] = '0' + (ms / 10) % 10;
+    tmp[3] = '0' + ms % 10;
+    fmt_pad(fmt, tmp, sizeof(tmp), 0);
+}
+
+int
+fmt_flush(xsis_fmt_t *fmt){
+    // Local variables
+    size_t              off = 0;        // Bytes written so far
+    ssize_t             n;              // Bytes written by write()
+    int                 err = 0;        // Return code
+
+    // Keep order with anything printed through stdio
+    fflush(stdout);
+
+    while (off < fmt->len){
+        n = write(STDOUT_FILENO, fmt->buf + off, fmt->len - off);
+        if (n < 0){
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            err = 1;
+            break;
+        }
+        off += n;
+    }
+    fmt->len = 0;
+    if (fmt->err)
+        err = 1;
+
+    // Return
+    return(err);
+}
+
+void
+fmt_free(xsis_fmt_t *fmt){
+    // Release output buffer
+    free(fmt->buf);
+    fmt->buf = NULL;
+    fmt->len = fmt->size = 0;
+}
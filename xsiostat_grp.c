@@ -0,0 +1,188 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_grp.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include "xsiostat.h"
+
+/*
+ * Rollups are rebuilt every tick in a single pass over the VBDs: each
+ * VBD's rates and in-flight requests are added to its group, found
+ * through a small open-addressing table keyed by domid, tapdisk pid or
+ * SR index (SR names are interned when VBDs are attached). Groups are
+ * then sorted by key so rows keep their place from tick to tick. Derived
+ * figures of a group are computed from its summed counter deltas, as
+ * they are for a single VBD, except utilisation which is averaged.
+ */
+
+int
+grp_type(const char *arg){
+    // Map a --group-by argument to XSIS_GRP_*
+    if (!strcmp(arg, "dom"))
+        return(XSIS_GRP_DOM);
+    if (!strcmp(arg, "tapdisk"))
+        return(XSIS_GRP_TAPDISK);
+    if (!strcmp(arg, "sr"))
+        return(XSIS_GRP_SR);
+    return(-1);
+}
+
+static int
+grp_cmp(const void *a, const void *b){
+    // Local variables
+    const xsis_grp_t    *x = a;         // First group
+    const xsis_grp_t    *y = b;         // Second group
+
+    return((x->key < y->key) ? -1 : (x->key > y->key));
+}
+
+// Make room for 'n' groups and clear the hash table
+static int
+grp_reserve(xsis_grps_t *grps, uint32_t n){
+    // Local variables
+    xsis_grp_t          *arr;           // Reallocated groups
+    uint32_t            *tbl;           // Reallocated table
+    uint32_t            size;           // New table size
+
+    if (n > grps->grpsz){
+        if (!(arr = realloc(grps->grps, n*sizeof(xsis_grp_t)))){
+            perror("realloc");
+            return(1);
+        }
+        grps->grps = arr;
+        grps->grpsz = n;
+    }
+    for (size = grps->tblsz ? grps->tblsz : 64; size < 2*n; size *= 2);
+    if (size != grps->tblsz){
+        if (!(tbl = realloc(grps->tbl, size*sizeof(uint32_t)))){
+            perror("realloc");
+            return(1);
+        }
+        grps->tbl = tbl;
+        grps->tblsz = size;
+    }
+    memset(grps->tbl, 0, grps->tblsz*sizeof(uint32_t));
+    return(0);
+}
+
+// Derive group figures from its sums
+static void
+grp_derive(xsis_grp_t *grp){
+    // Local variables
+    uint64_t            *d = grp->delta; // Summed counter deltas
+
+    grp->drv[XSIS_DRV_RLAT] = d[XSIS_CTR_RCP] ?
+        (double)d[XSIS_CTR_RTU] / (double)d[XSIS_CTR_RCP] : 0;
+    grp->drv[XSIS_DRV_WLAT] = d[XSIS_CTR_WCP] ?
+        (double)d[XSIS_CTR_WTU] / (double)d[XSIS_CTR_WCP] : 0;
+    grp->drv[XSIS_DRV_RRQSZ] = d[XSIS_CTR_ROP] ?
+        (double)d[XSIS_CTR_RSC] * XSIS_SECTOR_SZ/1024 / d[XSIS_CTR_ROP] : 0;
+    grp->drv[XSIS_DRV_WRQSZ] = d[XSIS_CTR_WOP] ?
+        (double)d[XSIS_CTR_WSC] * XSIS_SECTOR_SZ/1024 / d[XSIS_CTR_WOP] : 0;
+    grp->drv[XSIS_DRV_UTIL] /= grp->nvbds;
+}
+
+int
+grp_update(xsis_grps_t *grps, xsis_vbds_t *vbds){
+    // Local variables
+    xsis_snap_t         *snap;          // VBD counters and rates
+    xsis_vbd_t          *vbd;           // Temporary vbd iterator
+    xsis_grp_t          *grp;           // Group of vbd
+    uint32_t            key;            // Group key of vbd
+    uint32_t            s;              // VBD slot
+    uint32_t            h;              // Table slot
+    uint32_t            g;              // Group index
+    int                 i;              // Rate index
+
+    // There are at most as many groups as VBDs
+    grps->ngrps = 0;
+    if (grp_reserve(grps, vbds->nvbds ? vbds->nvbds : 1))
+        return(1);
+
+    snap = &vbds->snap;
+    LIST_FOREACH(vbd, &vbds->list, vbds){
+        switch (grps->by){
+        case XSIS_GRP_DOM:
+            key = vbd->domid;
+            break;
+        case XSIS_GRP_TAPDISK:
+            key = vbd->tdpid;
+            break;
+        default:
+            key = vbd->srid;
+            break;
+        }
+
+        // Find or create the group
+        for (h = (key * 0x9e3779b1U) & (grps->tblsz-1); grps->tbl[h] &&
+             grps->grps[grps->tbl[h]-1].key != key;
+             h = (h+1) & (grps->tblsz-1));
+        if (!grps->tbl[h]){
+            grp = &grps->grps[grps->ngrps++];
+            memset(grp, 0, sizeof(*grp));
+            grp->key = key;
+            grps->tbl[h] = grps->ngrps;
+        } else
+            grp = &grps->grps[grps->tbl[h]-1];
+
+        // Add the VBD in
+        s = vbd->slot;
+        grp->nvbds++;
+        for (i = 0; i < XSIS_NRATES; i++)
+            grp->rate[i] += snap->rate[i][s];
+        grp->infrd += snap->cur[XSIS_CTR_ROP][s] - snap->cur[XSIS_CTR_RCP][s];
+        grp->infwr += snap->cur[XSIS_CTR_WOP][s] - snap->cur[XSIS_CTR_WCP][s];
+        if (grps->drv){
+            for (i = 0; i < XSIS_NCTRS; i++)
+                grp->delta[i] += snap->cur[i][s] - snap->prev[i][s];
+            grp->drv[XSIS_DRV_IOPS] += snap->drv[XSIS_DRV_IOPS][s];
+            grp->drv[XSIS_DRV_UTIL] += snap->drv[XSIS_DRV_UTIL][s];
+        }
+    }
+    for (g = 0; grps->drv && g < grps->ngrps; g++)
+        grp_derive(&grps->grps[g]);
+
+    // Stable output order (the table is not used past this point)
+    qsort(grps->grps, grps->ngrps, sizeof(xsis_grp_t), grp_cmp);
+    return(0);
+}
+
+const char *
+grp_name(xsis_grps_t *grps, xsis_vbds_t *vbds, xsis_grp_t *grp){
+    // Only SR groups are named; others are shown by their key
+    if (grps->by != XSIS_GRP_SR)
+        return(NULL);
+    return((grp->key && grp->key < vbds->nsrs) ? vbds->srs[grp->key] : "-");
+}
+
+void
+grp_free(xsis_grps_t *grps){
+    // Release group buffers
+    free(grps->grps);
+    free(grps->tbl);
+    grps->grps = NULL;
+    grps->tbl = NULL;
+    grps->ngrps = grps->grpsz = grps->tblsz = 0;
+}
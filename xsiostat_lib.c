@@ -0,0 +1,182 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_lib.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include "xsiostat.h"
+
+/*
+ * Public API of libxsiostat (see libxsiostat.h). A context wraps the same
+ * VBD set the xsiostat binary samples, and a refresh runs the same steps
+ * as one of its ticks: follow plugs and unplugs, snapshot every page and
+ * compute rates. The view handed out only borrows the snapshot arrays,
+ * so it has to be rebuilt whenever they move (every refresh swaps cur and
+ * prev, and growing the snapshot reallocates all of them).
+ */
+
+// The public enums are the internal ones
+#define LIB_SAME(pub, in) _Static_assert((int)(pub) == (int)(in), #pub)
+LIB_SAME(XSIOSTAT_CTR_ROP, XSIS_CTR_ROP);
+LIB_SAME(XSIOSTAT_CTR_RSC, XSIS_CTR_RSC);
+LIB_SAME(XSIOSTAT_CTR_WOP, XSIS_CTR_WOP);
+LIB_SAME(XSIOSTAT_CTR_WSC, XSIS_CTR_WSC);
+LIB_SAME(XSIOSTAT_CTR_RTU, XSIS_CTR_RTU);
+LIB_SAME(XSIOSTAT_CTR_WTU, XSIS_CTR_WTU);
+LIB_SAME(XSIOSTAT_CTR_RCP, XSIS_CTR_RCP);
+LIB_SAME(XSIOSTAT_CTR_WCP, XSIS_CTR_WCP);
+LIB_SAME(XSIOSTAT_RATE_RIOPS, XSIS_RATE_RIOPS);
+LIB_SAME(XSIOSTAT_RATE_WIOPS, XSIS_RATE_WIOPS);
+LIB_SAME(XSIOSTAT_RATE_RTPUT, XSIS_RATE_RTPUT);
+LIB_SAME(XSIOSTAT_RATE_WTPUT, XSIS_RATE_WTPUT);
+LIB_SAME(XSIOSTAT_RATE_RAVGQ, XSIS_RATE_RAVGQ);
+LIB_SAME(XSIOSTAT_RATE_WAVGQ, XSIS_RATE_WAVGQ);
+LIB_SAME(XSIOSTAT_DRV_IOPS, XSIS_DRV_IOPS);
+LIB_SAME(XSIOSTAT_DRV_RLAT, XSIS_DRV_RLAT);
+LIB_SAME(XSIOSTAT_DRV_WLAT, XSIS_DRV_WLAT);
+LIB_SAME(XSIOSTAT_DRV_RRQSZ, XSIS_DRV_RRQSZ);
+LIB_SAME(XSIOSTAT_DRV_WRQSZ, XSIS_DRV_WRQSZ);
+LIB_SAME(XSIOSTAT_DRV_UTIL, XSIS_DRV_UTIL);
+LIB_SAME(XSIOSTAT_NCTRS, XSIS_NCTRS);
+LIB_SAME(XSIOSTAT_NRATES, XSIS_NRATES);
+LIB_SAME(XSIOSTAT_NDRVS, XSIS_NDRVS);
+#undef LIB_SAME
+
+// Point the published view at the snapshot arrays
+static void
+lib_view(xsiostat_t *xs){
+    // Local variables
+    xsis_snap_t         *snap;          // Snapshot of all VBDs
+    xsiostat_snap_t     *view;          // Published view
+    int                 i;              // Temporary index
+
+    snap = &xs->vbds.snap;
+    view = &xs->view;
+    view->nvbds = snap->nslots;
+    view->ids = snap->ids;
+    for (i = 0; i < XSIS_NCTRS; i++){
+        view->cur[i] = snap->cur[i];
+        view->prev[i] = snap->prev[i];
+    }
+    view->ts = snap->tcur;
+    view->flags = snap->flags;
+    for (i = 0; i < XSIS_NRATES; i++)
+        view->rate[i] = snap->rate[i];
+    for (i = 0; i < XSIS_NDRVS; i++)
+        view->drv[i] = snap->drv[i];
+}
+
+// Parse an id filter option (left empty if not given)
+static int
+lib_filter(xsis_flts_t *flts, const char *arg){
+    // Local variables
+    char                *tmp;           // Writable copy of arg
+    int                 err;            // Return code
+
+    if (!arg)
+        return(0);
+    if (!(tmp = strdup(arg))){
+        perror("strdup");
+        return(1);
+    }
+    err = flt_parse(flts, tmp);
+    free(tmp);
+    return(err);
+}
+
+int
+xsiostat_open(xsiostat_t **xs, const xsiostat_opts_t *opts){
+    // Local variables
+    int                 err = 0;        // Return code
+
+    // Allocate library context
+    if (!(*xs = calloc(1, sizeof(xsiostat_t)))){
+        perror("calloc");
+        goto err;
+    }
+    vbds_init(&(*xs)->vbds);
+    flts_init(&(*xs)->domids);
+    flts_init(&(*xs)->vbdids);
+    (*xs)->unit = 1000000;
+    if (opts){
+        if (opts->root)
+            (*xs)->vbds.root = opts->root;
+        if (opts->unit)
+            (*xs)->unit = opts->unit;
+        if (opts->idle_every)
+            (*xs)->vbds.snap.every = opts->idle_every;
+        (*xs)->scan = opts->scan;
+        if (lib_filter(&(*xs)->domids, opts->domids) ||
+            lib_filter(&(*xs)->vbdids, opts->vbdids))
+            goto err;
+    }
+
+    // Attach the VBDs present now
+    if (vbds_alloc(&(*xs)->vbds, &(*xs)->domids, &(*xs)->vbdids))
+        goto err;
+    lib_view(*xs);
+
+out:
+    // Return
+    return(err);
+
+err:
+    xsiostat_close(*xs);
+    *xs = NULL;
+    err = 1;
+    goto out;
+}
+
+int
+xsiostat_refresh(xsiostat_t *xs){
+    // Drain xenstore watch events (there is no event loop to do it here),
+    // so none pile up on the connection while the VBD set is stable
+    if (xs->vbds.xsc)
+        xsc_update(xs->vbds.xsc);
+
+    // Follow plugs and unplugs, then sample as a tick of xsiostat would
+    if (vbds_refresh(&xs->vbds, &xs->domids, &xs->vbdids, xs->scan))
+        return(1);
+    vbds_update(&xs->vbds);
+    snap_rates(&xs->vbds.snap, xs->unit);
+    snap_derive(&xs->vbds.snap);
+    lib_view(xs);
+    return(0);
+}
+
+const xsiostat_snap_t *
+xsiostat_snapshot(xsiostat_t *xs){
+    return(&xs->view);
+}
+
+void
+xsiostat_close(xsiostat_t *xs){
+    // Release library context
+    if (xs){
+        vbds_free(&xs->vbds);
+        flts_free(&xs->domids);
+        flts_free(&xs->vbdids);
+        free(xs);
+    }
+}
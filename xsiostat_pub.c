@@ -0,0 +1,216 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_pub.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#include "xsiostat.h"
+
+/*
+ * The segment layout and the reader side of the sequence lock are
+ * described in libxsiostat.h. The segment is built under a temporary name
+ * and renamed into place, so readers never find a partial header, and it
+ * is grown (never shrunk) before a tick is written: pages past the end of
+ * an older reader mapping are never touched by it.
+ */
+
+// Offset of the first entry
+#define PUB_HDRSZ   ((sizeof(xsiostat_pub_t) + 63) & ~(size_t)63)
+
+// Make room for at least n entries
+static int
+pub_grow(xsis_pub_t *pub, uint32_t n){
+    // Local variables
+    size_t              pgsz;           // Page size
+    size_t              len;            // New segment length
+    void                *map;           // New mapping
+
+    // Double the segment (at least), filling whole pages
+    if (n < pub->maxvbds*2)
+        n = pub->maxvbds*2;
+    pgsz = sysconf(_SC_PAGESIZE);
+    len = PUB_HDRSZ + (size_t)n*sizeof(xsiostat_pub_vbd_t);
+    len = (len + pgsz - 1) & ~(pgsz - 1);
+
+    if (ftruncate(pub->fd, len) < 0){
+        perror("ftruncate");
+        return(1);
+    }
+    if (pub->hdr)
+        map = mremap(pub->hdr, pub->len, len, MREMAP_MAYMOVE);
+    else
+        map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   pub->fd, 0);
+    if (map == MAP_FAILED){
+        perror("mmap");
+        return(1);
+    }
+    pub->hdr = map;
+    pub->len = len;
+    pub->maxvbds = (len - PUB_HDRSZ)/sizeof(xsiostat_pub_vbd_t);
+    return(0);
+}
+
+int
+pub_tick(xsis_pub_t *pub, xsis_snap_t *snap){
+    // Local variables
+    struct timespec     now;            // Tick time
+    xsiostat_pub_t      *hdr;           // Segment header
+    xsiostat_pub_vbd_t  *ent;           // Segment entries
+    uint64_t            gen;            // Sequence of this tick
+    uint32_t            i;              // Slot index
+    int                 j;              // Field index
+
+    if (snap->nslots > pub->maxvbds && pub_grow(pub, snap->nslots))
+        return(1);
+    hdr = pub->hdr;
+    ent = (xsiostat_pub_vbd_t *)((char *)hdr + hdr->hdrsz);
+
+    // Readers retry while gen is odd, or if it moved under them
+    gen = hdr->gen;
+    __atomic_store_n(&hdr->gen, gen + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    gen += 2;
+
+    for (i = 0; i < snap->nslots; i++){
+        ent[i].id = snap->ids[i];
+        ent[i].gen = gen;
+        ent[i].ts = snap->tcur[i];
+        ent[i].flags = snap->flags[i];
+        for (j = 0; j < XSIS_NCTRS; j++)
+            ent[i].cur[j] = snap->cur[j][i];
+        for (j = 0; j < XSIS_NDRVS; j++)
+            ent[i].drv[j] = snap->drv[j][i];
+        for (j = 0; j < XSIS_NRATES; j++)
+            ent[i].rate[j] = snap->rate[j][i];
+    }
+    hdr->maxvbds = pub->maxvbds;
+    hdr->nvbds = snap->nslots;
+    clock_gettime(CLOCK_REALTIME, &now);
+    hdr->ts = (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+    hdr->ticks++;
+
+    __atomic_store_n(&hdr->gen, gen, __ATOMIC_RELEASE);
+    return(0);
+}
+
+int
+pub_open(xsis_pub_t **pub, char *path, uint32_t interval, uint32_t unit){
+    // Local variables
+    struct stat         st;             // Existing segment
+    char                *tmp = NULL;    // Segment pathname while built
+    char                *name;          // Segment pathname
+    xsiostat_pub_t      *hdr;           // Segment header
+    int                 err = 0;        // Return code
+
+    // Allocate republisher context
+    if (!(*pub = calloc(1, sizeof(xsis_pub_t)))){
+        perror("calloc");
+        goto err;
+    }
+    (*pub)->fd = -1;
+    (*pub)->interval = interval;
+    (*pub)->unit = unit;
+
+    // Replace a stale segment, but never any other file
+    if (!lstat(path, &st) && !S_ISREG(st.st_mode)){
+        fprintf(stderr, "'%s' exists and is not a regular file.\n", path);
+        goto err;
+    }
+
+    // Build the segment aside
+    if (asprintf(&tmp, "%s.%u", path, (uint32_t)getpid()) < 0){
+        tmp = NULL;
+        perror("asprintf");
+        goto err;
+    }
+    if (((*pub)->fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                           0644)) < 0){
+        perror("open");
+        free(tmp);
+        tmp = NULL;
+        goto err;
+    }
+    if (pub_grow(*pub, XSIS_PUB_MINVBDS))
+        goto err;
+    hdr = (*pub)->hdr;
+    hdr->magic = XSIOSTAT_PUB_MAGIC;
+    hdr->version = XSIOSTAT_PUB_VERSION;
+    hdr->hdrsz = PUB_HDRSZ;
+    hdr->vbdsz = sizeof(xsiostat_pub_vbd_t);
+    hdr->maxvbds = (*pub)->maxvbds;
+    hdr->interval = interval;
+    hdr->unit = unit;
+    hdr->pid = getpid();
+
+    // Then publish it
+    if (!(name = strdup(path))){
+        perror("strdup");
+        goto err;
+    }
+    if (rename(tmp, path) < 0){
+        perror("rename");
+        free(name);
+        goto err;
+    }
+    (*pub)->path = name;
+    free(tmp);
+
+out:
+    // Return
+    return(err);
+
+err:
+    if (tmp){
+        (void)unlink(tmp);
+        free(tmp);
+    }
+    pub_close(*pub);
+    *pub = NULL;
+    err = 1;
+    goto out;
+}
+
+void
+pub_close(xsis_pub_t *pub){
+    // Release republisher resources (readers see pid go once unlinked)
+    if (pub){
+        if (pub->path){
+            (void)unlink(pub->path);
+            free(pub->path);
+        }
+        if (pub->hdr){
+            __atomic_store_n(&pub->hdr->pid, 0, __ATOMIC_RELEASE);
+            (void)munmap(pub->hdr, pub->len);
+        }
+        if (pub->fd >= 0)
+            (void)close(pub->fd);
+        free(pub);
+    }
+}
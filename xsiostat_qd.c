@@ -0,0 +1,215 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_qd.c
+ * ---------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/queue.h>
+#include "xsiostat.h"
+
+/*
+ * The queue depth sampler has its own timerfd on the event loop and reads
+ * only the submitted and completed counters of every VBD, many times per
+ * output interval. Each sample of requests in flight (r+w) goes into a
+ * per-VBD histogram with a bin per depth up to XSIS_QD_EXACT and four
+ * bins per power of two above, so percentiles are within 25% of the
+ * truth for deep queues. qd_tick() turns the histograms into figures at
+ * every output tick and starts them over.
+ */
+
+// Histogram bin of a depth (also used by the analysis, with more bins)
+uint32_t
+qd_bin(uint64_t d, uint32_t nbins){
+    // Local variables
+    uint32_t            o;              // Octave (floor(log2(d)))
+    uint32_t            b;              // Bin
+
+    if (d < XSIS_QD_EXACT)
+        return(d);
+    o = 63 - __builtin_clzll(d);
+    b = XSIS_QD_EXACT + (o-4)*4 + ((d >> (o-2)) & 3);
+    return((b < nbins) ? b : nbins-1);
+}
+
+// Deepest depth falling in a bin
+uint64_t
+qd_top(uint32_t b, uint32_t nbins){
+    // Local variables
+    uint32_t            o;              // Octave of the bin
+
+    if (b < XSIS_QD_EXACT)
+        return(b);
+    if (b == nbins-1)
+        return(UINT64_MAX);
+    o = 4 + (b - XSIS_QD_EXACT)/4;
+    return(((uint64_t)(4 + (b - XSIS_QD_EXACT)%4 + 1) << (o-2)) - 1);
+}
+
+// Take a sample of every VBD
+static void
+qd_sample(xsis_qd_t *qd){
+    // Local variables
+    const volatile tapdisk_stats *page; // Stats page of vbd
+    xsis_vbdqd_t        *h;             // Histogram of vbd
+    xsis_vbd_t          *vbd;           // Temporary VBD iterator
+    uint64_t            rcp, wcp;       // Requests completed
+    uint64_t            rop, wop;       // Requests submitted
+    uint64_t            d;              // Requests in flight
+
+    LIST_FOREACH(vbd, &qd->vbds->list, vbds){
+        if (!vbd->qd && !(vbd->qd = calloc(1, sizeof(xsis_vbdqd_t)))){
+            perror("calloc");
+            return;
+        }
+        h = vbd->qd;
+
+        // Completions first, so a torn read can only undercount
+        page = (const volatile tapdisk_stats *)vbd->shmmap;
+        rcp = page->read_reqs_completed;
+        wcp = page->write_reqs_completed;
+        rop = page->read_reqs_submitted;
+        wop = page->write_reqs_submitted;
+        d = ((rop > rcp) ? rop - rcp : 0) + ((wop > wcp) ? wop - wcp : 0);
+
+        h->bins[qd_bin(d, XSIS_QD_NBINS)]++;
+        h->n++;
+        h->sum += d;
+        if (d){
+            h->busy++;
+            if (d > h->max)
+                h->max = d;
+        }
+    }
+}
+
+// Sampling timer expired
+static int
+qd_cb(xsis_evtsrc_t *src, uint32_t events){
+    // Local variables
+    xsis_qd_t           *qd = src->arg; // Queue depth sampler
+    uint64_t            exp;            // Timer expiries
+
+    // Expiries missed are not made up for (samples just get sparser)
+    if (read(src->fd, &exp, sizeof(exp)) == sizeof(exp))
+        qd_sample(qd);
+    return(0);
+}
+
+// Smallest depth at least 'rank' samples are at or under
+static float
+qd_rank(xsis_vbdqd_t *h, uint32_t rank){
+    // Local variables
+    uint64_t            top;            // Deepest depth of the bin
+    uint32_t            sum = 0;        // Samples in bins so far
+    uint32_t            b;              // Bin
+
+    for (b = 0; b < XSIS_QD_NBINS-1; b++)
+        if ((sum += h->bins[b]) >= rank)
+            break;
+    top = qd_top(b, XSIS_QD_NBINS);
+    return((top < h->max) ? top : h->max);
+}
+
+void
+qd_tick(xsis_qd_t *qd){
+    // Local variables
+    xsis_vbdqd_t        *h;             // Histogram of vbd
+    xsis_vbd_t          *vbd;           // Temporary VBD iterator
+
+    LIST_FOREACH(vbd, &qd->vbds->list, vbds){
+        if (!(h = vbd->qd))
+            continue;
+        if (!h->n){
+            memset(h->out, 0, sizeof(h->out));
+            continue;
+        }
+        h->out[XSIS_QD_MEAN] = (float)h->sum/h->n;
+        h->out[XSIS_QD_P50] = qd_rank(h, (h->n + 1)/2);
+        h->out[XSIS_QD_P99] = qd_rank(h, h->n - h->n/100);
+        h->out[XSIS_QD_MAX] = h->max;
+        h->out[XSIS_QD_BUSY] = (float)h->busy/h->n;
+
+        // Start the next interval over
+        memset(h->bins, 0, sizeof(h->bins));
+        h->n = h->busy = 0;
+        h->sum = h->max = 0;
+    }
+}
+
+int
+qd_open(xsis_qd_t **qd, uint32_t hz, xsis_evt_t *evt, xsis_vbds_t *vbds){
+    // Local variables
+    struct itimerspec   its;            // Timer setup
+    uint64_t            ns;             // Sampling interval (ns)
+    int                 err = 0;        // Return code
+
+    // Allocate sampler context
+    if (!(*qd = calloc(1, sizeof(xsis_qd_t)))){
+        perror("calloc");
+        goto err;
+    }
+    (*qd)->src.fd = -1;
+    (*qd)->hz = hz;
+    (*qd)->vbds = vbds;
+
+    // Sample from a periodic timer on the event loop
+    if (((*qd)->src.fd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC)) < 0){
+        perror("timerfd_create");
+        goto err;
+    }
+    ns = 1000000000ULL/hz;
+    its.it_value.tv_sec = its.it_interval.tv_sec = ns/1000000000;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = ns%1000000000;
+    if (timerfd_settime((*qd)->src.fd, 0, &its, NULL) < 0){
+        perror("timerfd_settime");
+        goto err;
+    }
+    (*qd)->src.cb = qd_cb;
+    (*qd)->src.arg = *qd;
+    if (evt_add(evt, &(*qd)->src, EPOLLIN))
+        goto err;
+
+out:
+    // Return
+    return(err);
+
+err:
+    qd_close(*qd);
+    *qd = NULL;
+    err = 1;
+    goto out;
+}
+
+void
+qd_close(xsis_qd_t *qd){
+    // Release sampler resources (histograms go with their VBDs)
+    if (qd){
+        if (qd->src.fd >= 0)
+            (void)close(qd->src.fd);
+        free(qd);
+    }
+}
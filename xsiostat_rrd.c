@@ -0,0 +1,534 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_rrd.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "xsiostat.h"
+
+/*
+ * xcp-rrdd plugin, version 2 of the shared page protocol. The page is:
+ *
+ *     "DATASOURCES"                       11 bytes
+ *     CRC32 of timestamp and values       4
+ *     CRC32 of metadata                   4
+ *     datasource count (n)                4
+ *     timestamp (seconds since epoch)     8
+ *     values (int64 or double)            8 * n
+ *     metadata length                     4
+ *     metadata (JSON)
+ *
+ * all big endian. xcp-rrdd skips a page whose data checksum it has seen
+ * before, and only parses the metadata again when its checksum changes.
+ * Here too the metadata is only rebuilt when the VBD set changes (slots
+ * only move then); other ticks rewrite the timestamp and values in place.
+ * A reader catching a write half done fails the checksum and retries.
+ *
+ * Datasources are owned by the VM of the VBD's domain when xenstore has
+ * it, by the host otherwise (with the domid in their names).
+ */
+
+#define RRD_MAGIC               "DATASOURCES"
+#define RRD_DATACRC             11      // Offset of the data checksum
+#define RRD_METACRC             15      // Offset of the metadata checksum
+#define RRD_COUNT               19      // Offset of the datasource count
+#define RRD_TS                  23      // Offset of the timestamp
+#define RRD_VALUES              31      // Offset of the first value
+
+#define RRD_RATE                0       // Rate (rate[a])
+#define RRD_TPUT                1       // Throughput in bytes (rate[a])
+#define RRD_QUEUE               2       // Average queue size (r+w)
+#define RRD_LOWMEM              3       // Low memory mode (0 or 1)
+
+// Datasources of each VBD, in page order
+static const struct {
+    const char          *name;          // name suffix
+    uint8_t             kind;           // RRD_*
+    uint8_t             a;              // rate index
+    const char          *units;         // units
+    const char          *desc;          // description
+} rrd_dss[] = {
+    { "iops_read", RRD_RATE, XSIS_RATE_RIOPS, "requests/s",
+      "Read requests per second" },
+    { "iops_write", RRD_RATE, XSIS_RATE_WIOPS, "requests/s",
+      "Write requests per second" },
+    { "read", RRD_TPUT, XSIS_RATE_RTPUT, "B/s",
+      "Bytes read per second" },
+    { "write", RRD_TPUT, XSIS_RATE_WTPUT, "B/s",
+      "Bytes written per second" },
+    { "avgqu_sz", RRD_QUEUE, 0, "requests",
+      "Average queue size (reads and writes)" },
+    { "lowmem", RRD_LOWMEM, 0, "",
+      "Tapdisk in low memory mode" },
+};
+#define RRD_NDSS    (sizeof(rrd_dss)/sizeof(rrd_dss[0]))
+
+// CRC32 (as zlib's crc32()), table built by rrd_open()
+static uint32_t rrd_crctbl[256];
+
+static void
+rrd_crc_init(void){
+    // Local variables
+    uint32_t            c;              // Table entry
+    int                 i, j;           // Temporary indexes
+
+    for (i = 0; i < 256; i++){
+        c = i;
+        for (j = 0; j < 8; j++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        rrd_crctbl[i] = c;
+    }
+}
+
+static uint32_t
+rrd_crc(const char *buf, size_t len){
+    // Local variables
+    uint32_t            c = 0xffffffff; // Running CRC
+    size_t              i;              // Byte index
+
+    for (i = 0; i < len; i++)
+        c = rrd_crctbl[(c ^ (uint8_t)buf[i]) & 0xff] ^ (c >> 8);
+    return(c ^ 0xffffffff);
+}
+
+static void
+rrd_put32(char *p, uint32_t v){
+    v = htobe32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void
+rrd_put64(char *p, uint64_t v){
+    v = htobe64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static void
+rrd_putd(char *p, double d){
+    // Local variables
+    uint64_t            v;              // Bits of d
+
+    memcpy(&v, &d, sizeof(v));
+    rrd_put64(p, v);
+}
+
+// Linux name of a Xen virtual disk (e.g. 51712 is xvda, 768 hda)
+static void
+rrd_dev(uint32_t vbdid, char *buf, size_t len){
+    // Local variables
+    const char          *pfx;           // Device name prefix
+    uint32_t            disk;           // Disk index
+    uint32_t            minor;          // Minor number
+
+    minor = vbdid & 0xff;
+    if (vbdid & (1 << 28)){
+        pfx = "xvd";
+        disk = (vbdid >> 8) & 0xfffff;
+    } else
+    switch (vbdid >> 8){
+    case 202:
+        pfx = "xvd";
+        disk = minor >> 4;
+        break;
+    case 8:
+        pfx = "sd";
+        disk = minor >> 4;
+        break;
+    case 3:
+        pfx = "hd";
+        disk = minor >> 6;
+        break;
+    case 22:
+        pfx = "hd";
+        disk = 2 + (minor >> 6);
+        break;
+    default:
+        (void)snprintf(buf, len, "%u", vbdid);
+        return;
+    }
+    if (disk < 26)
+        (void)snprintf(buf, len, "%s%c", pfx, 'a' + disk);
+    else
+        (void)snprintf(buf, len, "%s%c%c", pfx, 'a' + disk/26 - 1,
+                       'a' + disk%26);
+}
+
+// VM of a domain (looked up in xenstore the first time)
+static const char *
+rrd_vm(xsis_rrd_t *rrd, xsis_vbds_t *vbds, uint32_t domid){
+    // Local variables
+    xsis_rrdvm_t        *vms;           // Reallocated table
+    uint32_t            lo = 0;         // Search lower bound
+    uint32_t            hi;             // Search upper bound
+    uint32_t            mid;            // Search midpoint
+
+    hi = rrd->nvms;
+    while (lo < hi){
+        mid = lo + (hi-lo)/2;
+        if (rrd->vms[mid].domid < domid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < rrd->nvms && rrd->vms[lo].domid == domid){
+        rrd->vms[lo].used = 1;
+        return(rrd->vms[lo].uuid);
+    }
+
+    // Miss (a failure only costs a host owned datasource)
+    if (rrd->nvms == rrd->vmsz){
+        if (!(vms = realloc(rrd->vms, (rrd->vmsz ? rrd->vmsz*2 : 64) *
+                                      sizeof(xsis_rrdvm_t))))
+            return("");
+        rrd->vms = vms;
+        rrd->vmsz = rrd->vmsz ? rrd->vmsz*2 : 64;
+    }
+    memmove(&rrd->vms[lo+1], &rrd->vms[lo],
+            (rrd->nvms-lo)*sizeof(xsis_rrdvm_t));
+    rrd->nvms++;
+    rrd->vms[lo].domid = domid;
+    rrd->vms[lo].used = 1;
+    if (!vbds->xsc || xsc_vm(vbds->xsc->xsh, domid, rrd->vms[lo].uuid,
+                             sizeof(rrd->vms[lo].uuid)))
+        rrd->vms[lo].uuid[0] = '\0';
+    return(rrd->vms[lo].uuid);
+}
+
+// Rebuild the metadata and lay the page out for the current VBD set
+static int
+rrd_meta(xsis_rrd_t *rrd, xsis_vbds_t *vbds){
+    // Local variables
+    xsis_snap_t         *snap;          // Snapshot of all VBDs
+    const char          *vm;            // VM owning a VBD ("" = host)
+    char                dev[16];        // Device name of a VBD
+    char                *page;          // Reallocated page
+    size_t              need;           // Page length
+    uint32_t            s;              // Slot index
+    uint32_t            i, j;           // Temporary indexes
+
+    snap = &vbds->snap;
+    for (i = 0; i < rrd->nvms; i++)
+        rrd->vms[i].used = 0;
+
+    rrd->meta.len = 0;
+    fmt_str(&rrd->meta, "{\"datasources\":{");
+    for (s = 0; s < snap->nslots; s++){
+        vm = rrd_vm(rrd, vbds, snap->ids[s].domid);
+        rrd_dev(snap->ids[s].vbdid, dev, sizeof(dev));
+        for (i = 0; i < RRD_NDSS; i++){
+            fmt_str(&rrd->meta, (s || i) ? ",\"xsiostat_" : "\"xsiostat_");
+            if (!*vm){
+                fmt_uint(&rrd->meta, snap->ids[s].domid, 0);
+                fmt_str(&rrd->meta, "_");
+            }
+            fmt_str(&rrd->meta, dev);
+            fmt_str(&rrd->meta, "_");
+            fmt_str(&rrd->meta, rrd_dss[i].name);
+            fmt_str(&rrd->meta, "\":{\"description\":\"");
+            fmt_str(&rrd->meta, rrd_dss[i].desc);
+            fmt_str(&rrd->meta, "\",\"owner\":\"");
+            if (*vm){
+                fmt_str(&rrd->meta, "vm ");
+                fmt_str(&rrd->meta, vm);
+            } else
+                fmt_str(&rrd->meta, "host");
+            fmt_str(&rrd->meta, (rrd_dss[i].kind == RRD_LOWMEM) ?
+                                "\",\"value_type\":\"int64\"" :
+                                "\",\"value_type\":\"float\"");
+            fmt_str(&rrd->meta, ",\"type\":\"gauge\",\"default\":\"true\"," \
+                                "\"units\":\"");
+            fmt_str(&rrd->meta, rrd_dss[i].units);
+            fmt_str(&rrd->meta, (rrd_dss[i].kind == RRD_LOWMEM) ?
+                                "\",\"min\":\"0.0\",\"max\":\"1.0\"}" :
+                                "\",\"min\":\"0.0\",\"max\":\"inf\"}");
+        }
+    }
+    fmt_str(&rrd->meta, "}}");
+    if (rrd->meta.err)
+        return(1);
+
+    // Forget domains that went away (their ids may be reused)
+    for (i = j = 0; i < rrd->nvms; i++)
+        if (rrd->vms[i].used)
+            rrd->vms[j++] = rrd->vms[i];
+    rrd->nvms = j;
+
+    // Lay the page out
+    rrd->nds = snap->nslots*RRD_NDSS;
+    need = RRD_VALUES + (size_t)rrd->nds*8 + 4 + rrd->meta.len;
+    if (need > rrd->size){
+        if (!(page = realloc(rrd->page, need))){
+            perror("realloc");
+            return(1);
+        }
+        rrd->page = page;
+        rrd->size = need;
+    }
+    memcpy(rrd->page, RRD_MAGIC, RRD_DATACRC);
+    rrd_put32(rrd->page + RRD_METACRC, rrd_crc(rrd->meta.buf, rrd->meta.len));
+    rrd_put32(rrd->page + RRD_COUNT, rrd->nds);
+    rrd_put32(rrd->page + RRD_VALUES + (size_t)rrd->nds*8, rrd->meta.len);
+    memcpy(rrd->page + RRD_VALUES + (size_t)rrd->nds*8 + 4, rrd->meta.buf,
+           rrd->meta.len);
+    rrd->len = need;
+    return(0);
+}
+
+// Call a Plugin.Local method of xcp-rrdd (XML-RPC on its Unix socket)
+static int
+rrd_rpc(xsis_rrd_t *rrd, const char *method){
+    // Local variables
+    struct sockaddr_un  addr;           // xcp-rrdd socket address
+    struct timeval      tv;             // Socket timeout
+    char                body[1024];     // Request body
+    char                req[1536];      // Request
+    char                rsp[512];       // Response (head of)
+    size_t              off;            // Bytes sent or received
+    ssize_t             n;              // Bytes sent or received by a call
+    int                 len;            // Request length
+    int                 fd;             // Socket
+    int                 err = 1;        // Return code
+
+    len = snprintf(body, sizeof(body), "<?xml version=\"1.0\"?><methodCall>" \
+                   "<methodName>Plugin.Local.%s</methodName><params><param>" \
+                   "<value><struct><member><name>uid</name><value><string>" \
+                   "%s</string></value></member>%s</struct></value></param>" \
+                   "</params></methodCall>", method, rrd->uid,
+                   strcmp(method, "register") ? "" :
+                   "<member><name>info</name><value><string>Five_seconds" \
+                   "</string></value></member><member><name>protocol</name>" \
+                   "<value><string>V2</string></value></member>");
+    len = snprintf(req, sizeof(req), "POST / HTTP/1.0\r\nHost: localhost\r\n" \
+                   "Content-Type: text/xml\r\nContent-Length: %d\r\n\r\n%s",
+                   len, body);
+
+    // A stuck xcp-rrdd must not stall sampling for long
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return(1);
+    tv.tv_sec = XSIS_RRD_TIMEOUT;
+    tv.tv_usec = 0;
+    (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, XSIS_RRD_SOCK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto out;
+    for (off = 0; off < (size_t)len; off += n)
+        if ((n = write(fd, req + off, len - off)) <= 0)
+            goto out;
+    for (off = 0; off < sizeof(rsp) - 1; off += n)
+        if ((n = read(fd, rsp + off, sizeof(rsp) - 1 - off)) <= 0)
+            break;
+    rsp[off] = '\0';
+
+    // The call worked if it got a 200 without a fault
+    if (!strncmp(rsp, "HTTP/1.", 7) && !strncmp(rsp + 8, " 200", 4) &&
+        !strstr(rsp, "<fault>"))
+        err = 0;
+
+out:
+    // Return
+    (void)close(fd);
+    return(err);
+}
+
+// (Re)register the plugin (xcp-rrdd forgets plugins when it restarts)
+static void
+rrd_register(xsis_rrd_t *rrd){
+    if (rrd_rpc(rrd, "register")){
+        if (rrd->registered)
+            fprintf(stderr, "Could not register with xcp-rrdd (%s), will" \
+                            " retry.\n", XSIS_RRD_SOCK);
+        rrd->registered = 0;
+    } else
+        rrd->registered = 1;
+}
+
+int
+rrd_tick(xsis_rrd_t *rrd, xsis_vbds_t *vbds){
+    // Local variables
+    xsis_snap_t         *snap;          // Snapshot of all VBDs
+    uint64_t            setver;         // Current VBD set
+    uint8_t             full;           // Metadata rebuilt (flag)
+    size_t              len;            // Bytes of page to write
+    size_t              off;            // Bytes written so far
+    ssize_t             n;              // Bytes written by pwrite()
+    char                *val;           // Next value
+    double              d;              // Temporary value
+    uint32_t            s;              // Slot index
+    uint32_t            i;              // Datasource index
+
+    // Only a change of VBD set moves slots (and needs new metadata)
+    snap = &vbds->snap;
+    setver = vbds->nattached + vbds->ndetached;
+    if ((full = (!rrd->built || setver != rrd->setver))){
+        if (rrd_meta(rrd, vbds))
+            return(1);
+        rrd->setver = setver;
+        rrd->built = 1;
+    }
+
+    // Update the values in place
+    rrd_put64(rrd->page + RRD_TS, (uint64_t)time(NULL));
+    val = rrd->page + RRD_VALUES;
+    for (s = 0; s < snap->nslots; s++){
+        for (i = 0; i < RRD_NDSS; i++, val += 8){
+            switch (rrd_dss[i].kind){
+            case RRD_RATE:
+                d = snap->rate[rrd_dss[i].a][s];
+                break;
+            case RRD_TPUT:
+                d = (double)snap->rate[rrd_dss[i].a][s]*rrd->unit;
+                break;
+            case RRD_QUEUE:
+                d = snap->rate[XSIS_RATE_RAVGQ][s] +
+                    snap->rate[XSIS_RATE_WAVGQ][s];
+                break;
+            default:
+                rrd_put64(val, !!(snap->flags[s] & BT3_LOW_MEMORY_MODE));
+                continue;
+            }
+            rrd_putd(val, d);
+        }
+    }
+    rrd_put32(rrd->page + RRD_DATACRC,
+              rrd_crc(rrd->page + RRD_TS, 8 + (size_t)rrd->nds*8));
+
+    // Write what changed (all of it if the metadata did)
+    len = full ? rrd->len : RRD_VALUES + (size_t)rrd->nds*8;
+    for (off = 0; off < len; off += n){
+        if ((n = pwrite(rrd->fd, rrd->page + off, len - off, off)) < 0){
+            if (errno == EINTR){
+                n = 0;
+                continue;
+            }
+            perror("pwrite");
+            return(1);
+        }
+    }
+    if (full && ftruncate(rrd->fd, rrd->len) < 0){
+        perror("ftruncate");
+        return(1);
+    }
+
+    if (rrd->uid && ++rrd->ticks >= rrd->regticks){
+        rrd->ticks = 0;
+        rrd_register(rrd);
+    }
+    return(0);
+}
+
+int
+rrd_open(xsis_rrd_t **rrd, char *arg, uint32_t interval, uint32_t unit){
+    // Local variables
+    int                 err = 0;        // Return code
+
+    // Allocate plugin context
+    if (!(*rrd = calloc(1, sizeof(xsis_rrd_t)))){
+        perror("calloc");
+        goto err;
+    }
+    (*rrd)->fd = -1;
+    (*rrd)->unit = unit;
+    fmt_init(&(*rrd)->meta, XSIS_FMT_TABLE);
+    rrd_crc_init();
+
+    // A pathname is written to as is; a uid is registered with xcp-rrdd
+    if (strchr(arg, '/')){
+        if (!((*rrd)->path = strdup(arg))){
+            perror("strdup");
+            goto err;
+        }
+    } else {
+        if (!*arg || arg[strspn(arg, "abcdefghijklmnopqrstuvwxyz" \
+                                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ" \
+                                     "0123456789_-.")]){
+            fprintf(stderr, "Invalid plugin uid '%s'.\n", arg);
+            goto err;
+        }
+        if (!((*rrd)->uid = strdup(arg))){
+            perror("strdup");
+            goto err;
+        }
+        if (asprintf(&(*rrd)->path, XSIS_RRD_DIR "/%s", arg) < 0){
+            (*rrd)->path = NULL;
+            perror("asprintf");
+            goto err;
+        }
+        if (mkdir(XSIS_RRD_DIR, 0755) < 0 && errno != EEXIST){
+            perror("mkdir");
+            goto err;
+        }
+
+        // Register on the first tick, when the page has been written
+        (*rrd)->regticks = (XSIS_RRD_REREG*1000 + interval - 1)/interval;
+        (*rrd)->ticks = (*rrd)->regticks - 1;
+        (*rrd)->registered = 1;
+    }
+
+    if (((*rrd)->fd = open((*rrd)->path, O_WRONLY | O_CREAT | O_TRUNC |
+                                         O_CLOEXEC, 0644)) < 0){
+        perror("open");
+        goto err;
+    }
+
+out:
+    // Return
+    return(err);
+
+err:
+    rrd_close(*rrd);
+    *rrd = NULL;
+    err = 1;
+    goto out;
+}
+
+void
+rrd_close(xsis_rrd_t *rrd){
+    // Release plugin resources (deregistering first)
+    if (rrd){
+        if (rrd->uid && rrd->built && rrd->registered)
+            (void)rrd_rpc(rrd, "deregister");
+        if (rrd->fd >= 0){
+            (void)close(rrd->fd);
+            if (rrd->uid)
+                (void)unlink(rrd->path);
+        }
+        free(rrd->path);
+        free(rrd->uid);
+        free(rrd->page);
+        free(rrd->vms);
+        fmt_free(&rrd->meta);
+        free(rrd);
+    }
+}
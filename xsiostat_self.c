@@ -0,0 +1,85 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_self.c
+ * -----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "xsiostat.h"
+
+/*
+ * Each tick is split into phases (XSIS_PH_*) by marks: the time since the
+ * previous mark is charged to the phase being marked. Figures of a tick
+ * are only published by self_end(), so anything printed during a tick
+ * describes the tick before it.
+ */
+
+static uint64_t
+self_now(void){
+    // Local variables
+    struct timespec     ts;             // Current time
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec);
+}
+
+void
+self_init(xsis_self_t *self, uint32_t interval){
+    memset(self, 0, sizeof(*self));
+    self->interval = (uint64_t)interval*1000000;
+}
+
+void
+self_start(xsis_self_t *self){
+    self->mark = self_now();
+}
+
+void
+self_mark(xsis_self_t *self, int phase){
+    // Local variables
+    uint64_t            now;            // End of the phase (ns)
+
+    now = self_now();
+    self->cur[phase] += now - self->mark;
+    self->mark = now;
+}
+
+void
+self_end(xsis_self_t *self, uint64_t missed){
+    // Local variables
+    uint64_t            tick = 0;       // Tick length (ns)
+    int                 i;              // Phase index
+
+    for (i = 0; i < XSIS_NPHASES; i++){
+        tick += self->cur[i];
+        self->total[i] += self->cur[i];
+        self->last[i] = self->cur[i];
+        self->cur[i] = 0;
+    }
+    self->tick = tick;
+    self->busy += tick;
+    if (tick > self->maxtick)
+        self->maxtick = tick;
+    if (tick > self->interval)
+        self->overruns++;
+    self->missed = missed;
+    self->ticks++;
+}
@@ -0,0 +1,380 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_snap.c
+ * -----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "xsiostat.h"
+
+/*
+ * Each attached VBD owns one slot in a set of per-field arrays. Slots are
+ * kept dense: removing a VBD moves the last slot into the hole. At every
+ * tick the cur and prev arrays are swapped (no copying), every VBD writes
+ * its new counters into cur, and rates are computed in one pass per field
+ * over all slots. Each slot is timestamped (CLOCK_MONOTONIC) as its page
+ * is read, so rates are exact however long a tick takes to read.
+ *
+ * A slot whose counters did not move and has nothing in flight is idle.
+ * Once idle for a few ticks, its page is only fully read every 'every'
+ * ticks; in between, snap_probe() compares the two submission counters
+ * and the flags, and carries the slot over unchanged (nothing can
+ * complete or move with nothing in flight), falling back to a full read
+ * as soon as any of them changes.
+ *
+ * Derived figures (snap_derive) divide the integer deltas of a slot by
+ * each other in double precision, so latencies and request sizes are
+ * exact whatever the magnitude of the counters.
+ */
+
+static int
+snap_grow(xsis_snap_t *snap){
+    // Local variables
+    uint32_t            slotsz;         // New number of slots
+    void                *ptr;           // Reallocated array
+    int                 i;              // Temporary index
+
+    // Double all arrays (they are only ever grown)
+    slotsz = snap->slotsz ? snap->slotsz*2 : 64;
+#define SNAP_REALLOC(arr) \
+    if (!(ptr = realloc((arr), slotsz*sizeof(*(arr))))) \
+        goto err; \
+    (arr) = ptr;
+    for (i = 0; i < XSIS_NCTRS; i++){
+        SNAP_REALLOC(snap->cur[i]);
+        SNAP_REALLOC(snap->prev[i]);
+    }
+    for (i = 0; i < XSIS_NRATES; i++){
+        SNAP_REALLOC(snap->rate[i]);
+    }
+    for (i = 0; i < XSIS_NDRVS; i++){
+        SNAP_REALLOC(snap->drv[i]);
+    }
+    SNAP_REALLOC(snap->tcur);
+    SNAP_REALLOC(snap->tprev);
+    SNAP_REALLOC(snap->idt);
+    SNAP_REALLOC(snap->flags);
+    SNAP_REALLOC(snap->vbds);
+    SNAP_REALLOC(snap->ids);
+#undef SNAP_REALLOC
+    snap->slotsz = slotsz;
+
+    // Return
+    return(0);
+
+err:
+    perror("realloc");
+    return(1);
+}
+
+int
+snap_add(xsis_snap_t *snap, xsis_vbd_t *vbd){
+    // Local variables
+    uint32_t            slot;           // New slot
+    int                 i;              // Temporary index
+
+    // Allocate a zeroed slot at the end
+    if (snap->nslots == snap->slotsz && snap_grow(snap))
+        return(1);
+    slot = snap->nslots++;
+    for (i = 0; i < XSIS_NCTRS; i++)
+        snap->cur[i][slot] = snap->prev[i][slot] = 0;
+    for (i = 0; i < XSIS_NRATES; i++)
+        snap->rate[i][slot] = 0;
+    for (i = 0; i < XSIS_NDRVS; i++)
+        snap->drv[i][slot] = 0;
+    snap->tcur[slot] = snap->tprev[slot] = 0;
+    snap->flags[slot] = 0;
+    snap->vbds[slot] = vbd;
+    snap->ids[slot].domid = vbd->domid;
+    snap->ids[slot].vbdid = vbd->vbdid;
+    snap->ids[slot].tdpid = vbd->tdpid;
+    snap->ids[slot].reserved = 0;
+    vbd->slot = slot;
+
+    // Return
+    return(0);
+}
+
+void
+snap_del(xsis_snap_t *snap, xsis_vbd_t *vbd){
+    // Local variables
+    uint32_t            slot;           // Slot being released
+    uint32_t            last;           // Last slot in use
+    int                 i;              // Temporary index
+
+    // Move the last slot into the hole
+    slot = vbd->slot;
+    last = --snap->nslots;
+    if (slot != last){
+        for (i = 0; i < XSIS_NCTRS; i++){
+            snap->cur[i][slot] = snap->cur[i][last];
+            snap->prev[i][slot] = snap->prev[i][last];
+        }
+        for (i = 0; i < XSIS_NRATES; i++)
+            snap->rate[i][slot] = snap->rate[i][last];
+        for (i = 0; i < XSIS_NDRVS; i++)
+            snap->drv[i][slot] = snap->drv[i][last];
+        snap->tcur[slot] = snap->tcur[last];
+        snap->tprev[slot] = snap->tprev[last];
+        snap->flags[slot] = snap->flags[last];
+        snap->vbds[slot] = snap->vbds[last];
+        snap->vbds[slot]->slot = slot;
+        snap->ids[slot] = snap->ids[last];
+    }
+}
+
+void
+snap_rotate(xsis_snap_t *snap){
+    // Local variables
+    struct timespec     ts;             // Time of the rotation
+    uint64_t            *tmp;           // Temporary array pointer
+    int                 i;              // Temporary index
+
+    // Current counters become the previous ones
+    for (i = 0; i < XSIS_NCTRS; i++){
+        tmp = snap->prev[i];
+        snap->prev[i] = snap->cur[i];
+        snap->cur[i] = tmp;
+    }
+    tmp = snap->tprev;
+    snap->tprev = snap->tcur;
+    snap->tcur = tmp;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    snap->now = (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+int
+snap_copy(const volatile tapdisk_stats *page, const uint64_t *floor,
+          uint64_t *v, uint64_t *flags, uint64_t *ts){
+    // Local variables
+    tapdisk_stats       a;              // First copy of the page
+    tapdisk_stats       b;              // Second copy of the page
+    struct timespec     now;            // Time of the copy
+    int                 ok = 0;         // Copy is consistent (flag)
+    int                 try;            // Attempt number
+    int                 i;              // Temporary index
+
+    // Copy the page until two copies agree and the counters make sense
+    for (try = 0; try <= XSIS_SNAP_RETRIES && !ok; try++){
+        a = *page;
+        __sync_synchronize();
+        b = *page;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        v[XSIS_CTR_ROP] = a.read_reqs_submitted;
+        v[XSIS_CTR_RSC] = a.read_sectors;
+        v[XSIS_CTR_WOP] = a.write_reqs_submitted;
+        v[XSIS_CTR_WSC] = a.write_sectors;
+        v[XSIS_CTR_RTU] = a.read_total_ticks;
+        v[XSIS_CTR_WTU] = a.write_total_ticks;
+        v[XSIS_CTR_RCP] = a.read_reqs_completed;
+        v[XSIS_CTR_WCP] = a.write_reqs_completed;
+
+        ok = !memcmp(&a, &b, sizeof(a)) &&
+             v[XSIS_CTR_RCP] <= v[XSIS_CTR_ROP] &&
+             v[XSIS_CTR_WCP] <= v[XSIS_CTR_WOP];
+        for (i = 0; ok && floor && i < XSIS_NCTRS; i++)
+            ok = (v[i] >= floor[i]);
+    }
+    *flags = a.flags;
+    *ts = (uint64_t)now.tv_sec*1000000000 + now.tv_nsec;
+
+    // Return the number of attempts
+    return(try);
+}
+
+void
+snap_read(xsis_snap_t *snap, uint32_t slot,
+          const volatile tapdisk_stats *page){
+    // Local variables
+    uint64_t            v[XSIS_NCTRS];  // Counters from the page
+    uint64_t            floor[XSIS_NCTRS]; // Counters of the last tick
+    int                 i;              // Temporary index
+
+    for (i = 0; i < XSIS_NCTRS; i++)
+        floor[i] = snap->prev[i][slot];
+    if (snap_copy(page, floor, v, &snap->flags[slot], &snap->tcur[slot]) > 1)
+        snap->torn++;
+
+    // Never let a counter go backwards or complete more than submitted
+    for (i = 0; i < XSIS_NCTRS; i++)
+        snap->cur[i][slot] = (v[i] < floor[i]) ? floor[i] : v[i];
+    if (snap->cur[XSIS_CTR_RCP][slot] > snap->cur[XSIS_CTR_ROP][slot])
+        snap->cur[XSIS_CTR_RCP][slot] = snap->cur[XSIS_CTR_ROP][slot];
+    if (snap->cur[XSIS_CTR_WCP][slot] > snap->cur[XSIS_CTR_WOP][slot])
+        snap->cur[XSIS_CTR_WCP][slot] = snap->cur[XSIS_CTR_WOP][slot];
+}
+
+int
+snap_probe(xsis_snap_t *snap, uint32_t slot,
+           const volatile tapdisk_stats *page){
+    // Local variables
+    int                 i;              // Temporary index
+
+    // Any new request, or a change of mode (e.g. entering low memory
+    // mode while idle), needs a full read
+    if (page->read_reqs_submitted != snap->prev[XSIS_CTR_ROP][slot] ||
+        page->write_reqs_submitted != snap->prev[XSIS_CTR_WOP][slot] ||
+        page->flags != snap->flags[slot])
+        return(0);
+
+    // Otherwise the page is as it was (flags are not rotated)
+    for (i = 0; i < XSIS_NCTRS; i++)
+        snap->cur[i][slot] = snap->prev[i][slot];
+    snap->tcur[slot] = snap->now;
+    snap->probed++;
+    return(1);
+}
+
+int
+snap_idle(xsis_snap_t *snap, uint32_t slot){
+    // Local variables
+    int                 i;              // Temporary index
+
+    for (i = 0; i < XSIS_NCTRS; i++)
+        if (snap->cur[i][slot] != snap->prev[i][slot])
+            return(0);
+    return(snap->cur[XSIS_CTR_ROP][slot] == snap->cur[XSIS_CTR_RCP][slot] &&
+           snap->cur[XSIS_CTR_WOP][slot] == snap->cur[XSIS_CTR_WCP][slot] &&
+           !(snap->flags[slot] & BT3_LOW_MEMORY_MODE));
+}
+
+// Per-second rate of a counter over all slots
+static void
+snap_rate(float *restrict rate, const uint64_t *restrict cur,
+          const uint64_t *restrict prev, const float *restrict idt,
+          uint32_t nslots, float scale){
+    // Local variables
+    uint32_t            i;              // Slot index
+
+    for (i = 0; i < nslots; i++)
+        rate[i] = (float)(cur[i] - prev[i]) * scale * idt[i];
+}
+
+void
+snap_rates(xsis_snap_t *snap, uint32_t unit){
+    // Local variables
+    float               ops;            // Scale for operations
+    float               tput;           // Scale for sectors
+    float               avgq;           // Scale for ticks (usecs)
+    uint32_t            i;              // Slot index
+
+    // Inverse of each slot's sampling period (0 until it has two samples)
+    for (i = 0; i < snap->nslots; i++)
+        snap->idt[i] = (snap->tprev[i] && snap->tcur[i] > snap->tprev[i]) ?
+                       1e9f / (float)(snap->tcur[i] - snap->tprev[i]) : 0;
+
+    ops = 1;
+    tput = (float)XSIS_SECTOR_SZ / (float)unit;
+    avgq = 1.0f / 1000000;
+
+    snap_rate(snap->rate[XSIS_RATE_RIOPS], snap->cur[XSIS_CTR_ROP],
+              snap->prev[XSIS_CTR_ROP], snap->idt, snap->nslots,
+              ops);
+    snap_rate(snap->rate[XSIS_RATE_WIOPS], snap->cur[XSIS_CTR_WOP],
+              snap->prev[XSIS_CTR_WOP], snap->idt, snap->nslots,
+              ops);
+    snap_rate(snap->rate[XSIS_RATE_RTPUT], snap->cur[XSIS_CTR_RSC],
+              snap->prev[XSIS_CTR_RSC], snap->idt, snap->nslots,
+              tput);
+    snap_rate(snap->rate[XSIS_RATE_WTPUT], snap->cur[XSIS_CTR_WSC],
+              snap->prev[XSIS_CTR_WSC], snap->idt, snap->nslots,
+              tput);
+    snap_rate(snap->rate[XSIS_RATE_RAVGQ], snap->cur[XSIS_CTR_RTU],
+              snap->prev[XSIS_CTR_RTU], snap->idt, snap->nslots,
+              avgq);
+    snap_rate(snap->rate[XSIS_RATE_WAVGQ], snap->cur[XSIS_CTR_WTU],
+              snap->prev[XSIS_CTR_WTU], snap->idt, snap->nslots,
+              avgq);
+}
+
+// Ratio of two counter deltas (0 if nothing was counted)
+static inline double
+snap_ratio(uint64_t num, uint64_t den, double scale){
+    return(den ? (double)num * scale / (double)den : 0);
+}
+
+void
+snap_derive(xsis_snap_t *snap){
+    // Local variables
+    uint64_t            d[XSIS_NCTRS];  // Counter deltas of a slot
+    uint64_t            dt;             // Sampling period of a slot (ns)
+    double              util;           // Utilisation of a slot (%)
+    uint32_t            i;              // Slot index
+    int                 c;              // Counter index
+
+    // Divide integer deltas in double precision, once per slot
+    for (i = 0; i < snap->nslots; i++){
+        if (!snap->tprev[i] || snap->tcur[i] <= snap->tprev[i]){
+            for (c = 0; c < XSIS_NDRVS; c++)
+                snap->drv[c][i] = 0;
+            continue;
+        }
+        dt = snap->tcur[i] - snap->tprev[i];
+        for (c = 0; c < XSIS_NCTRS; c++)
+            d[c] = snap->cur[c][i] - snap->prev[c][i];
+
+        snap->drv[XSIS_DRV_IOPS][i] = snap_ratio(d[XSIS_CTR_ROP] +
+                                                 d[XSIS_CTR_WOP], dt, 1e9);
+        snap->drv[XSIS_DRV_RLAT][i] = snap_ratio(d[XSIS_CTR_RTU],
+                                                 d[XSIS_CTR_RCP], 1);
+        snap->drv[XSIS_DRV_WLAT][i] = snap_ratio(d[XSIS_CTR_WTU],
+                                                 d[XSIS_CTR_WCP], 1);
+        snap->drv[XSIS_DRV_RRQSZ][i] = snap_ratio(d[XSIS_CTR_RSC],
+                                                  d[XSIS_CTR_ROP],
+                                                  XSIS_SECTOR_SZ/1024.0);
+        snap->drv[XSIS_DRV_WRQSZ][i] = snap_ratio(d[XSIS_CTR_WSC],
+                                                  d[XSIS_CTR_WOP],
+                                                  XSIS_SECTOR_SZ/1024.0);
+
+        // Time in service over the period is the average queue size; it
+        // is the utilisation while requests do not overlap, an upper bound
+        // of it when they do
+        util = snap_ratio(d[XSIS_CTR_RTU] + d[XSIS_CTR_WTU], dt, 1e5);
+        snap->drv[XSIS_DRV_UTIL][i] = (util < 100) ? util : 100;
+    }
+}
+
+void
+snap_free(xsis_snap_t *snap){
+    // Local variables
+    int                 i;              // Temporary index
+
+    // Release all arrays
+    for (i = 0; i < XSIS_NCTRS; i++){
+        free(snap->cur[i]);
+        free(snap->prev[i]);
+    }
+    for (i = 0; i < XSIS_NRATES; i++)
+        free(snap->rate[i]);
+    for (i = 0; i < XSIS_NDRVS; i++)
+        free(snap->drv[i]);
+    free(snap->tcur);
+    free(snap->tprev);
+    free(snap->idt);
+    free(snap->flags);
+    free(snap->vbds);
+    free(snap->ids);
+    memset(snap, 0, sizeof(*snap));
+}
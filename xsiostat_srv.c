@@ -0,0 +1,598 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_srv.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/queue.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "xsiostat.h"
+
+/*
+ * Scrapers connect to a Unix socket and send an HTTP request; they get
+ * the counters and rates of every VBD as OpenMetrics text. The response
+ * is rendered at most once per tick, on the first scrape after it, and
+ * shared (reference counted) by every scraper of that tick, so a slow
+ * scraper still gets a consistent response after the next tick. All
+ * sockets are sources of the main event loop. A scraper making no
+ * progress (nothing read or sent) for SRV_TIMEOUT seconds is dropped,
+ * whatever the interval.
+ */
+
+#define SRV_TIMEOUT             10      // Seconds before dropping a scraper
+
+#define SRV_CTR                 0       // Counter (cur[a])
+#define SRV_RATE                1       // Rate gauge (rate[a])
+#define SRV_DIFF                2       // Difference gauge (cur[a]-cur[b])
+
+// Metric families, in output order
+static const struct {
+    const char          *name;          // family name
+    uint8_t             kind;           // SRV_*
+    uint8_t             a;              // counter or rate index
+    uint8_t             b;              // counter subtracted (SRV_DIFF)
+    const char          *help;          // description
+} srv_metrics[] = {
+    { "xsiostat_read_requests", SRV_CTR, XSIS_CTR_ROP, 0,
+      "Read requests submitted" },
+    { "xsiostat_read_completed", SRV_CTR, XSIS_CTR_RCP, 0,
+      "Read requests completed" },
+    { "xsiostat_read_sectors", SRV_CTR, XSIS_CTR_RSC, 0,
+      "Sectors read" },
+    { "xsiostat_read_ticks_microseconds", SRV_CTR, XSIS_CTR_RTU, 0,
+      "Time spent on read requests" },
+    { "xsiostat_write_requests", SRV_CTR, XSIS_CTR_WOP, 0,
+      "Write requests submitted" },
+    { "xsiostat_write_completed", SRV_CTR, XSIS_CTR_WCP, 0,
+      "Write requests completed" },
+    { "xsiostat_write_sectors", SRV_CTR, XSIS_CTR_WSC, 0,
+      "Sectors written" },
+    { "xsiostat_write_ticks_microseconds", SRV_CTR, XSIS_CTR_WTU, 0,
+      "Time spent on write requests" },
+    { "xsiostat_read_inflight", SRV_DIFF, XSIS_CTR_ROP, XSIS_CTR_RCP,
+      "Read requests in flight" },
+    { "xsiostat_write_inflight", SRV_DIFF, XSIS_CTR_WOP, XSIS_CTR_WCP,
+      "Write requests in flight" },
+    { "xsiostat_read_iops", SRV_RATE, XSIS_RATE_RIOPS, 0,
+      "Read requests per second over the last interval" },
+    { "xsiostat_write_iops", SRV_RATE, XSIS_RATE_WIOPS, 0,
+      "Write requests per second over the last interval" },
+    { "xsiostat_read_mbps", SRV_RATE, XSIS_RATE_RTPUT, 0,
+      "Read throughput (MB/s) over the last interval" },
+    { "xsiostat_write_mbps", SRV_RATE, XSIS_RATE_WTPUT, 0,
+      "Write throughput (MB/s) over the last interval" },
+    { "xsiostat_read_avg_queue", SRV_RATE, XSIS_RATE_RAVGQ, 0,
+      "Average read queue size over the last interval" },
+    { "xsiostat_write_avg_queue", SRV_RATE, XSIS_RATE_WAVGQ, 0,
+      "Average write queue size over the last interval" },
+};
+
+// Queue depth gauges (--qd), indexed by XSIS_QD_*
+static const struct {
+    const char          *name;          // family name
+    const char          *help;          // description
+} srv_qds[XSIS_NQDS] = {
+    { "xsiostat_queue_depth_mean",
+      "Mean requests in flight sampled over the last interval" },
+    { "xsiostat_queue_depth_p50",
+      "Median requests in flight sampled over the last interval" },
+    { "xsiostat_queue_depth_p99",
+      "99th percentile of requests in flight over the last interval" },
+    { "xsiostat_queue_depth_max",
+      "Most requests in flight sampled over the last interval" },
+    { "xsiostat_busy_ratio",
+      "Fraction of samples with requests in flight over the last interval" },
+};
+
+// Derived figure gauges (-x), indexed by XSIS_DRV_*
+static const struct {
+    const char          *name;          // family name
+    const char          *help;          // description
+} srv_drvs[XSIS_NDRVS] = {
+    { "xsiostat_iops",
+      "Requests per second (r+w) over the last interval" },
+    { "xsiostat_read_latency_microseconds",
+      "Average read service time over the last interval" },
+    { "xsiostat_write_latency_microseconds",
+      "Average write service time over the last interval" },
+    { "xsiostat_read_request_kibibytes",
+      "Average read request size over the last interval" },
+    { "xsiostat_write_request_kibibytes",
+      "Average write request size over the last interval" },
+    { "xsiostat_utilisation_percent",
+      "Time with requests in service over the last interval" },
+};
+
+// Tapdisk gauges (--cpu), indexed by XSIS_CPU_*
+static const struct {
+    const char          *name;          // family name
+    const char          *help;          // description
+} srv_cpus[XSIS_NCPUS] = {
+    { "xsiostat_tapdisk_cpu_percent",
+      "CPU time used by the tapdisk over the last interval" },
+    { "xsiostat_tapdisk_cpu_microseconds_per_request",
+      "CPU time used by the tapdisk per request of its VBDs" },
+    { "xsiostat_tapdisk_context_switches_per_second",
+      "Context switches of the tapdisk over the last interval" },
+    { "xsiostat_tapdisk_syscalls_per_second",
+      "Read and write syscalls of the tapdisk over the last interval" },
+};
+
+// Tick phases, as labels of xsiostat_self_phase_microseconds
+static const char *srv_phases[XSIS_NPHASES] = {
+    "scan", "snapshot", "rates", "output", "record"
+};
+
+// Append a metric family header
+static void
+srv_family(xsis_fmt_t *fmt, const char *name, const char *type,
+           const char *help){
+    fmt_str(fmt, "# TYPE ");
+    fmt_str(fmt, name);
+    fmt_str(fmt, " ");
+    fmt_str(fmt, type);
+    fmt_str(fmt, "\n# HELP ");
+    fmt_str(fmt, name);
+    fmt_str(fmt, " ");
+    fmt_str(fmt, help);
+    fmt_str(fmt, ".\n");
+}
+
+// Append a family with a single unlabelled counter
+static void
+srv_counter(xsis_fmt_t *fmt, const char *name, const char *help,
+            uint64_t val){
+    srv_family(fmt, name, "counter", help);
+    fmt_str(fmt, name);
+    fmt_str(fmt, "_total ");
+    fmt_uint(fmt, val, 0);
+    fmt_str(fmt, "\n");
+}
+
+// Render xsiostat's own cost and counters
+static void
+srv_render_self(xsis_fmt_t *fmt, xsis_self_t *self, xsis_vbds_t *vbds){
+    // Local variables
+    int                 i;              // Phase index
+
+    srv_family(fmt, "xsiostat_self_phase_microseconds", "counter",
+               "Time spent by xsiostat in each phase of its ticks");
+    for (i = 0; i < XSIS_NPHASES; i++){
+        fmt_str(fmt, "xsiostat_self_phase_microseconds_total{phase=\"");
+        fmt_str(fmt, srv_phases[i]);
+        fmt_str(fmt, "\"} ");
+        fmt_uint(fmt, self->total[i]/1000, 0);
+        fmt_str(fmt, "\n");
+    }
+    srv_family(fmt, "xsiostat_self_tick_microseconds", "gauge",
+               "Time taken by the last complete tick");
+    fmt_str(fmt, "xsiostat_self_tick_microseconds ");
+    fmt_uint(fmt, self->tick/1000, 0);
+    fmt_str(fmt, "\n");
+    srv_counter(fmt, "xsiostat_self_ticks", "Ticks completed",
+                self->ticks);
+    srv_counter(fmt, "xsiostat_self_overruns",
+                "Ticks that took longer than the interval", self->overruns);
+    srv_counter(fmt, "xsiostat_self_missed_ticks",
+                "Timer expiries missed", self->missed);
+    if (!vbds)
+        return;
+    srv_counter(fmt, "xsiostat_self_vbds_attached", "VBDs attached",
+                vbds->nattached);
+    srv_counter(fmt, "xsiostat_self_vbds_detached", "VBDs detached",
+                vbds->ndetached);
+    srv_counter(fmt, "xsiostat_self_vbds_filtered",
+                "VBDs skipped by the domain and VBD filters",
+                vbds->nfiltered);
+    srv_counter(fmt, "xsiostat_self_attach_failures",
+                "Failed VBD attaches (retried later)", vbds->nattfail);
+    srv_counter(fmt, "xsiostat_self_torn_reads",
+                "Stats page reads that had to be retried", vbds->snap.torn);
+    srv_counter(fmt, "xsiostat_self_idle_probes",
+                "Idle VBDs carried over without reading their stats page",
+                vbds->snap.probed);
+}
+
+static uint64_t
+srv_now(void){
+    // Local variables
+    struct timespec     ts;             // Current time
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec);
+}
+
+// Time a scraper making no progress from now is dropped at (ns)
+static uint64_t
+srv_deadline(void){
+    return(srv_now() + (uint64_t)SRV_TIMEOUT*1000000000);
+}
+
+static void
+srv_unref(xsis_srvbuf_t *buf){
+    // Release a response when its last holder is done
+    if (buf && !--buf->refs){
+        free(buf->mem);
+        free(buf);
+    }
+}
+
+// Append the labels identifying a VBD
+static void
+srv_labels(xsis_fmt_t *fmt, xsis_snap_t *snap, xsis_vbd_t *vbd){
+    fmt_str(fmt, "{domid=\"");
+    fmt_uint(fmt, vbd->domid, 0);
+    fmt_str(fmt, "\",vbdid=\"");
+    fmt_uint(fmt, vbd->vbdid, 0);
+    fmt_str(fmt, "\",tdpid=\"");
+    fmt_uint(fmt, vbd->tdpid, 0);
+    fmt_str(fmt, "\",low_mem=\"");
+    fmt_uint(fmt, !!(snap->flags[vbd->slot] & BT3_LOW_MEMORY_MODE), 0);
+    fmt_str(fmt, "\"} ");
+}
+
+// Render the response for the last tick
+static xsis_srvbuf_t *
+srv_render(xsis_srv_t *srv){
+    // Local variables
+    xsis_fmt_t          *fmt;           // Response being rendered
+    xsis_snap_t         *snap;          // VBD counters and rates
+    xsis_srvbuf_t       *buf;           // Rendered response
+    xsis_vbd_t          *vbd;           // Temporary vbd iterator
+    char                hdr[XSIS_SRV_HDRSZ]; // Response header
+    size_t              hdrlen;         // Response header length
+    uint32_t            s;              // VBD slot
+    uint32_t            m;              // Metric index
+    int                 i;              // Temporary index
+
+    // Leave room in front of the body for the header
+    fmt = &srv->fmt;
+    fmt->len = 0;
+    fmt->err = 0;
+    for (i = 0; i < XSIS_SRV_HDRSZ/16; i++)
+        fmt_str(fmt, "                ");
+
+    // One family at a time, one sample per VBD (none before a tick)
+    for (m = 0; m < sizeof(srv_metrics)/sizeof(srv_metrics[0]); m++){
+        srv_family(fmt, srv_metrics[m].name,
+                   (srv_metrics[m].kind == SRV_CTR) ? "counter" : "gauge",
+                   srv_metrics[m].help);
+
+        if (!srv->vbds)
+            continue;
+        snap = &srv->vbds->snap;
+        LIST_FOREACH(vbd, &srv->vbds->list, vbds){
+            s = vbd->slot;
+            fmt_str(fmt, srv_metrics[m].name);
+            if (srv_metrics[m].kind == SRV_CTR)
+                fmt_str(fmt, "_total");
+            srv_labels(fmt, snap, vbd);
+            switch (srv_metrics[m].kind){
+            case SRV_CTR:
+                fmt_uint(fmt, snap->cur[srv_metrics[m].a][s], 0);
+                break;
+            case SRV_RATE:
+                fmt_fixed(fmt, snap->rate[srv_metrics[m].a][s], 0);
+                break;
+            case SRV_DIFF:
+                fmt_uint(fmt, snap->cur[srv_metrics[m].a][s] -
+                              snap->cur[srv_metrics[m].b][s], 0);
+                break;
+            }
+            fmt_str(fmt, "\n");
+        }
+    }
+
+    // Derived figures
+    for (m = 0; srv->drv && m < XSIS_NDRVS; m++){
+        srv_family(fmt, srv_drvs[m].name, "gauge", srv_drvs[m].help);
+        if (!srv->vbds)
+            continue;
+        snap = &srv->vbds->snap;
+        LIST_FOREACH(vbd, &srv->vbds->list, vbds){
+            fmt_str(fmt, srv_drvs[m].name);
+            srv_labels(fmt, snap, vbd);
+            fmt_fixed(fmt, snap->drv[m][vbd->slot], 0);
+            fmt_str(fmt, "\n");
+        }
+    }
+
+    // Queue depth distributions (VBDs not sampled yet are left out)
+    for (m = 0; srv->qd && m < XSIS_NQDS; m++){
+        srv_family(fmt, srv_qds[m].name, "gauge", srv_qds[m].help);
+        if (!srv->vbds)
+            continue;
+        LIST_FOREACH(vbd, &srv->vbds->list, vbds){
+            if (!vbd->qd)
+                continue;
+            fmt_str(fmt, srv_qds[m].name);
+            srv_labels(fmt, &srv->vbds->snap, vbd);
+            fmt_fixed(fmt, vbd->qd->out[m], 0);
+            fmt_str(fmt, "\n");
+        }
+    }
+    // Tapdisk figures, one sample per tapdisk (not per VBD)
+    for (m = 0; srv->cpu && m < XSIS_NCPUS; m++){
+        srv_family(fmt, srv_cpus[m].name, "gauge", srv_cpus[m].help);
+        for (i = 0; srv->vbds && i < (int)srv->cpu->ntds; i++){
+            fmt_str(fmt, srv_cpus[m].name);
+            fmt_str(fmt, "{tdpid=\"");
+            fmt_uint(fmt, srv->cpu->tds[i]->tdpid, 0);
+            fmt_str(fmt, "\"} ");
+            fmt_fixed(fmt, srv->cpu->tds[i]->out[m], 0);
+            fmt_str(fmt, "\n");
+        }
+    }
+    if (srv->self)
+        srv_render_self(fmt, srv->self, srv->vbds);
+    fmt_str(fmt, "# EOF\n");
+    if (fmt->err)
+        return(NULL);
+
+    // Take the rendered buffer over and put the header in front
+    if (!(buf = calloc(1, sizeof(xsis_srvbuf_t)))){
+        perror("calloc");
+        return(NULL);
+    }
+    hdrlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+                      "Content-Type: application/openmetrics-text;"
+                      " version=1.0.0; charset=utf-8\r\n"
+                      "Content-Length: %zu\r\n"
+                      "Connection: close\r\n\r\n",
+                      fmt->len - XSIS_SRV_HDRSZ);
+    buf->refs = 1;
+    buf->mem = fmt->buf;
+    buf->off = XSIS_SRV_HDRSZ - hdrlen;
+    buf->len = fmt->len - buf->off;
+    memcpy(buf->mem + buf->off, hdr, hdrlen);
+    fmt->buf = NULL;
+    fmt->len = fmt->size = 0;
+
+    // Return
+    return(buf);
+}
+
+static void
+srv_drop(xsis_srvcli_t *cli){
+    // Close a scraper and free its slot
+    evt_del(cli->srv->evt, &cli->src);
+    (void)close(cli->src.fd);
+    srv_unref(cli->buf);
+    cli->src.fd = -1;
+    cli->buf = NULL;
+    cli->srv->ncli--;
+}
+
+// Drop scrapers that stalled
+static void
+srv_expire(xsis_srv_t *srv){
+    // Local variables
+    uint64_t            now;            // Current time (ns)
+    uint32_t            i;              // Scraper index
+
+    now = srv_now();
+    for (i = 0; i < XSIS_SRV_MAXCLI; i++)
+        if (srv->cli[i].src.fd >= 0 && srv->cli[i].deadline <= now)
+            srv_drop(&srv->cli[i]);
+}
+
+// Make progress on a scraper (returns 1 when it is done)
+static int
+srv_serve(xsis_srv_t *srv, xsis_srvcli_t *cli){
+    // Local variables
+    ssize_t             n;              // Bytes read or sent
+
+    // Read the request head (its contents do not matter)
+    if (!cli->buf){
+        n = read(cli->src.fd, cli->req + cli->reqlen,
+                 sizeof(cli->req) - 1 - cli->reqlen);
+        if (n < 0)
+            return(errno != EAGAIN && errno != EINTR);
+        if (n == 0)
+            return(1);
+        cli->deadline = srv_deadline();
+        cli->reqlen += n;
+        cli->req[cli->reqlen] = '\0';
+        if (!strstr(cli->req, "\r\n\r\n") && !strstr(cli->req, "\n\n") &&
+            cli->reqlen < sizeof(cli->req) - 1)
+            return(0);
+
+        // Share the response of this tick, rendering it if needed
+        if (!srv->cur && !(srv->cur = srv_render(srv)))
+            return(1);
+        cli->buf = srv->cur;
+        cli->buf->refs++;
+        cli->off = 0;
+    }
+
+    // Send as much of the response as the socket takes
+    while (cli->off < cli->buf->len){
+        n = send(cli->src.fd, cli->buf->mem + cli->buf->off + cli->off,
+                 cli->buf->len - cli->off, MSG_NOSIGNAL);
+        if (n < 0){
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return(1);
+            return(evt_mod(srv->evt, &cli->src, EPOLLOUT));
+        }
+        cli->deadline = srv_deadline();
+        cli->off += n;
+    }
+    return(1);
+}
+
+// Scraper socket ready
+static int
+srv_cli_cb(xsis_evtsrc_t *src, uint32_t events){
+    // Local variables
+    xsis_srvcli_t       *cli = src->arg; // Scraper
+
+    if (srv_serve(cli->srv, cli))
+        srv_drop(cli);
+    return(0);
+}
+
+// Listening socket ready
+static int
+srv_accept_cb(xsis_evtsrc_t *src, uint32_t events){
+    // Local variables
+    xsis_srv_t          *srv = src->arg; // Server
+    xsis_srvcli_t       *cli;           // New scraper
+    uint32_t            i;              // Scraper index
+    int                 fd;             // Accepted socket
+
+    // Take new scrapers (beyond the limit they are turned away)
+    srv_expire(srv);
+    while ((fd = accept4(srv->src.fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0){
+        for (i = 0; i < XSIS_SRV_MAXCLI && srv->cli[i].src.fd >= 0; i++);
+        if (i == XSIS_SRV_MAXCLI){
+            (void)close(fd);
+            continue;
+        }
+        cli = &srv->cli[i];
+        memset(cli, 0, sizeof(*cli));
+        cli->src.fd = fd;
+        cli->src.cb = srv_cli_cb;
+        cli->src.arg = cli;
+        cli->srv = srv;
+        cli->deadline = srv_deadline();
+        if (evt_add(srv->evt, &cli->src, EPOLLIN)){
+            (void)close(fd);
+            cli->src.fd = -1;
+            continue;
+        }
+        srv->ncli++;
+    }
+    return(0);
+}
+
+int
+srv_open(xsis_srv_t **srv, char *path, xsis_evt_t *evt){
+    // Local variables
+    struct sockaddr_un  addr;           // Socket address
+    struct stat         st;             // Existing socket file
+    uint32_t            i;              // Scraper index
+    int                 err = 0;        // Return code
+
+    // Allocate server context
+    if (!(*srv = calloc(1, sizeof(xsis_srv_t)))){
+        perror("calloc");
+        goto err;
+    }
+    (*srv)->src.fd = -1;
+    for (i = 0; i < XSIS_SRV_MAXCLI; i++)
+        (*srv)->cli[i].src.fd = -1;
+    (*srv)->evt = evt;
+    fmt_init(&(*srv)->fmt, XSIS_FMT_TABLE);
+    if (strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "Socket pathname '%s' is too long.\n", path);
+        goto err;
+    }
+
+    // Replace a stale socket, but never any other file
+    if (!lstat(path, &st)){
+        if (!S_ISSOCK(st.st_mode)){
+            fprintf(stderr, "'%s' exists and is not a socket.\n", path);
+            goto err;
+        }
+        (void)unlink(path);
+    }
+
+    // Listen for scrapers
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (((*srv)->src.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+                                          SOCK_CLOEXEC, 0)) < 0){
+        perror("socket");
+        goto err;
+    }
+    if (bind((*srv)->src.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        perror("bind");
+        goto err;
+    }
+    if (!((*srv)->path = strdup(path))){
+        perror("strdup");
+        goto err;
+    }
+    if (listen((*srv)->src.fd, XSIS_SRV_MAXCLI) < 0){
+        perror("listen");
+        goto err;
+    }
+    (*srv)->src.cb = srv_accept_cb;
+    (*srv)->src.arg = *srv;
+    if (evt_add(evt, &(*srv)->src, EPOLLIN))
+        goto err;
+
+out:
+    // Return
+    return(err);
+
+err:
+    srv_close(*srv);
+    *srv = NULL;
+    err = 1;
+    goto out;
+}
+
+void
+srv_tick(xsis_srv_t *srv, xsis_vbds_t *vbds, xsis_self_t *self){
+    // The next scrape renders the new counters
+    srv->vbds = vbds;
+    srv->self = self;
+    srv_unref(srv->cur);
+    srv->cur = NULL;
+
+    // Drop scrapers that stalled
+    srv_expire(srv);
+}
+
+void
+srv_close(xsis_srv_t *srv){
+    // Local variables
+    uint32_t            i;              // Scraper index
+
+    // Release server resources
+    if (srv){
+        for (i = 0; i < XSIS_SRV_MAXCLI; i++)
+            if (srv->cli[i].src.fd >= 0)
+                srv_drop(&srv->cli[i]);
+        srv_unref(srv->cur);
+        if (srv->src.fd >= 0)
+            (void)close(srv->src.fd);
+        if (srv->path){
+            (void)unlink(srv->path);
+            free(srv->path);
+        }
+        fmt_free(&srv->fmt);
+        free(srv);
+    }
+}
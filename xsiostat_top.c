@@ -0,0 +1,170 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_top.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include "xsiostat.h"
+
+/*
+ * The N highest scoring VBDs are kept in a min-heap of N entries while
+ * walking the VBD list once, so a tick costs O(VBDs * log N) rather than
+ * a sort of every VBD; only the N winners are sorted for output. VBDs
+ * shown by the previous tick get their score scaled by 'hyst', so a
+ * newcomer has to beat them by that margin and rows do not flicker.
+ */
+
+// -k arguments, indexed by XSIS_RATE_* and XSIS_TOP_*
+static const char *top_keys[XSIS_NTOPKEYS] = {
+    "riops", "wiops", "rMB", "wMB", "rqs", "wqs", "lat"
+};
+
+int
+top_init(xsis_top_t *top, uint32_t n, const char *key, float hyst){
+    // Local variables
+    int                 i;              // Key index
+
+    memset(top, 0, sizeof(*top));
+    for (i = 0; i < XSIS_NTOPKEYS; i++)
+        if (!strcmp(key, top_keys[i]))
+            break;
+    if (i == XSIS_NTOPKEYS){
+        fprintf(stderr, "Invalid ranking key \"%s\".\n", key);
+        return(1);
+    }
+    top->key = i;
+    top->n = n;
+    top->hyst = 1 + hyst/100;
+
+    // Heap storage
+    if (!(top->rows = calloc(n, sizeof(xsis_vbd_t *))) ||
+        !(top->score = calloc(n, sizeof(float)))){
+        perror("calloc");
+        top_free(top);
+        return(1);
+    }
+
+    // Return
+    return(0);
+}
+
+// Score of a VBD under the ranking key
+static float
+top_score(xsis_top_t *top, xsis_snap_t *snap, uint32_t s){
+    // Local variables
+    uint64_t            ops;            // Requests completed (r+w)
+    uint64_t            usecs;          // Time spent on them (r+w)
+
+    if (top->key < XSIS_NRATES)
+        return(snap->rate[top->key][s]);
+
+    // Average service time (us) of the requests completed this tick
+    ops = (snap->cur[XSIS_CTR_RCP][s] - snap->prev[XSIS_CTR_RCP][s]) +
+          (snap->cur[XSIS_CTR_WCP][s] - snap->prev[XSIS_CTR_WCP][s]);
+    usecs = (snap->cur[XSIS_CTR_RTU][s] - snap->prev[XSIS_CTR_RTU][s]) +
+            (snap->cur[XSIS_CTR_WTU][s] - snap->prev[XSIS_CTR_WTU][s]);
+    return(ops ? (float)usecs/ops : 0);
+}
+
+// Restore the min-heap property below entry 'i'
+static void
+top_sift(xsis_top_t *top, uint32_t i){
+    // Local variables
+    xsis_vbd_t          *vbd;           // Entry being moved down
+    float               score;          // Its score
+    uint32_t            c;              // Smaller child
+
+    vbd = top->rows[i];
+    score = top->score[i];
+    while ((c = 2*i + 1) < top->nrows){
+        if (c + 1 < top->nrows && top->score[c+1] < top->score[c])
+            c++;
+        if (score <= top->score[c])
+            break;
+        top->rows[i] = top->rows[c];
+        top->score[i] = top->score[c];
+        i = c;
+    }
+    top->rows[i] = vbd;
+    top->score[i] = score;
+}
+
+void
+top_select(xsis_top_t *top, xsis_vbds_t *vbds){
+    // Local variables
+    xsis_vbd_t          *vbd;           // Temporary vbd iterator
+    float               score;          // Score of vbd
+    uint32_t            n;              // VBDs selected
+    uint32_t            i;              // Heap index
+
+    // Keep the N best (earlier VBDs win ties)
+    top->nrows = 0;
+    LIST_FOREACH(vbd, &vbds->list, vbds){
+        score = top_score(top, &vbds->snap, vbd->slot);
+        if (vbd->top)
+            score *= top->hyst;
+        vbd->top = 0;
+        if (top->nrows < top->n){
+            // Heap not full yet: sift the new entry up
+            for (i = top->nrows++; i && top->score[(i-1)/2] > score;
+                 i = (i-1)/2){
+                top->rows[i] = top->rows[(i-1)/2];
+                top->score[i] = top->score[(i-1)/2];
+            }
+            top->rows[i] = vbd;
+            top->score[i] = score;
+        } else
+        if (score > top->score[0]){
+            top->rows[0] = vbd;
+            top->score[0] = score;
+            top_sift(top, 0);
+        }
+    }
+
+    // Sort the winners, best first, by popping the heap into its tail
+    n = top->nrows;
+    for (i = n; i > 1; i--){
+        vbd = top->rows[0];
+        score = top->score[0];
+        top->rows[0] = top->rows[i-1];
+        top->score[0] = top->score[i-1];
+        top->nrows--;
+        top_sift(top, 0);
+        top->rows[i-1] = vbd;
+        top->score[i-1] = score;
+    }
+    top->nrows = n;
+    for (i = 0; i < n; i++)
+        top->rows[i]->top = 1;
+}
+
+void
+top_free(xsis_top_t *top){
+    // Release selection buffers
+    free(top->rows);
+    free(top->score);
+    top->rows = NULL;
+    top->score = NULL;
+    top->n = top->nrows = 0;
+}
@@ -30,58 +30,14 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 #include <sys/queue.h>
-#include <xenstore.h>
 #include "xsiostat.h"
 
 // Global variables
-extern int PAGE_SIZE;
-
-static uint32_t
-vbd_read_tapdisk_pid(uint32_t domid, uint32_t vbdid)
-{
-    // XenStore tapdisk pid path
-    static const char* PATH_FMT = "/local/domain/0/backend/vbd3/%u/%u/kthread-pid";
-
-    // Local variables
-    char *path;                 // Path storage
-    unsigned int len;           // Temp variable
-    void *value;                // Value returned by xs_read
-    uint32_t retvalue = 0;      // Value converted to integer
-
-    // Open Xenstore connection
-    struct xs_handle *handle = xs_open(XS_OPEN_READONLY);
-
-    if (!handle) {
-        perror("xs_open");
-        goto err;
-    }
-
-    // Format tapdisk pid path
-    if (asprintf(&path, PATH_FMT, domid, vbdid) < 0) {
-        perror("asprintf");
-        goto asperr;
-    }
-
-    // Read value
-    value = xs_read(handle, XBT_NULL, path, &len);
-
-    if (!value) {
-        perror("xs_read");
-        goto readerr;
-    }
-
-    // Convert to int
-    retvalue = atoi((const char *)value);
-
-    free(value);
-readerr:
-    free(path);
-asperr:
-    xs_close(handle);
-err:
-    return retvalue;
-}
+static int PAGE_SIZE;                   // Size of a stats page mapping
 
 static void
 vbd_free(xsis_vbd_t *vbd){
@@ -91,14 +47,41 @@ vbd_free(xsis_vbd_t *vbd){
             (void)munmap(vbd->shmmap, PAGE_SIZE);
         if (vbd->shmfd >= 0)
             (void)close(vbd->shmfd);
+        win_vbd_free(vbd);
+        free(vbd->qd);
         free(vbd);
     }
 }
 
+// Open and map the stats page of a VBD (safe to call from any thread)
 static int
-vbd_open(xsis_vbd_t **vbd, uint32_t domid, uint32_t vbdid){
+vbd_map(const char *root, uint32_t tdpid, uint32_t domid, uint32_t vbdid,
+        int32_t *shmfd, void **shmmap){
+    // Local variables
+    char                path[PATH_MAX]; // Stats file path
+
+    // Open stats fd
+    (void)snprintf(path, sizeof(path), XSIS_TD3_PATHFMT, root, tdpid, domid,
+                   vbdid);
+    if ((*shmfd = open(path, O_RDONLY | O_CLOEXEC)) < 0){
+        perror("open");
+        return(1);
+    }
+
+    // mmap() stats entry
+    if ((*shmmap = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, *shmfd,
+                        0)) == MAP_FAILED){
+        *shmmap = NULL;
+        perror("mmap");
+        return(1);
+    }
+    return(0);
+}
+
+static int
+vbd_open(xsis_vbd_t **vbd, xsis_xs_t *xsc, const char *root, uint32_t domid,
+         uint32_t vbdid){
     // Local variables
-    char                *ptr;           // Temporary char pointer
     int                 err = 0;        // Return code
     uint32_t            tdpid = 0;      // Tapdisk PID
 
@@ -107,34 +90,20 @@ vbd_open(xsis_vbd_t **vbd, uint32_t domid, uint32_t vbdid){
         perror("calloc");
         goto err;
     }
+    (*vbd)->shmfd = -1;
+    (*vbd)->tdwd = -1;
 
-    tdpid = vbd_read_tapdisk_pid(domid, vbdid);
-    if (!tdpid) {
-        perror("vbd_read_tapdisk_pid");
+    // Fetch tapdisk pid (from cache, or through xenstore)
+    if (!xsc || !(tdpid = xsc_tdpid(xsc, domid, vbdid)))
         goto err;
-    }
 
     (*vbd)->domid = domid;
     (*vbd)->vbdid = vbdid;
     (*vbd)->tdpid = tdpid;
-    (*vbd)->shmfd = -1;
-
-    // Open stats fd
-    if (asprintf(&ptr, XSIS_TD3_PATHFMT, tdpid, domid, vbdid) < 0){
-        perror("asprintf");
-        goto err;
-    }
-    if (((*vbd)->shmfd = open(ptr, O_RDONLY)) < 0){
-        perror("open");
-        goto err;
-    }
 
-    // mmap() stats entry
-    if (!((*vbd)->shmmap = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED,
-                                (*vbd)->shmfd, 0))){
-        perror("mmap");
+    // Open and map stats entry
+    if (vbd_map(root, tdpid, domid, vbdid, &(*vbd)->shmfd, &(*vbd)->shmmap))
         goto err;
-    }
 
 out:
     // Return
@@ -147,35 +116,29 @@ err:
 }
 
 int
-vbd_update(xsis_vbd_t *vbd){
+vbd_update(xsis_vbd_t *vbd, xsis_snap_t *snap){
     // Local variables
     struct stat         vbdst;          // Temporary stat struct
     int                 err = 0;        // Return code
 
-    // Check if VBD remains valid
-    if (fstat(vbd->shmfd, &vbdst) || !(vbdst.st_nlink))
-        goto err;
+    // Check if VBD remains valid (unless inotify reports its removal)
+    if (vbd->tdwd < 0)
+        if (fstat(vbd->shmfd, &vbdst) || !(vbdst.st_nlink))
+            goto err;
+
+    // Idle VBDs are only probed between full reads
+    if (vbd->idle >= XSIS_IDLE_TICKS && snap->every > 1 &&
+        (vbd->idle % snap->every) &&
+        snap_probe(snap, vbd->slot,
+                   (const volatile tapdisk_stats *)vbd->shmmap)){
+        vbd->idle++;
+        goto out;
+    }
+
+    // Snapshot the shm page into the VBD slot
+    snap_read(snap, vbd->slot, (const volatile tapdisk_stats *)vbd->shmmap);
+    vbd->idle = snap_idle(snap, vbd->slot) ? vbd->idle + 1 : 0;
 
-    // Update VBD entries based on shm mapping
-    vbd->tdstat.rop_1 = vbd->tdstat.rop_0;
-    vbd->tdstat.rop_0 = ((tapdisk_stats *)(vbd->shmmap))->read_reqs_submitted;
-    vbd->tdstat.rsc_1 = vbd->tdstat.rsc_0;
-    vbd->tdstat.rsc_0 = ((tapdisk_stats *)(vbd->shmmap))->read_sectors;
-    vbd->tdstat.wop_1 = vbd->tdstat.wop_0;
-    vbd->tdstat.wop_0 = ((tapdisk_stats *)(vbd->shmmap))->write_reqs_submitted;
-    vbd->tdstat.wsc_1 = vbd->tdstat.wsc_0;
-    vbd->tdstat.wsc_0 = ((tapdisk_stats *)(vbd->shmmap))->write_sectors;
-    vbd->tdstat.wtu_1 = vbd->tdstat.wtu_0;
-    vbd->tdstat.wtu_0 = ((tapdisk_stats *)(vbd->shmmap))->write_total_ticks;
-    vbd->tdstat.rtu_1 = vbd->tdstat.rtu_0;
-    vbd->tdstat.rtu_0 = ((tapdisk_stats *)(vbd->shmmap))->read_total_ticks;
-    vbd->tdstat.infrd = ((tapdisk_stats *)(vbd->shmmap))->read_reqs_submitted -
-                        ((tapdisk_stats *)(vbd->shmmap))->read_reqs_completed;
-    vbd->tdstat.infwr = ((tapdisk_stats *)(vbd->shmmap))->write_reqs_submitted -
-                        ((tapdisk_stats *)(vbd->shmmap))->write_reqs_completed;
-
-    vbd->tdstat.low_mem_mode = ((tapdisk_stats *)(vbd->shmmap))->flags
-                               & BT3_LOW_MEMORY_MODE;
 out:
     // Return
     return(err);
@@ -185,55 +148,444 @@ err:
     goto out;
 }
 
+/*
+ * Attached VBDs are indexed by an open-addressing (linear probing) table
+ * keyed by (domid, vbdid), kept at most 3/4 full. Removal shifts later
+ * entries of the probe sequence back, so no tombstones are needed.
+ */
+
+static uint32_t
+vbd_hash(uint32_t domid, uint32_t vbdid){
+    // Local variables
+    uint64_t            key;            // Combined key
+
+    key = ((uint64_t)domid << 32) | vbdid;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return((uint32_t)key);
+}
+
+xsis_vbd_t *
+vbd_find(xsis_vbds_t *vbds, uint32_t domid, uint32_t vbdid){
+    // Local variables
+    xsis_vbd_t          *vbd;           // Temporary VBD pointer
+    uint32_t            i;              // Table slot
+
+    if (!vbds->tblsz)
+        return(NULL);
+    for (i = vbd_hash(domid, vbdid) & (vbds->tblsz-1); (vbd = vbds->tbl[i]);
+         i = (i+1) & (vbds->tblsz-1))
+        if ((vbd->domid == domid) && (vbd->vbdid == vbdid))
+            break;
+    return(vbd);
+}
+
+static void
+vbds_place(xsis_vbd_t **tbl, uint32_t tblsz, xsis_vbd_t *vbd){
+    // Local variables
+    uint32_t            i;              // Table slot
+
+    for (i = vbd_hash(vbd->domid, vbd->vbdid) & (tblsz-1); tbl[i];
+         i = (i+1) & (tblsz-1));
+    tbl[i] = vbd;
+}
+
+int
+vbd_insert(xsis_vbd_t *vbd, xsis_vbds_t *vbds){
+    // Local variables
+    xsis_vbd_t          **tbl;          // Resized table
+    uint32_t            tblsz;          // Resized table slots
+    uint32_t            i;              // Table slot
+
+    // Allocate snapshot slot
+    if (snap_add(&vbds->snap, vbd))
+        return(1);
+
+    // Grow table to keep it at most 3/4 full
+    if ((vbds->nvbds+1)*4 > vbds->tblsz*3){
+        tblsz = vbds->tblsz ? vbds->tblsz*2 : 64;
+        if (!(tbl = calloc(tblsz, sizeof(xsis_vbd_t *)))){
+            perror("calloc");
+            snap_del(&vbds->snap, vbd);
+            return(1);
+        }
+        for (i = 0; i < vbds->tblsz; i++)
+            if (vbds->tbl[i])
+                vbds_place(tbl, tblsz, vbds->tbl[i]);
+        free(vbds->tbl);
+        vbds->tbl = tbl;
+        vbds->tblsz = tblsz;
+    }
+
+    // Insert VBD in table and list
+    vbds_place(vbds->tbl, vbds->tblsz, vbd);
+    LIST_INSERT_HEAD(&vbds->list, vbd, vbds);
+    vbds->nvbds++;
+
+    // Return
+    return(0);
+}
+
+void
+vbd_remove(xsis_vbd_t *vbd, xsis_vbds_t *vbds){
+    // Local variables
+    uint32_t            mask;           // Table slot mask
+    uint32_t            i, j, k;        // Hole, probe and home slots
+
+    // Find VBD slot
+    mask = vbds->tblsz-1;
+    for (i = vbd_hash(vbd->domid, vbd->vbdid) & mask; vbds->tbl[i] != vbd;
+         i = (i+1) & mask);
+
+    // Shift back entries whose probe sequence crosses the hole
+    vbds->tbl[i] = NULL;
+    for (j = (i+1) & mask; vbds->tbl[j]; j = (j+1) & mask){
+        k = vbd_hash(vbds->tbl[j]->domid, vbds->tbl[j]->vbdid) & mask;
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        vbds->tbl[i] = vbds->tbl[j];
+        vbds->tbl[j] = NULL;
+        i = j;
+    }
+
+    // Remove VBD from list and release its slot
+    LIST_REMOVE(vbd, vbds);
+    vbds->nvbds--;
+    snap_del(&vbds->snap, vbd);
+}
+
+// Index of an SR name in vbds->srs, adding it if new (0 if unknown)
+static uint32_t
+vbds_srid(xsis_vbds_t *vbds, const char *sr){
+    // Local variables
+    char                **srs;          // Reallocated SR names
+    uint32_t            i;              // SR index
+
+    if (!*sr)
+        return(0);
+    for (i = 1; i < vbds->nsrs; i++)
+        if (!strcmp(vbds->srs[i], sr))
+            return(i);
+    if (vbds->nsrs + 1 >= vbds->srsz){
+        if (!(srs = realloc(vbds->srs, (vbds->srsz ? vbds->srsz*2 : 16) *
+                                       sizeof(char *)))){
+            perror("realloc");
+            return(0);
+        }
+        vbds->srs = srs;
+        vbds->srsz = vbds->srsz ? vbds->srsz*2 : 16;
+        if (!vbds->nsrs)
+            vbds->srs[vbds->nsrs++] = NULL;
+    }
+    if (!(vbds->srs[vbds->nsrs] = strdup(sr))){
+        perror("strdup");
+        return(0);
+    }
+    return(vbds->nsrs++);
+}
+
+// Watch, insert and prime an opened VBD (sr: SR name, or NULL to look
+// it up now if wanted)
+static int
+vbd_add(xsis_vbds_t *vbds, xsis_vbd_t *vbd, const char *sr){
+    // Local variables
+    char                path[PATH_MAX]; // td3 directory path
+    char                buf[XSIS_SR_LEN] = ""; // SR name looked up
+
+    // Tag the VBD with its SR
+    if (vbds->wantsr){
+        if (!sr){
+            if (vbds->xsc)
+                (void)xsc_sr(vbds->xsc->xsh, vbd->domid, vbd->vbdid, buf,
+                             sizeof(buf));
+            sr = buf;
+        }
+        vbd->srid = vbds_srid(vbds, sr);
+    }
+
+    // Watch the tapdisk directory for removal of the stats file
+    if (vbds->inofd >= 0){
+        (void)snprintf(path, sizeof(path), "%s/" XSIS_TD3_BASEFMT,
+                       vbds->root, vbd->tdpid);
+        vbd->tdwd = inotify_add_watch(vbds->inofd, path,
+                                      IN_DELETE|IN_DELETE_SELF|IN_ONLYDIR);
+    }
+
+    // Insert new VBD in table and list
+    if (vbd_insert(vbd, vbds)){
+        vbd_free(vbd);
+        return(1);
+    }
+
+    // Prime counters so the first rates cover the time since attach
+    snap_read(&vbds->snap, vbd->slot,
+              (const volatile tapdisk_stats *)vbd->shmmap);
+    vbds->nattached++;
+    return(0);
+}
+
+// Filter a VBD by id (returns 1 if it should be attached)
+static int
+vbd_wanted(xsis_vbds_t *vbds, xsis_flts_t *domids, xsis_flts_t *vbdids,
+           uint32_t domid, uint32_t vbdid){
+    // Filter domids and vbdids
+    if ((domids->nflts && !flt_isset(domids, domid)) ||
+        (vbdids->nflts && !flt_isset(vbdids, vbdid))){
+        vbds->nfiltered++;
+        return(0);
+    }
+
+    // Do not add repeated entries
+    return(!vbd_find(vbds, domid, vbdid));
+}
+
+static int
+vbd_attach(xsis_vbds_t *vbds, xsis_flts_t *domids, xsis_flts_t *vbdids,
+           uint32_t domid, uint32_t vbdid){
+    // Local variables
+    xsis_vbd_t          *vbd;           // Temporary VBD pointer
+
+    if (!vbd_wanted(vbds, domids, vbdids, domid, vbdid))
+        return(0);
+
+    // Allocate VBD entry
+    if (vbd_open(&vbd, vbds->xsc, vbds->root, domid, vbdid)){
+        vbds->nattfail++;
+        return(1);
+    }
+    return(vbd_add(vbds, vbd, NULL));
+}
+
+/*
+ * On a cold start with many VBDs, the xenstore lookups and shm attaches
+ * dominate. They are spread over a few threads taking VBDs from a shared
+ * queue: the main thread uses the persistent connection, the others one
+ * private connection each (XSIS_ATTACH_WORKERS-1 at most, closed once
+ * done), so round trips to xenstored overlap. Pids already cached are not
+ * looked up again, and those read are cached afterwards. The results are
+ * then inserted by the main thread in (domid, vbdid) order; any VBD a
+ * worker could not open goes through the serial path instead.
+ */
+
+static int
+vbds_attcmp(const void *a, const void *b){
+    // Local variables
+    const xsis_vbdatt_t *x = a;         // First entry
+    const xsis_vbdatt_t *y = b;         // Second entry
+
+    if (x->domid != y->domid)
+        return((x->domid < y->domid) ? -1 : 1);
+    if (x->vbdid != y->vbdid)
+        return((x->vbdid < y->vbdid) ? -1 : 1);
+    return(0);
+}
+
+// Attach queued VBDs using one xenstore connection
+static void
+vbds_attach_run(xsis_attq_t *q, struct xs_handle *xsh){
+    // Local variables
+    xsis_vbdatt_t       *att;           // VBD being attached
+    uint32_t            i;              // Queue index
+
+    while ((i = __sync_fetch_and_add(&q->next, 1)) < q->natts){
+        att = &q->atts[i];
+        if (!att->tdpid &&
+            !(att->tdpid = xsc_conn_tdpid(xsh, att->domid, att->vbdid)))
+            continue;
+        if (q->wantsr)
+            (void)xsc_sr(xsh, att->domid, att->vbdid, att->sr,
+                         sizeof(att->sr));
+        if (vbd_map(q->root, att->tdpid, att->domid, att->vbdid,
+                    &att->shmfd, &att->shmmap) && att->shmfd >= 0){
+            (void)close(att->shmfd);
+            att->shmfd = -1;
+        }
+    }
+}
+
+static void *
+vbds_attach_worker(void *arg){
+    // Local variables
+    struct xs_handle    *xsh;           // Private xenstore connection
+
+    // Without a connection, the other threads take the whole queue
+    if ((xsh = xsc_conn())){
+        vbds_attach_run(arg, xsh);
+        xsc_conn_close(xsh);
+    }
+    return(NULL);
+}
+
+static void
+vbds_attach_all(xsis_vbds_t *vbds, xsis_flts_t *domids, xsis_flts_t *vbdids,
+                xsis_attq_t *q){
+    // Local variables
+    pthread_t           tids[XSIS_ATTACH_WORKERS]; // Worker threads
+    xsis_vbdatt_t       *att;           // VBD being merged
+    xsis_vbd_t          *vbd;           // New VBD entry
+    uint32_t            nt = 0;         // Worker threads started
+    uint32_t            i;              // Temporary index
+
+    // Run the workers (the main thread being one of them), one per
+    // XSIS_ATTACH_MIN VBDs
+    qsort(q->atts, q->natts, sizeof(xsis_vbdatt_t), vbds_attcmp);
+    for (i = 0; i < q->natts; i++)
+        q->atts[i].tdpid = xsc_cached(vbds->xsc, q->atts[i].domid,
+                                      q->atts[i].vbdid);
+    q->next = 0;
+    for (nt = 0; nt+1 < vbds->nworkers && nt+1 < XSIS_ATTACH_WORKERS &&
+                 (nt+1)*XSIS_ATTACH_MIN <= q->natts; nt++)
+        if (pthread_create(&tids[nt], NULL, vbds_attach_worker, q))
+            break;
+    if (nt)
+        vbds_attach_run(q, vbds->xsc->xsh);
+    for (i = 0; i < nt; i++)
+        (void)pthread_join(tids[i], NULL);
+    for (i = 0; nt && i < q->natts; i++)
+        xsc_put(vbds->xsc, q->atts[i].domid, q->atts[i].vbdid,
+                q->atts[i].tdpid);
+
+    // Merge in order
+    for (i = 0; i < q->natts; i++){
+        att = &q->atts[i];
+        if (!att->shmmap){
+            // Not ready yet (e.g. no kthread-pid): scan again next tick
+            if (vbd_attach(vbds, domids, vbdids, att->domid, att->vbdid))
+                vbds->rescan = 1;
+            continue;
+        }
+        if (!(vbd = calloc(1, sizeof(xsis_vbd_t)))){
+            perror("calloc");
+            (void)munmap(att->shmmap, PAGE_SIZE);
+            (void)close(att->shmfd);
+            vbds->rescan = 1;
+            continue;
+        }
+        vbd->domid = att->domid;
+        vbd->vbdid = att->vbdid;
+        vbd->tdpid = att->tdpid;
+        vbd->shmfd = att->shmfd;
+        vbd->shmmap = att->shmmap;
+        vbd->tdwd = -1;
+        (void)vbd_add(vbds, vbd, att->sr);
+    }
+}
+
+void
+vbds_update(xsis_vbds_t *vbds){
+    // Local variables
+    xsis_vbd_t          *vbd;           // Temporary vbd iterator
+    xsis_vbd_t          *next;          // Next vbd (vbd may be deleted)
+
+    // Snapshot VBD statistics (each read is timestamped)
+    snap_rotate(&vbds->snap);
+    for (vbd = LIST_FIRST(&vbds->list); vbd; vbd = next){
+        next = LIST_NEXT(vbd, vbds);
+        if (vbd_update(vbd, &vbds->snap))
+            vbd_delete(vbd, vbds);
+    }
+}
+
+void
+vbds_init(xsis_vbds_t *vbds){
+    // Initialise empty VBD set (inotify is armed by the first scan)
+    if (!PAGE_SIZE)
+        PAGE_SIZE = sysconf(_SC_PAGESIZE);
+    LIST_INIT(&vbds->list);
+    vbds->tbl = NULL;
+    vbds->tblsz = 0;
+    vbds->nvbds = 0;
+    memset(&vbds->snap, 0, sizeof(vbds->snap));
+    vbds->snap.every = XSIS_IDLE_EVERY;
+    vbds->inofd = -1;
+    vbds->vbd3wd = -1;
+    vbds->rescan = 1;
+    vbds->nworkers = XSIS_ATTACH_WORKERS;
+    vbds->xsc = NULL;
+    vbds->root = XSIS_SHM_ROOT;
+    vbds->nattached = vbds->ndetached = 0;
+    vbds->nfiltered = vbds->nattfail = 0;
+    vbds->wantsr = 0;
+    vbds->srs = NULL;
+    vbds->nsrs = vbds->srsz = 0;
+}
+
 int
 vbds_alloc(xsis_vbds_t *vbds, xsis_flts_t *domids, xsis_flts_t *vbdids){
     // Local variables
     DIR                 *dp = NULL;     // dir pointer
     struct dirent       *dirp;          // dirent pointer
-    xsis_vbd_t          *vbd;           // Temporary VBD pointer
+    xsis_attq_t         q;              // VBDs found
+    xsis_vbdatt_t       *atts;          // Reallocated queue
     uint32_t            domid;          // Temporary DOM ID
     uint32_t            vbdid;          // Temporary VBD ID
     int                 err = 0;        // Return code
 
+    memset(&q, 0, sizeof(q));
+    q.root = vbds->root;
+    q.wantsr = vbds->wantsr;
+
+    // Open xenstore once; the connection is kept for later attaches
+    if (!vbds->xsc && xsc_open(&vbds->xsc))
+        goto err;
+
+    // Arm inotify before scanning so no entry falls in between
+    if (vbds->inofd < 0){
+        if ((vbds->inofd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0)
+            perror("inotify_init1");
+        else
+        if ((vbds->vbd3wd = inotify_add_watch(vbds->inofd, vbds->root,
+                                IN_CREATE|IN_DELETE|IN_MOVED_FROM|
+                                IN_MOVED_TO|IN_ONLYDIR)) < 0){
+            perror("inotify_add_watch");
+            (void)close(vbds->inofd);
+            vbds->inofd = -1;
+        }
+    }
+
     // Open VBD3 base dir
-    if (!(dp = opendir(XSIS_VBD3_DIR))){
+    if (!(dp = opendir(vbds->root))){
         perror("opendir");
         goto err;
     }
 
-    // Scan for valid VBD entries
+    // Scan for valid VBD entries (a failed attach sets rescan again)
+    vbds->rescan = 0;
     while ((dirp = readdir(dp))){
         // Skip irrelevant entries and fetch DOM/VBD ids
         if (sscanf(dirp->d_name, XSIS_VBD3_BASEFMT, &domid, &vbdid) != 2)
             continue;
 
-        // Filter domids and vbdids
-        if (!LIST_EMPTY(domids))
-            if (!flt_isset(domids, domid))
-                continue;
-        if (!LIST_EMPTY(vbdids))
-            if (!flt_isset(vbdids, vbdid))
-                continue;
-
-        // Do not add repeated entries
-        LIST_FOREACH(vbd, vbds, vbds)
-            if ((vbd->domid == domid) && (vbd->vbdid == vbdid))
-                break;
-        if (vbd)
-            continue;
-
-        // Allocate VBD entry
-        if (vbd_open(&vbd, domid, vbdid))
+        // Queue VBDs to attach
+        if (!vbd_wanted(vbds, domids, vbdids, domid, vbdid))
             continue;
-
-        // Insert new VBD in list
-        LIST_INSERT_HEAD(vbds, vbd, vbds);
+        if (q.natts == q.attsz){
+            if (!(atts = realloc(q.atts, (q.attsz ? q.attsz*2 : 64) *
+                                         sizeof(xsis_vbdatt_t)))){
+                perror("realloc");
+                goto err;
+            }
+            q.atts = atts;
+            q.attsz = q.attsz ? q.attsz*2 : 64;
+        }
+        q.atts[q.natts].domid = domid;
+        q.atts[q.natts].vbdid = vbdid;
+        q.atts[q.natts].tdpid = 0;
+        q.atts[q.natts].shmfd = -1;
+        q.atts[q.natts].shmmap = NULL;
+        q.atts[q.natts].sr[0] = '\0';
+        q.natts++;
     }
 
+    // Attach them (in parallel if there are many)
+    vbds_attach_all(vbds, domids, vbdids, &q);
+
 out:
     // Close VBD3 base dir
     if (dp)
         closedir(dp);
+    free(q.atts);
 
     // Return
     return(err);
@@ -243,9 +595,99 @@ err:
     goto out;
 }
 
+// Delete VBDs whose stats file is gone (used after losing inotify events)
+static void
+vbds_check(xsis_vbds_t *vbds){
+    // Local variables
+    xsis_vbd_t          *vbd;           // Temporary VBD pointer
+    xsis_vbd_t          *next;          // Next VBD (vbd may be deleted)
+    struct stat         vbdst;          // Temporary stat struct
+
+    for (vbd = LIST_FIRST(&vbds->list); vbd; vbd = next){
+        next = LIST_NEXT(vbd, vbds);
+        if (fstat(vbd->shmfd, &vbdst) || !(vbdst.st_nlink))
+            vbd_delete(vbd, vbds);
+    }
+}
+
+int
+vbds_refresh(xsis_vbds_t *vbds, xsis_flts_t *domids, xsis_flts_t *vbdids,
+             uint8_t scan){
+    // Local variables
+    char                buf[4096]       // inotify event buffer
+                        __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;           // Temporary event pointer
+    xsis_vbd_t          *vbd;           // Temporary VBD pointer
+    xsis_vbd_t          *next;          // Next VBD (vbd may be deleted)
+    uint32_t            domid;          // Temporary DOM ID
+    uint32_t            vbdid;          // Temporary VBD ID
+    ssize_t             len;            // Bytes read from inotify
+    char                *ptr;           // Temporary event iterator
+
+    // Without inotify, fall back to scanning the directory every time
+    if (vbds->inofd < 0)
+        return(scan ? vbds_alloc(vbds, domids, vbdids) : 0);
+
+    // Drain pending events
+    while ((len = read(vbds->inofd, buf, sizeof(buf))) > 0){
+        for (ptr = buf; ptr < buf + len;
+             ptr += sizeof(struct inotify_event) + ev->len){
+            ev = (struct inotify_event *)ptr;
+
+            // Events were lost: recheck everything
+            if (ev->mask & IN_Q_OVERFLOW){
+                vbds->rescan = 1;
+                continue;
+            }
+
+            if (ev->wd == vbds->vbd3wd){
+                // vbd3-<domid>-<vbdid> created or removed
+                if (!ev->len || sscanf(ev->name, XSIS_VBD3_BASEFMT,
+                                       &domid, &vbdid) != 2)
+                    continue;
+                if (ev->mask & (IN_DELETE|IN_MOVED_FROM)){
+                    if ((vbd = vbd_find(vbds, domid, vbdid)))
+                        vbd_delete(vbd, vbds);
+                } else
+                if (scan && vbd_attach(vbds, domids, vbdids, domid, vbdid))
+                    // Not ready yet (e.g. xenstore not populated)
+                    vbds->rescan = 1;
+                continue;
+            }
+
+            // td3-<pid> directory or one of its stats files removed
+            if (ev->mask & (IN_DELETE_SELF|IN_IGNORED)){
+                for (vbd = LIST_FIRST(&vbds->list); vbd; vbd = next){
+                    next = LIST_NEXT(vbd, vbds);
+                    if (vbd->tdwd == ev->wd)
+                        vbd_delete(vbd, vbds);
+                }
+            } else
+            if (ev->len && sscanf(ev->name, XSIS_TD3_VBDFMT,
+                                  &domid, &vbdid) == 2){
+                if ((vbd = vbd_find(vbds, domid, vbdid)) &&
+                    vbd->tdwd == ev->wd)
+                    vbd_delete(vbd, vbds);
+            }
+        }
+    }
+
+    // Recover from lost events or failed attaches
+    if (vbds->rescan){
+        vbds_check(vbds);
+        if (scan)
+            return(vbds_alloc(vbds, domids, vbdids));
+        vbds->rescan = 0;
+    }
+
+    // Return
+    return(0);
+}
+
 void
 vbd_delete(xsis_vbd_t *vbd, xsis_vbds_t *vbds){
-    LIST_REMOVE(vbd, vbds);
+    vbds->ndetached++;
+    vbd_remove(vbd, vbds);
     vbd_free(vbd);
 }
 
@@ -253,11 +695,33 @@ void
 vbds_free(xsis_vbds_t *vbds){
     // Local variables
     xsis_vbd_t          *vbd;           // Temporary VBD pointer
+    uint32_t            i;              // SR index
 
     // Loop through VBDs, freeing resources
-    LIST_FOREACH(vbd, vbds, vbds){
+    while ((vbd = LIST_FIRST(&vbds->list)))
         vbd_delete(vbd, vbds);
-    }
+
+    // Release table and snapshot
+    free(vbds->tbl);
+    vbds->tbl = NULL;
+    vbds->tblsz = 0;
+    snap_free(&vbds->snap);
+
+    // Release SR names
+    for (i = 1; i < vbds->nsrs; i++)
+        free(vbds->srs[i]);
+    free(vbds->srs);
+    vbds->srs = NULL;
+    vbds->nsrs = vbds->srsz = 0;
+
+    // Release inotify
+    if (vbds->inofd >= 0)
+        (void)close(vbds->inofd);
+    vbds->inofd = -1;
+
+    // Release xenstore connection
+    xsc_close(vbds->xsc);
+    vbds->xsc = NULL;
 
     // Return
     return;
@@ -0,0 +1,267 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_win.c
+ * ----------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include "xsiostat.h"
+
+/*
+ * Every VBD keeps a ring of counter snapshots taken one step apart (a
+ * step is XSIS_WIN_STEP or the report interval, whichever is longer),
+ * sized for the longest window. A window's averages are the difference
+ * between the current counters and the ring entry one window ago, which
+ * is O(1). Minimum and maximum rates are taken over the per-step rates
+ * in the window, using monotonic queues (amortised O(1) per step).
+ */
+
+int
+win_init(xsis_win_t *win, char *arg, uint32_t interval){
+    // Local variables
+    unsigned long       secs;           // Parsed window length
+    uint64_t            stepms;         // Ring step (ms)
+    char                *ptr = arg;     // Parse position
+    char                *start;         // Start of current length
+    uint32_t            w;              // Window index
+
+    memset(win, 0, sizeof(*win));
+    stepms = (interval > XSIS_WIN_STEP) ? interval : XSIS_WIN_STEP;
+    win->step = stepms*1000000;
+
+    // Parse a comma separated list of window lengths in seconds
+    do {
+        start = ptr;
+        secs = strtoul(start, &ptr, 10);
+        if (ptr == start || !secs || secs > 86400 || (*ptr && *ptr != ',')){
+            fprintf(stderr, "Invalid window list \"%s\".\n", arg);
+            return(1);
+        }
+        if (win->nwins == XSIS_WIN_MAX){
+            fprintf(stderr, "At most %d windows may be given.\n",
+                    XSIS_WIN_MAX);
+            return(1);
+        }
+        w = win->nwins++;
+        win->secs[w] = secs;
+        win->steps[w] = (secs*1000 + stepms - 1) / stepms;
+        if (win->steps[w] + 1 > win->ringsz)
+            win->ringsz = win->steps[w] + 1;
+        win->qoff[w] = win->nqe;
+        win->nqe += XSIS_NWINQS*(win->steps[w] + 1);
+    } while (*ptr++ == ',');
+
+    // Allocate ring timestamps
+    if (!(win->ts = calloc(win->ringsz, sizeof(uint64_t)))){
+        perror("calloc");
+        return(1);
+    }
+    win->head = win->ringsz - 1;
+
+    // Return
+    return(0);
+}
+
+// Append a per-step rate to a min (max = 0) or max (max = 1) queue
+static void
+win_qpush(xsis_win_t *win, xsis_vbdwin_t *vw, uint32_t w, uint32_t j,
+          float val, int max){
+    // Local variables
+    xsis_winq_t         *q;             // Queue
+    xsis_winqe_t        *qe;            // Queue storage
+    uint32_t            cap;            // Queue capacity
+    uint32_t            back;           // Index of newest entry
+
+    q = &vw->q[w][j];
+    cap = win->steps[w] + 1;
+    qe = vw->qe + win->qoff[w] + j*cap;
+
+    // Drop entries that can no longer be the min/max
+    while (q->len){
+        back = (q->first + q->len - 1) % cap;
+        if (max ? (qe[back].val > val) : (qe[back].val < val))
+            break;
+        q->len--;
+    }
+    back = (q->first + q->len++) % cap;
+    qe[back].seq = win->seq;
+    qe[back].val = val;
+
+    // Drop entries that left the window
+    while (qe[q->first].seq + win->steps[w] <= win->seq){
+        q->first = (q->first + 1) % cap;
+        q->len--;
+    }
+}
+
+static float
+win_qfront(xsis_win_t *win, xsis_vbdwin_t *vw, uint32_t w, uint32_t j){
+    // Local variables
+    xsis_winq_t         *q;             // Queue
+
+    q = &vw->q[w][j];
+    if (!q->len)
+        return(0);
+    return(vw->qe[win->qoff[w] + j*(win->steps[w]+1) + q->first].val);
+}
+
+static xsis_vbdwin_t *
+win_vbd_alloc(xsis_win_t *win){
+    // Local variables
+    xsis_vbdwin_t       *vw;            // Per-VBD state
+
+    if (!(vw = calloc(1, sizeof(xsis_vbdwin_t))) ||
+        !(vw->ring = calloc(win->ringsz*XSIS_WIN_NCTRS, sizeof(uint64_t))) ||
+        !(vw->qe = calloc(win->nqe, sizeof(xsis_winqe_t)))){
+        perror("calloc");
+        if (vw){
+            free(vw->ring);
+            free(vw);
+        }
+        return(NULL);
+    }
+    return(vw);
+}
+
+int
+win_update(xsis_win_t *win, xsis_vbds_t *vbds, uint64_t now){
+    // Local variables
+    xsis_snap_t         *snap;          // Current counters
+    xsis_vbd_t          *vbd;           // Temporary VBD iterator
+    xsis_vbdwin_t       *vw;            // Per-VBD state
+    uint64_t            *cur;           // Ring entry being written
+    uint64_t            *prev;          // Previous ring entry
+    float               dt;             // Step length (secs)
+    float               iops;           // Step IOPS (r+w)
+    float               tput;           // Step throughput (sectors/s)
+    uint32_t            s;              // VBD slot
+    uint32_t            w;              // Window index
+    int                 i;              // Counter index
+
+    // Take a ring step when a step has elapsed (allowing for jitter)
+    win->now = now;
+    if (win->seq && now + win->step/20 < win->ts[win->head] + win->step)
+        return(0);
+    dt = (float)(now - win->ts[win->head])/1000000000;
+    win->head = (win->head + 1) % win->ringsz;
+    win->ts[win->head] = now;
+    win->seq++;
+
+    // Push the current counters of every VBD
+    snap = &vbds->snap;
+    LIST_FOREACH(vbd, &vbds->list, vbds){
+        if (!vbd->win && !(vbd->win = win_vbd_alloc(win)))
+            return(1);
+        vw = vbd->win;
+        s = vbd->slot;
+        cur = vw->ring + win->head*XSIS_WIN_NCTRS;
+        for (i = 0; i < XSIS_WIN_NCTRS; i++)
+            cur[i] = snap->cur[i][s];
+
+        // Rates over the step that just ended
+        if (vw->nent && dt > 0){
+            prev = vw->ring + ((win->head + win->ringsz - 1) % win->ringsz)*
+                              XSIS_WIN_NCTRS;
+            iops = (float)((cur[XSIS_CTR_ROP] - prev[XSIS_CTR_ROP]) +
+                           (cur[XSIS_CTR_WOP] - prev[XSIS_CTR_WOP])) / dt;
+            tput = (float)((cur[XSIS_CTR_RSC] - prev[XSIS_CTR_RSC]) +
+                           (cur[XSIS_CTR_WSC] - prev[XSIS_CTR_WSC])) / dt;
+            for (w = 0; w < win->nwins; w++){
+                win_qpush(win, vw, w, XSIS_WINQ_MINIOPS, iops, 0);
+                win_qpush(win, vw, w, XSIS_WINQ_MAXIOPS, iops, 1);
+                win_qpush(win, vw, w, XSIS_WINQ_MINTPUT, tput, 0);
+                win_qpush(win, vw, w, XSIS_WINQ_MAXTPUT, tput, 1);
+            }
+        }
+        if (vw->nent < win->ringsz)
+            vw->nent++;
+    }
+
+    // Return
+    return(0);
+}
+
+void
+win_rates(xsis_win_t *win, xsis_snap_t *snap, xsis_vbd_t *vbd, uint32_t w,
+          uint32_t unit, float *out){
+    // Local variables
+    xsis_vbdwin_t       *vw;            // Per-VBD state
+    uint64_t            *old;           // Ring entry one window ago
+    uint32_t            back;           // Steps back to that entry
+    uint32_t            s;              // VBD slot
+    float               dt;             // Window length covered (secs)
+    float               tscale;         // Sectors/s to throughput units
+
+    memset(out, 0, XSIS_NWOUTS*sizeof(float));
+    if (!(vw = vbd->win) || !vw->nent)
+        return;
+
+    // Averages since the entry one window ago (or the oldest one)
+    back = (win->steps[w] < vw->nent-1) ? win->steps[w] : vw->nent-1;
+    old = vw->ring + ((win->head + win->ringsz - back) % win->ringsz)*
+                     XSIS_WIN_NCTRS;
+    dt = (float)(win->now - win->ts[(win->head + win->ringsz - back) %
+                                    win->ringsz])/1000000000;
+    tscale = (float)XSIS_SECTOR_SZ / unit;
+    s = vbd->slot;
+    if (dt > 0){
+        out[XSIS_RATE_RIOPS] = (float)(snap->cur[XSIS_CTR_ROP][s] -
+                                       old[XSIS_CTR_ROP]) / dt;
+        out[XSIS_RATE_WIOPS] = (float)(snap->cur[XSIS_CTR_WOP][s] -
+                                       old[XSIS_CTR_WOP]) / dt;
+        out[XSIS_RATE_RTPUT] = (float)(snap->cur[XSIS_CTR_RSC][s] -
+                                       old[XSIS_CTR_RSC]) * tscale / dt;
+        out[XSIS_RATE_WTPUT] = (float)(snap->cur[XSIS_CTR_WSC][s] -
+                                       old[XSIS_CTR_WSC]) * tscale / dt;
+        out[XSIS_RATE_RAVGQ] = (float)(snap->cur[XSIS_CTR_RTU][s] -
+                                       old[XSIS_CTR_RTU]) / (dt*1000000);
+        out[XSIS_RATE_WAVGQ] = (float)(snap->cur[XSIS_CTR_WTU][s] -
+                                       old[XSIS_CTR_WTU]) / (dt*1000000);
+    }
+
+    // Extremes of the per-step rates within the window
+    out[XSIS_WOUT_MINIOPS] = win_qfront(win, vw, w, XSIS_WINQ_MINIOPS);
+    out[XSIS_WOUT_MAXIOPS] = win_qfront(win, vw, w, XSIS_WINQ_MAXIOPS);
+    out[XSIS_WOUT_MINTPUT] = win_qfront(win, vw, w, XSIS_WINQ_MINTPUT) *
+                             tscale;
+    out[XSIS_WOUT_MAXTPUT] = win_qfront(win, vw, w, XSIS_WINQ_MAXTPUT) *
+                             tscale;
+}
+
+void
+win_vbd_free(xsis_vbd_t *vbd){
+    // Release per-VBD window state
+    if (vbd->win){
+        free(vbd->win->ring);
+        free(vbd->win->qe);
+        free(vbd->win);
+        vbd->win = NULL;
+    }
+}
+
+void
+win_free(xsis_win_t *win){
+    // Release shared window state
+    free(win->ts);
+    win->ts = NULL;
+}
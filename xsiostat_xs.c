@@ -0,0 +1,361 @@
+/*
+ * -----------------------------
+ *  XenServer Storage I/O Stats
+ * -----------------------------
+ *  xsiostat_xs.c
+ * ---------------
+ *
+ * Copyright (C) 2013, 2014 Citrix Systems Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+// Header files
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <xenstore.h>
+#include "xsiostat.h"
+
+/*
+ * Tapdisk pids are cached in a sorted array keyed by (domid, vbdid). A
+ * watch on XSIS_XS_VBD3_PATH keeps the cache coherent: a write to a
+ * kthread-pid key refreshes that entry, and any change at or above a VBD
+ * directory (creation or removal) drops the entries below it, so they
+ * are re-read on the next lookup. Other keys written while a VBD is set
+ * up are ignored, so a boot storm costs one read per VBD. Once the event
+ * loop runs, xsc_listen() has watch events applied as they arrive rather
+ * than at the next lookup, so they never pile up on the connection (which
+ * xenstored would eventually drop) while no VBD is being attached.
+ */
+
+static uint64_t
+xsc_key(uint32_t domid, uint32_t vbdid){
+    return(((uint64_t)domid << 32) | vbdid);
+}
+
+// Index of the first entry with key >= 'key'
+static uint32_t
+xsc_search(xsis_xs_t *xsc, uint64_t key){
+    // Local variables
+    uint32_t            lo = 0;         // Search lower bound
+    uint32_t            hi;             // Search upper bound
+    uint32_t            mid;            // Search midpoint
+
+    hi = xsc->npids;
+    while (lo < hi){
+        mid = lo + (hi-lo)/2;
+        if (xsc->pids[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return(lo);
+}
+
+static void
+xsc_set(xsis_xs_t *xsc, uint32_t domid, uint32_t vbdid, uint32_t tdpid){
+    // Local variables
+    xsis_xspid_t        *pids;          // Reallocated cache
+    uint64_t            key;            // Cache key
+    uint32_t            i;              // Cache index
+
+    key = xsc_key(domid, vbdid);
+    i = xsc_search(xsc, key);
+    if (i < xsc->npids && xsc->pids[i].key == key){
+        xsc->pids[i].tdpid = tdpid;
+        return;
+    }
+
+    // Insert new entry (a failure only costs a later re-read)
+    if (xsc->npids == xsc->pidsz){
+        if (!(pids = realloc(xsc->pids, (xsc->pidsz ? xsc->pidsz*2 : 64) *
+                                        sizeof(xsis_xspid_t))))
+            return;
+        xsc->pids = pids;
+        xsc->pidsz = xsc->pidsz ? xsc->pidsz*2 : 64;
+    }
+    memmove(&xsc->pids[i+1], &xsc->pids[i],
+            (xsc->npids-i)*sizeof(xsis_xspid_t));
+    xsc->pids[i].key = key;
+    xsc->pids[i].tdpid = tdpid;
+    xsc->npids++;
+}
+
+// Drop all entries with keys in [lo, hi]
+static void
+xsc_drop(xsis_xs_t *xsc, uint64_t lo, uint64_t hi){
+    // Local variables
+    uint32_t            i, j;           // First/last+1 index dropped
+
+    i = xsc_search(xsc, lo);
+    for (j = i; j < xsc->npids && xsc->pids[j].key <= hi; j++);
+    memmove(&xsc->pids[i], &xsc->pids[j],
+            (xsc->npids-j)*sizeof(xsis_xspid_t));
+    xsc->npids -= j-i;
+}
+
+static uint32_t
+xsc_read(struct xs_handle *xsh, uint32_t domid, uint32_t vbdid){
+    // Local variables
+    char                path[128];      // kthread-pid path
+    unsigned int        len;            // Value length
+    char                *value;         // Value returned by xs_read
+    uint32_t            tdpid;          // Value converted to integer
+
+    (void)snprintf(path, sizeof(path), XSIS_XS_VBD3_PATH "/%u/%u/kthread-pid",
+                   domid, vbdid);
+    if (!(value = xs_read(xsh, XBT_NULL, path, &len)))
+        return(0);
+    tdpid = (uint32_t)strtoul(value, NULL, 10);
+    free(value);
+    return(tdpid);
+}
+
+int
+xsc_open(xsis_xs_t **xsc){
+    // Local variables
+    int                 err = 0;        // Return code
+
+    // Allocate cache context
+    if (!(*xsc = calloc(1, sizeof(xsis_xs_t)))){
+        perror("calloc");
+        goto err;
+    }
+
+    // Open the (only) Xenstore connection
+    if (!((*xsc)->xsh = xs_open(XS_OPEN_READONLY))){
+        perror("xs_open");
+        goto err;
+    }
+
+    // Watch the backend subtree; without it every lookup reads xenstore
+    (*xsc)->watching = xs_watch((*xsc)->xsh, XSIS_XS_VBD3_PATH,
+                                XSIS_XS_TOKEN);
+    if (!(*xsc)->watching)
+        perror("xs_watch");
+
+out:
+    // Return
+    return(err);
+
+err:
+    xsc_close(*xsc);
+    *xsc = NULL;
+    err = 1;
+    goto out;
+}
+
+int
+xsc_fd(xsis_xs_t *xsc){
+    // Watch events are pending when this fd is readable
+    return((xsc && xsc->watching) ? xs_fileno(xsc->xsh) : -1);
+}
+
+static int
+xsc_cb(xsis_evtsrc_t *src, uint32_t events){
+    // Apply watch events as they come, so none queue up for us
+    xsc_update(src->arg);
+    return(0);
+}
+
+int
+xsc_listen(xsis_xs_t *xsc, xsis_evt_t *evt){
+    // Without a watch there is nothing to listen to
+    if (!xsc || xsc->src.cb || (xsc->src.fd = xsc_fd(xsc)) < 0)
+        return(0);
+    xsc->src.cb = xsc_cb;
+    xsc->src.arg = xsc;
+    return(evt_add(evt, &xsc->src, EPOLLIN));
+}
+
+void
+xsc_update(xsis_xs_t *xsc){
+    // Local variables
+    char                **ev;           // Watch event
+    const char          *path;          // Changed path below the watch
+    uint32_t            domid;          // Temporary DOM ID
+    uint32_t            vbdid;          // Temporary VBD ID
+    uint32_t            tdpid;          // Temporary tapdisk pid
+    int                 off;            // Parsed path length
+
+    if (!xsc->watching)
+        return;
+
+    // Apply pending watch events
+    while ((ev = xs_check_watch(xsc->xsh))){
+        path = ev[XS_WATCH_PATH];
+        if (strncmp(path, XSIS_XS_VBD3_PATH, strlen(XSIS_XS_VBD3_PATH))){
+            free(ev);
+            continue;
+        }
+        path += strlen(XSIS_XS_VBD3_PATH);
+
+        if (!*path){
+            // Whole subtree changed (also fired once when registering)
+            xsc->npids = 0;
+        } else
+        if (sscanf(path, "/%u%n", &domid, &off) == 1 && !path[off]){
+            // Domain directory created or removed
+            xsc_drop(xsc, xsc_key(domid, 0), xsc_key(domid, UINT32_MAX));
+        } else
+        if (sscanf(path, "/%u/%u%n", &domid, &vbdid, &off) == 2){
+            if (!path[off]){
+                // VBD directory created or removed
+                xsc_drop(xsc, xsc_key(domid, vbdid), xsc_key(domid, vbdid));
+            } else
+            if (!strcmp(path + off, "/kthread-pid")){
+                // Tapdisk pid (re)written or removed
+                if ((tdpid = xsc_read(xsc->xsh, domid, vbdid)))
+                    xsc_set(xsc, domid, vbdid, tdpid);
+                else
+                    xsc_drop(xsc, xsc_key(domid, vbdid),
+                             xsc_key(domid, vbdid));
+            }
+        }
+        free(ev);
+    }
+}
+
+uint32_t
+xsc_tdpid(xsis_xs_t *xsc, uint32_t domid, uint32_t vbdid){
+    // Local variables
+    uint64_t            key;            // Cache key
+    uint32_t            tdpid;          // Tapdisk pid
+    uint32_t            i;              // Cache index
+
+    // Bring the cache up to date and look the VBD up
+    xsc_update(xsc);
+    key = xsc_key(domid, vbdid);
+    i = xsc_search(xsc, key);
+    if (i < xsc->npids && xsc->pids[i].key == key)
+        return(xsc->pids[i].tdpid);
+
+    // Miss: read through the persistent connection
+    if ((tdpid = xsc_read(xsc->xsh, domid, vbdid)) && xsc->watching)
+        xsc_set(xsc, domid, vbdid, tdpid);
+    return(tdpid);
+}
+
+// Cached pid of a VBD (0 if not cached), without reading xenstore
+uint32_t
+xsc_cached(xsis_xs_t *xsc, uint32_t domid, uint32_t vbdid){
+    // Local variables
+    uint64_t            key;            // Cache key
+    uint32_t            i;              // Cache index
+
+    xsc_update(xsc);
+    key = xsc_key(domid, vbdid);
+    i = xsc_search(xsc, key);
+    return((i < xsc->npids && xsc->pids[i].key == key) ?
+           xsc->pids[i].tdpid : 0);
+}
+
+// Cache a pid read on another connection; watch events still pending
+// here are applied after it, so a later change is not lost
+void
+xsc_put(xsis_xs_t *xsc, uint32_t domid, uint32_t vbdid, uint32_t tdpid){
+    if (xsc->watching && tdpid)
+        xsc_set(xsc, domid, vbdid, tdpid);
+}
+
+/*
+ * Extra uncached connections let several threads look tapdisk pids up
+ * concurrently (requests on one connection are serialised).
+ */
+
+struct xs_handle *
+xsc_conn(void){
+    return(xs_open(XS_OPEN_READONLY));
+}
+
+uint32_t
+xsc_conn_tdpid(struct xs_handle *xsh, uint32_t domid, uint32_t vbdid){
+    return(xsc_read(xsh, domid, vbdid));
+}
+
+int
+xsc_sr(struct xs_handle *xsh, uint32_t domid, uint32_t vbdid, char *sr,
+       size_t len){
+    // Local variables
+    char                path[128];      // params path
+    unsigned int        vlen;           // Value length
+    char                *value;         // Value returned by xs_read
+    char                *end;           // End of the SR component
+    char                *start;         // Start of the SR component
+
+    // The backing path (e.g. /dev/sm/backend/<sr>/<vdi>, or
+    // <type>:/var/run/sr-mount/<sr>/<vdi>.vhd) names the SR as the
+    // directory holding the VDI
+    (void)snprintf(path, sizeof(path), XSIS_XS_VBD3_PATH "/%u/%u/params",
+                   domid, vbdid);
+    if (!xsh || !(value = xs_read(xsh, XBT_NULL, path, &vlen)))
+        return(1);
+    if (!(end = strrchr(value, '/')) || end == value){
+        free(value);
+        return(1);
+    }
+    for (start = end; start > value && start[-1] != '/' &&
+                      start[-1] != ':'; start--);
+    (void)snprintf(sr, len, "%.*s", (int)(end - start), start);
+    free(value);
+
+    // Return
+    return(!*sr);
+}
+
+int
+xsc_vm(struct xs_handle *xsh, uint32_t domid, char *uuid, size_t len){
+    // Local variables
+    char                path[64];       // vm path
+    unsigned int        vlen;           // Value length
+    char                *value;         // Value returned by xs_read
+    char                *start;         // Start of the uuid
+    size_t              n;              // Length of the uuid
+
+    // The domain's vm key holds /vm/<uuid>
+    (void)snprintf(path, sizeof(path), "/local/domain/%u/vm", domid);
+    if (!xsh || !(value = xs_read(xsh, XBT_NULL, path, &vlen)))
+        return(1);
+    start = strrchr(value, '/') ? strrchr(value, '/') + 1 : value;
+    n = strspn(start, "0123456789abcdef-");
+    if (start[n] || n >= len)
+        n = 0;
+    memcpy(uuid, start, n);
+    uuid[n] = '\0';
+    free(value);
+
+    // Return
+    return(!n);
+}
+
+void
+xsc_conn_close(struct xs_handle *xsh){
+    if (xsh)
+        xs_close(xsh);
+}
+
+void
+xsc_close(xsis_xs_t *xsc){
+    // Release cache resources
+    if (xsc){
+        if (xsc->xsh){
+            if (xsc->watching)
+                (void)xs_unwatch(xsc->xsh, XSIS_XS_VBD3_PATH, XSIS_XS_TOKEN);
+            xs_close(xsc->xsh);
+        }
+        free(xsc->pids);
+        free(xsc);
+    }
+}